@@ -24,6 +24,8 @@
 #include <limits.h>
 
 #include "audio.h"
+#include "status.h"
+#include "i18n.h"
 
 
 int audio_format_equal (audio_format_t *a, audio_format_t *b)
@@ -54,17 +56,69 @@ audio_device_t *append_audio_device(audio_device_t *devices_list,
   devices_list->options = options;
   devices_list->filename = filename;
   devices_list->device = NULL;
+  devices_list->ring = NULL;
+  devices_list->slow_policy = SLOW_DEVICE_BLOCK;
+  devices_list->dropped = 0;
   devices_list->next_device = NULL;
 
   return devices_list;
 }
 
 
+/* Write function for a device's own ring */
+static int audio_device_ring_write (void *ptr, int nbytes, int eos, void *arg)
+{
+  audio_device_t *d = (audio_device_t *) arg;
+
+  return ao_play(d->device, ptr, nbytes) ? nbytes : 0;
+}
+
+static void audio_device_dropped (audio_device_t *d, long nbytes)
+{
+  if (d->dropped == 0) {
+    ao_info *info = ao_driver_info(d->driver_id);
+
+    status_error(_("Warning: Device %s can't keep up, dropping audio.\n"),
+		 info->short_name);
+  }
+
+  d->dropped += nbytes;
+}
+
+static int audio_device_queue (audio_device_t *d, void *ptr, int nbytes)
+{
+  buf_t *ring = d->ring;
+
+  if (buffer_full(ring) + nbytes > ring->size) {
+    switch (d->slow_policy) {
+    case SLOW_DEVICE_BLOCK:
+      break;
+
+    case SLOW_DEVICE_DROP:
+      audio_device_dropped(d, nbytes);
+      return 1;
+
+    case SLOW_DEVICE_RESYNC:
+      /* Whatever it hasn't got to yet is already late.  The device
+	 may be stuck in ao_play(), so don't wait for it here: it drops
+	 the backlog when it comes back, and the submit below waits for
+	 the room like any other. */
+      audio_device_dropped(d, buffer_discard(ring));
+      break;
+    }
+  }
+
+  return buffer_submit_data(ring, ptr, nbytes);
+}
+
 int audio_devices_write(audio_device_t *d, void *ptr, int nbytes)
 {
 
   while (d != NULL) {
-    if (ao_play(d->device, ptr, nbytes) == 0)
+    if (d->ring != NULL) {
+      if (!audio_device_queue(d, ptr, nbytes))
+	return 0; /* error occurred */
+    } else if (ao_play(d->device, ptr, nbytes) == 0)
       return 0; /* error occurred */
     d = d->next_device;
   }
@@ -72,6 +126,71 @@ int audio_devices_write(audio_device_t *d, void *ptr, int nbytes)
   return 1;
 }
 
+void audio_devices_start_threads(audio_device_t *d, long ring_size,
+				 int chunk_size, slow_device_t slow_policy)
+{
+  while (d != NULL) {
+    d->ring = buffer_create(ring_size, 0, audio_device_ring_write, d,
+			    chunk_size);
+    d->slow_policy = slow_policy;
+    d->dropped = 0;
+
+    if (d->ring == NULL || buffer_thread_start(d->ring) != 0) {
+      status_error(_("ERROR: Could not start output thread.\n"));
+      exit(1);
+    }
+
+    d = d->next_device;
+  }
+}
+
+/* Wait for every device to play what it has been given, so they can be
+   closed or reopened.  The last part chunk only gets played at EOS, which
+   also ends the thread, so it is started again afterwards. */
+void audio_devices_drain(audio_device_t *d)
+{
+  while (d != NULL) {
+    if (d->ring != NULL) {
+      buffer_mark_eos(d->ring);
+      buffer_wait_for_empty(d->ring);
+      buffer_thread_kill(d->ring);
+      buffer_reset(d->ring);
+      buffer_thread_start(d->ring);
+    }
+    d = d->next_device;
+  }
+}
+
+/* Throw away whatever hasn't been played yet, after a skip.  The threads
+   will have stopped on the cancel, so start them again too. */
+void audio_devices_flush(audio_device_t *d)
+{
+  while (d != NULL) {
+    if (d->ring != NULL) {
+      buffer_thread_kill(d->ring);
+      buffer_reset(d->ring);
+      buffer_thread_start(d->ring);
+    }
+    d = d->next_device;
+  }
+}
+
+void audio_devices_stop_threads(audio_device_t *d, int drain)
+{
+  while (d != NULL) {
+    if (d->ring != NULL) {
+      if (drain) {
+	buffer_mark_eos(d->ring);
+	buffer_wait_for_empty(d->ring);
+      }
+      buffer_thread_kill(d->ring);
+      buffer_destroy(d->ring);
+      d->ring = NULL;
+    }
+    d = d->next_device;
+  }
+}
+
 int add_ao_option(ao_option **op_h, const char *optstring)
 {
   char *key, *value;
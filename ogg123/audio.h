@@ -21,6 +21,7 @@
 #define __AUDIO_H__
 
 #include <ao/ao.h>
+#include "buffer.h"
 
 
 typedef struct audio_format_t {
@@ -33,12 +34,26 @@ typedef struct audio_format_t {
 } audio_format_t;
 
 
+/* What to do with a device that can't keep up with the others */
+typedef enum slow_device_t {
+  SLOW_DEVICE_BLOCK,   /* Wait for it, holding up every device */
+  SLOW_DEVICE_DROP,    /* Skip the audio that doesn't fit in its ring */
+  SLOW_DEVICE_RESYNC   /* Throw away its ring and carry on from now */
+} slow_device_t;
+
 /* For facilitating output to multiple devices */
 typedef struct audio_device_t {
   int driver_id;
   ao_device *device;
   ao_option *options;
   char *filename;
+
+  /* With more than one device, each one is fed from its own ring by its
+     own thread, so they don't have to wait on each other */
+  buf_t *ring;
+  slow_device_t slow_policy;
+  long dropped;               /* Bytes lost to SLOW_DEVICE_DROP/RESYNC */
+
   struct audio_device_t *next_device;
 } audio_device_t;
 
@@ -49,6 +64,11 @@ audio_device_t *append_audio_device(audio_device_t *devices_list,
 				     ao_option *options, char *filename);
 void audio_devices_print_info(audio_device_t *d);
 int audio_devices_write(audio_device_t *d, void *ptr, int nbytes);
+void audio_devices_start_threads(audio_device_t *d, long ring_size,
+				 int chunk_size, slow_device_t slow_policy);
+void audio_devices_drain(audio_device_t *d);
+void audio_devices_flush(audio_device_t *d);
+void audio_devices_stop_threads(audio_device_t *d, int drain);
 int add_ao_option(ao_option **op_h, const char *optstring);
 void close_audio_devices (audio_device_t *devices);
 void free_audio_devices (audio_device_t *devices);
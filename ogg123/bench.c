@@ -0,0 +1,249 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+#include "status.h"
+#include "i18n.h"
+
+/* Decode times waiting for their block to reach the sink.  If the
+   buffer holds more blocks than this, the rest go unmeasured. */
+#define BENCH_MARKS 4096
+
+/* Latencies are kept in a histogram with this many buckets to each
+   doubling, so percentiles come out within about 12% */
+#define LATENCY_SUB     8
+#define LATENCY_BUCKETS (LATENCY_SUB * 40)
+
+#define MB (1024.0 * 1024.0)
+
+typedef struct bench_mark_t {
+  ogg_int64_t position;     /* Sink position once the block is through */
+  struct timeval decoded;
+} bench_mark_t;
+
+/* The marks are a ring with a single writer, the decoder, and a single
+   reader, the sink.  Each side only moves its own index. */
+static bench_mark_t marks[BENCH_MARKS];
+static volatile unsigned long marks_head = 0;
+static volatile unsigned long marks_tail = 0;
+
+/* Written by the decoder */
+static ogg_int64_t decoded_bytes = 0;
+static double decoded_seconds = 0.0;
+static ogg_int64_t input_bytes = 0;
+static int files = 0;
+static long unmeasured = 0;
+
+/* Written by the sink */
+static ogg_int64_t played_bytes = 0;
+static long latency[LATENCY_BUCKETS];
+static long latency_count = 0;
+static long latency_max = 0;
+
+static struct timeval start_time;
+static struct rusage start_usage;
+
+
+static double seconds_between (struct timeval *from, struct timeval *to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+
+/* Values under 2 * LATENCY_SUB microseconds get a bucket each, after
+   which each doubling is split into LATENCY_SUB buckets */
+static int latency_bucket (long usec)
+{
+  int octave = 0;
+
+  if (usec < 2 * LATENCY_SUB)
+    return usec;
+
+  while ((usec >> octave) >= 2 * LATENCY_SUB)
+    octave++;
+
+  if (octave * LATENCY_SUB + (usec >> octave) >= LATENCY_BUCKETS)
+    return LATENCY_BUCKETS - 1;
+
+  return octave * LATENCY_SUB + (usec >> octave);
+}
+
+
+/* The largest value that falls in a bucket */
+static long latency_bucket_max (int bucket)
+{
+  int octave;
+
+  if (bucket < 2 * LATENCY_SUB)
+    return bucket;
+
+  octave = bucket / LATENCY_SUB - 1;
+
+  return ((long) (bucket - octave * LATENCY_SUB + 1) << octave) - 1;
+}
+
+
+static double latency_percentile (double fraction)
+{
+  long wanted = (long) (fraction * latency_count);
+  long seen = 0;
+  int i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += latency[i];
+    if (seen > wanted)
+      break;
+  }
+
+  if (i == LATENCY_BUCKETS || latency_bucket_max(i) > latency_max)
+    return latency_max / 1000.0;
+
+  return latency_bucket_max(i) / 1000.0;
+}
+
+
+void bench_start (void)
+{
+  gettimeofday(&start_time, NULL);
+  getrusage(RUSAGE_SELF, &start_usage);
+}
+
+
+void bench_decoded (long nbytes, audio_format_t *fmt)
+{
+  long frame_bytes = (long) fmt->rate * fmt->channels * fmt->word_size;
+
+  decoded_bytes += nbytes;
+  if (frame_bytes > 0)
+    decoded_seconds += (double) nbytes / frame_bytes;
+
+  if (marks_head - marks_tail == BENCH_MARKS) {
+    unmeasured++;
+    return;
+  }
+
+  marks[marks_head % BENCH_MARKS].position = decoded_bytes;
+  gettimeofday(&marks[marks_head % BENCH_MARKS].decoded, NULL);
+  __sync_synchronize();
+  marks_head++;
+}
+
+
+void bench_file_done (data_source_t *source)
+{
+  data_source_stats_t stats;
+
+  source->transport->statistics(source, &stats);
+  input_bytes += stats.bytes_read;
+  files++;
+}
+
+
+int bench_play_callback (void *ptr, int nbytes, int eos, void *arg)
+{
+  struct timeval now;
+  bench_mark_t *mark;
+  long usec;
+
+  played_bytes += nbytes;
+
+  if (marks_tail == marks_head)
+    return nbytes;
+
+  gettimeofday(&now, NULL);
+  __sync_synchronize();
+
+  while (marks_tail != marks_head) {
+    mark = &marks[marks_tail % BENCH_MARKS];
+    if (mark->position > played_bytes)
+      break;
+
+    usec = (now.tv_sec - mark->decoded.tv_sec) * 1000000L
+      + (now.tv_usec - mark->decoded.tv_usec);
+    if (usec < 0)
+      usec = 0;
+
+    latency[latency_bucket(usec)]++;
+    latency_count++;
+    if (usec > latency_max)
+      latency_max = usec;
+
+    __sync_synchronize();
+    marks_tail++;
+  }
+
+  return nbytes;
+}
+
+
+void bench_report (buf_t *audio_buffer)
+{
+  struct timeval now;
+  struct rusage usage;
+  buffer_stats_t stats;
+  double wall, cpu;
+
+  gettimeofday(&now, NULL);
+  getrusage(RUSAGE_SELF, &usage);
+
+  wall = seconds_between(&start_time, &now);
+  cpu = seconds_between(&start_usage.ru_utime, &usage.ru_utime)
+    + seconds_between(&start_usage.ru_stime, &usage.ru_stime);
+  if (wall <= 0.0)
+    wall = 1e-6;
+
+  status_message(0, _("Benchmark: %d file(s), %.1f s of audio in %.3f s"),
+		 files, decoded_seconds, wall);
+  status_message(0, _("  Decoded: %.1f MB, %.2f MB/s, %.1fx realtime"),
+		 decoded_bytes / MB, decoded_bytes / MB / wall,
+		 decoded_seconds / wall);
+  status_message(0, _("  Read:    %.1f MB, %.2f MB/s"),
+		 input_bytes / MB, input_bytes / MB / wall);
+  status_message(0, _("  CPU:     %.3f s, %.2f%% of the audio's length"),
+		 cpu, decoded_seconds > 0.0 ? 100.0 * cpu / decoded_seconds : 0.0);
+
+  if (audio_buffer == NULL)
+    return;
+
+  buffer_statistics(audio_buffer, &stats);
+  status_message(0, _("  Buffer:  decoder waited %ld times, output waited %ld times,"
+		      " %ld wakeups, %ld underruns"),
+		 stats.write_waits, stats.play_waits, stats.wakeups,
+		 stats.underruns);
+  status_message(0, _("  Actions: %ld queued, at most %ld waiting,"
+		      " %.0f ns per insertion"),
+		 stats.actions_queued, stats.actions_max, stats.action_insert_ns);
+
+  if (latency_count > 0)
+    status_message(0, _("  Decode to play latency (ms): p50 %.3f, p90 %.3f,"
+			" p99 %.3f, p99.9 %.3f, max %.3f"),
+		   latency_percentile(0.5), latency_percentile(0.9),
+		   latency_percentile(0.99), latency_percentile(0.999),
+		   latency_max / 1000.0);
+  if (unmeasured > 0)
+    status_message(0, _("  (%ld blocks were not timed, the buffer held too many)"),
+		   unmeasured);
+}
@@ -0,0 +1,45 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+/* Benchmark mode.  The audio goes through the usual transport, format
+   and buffer path, but into a sink that throws it away as fast as it
+   arrives, so what is measured is ogg123 itself rather than the sound
+   card.  Each decoded block is stamped with the time it was decoded, and
+   the sink notes how long it took to get through the buffer. */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include "audio.h"
+#include "buffer.h"
+#include "transport.h"
+
+void bench_start (void);
+
+/* A block of nbytes was decoded and is about to be written */
+void bench_decoded (long nbytes, audio_format_t *fmt);
+
+/* A file has been played to the end */
+void bench_file_done (data_source_t *source);
+
+/* The null sink, in place of audio_play_callback() */
+int bench_play_callback (void *ptr, int nbytes, int eos, void *arg);
+
+/* Print the results, once the buffer has played out */
+void bench_report (buf_t *audio_buffer);
+
+#endif /* __BENCH_H__ */
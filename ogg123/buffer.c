@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <time.h>
 #include <string.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -54,6 +55,15 @@ FILE *debugfile;
 #define UNLOCK_MUTEX(mutex) { DEBUG1("Unlocking mutex %s", #mutex); pthread_mutex_unlock(&(mutex)); }
 #define COND_WAIT(cond, mutex) { DEBUG2("Unlocking %s and waiting on %s", #mutex, #cond); pthread_cond_wait(&(cond), &(mutex)); }
 #define COND_SIGNAL(cond) { DEBUG1("Signalling %s", #cond); pthread_cond_signal(&(cond)); }
+#define COND_BROADCAST(cond) { DEBUG1("Broadcasting %s", #cond); pthread_cond_broadcast(&(cond)); }
+
+/* curfill is the only part of the ring written from both ends.  These
+   are all full barriers, so the data is in place before the fill says
+   it is, and a sleeper's waiting flag is seen once the fill changes. */
+#define FILL_GET(buf)     __sync_add_and_fetch(&(buf)->curfill, 0)
+#define FILL_ADD(buf, n)  __sync_add_and_fetch(&(buf)->curfill, (n))
+#define FILL_SUB(buf, n)  __sync_sub_and_fetch(&(buf)->curfill, (n))
+#define BARRIER()         __sync_synchronize()
 
 extern signal_request_t sig_request;  /* Need access to global cancel flag */
 
@@ -68,11 +78,18 @@ void buffer_init_vars (buf_t *buf)
   buf->eos = 0;
   buf->abort_write = 0;
   buf->cancel_flag = 0;
+  buf->discard = 0;
 
   buf->curfill = 0;
   buf->start = 0;
+  buf->end = 0;
   buf->position = 0;
   buf->position_end = 0;
+  buf->held = 0;
+  buf->starved = 0;
+
+  buf->play_waiting = 0;
+  buf->write_waiting = 0;
 }
 
 void buffer_thread_init (buf_t *buf)
@@ -108,63 +125,114 @@ void buffer_mutex_unlock (void *arg)
 }
 
 
-action_t *malloc_action (action_func_t action_func, void *action_arg)
-{
-  action_t *action;
-
-  action = malloc(sizeof(action_t));
-
-  if (action == NULL) {
-    fprintf(stderr, _("ERROR: Out of memory in malloc_action().\n"));
-    exit(1);
-  }
-
-  action->position = 0;
-  action->action_func = action_func;
-  action->arg = action_arg;
-  action->next = NULL;
-
-  return action;
-}
-
-
 /* insert = 1:  Make this action the first action associated with this position
    insert = 0:  Make this action the last action associated with this position
 */
 #define INSERT 1
 #define APPEND 0
-void in_order_add_action (action_t **action_list, action_t *action, int insert)
+
+#define ACTIONS_MIN 64
+
+/* Whether action a runs before action b */
+#define ACTION_BEFORE(a, b) \
+  ((a)->position < (b)->position || \
+   ((a)->position == (b)->position && (a)->seq < (b)->seq))
+
+/* Add an action to the heap.  Actions inserted at a position get ever
+   smaller sequence numbers and appended ones ever larger, so each lands
+   ahead of or behind everything already there.  Called with the mutex
+   held. */
+void queue_action (buf_t *buf, action_func_t action_func, void *action_arg,
+		   ogg_int64_t position, int insert)
 {
-  insert = insert > 0 ? 1 : 0;  /* Clamp in case caller messed up */
+  struct timespec started, finished;
+  action_t *actions, action;
+  long i, parent;
 
-  while (*action_list != NULL && 
-	 (*action_list)->position <= (action->position + insert))
-    action_list = &((*action_list)->next);
+  if (buf->time_actions)
+    clock_gettime(CLOCK_MONOTONIC, &started);
 
-  action->next = *action_list;
-  *action_list = action;
-}
+  if (buf->nactions == buf->actions_size) {
+    long size = buf->actions_size > 0 ? 2 * buf->actions_size : ACTIONS_MIN;
 
+    actions = realloc(buf->actions, size * sizeof(action_t));
+    if (actions == NULL) {
+      fprintf(stderr, _("ERROR: Out of memory in queue_action().\n"));
+      exit(1);
+    }
+    buf->actions = actions;
+    buf->actions_size = size;
+  }
 
-void execute_actions (buf_t *buf, action_t **action_list, ogg_int64_t position)
-{
-  action_t *action;
+  action.position = position;
+  action.seq = insert ? -++buf->action_seq : ++buf->action_seq;
+  action.action_func = action_func;
+  action.arg = action_arg;
 
-  while (*action_list != NULL && (*action_list)->position <= position) {
-    action = *action_list;
-    action->action_func(buf, action->arg);
+  /* Sift up from the new leaf */
+  actions = buf->actions;
+  for (i = buf->nactions; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (!ACTION_BEFORE(&action, &actions[parent]))
+      break;
+    actions[i] = actions[parent];
+  }
+  actions[i] = action;
+  buf->nactions++;
+
+  buf->actions_queued++;
+  if (buf->nactions > buf->actions_max)
+    buf->actions_max = buf->nactions;
 
-    *action_list = (*action_list)->next;
-    free(action);
-    action = NULL;
+  if (buf->time_actions) {
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    buf->action_insert_ns += (finished.tv_sec - started.tv_sec) * 1e9
+      + (finished.tv_nsec - started.tv_nsec);
+  }
+}
+
+
+/* Take the earliest action off the heap.  Called with the mutex held. */
+void remove_first_action (buf_t *buf)
+{
+  action_t *actions = buf->actions;
+  action_t *last;
+  long i, child, n;
+
+  n = --buf->nactions;
+  last = &actions[n];
+
+  /* Sift the last leaf down from the root */
+  for (i = 0; (child = 2 * i + 1) < n; i = child) {
+    if (child + 1 < n && ACTION_BEFORE(&actions[child + 1], &actions[child]))
+      child++;
+    if (!ACTION_BEFORE(&actions[child], last))
+      break;
+    actions[i] = actions[child];
   }
+  actions[i] = *last;
 }
 
 
-void free_action (action_t *action)
+/* Run the actions due by position.  The lock is dropped while each one
+   runs, since actions may call back into the buffer. */
+void execute_actions (buf_t *buf, ogg_int64_t position)
 {
-  free(action);
-  action = NULL;
+  action_t action;
+
+  if (buf->nactions == 0)
+    return;
+
+  LOCK_MUTEX(buf->mutex);
+  while (buf->nactions > 0 && buf->actions[0].position <= position) {
+    action = buf->actions[0];
+    remove_first_action(buf);
+
+    UNLOCK_MUTEX(buf->mutex);
+    action.action_func(buf, action.arg);
+    LOCK_MUTEX(buf->mutex);
+  }
+  UNLOCK_MUTEX(buf->mutex);
 }
 
 
@@ -172,6 +240,7 @@ void free_action (action_t *action)
 int compute_dequeue_size (buf_t *buf, int request_size)
 {
   ogg_int64_t next_action_pos;
+  long curfill = FILL_GET(buf);
 
   /* 
      For simplicity, the number of bytes played must satisfy the following
@@ -182,19 +251,203 @@ int compute_dequeue_size (buf_t *buf, int request_size)
      4. Do not go past the next action.
   */
 
-  if (buf->actions != NULL) {
+  if (buf->nactions > 0) {
 
-    next_action_pos = buf->actions->position;
+    next_action_pos = buf->actions[0].position;
 
-    return MIN4((ogg_int64_t)buf->curfill, (ogg_int64_t)request_size,
+    return MIN4((ogg_int64_t)curfill, (ogg_int64_t)request_size,
                (ogg_int64_t)(buf->size - buf->start),
                next_action_pos - buf->position);
   } else
-    return MIN3(buf->curfill, (long)request_size, buf->size - buf->start);
+    return MIN3(curfill, (long)request_size, buf->size - buf->start);
 
 }
 
 
+/* The actions are shared with the decoder, so only take the lock to
+   look at them if there are any */
+int dequeue_size (buf_t *buf, int request_size)
+{
+  int size;
+
+  if (buf->nactions == 0)
+    return compute_dequeue_size(buf, request_size);
+
+  LOCK_MUTEX(buf->mutex);
+  size = compute_dequeue_size(buf, request_size);
+  UNLOCK_MUTEX(buf->mutex);
+
+  return size;
+}
+
+
+/* Readiness tests for the reading end, called both without the lock as
+   a fast path and with it before going to sleep */
+int play_ready (buf_t *buf)
+{
+  return !buf->prebuffering && !buf->paused &&
+    (FILL_GET(buf) >= buf->audio_chunk_size || buf->eos);
+}
+
+int get_ready (buf_t *buf)
+{
+  return buf->eos || (FILL_GET(buf) > 0 && !buf->prebuffering);
+}
+
+
+/* Put the reading end to sleep.  The flag goes up before the test is
+   made again, so a writer that commits in between will either see it
+   and signal, or will have its data seen here. */
+void sleep_until_ready (buf_t *buf, int (*ready) (buf_t *))
+{
+  pthread_cleanup_push(buffer_mutex_unlock, buf);
+
+  LOCK_MUTEX(buf->mutex);
+  buf->play_waiting = 1;
+  BARRIER();
+  if (!ready(buf) && !buf->abort_write && !buf->cancel_flag &&
+      !buf->discard) {
+    buf->play_waits++;
+    COND_WAIT(buf->playback_cond, buf->mutex);
+  }
+  buf->play_waiting = 0;
+  UNLOCK_MUTEX(buf->mutex);
+
+  pthread_cleanup_pop(0);
+}
+
+
+/* The reading end found nothing at all when it was ready for more.
+   Counted once each time it runs dry. */
+void note_underrun (buf_t *buf)
+{
+  if (buf->starved)
+    return;
+
+  pthread_cleanup_push(buffer_mutex_unlock, buf);
+
+  LOCK_MUTEX(buf->mutex);
+  if (!buf->eos && !buf->prebuffering && !buf->paused) {
+    buf->underruns++;
+    buf->starved = 1;
+  }
+  UNLOCK_MUTEX(buf->mutex);
+
+  pthread_cleanup_pop(0);
+}
+
+
+/* The reading end is running low before the end of the stream, so don't
+   go on until the prebuffer has filled up again */
+void start_rebuffer (buf_t *buf)
+{
+  pthread_cleanup_push(buffer_mutex_unlock, buf);
+
+  LOCK_MUTEX(buf->mutex);
+  if (!buf->eos && !buf->prebuffering && buf->prebuffer_size > 0) {
+    buf->prebuffering = 1;
+    buf->rebuffers++;
+  }
+  UNLOCK_MUTEX(buf->mutex);
+
+  pthread_cleanup_pop(0);
+}
+
+
+/* Put a writer to sleep until the fill drops to max_fill or below */
+void sleep_until_space (buf_t *buf, long max_fill)
+{
+  pthread_cleanup_push(buffer_mutex_unlock, buf);
+
+  LOCK_MUTEX(buf->mutex);
+  buf->write_waiting++;
+  BARRIER();
+  if (FILL_GET(buf) > max_fill && !buf->abort_write && !buf->cancel_flag
+      && !sig_request.cancel) {
+    buf->write_waits++;
+    COND_WAIT(buf->write_cond, buf->mutex);
+  }
+  buf->write_waiting--;
+  UNLOCK_MUTEX(buf->mutex);
+
+  pthread_cleanup_pop(0);
+}
+
+
+/* Hand n bytes written at end over to the reading end, waking it only if
+   it is actually asleep or waiting for the prebuffer to fill */
+void commit_data (buf_t *buf, long n)
+{
+  long curfill;
+
+  buf->end = (buf->end + n) % buf->size;
+  buf->position_end += n;
+  curfill = FILL_ADD(buf, n);
+  DEBUG1("writing chunk into buffer, curfill = %ld", curfill);
+
+  if (!buf->play_waiting && !buf->prebuffering)
+    return;
+
+  pthread_cleanup_push(buffer_mutex_unlock, buf);
+
+  LOCK_MUTEX(buf->mutex);
+  if (buf->prebuffering && (buf->prebuffer_size <= curfill)) {
+    DEBUG("prebuffering done")
+    buf->prebuffering = 0; /* done prebuffering */
+  }
+
+  if (!buf->prebuffering && !buf->paused && buf->play_waiting) {
+    DEBUG("Signalling playback thread that more data is available.");
+    buf->wakeups++;
+    COND_SIGNAL(buf->playback_cond);
+  }
+  UNLOCK_MUTEX(buf->mutex);
+
+  pthread_cleanup_pop(0);
+}
+
+
+/* Release n bytes read from start, waking any writer waiting for room */
+long consume_data (buf_t *buf, long n)
+{
+  long curfill;
+
+  buf->start = (buf->start + n) % buf->size;
+  buf->position += n;
+  if (n > 0)
+    buf->starved = 0;
+  curfill = FILL_SUB(buf, n);
+  DEBUG1("Updated buffer fill, curfill = %ld", curfill);
+
+  if (buf->space_func != NULL && curfill <= buf->low_water
+      && curfill + n > buf->low_water)
+    buf->space_func(buf, buf->space_arg);
+
+  if (buf->write_waiting) {
+    DEBUG("Signal decoder thread that buffer space is available");
+    LOCK_MUTEX(buf->mutex);
+    buf->wakeups++;
+    COND_BROADCAST(buf->write_cond);
+    UNLOCK_MUTEX(buf->mutex);
+  }
+
+  return curfill;
+}
+
+
+/* Drop everything the reading end hasn't got to, as the writer asked.
+   Actions queued in it are passed by, and run before the next write. */
+void discard_data (buf_t *buf)
+{
+  buf->discard = 0;
+  BARRIER();
+  consume_data(buf, FILL_GET(buf));
+
+  /* Emptied on purpose, so finding it empty next isn't an underrun */
+  buf->starved = 1;
+}
+
+
 void *buffer_thread_func (void *arg)
 {
   buf_t *buf = (buf_t*) arg;
@@ -211,62 +464,48 @@ void *buffer_thread_func (void *arg)
   /* This test is safe since curfill will never decrease and eos will
      never be unset. */
   while ( !(buf->eos && buf->curfill == 0) && !buf->abort_write) {
-
-    LOCK_MUTEX (buf->mutex);
+    long curfill;
 
     DEBUG("Check for cancelation");
     if (buf->cancel_flag || sig_request.cancel) {
       /* signal empty buffer space, so the main
          thread can wake up to die in peace */
       DEBUG("Abort: Wake up the writer thread");
-      COND_SIGNAL(buf->write_cond);
+      LOCK_MUTEX(buf->mutex);
+      COND_BROADCAST(buf->write_cond);
+      UNLOCK_MUTEX(buf->mutex);
 
       /* abort this thread, too */
-      UNLOCK_MUTEX(buf->mutex);
       break;
     }
 
+    if (buf->discard) {
+      DEBUG("Discarding the backlog");
+      discard_data(buf);
+      continue;
+    }
+
     DEBUG("Check for something to play");
     /* Block until we can play something */
-    if (buf->prebuffering || 
-	buf->paused || 
-	(buf->curfill < buf->audio_chunk_size && !buf->eos)) {
-
+    if (!play_ready(buf)) {
+      if (FILL_GET(buf) == 0)
+        note_underrun(buf);
       DEBUG("Waiting for more data to play.");
-      COND_WAIT(buf->playback_cond, buf->mutex);
-    }
-
-    DEBUG("Check for cancelation");
-    if (buf->cancel_flag || sig_request.cancel) {
-      /* signal empty buffer space, so the main
-         thread can wake up to die in peace */
-      DEBUG("Abort: Wake up the writer thread");
-      COND_SIGNAL(buf->write_cond);
-
-      /* abort this thread, too */
-      UNLOCK_MUTEX(buf->mutex);
-      break;
+      sleep_until_ready(buf, play_ready);
+      continue;
     }
 
     DEBUG("Ready to play");
 
-    UNLOCK_MUTEX(buf->mutex);
+    /* Position won't change while the actions run.  We clear out any
+       actions before we compute the dequeue size so we don't consider
+       actions that need to run right now.  */
+    execute_actions(buf, buf->position);
 
-    /* Don't need to lock buffer while running actions since position
-       won't change.  We clear out any actions before we compute the
-       dequeue size so we don't consider actions that need to
-       run right now.  */
-    execute_actions(buf, &buf->actions, buf->position);
+    write_amount = dequeue_size(buf, buf->audio_chunk_size);
 
-    LOCK_MUTEX(buf->mutex);
-
-    /* Need to be locked while we check things. */
-    write_amount = compute_dequeue_size(buf, buf->audio_chunk_size);
-
-    UNLOCK_MUTEX(buf->mutex);
- 
     if(write_amount){ /* we might have been woken spuriously */
-      /* No need to lock mutex here because the other thread will
+      /* No need to lock anything here because the other thread will
          NEVER reduce the number of bytes stored in the buffer */
       DEBUG1("Sending %d bytes to the audio device", write_amount);
       write_amount = buf->write_func(buf->buffer + buf->start, write_amount,
@@ -279,27 +518,16 @@ void *buffer_thread_func (void *arg)
         buffer_abort_write(buf);
       }
 
-      LOCK_MUTEX(buf->mutex);
-
-      buf->curfill -= write_amount;
-      buf->position += write_amount;
-      buf->start = (buf->start + write_amount) % buf->size;
-      DEBUG1("Updated buffer fill, curfill = %ld", buf->curfill);
+      curfill = consume_data(buf, write_amount);
 
       /* If we've essentially emptied the buffer and prebuffering is enabled,
          we need to do another prebuffering session */
-      if (!buf->eos && (buf->curfill < buf->audio_chunk_size))
-        buf->prebuffering = buf->prebuffer_size > 0;
+      if (!buf->eos && curfill < buf->audio_chunk_size &&
+          buf->prebuffer_size > 0 && !buf->prebuffering)
+        start_rebuffer(buf);
     }else{
       DEBUG("Woken spuriously");
     }
-
-    /* Signal a waiting decoder thread that they can put more audio into the
-       buffer */
-    DEBUG("Signal decoder thread that buffer space is available");
-    COND_SIGNAL(buf->write_cond);
-
-    UNLOCK_MUTEX(buf->mutex);
   }
 
   pthread_cleanup_pop(1);
@@ -309,85 +537,56 @@ void *buffer_thread_func (void *arg)
 }
 
 
-int submit_data_chunk (buf_t *buf, unsigned char *data, size_t size)
+/* Find the free space at the write end of the buffer, waiting for at
+   least min bytes of it */
+int reserve_space (buf_t *buf, unsigned char **ptr, long *len, long min)
 {
-  long   buf_write_pos; /* offset of first available write location */
-  size_t write_size;
-
-  DEBUG1("Enter submit_data_chunk, size %d", size);
-
-  pthread_cleanup_push(buffer_mutex_unlock, buf);
-
-  /* Put the data into the buffer as space is made available */
-  while (size > 0 && !buf->abort_write) {
-
-    /* Section 1: Write a chunk of data */
-    DEBUG("Obtaining lock on buffer");
-    LOCK_MUTEX(buf->mutex);
-    if (buf->size - buf->curfill > 0) {
-
-      /* Figure how much we can write into the buffer.  Requirements:
-	 1. Don't write more data than we have.
-	 2. Don't write more data than we have room for.
-	 3. Don't write past the end of the buffer. */
-      buf_write_pos = (buf->start + buf->curfill) % buf->size;
-      write_size = MIN3(size, buf->size - buf->curfill,
-			buf->size - buf_write_pos);
-
-      memcpy(buf->buffer + buf_write_pos, data, write_size);
-      buf->curfill += write_size;
-      data += write_size;
-      size -= write_size;
-      buf->position_end += write_size;
-      DEBUG1("writing chunk into buffer, curfill = %ld", buf->curfill);
-    }
-    else {
-
-      if (buf->cancel_flag || sig_request.cancel) {
-        UNLOCK_MUTEX(buf->mutex);
-        break;
-      }
-      /* No room for more data, wait until there is */
-      DEBUG("No room for data in buffer.  Waiting.");
-      COND_WAIT(buf->write_cond, buf->mutex);
+  while (!buf->abort_write) {
+    long space = buf->size - FILL_GET(buf);
+
+    if (space >= min) {
+      /* Don't hand out space past the end of the buffer */
+      *ptr = buf->buffer + buf->end;
+      *len = MIN(space, buf->size - buf->end);
+      return 1;
     }
-    /* Section 2: signal if we are not prebuffering, done
-       prebuffering, or paused */
-    if (buf->prebuffering && (buf->prebuffer_size <= buf->curfill)) {
 
-      DEBUG("prebuffering done")
-	buf->prebuffering = 0; /* done prebuffering */
-    }
-
-    if (!buf->prebuffering && !buf->paused) {
-
-      DEBUG("Signalling playback thread that more data is available.");
-      COND_SIGNAL(buf->playback_cond);
-    } else
-      DEBUG("Not signalling playback thread since prebuffering or paused.");
+    if (buf->cancel_flag || sig_request.cancel)
+      break;
 
-    UNLOCK_MUTEX(buf->mutex);
+    /* No room for more data, wait until there is */
+    DEBUG("No room for data in buffer.  Waiting.");
+    sleep_until_space(buf, buf->size - min);
   }
 
-  pthread_cleanup_pop(0);
-
-  DEBUG("Exit submit_data_chunk");
-  return !buf->abort_write;
+  return 0;
 }
 
 
-buffer_stats_t *malloc_buffer_stats ()
+int submit_data_chunk (buf_t *buf, unsigned char *data, size_t size)
 {
-  buffer_stats_t *new_stats;
+  unsigned char *ptr;
+  long space;
+  size_t write_size;
 
-  new_stats = malloc(sizeof(buffer_stats_t));
+  DEBUG1("Enter submit_data_chunk, size %d", size);
 
-  if (new_stats == NULL) {
-    fprintf(stderr, _("ERROR: Could not allocate memory in malloc_buffer_stats()\n"));
-    exit(1);
+  /* Put the data into the buffer as space is made available */
+  while (size > 0 && reserve_space(buf, &ptr, &space, 1)) {
+
+    /* Figure how much we can write into the buffer.  Requirements:
+       1. Don't write more data than we have.
+       2. Don't write more data than we have room for. */
+    write_size = MIN(size, (size_t)space);
+
+    memcpy(ptr, data, write_size);
+    data += write_size;
+    size -= write_size;
+    commit_data(buf, write_size);
   }
 
-  return new_stats;
+  DEBUG("Exit submit_data_chunk");
+  return !buf->abort_write;
 }
 
 
@@ -436,7 +635,9 @@ buf_t *buffer_create (long size, long prebuffer,
   buf->prebuffer_size = prebuffer;
   buf->size = size;
 
-  buf->actions = 0;
+  buf->actions = NULL;
+  buf->nactions = 0;
+  buf->actions_size = 0;
 
   /* Initialize flags */
   buffer_init_vars(buf);
@@ -447,8 +648,6 @@ buf_t *buffer_create (long size, long prebuffer,
 
 void buffer_reset (buf_t *buf)
 {
-  action_t *action;
-
   /* Cleanup pthread variables */
   pthread_mutex_destroy(&buf->mutex);
   pthread_cond_destroy(&buf->write_cond);
@@ -459,18 +658,62 @@ void buffer_reset (buf_t *buf)
   pthread_cond_init(&buf->write_cond, NULL);
   pthread_cond_init(&buf->playback_cond, NULL);
 
-  /* Clear old actions */
-  while (buf->actions != NULL) {
-    action = buf->actions;
-    buf->actions = buf->actions->next;
-    free(action);
-    action = NULL;
-  }
+  /* Clear old actions, keeping their slots */
+  buf->nactions = 0;
 
   buffer_init_vars(buf);
 }
 
 
+/* Change the prebuffer target on the fly, ending a prebuffering session
+   under way if the buffer already holds that much */
+void buffer_set_prebuffer (buf_t *buf, long prebuffer)
+{
+  if (prebuffer < 0)
+    prebuffer = 0;
+  if (prebuffer > buf->size)
+    prebuffer = buf->size;
+
+  pthread_cleanup_push(buffer_mutex_unlock, buf);
+
+  LOCK_MUTEX(buf->mutex);
+  buf->prebuffer_size = prebuffer;
+  if (buf->prebuffering && FILL_GET(buf) >= prebuffer) {
+    buf->prebuffering = 0;
+    if (buf->play_waiting)
+      COND_SIGNAL(buf->playback_cond);
+  }
+  UNLOCK_MUTEX(buf->mutex);
+
+  pthread_cleanup_pop(0);
+}
+
+
+/* Only to be set before the playback thread is started */
+void buffer_set_space_callback (buf_t *buf, long low_water,
+				buffer_space_func_t space_func, void *arg)
+{
+  buf->low_water = low_water;
+  buf->space_func = space_func;
+  buf->space_arg = arg;
+}
+
+
+/* Time each action insertion.  Set before anything is queued. */
+void buffer_time_actions (buf_t *buf, int enable)
+{
+  buf->time_actions = enable;
+}
+
+
+/* Have buffer_get_data() wait for the prebuffer again whenever it runs
+   dry, as the playback thread does.  Set before anything is read. */
+void buffer_rebuffer_reads (buf_t *buf, int enable)
+{
+  buf->rebuffer_reads = enable;
+}
+
+
 void buffer_destroy (buf_t *buf)
 {
   DEBUG("buffer_destroy");
@@ -482,6 +725,7 @@ void buffer_destroy (buf_t *buf)
   COND_SIGNAL(buf->playback_cond);
   pthread_cond_destroy(&buf->playback_cond);
 
+  free(buf->actions);
   free(buf);
   buf = NULL;
 }
@@ -537,7 +781,9 @@ void buffer_thread_kill (buf_t *buf)
   buf->cancel_flag = 1;
 
   /* Signal the playback condition to wake stuff up */
+  LOCK_MUTEX(buf->mutex);
   COND_SIGNAL(buf->playback_cond);
+  UNLOCK_MUTEX(buf->mutex);
 
   pthread_join(buf->thread, NULL);
 
@@ -553,6 +799,24 @@ int buffer_submit_data (buf_t *buf, unsigned char *data, long nbytes) {
   return submit_data_chunk (buf, data, nbytes);
 }
 
+/* Zero-copy writing: *len is the least amount of free space wanted,
+   which this waits for.  On return *ptr and *len give the space that can
+   be written straight into, which can be less than was asked for if the
+   free space wraps around the end of the buffer.  Nothing is seen by the
+   reader until buffer_commit() is called with however much was used. */
+int buffer_reserve (buf_t *buf, unsigned char **ptr, long *len)
+{
+  return reserve_space(buf, ptr, len, MIN(*len, buf->size));
+}
+
+int buffer_commit (buf_t *buf, long nbytes)
+{
+  if (nbytes > 0 && !buf->abort_write)
+    commit_data(buf, nbytes);
+
+  return !buf->abort_write;
+}
+
 size_t buffer_get_data (buf_t *buf, char *data, long nbytes)
 {
   int write_amount;
@@ -562,64 +826,47 @@ size_t buffer_get_data (buf_t *buf, char *data, long nbytes)
 
   DEBUG("Enter buffer_get_data");
 
-  pthread_cleanup_push(buffer_mutex_unlock, buf);
-
-  LOCK_MUTEX(buf->mutex);
-
   /* Put the data into the buffer as space is made available */
   while (nbytes > 0) {
 
-    if (buf->abort_write)
+    if (buf->abort_write || buf->cancel_flag)
       break;
 
-    DEBUG("Obtaining lock on buffer");
     /* Block until we can read something */
     if (buf->curfill == 0 && buf->eos)
       break; /* No more data to read */
 
-    if (buf->curfill == 0 || (buf->prebuffering && !buf->eos)) {
+    if (!get_ready(buf)) {
+      if (FILL_GET(buf) == 0) {
+	note_underrun(buf);
+	if (buf->rebuffer_reads)
+	  start_rebuffer(buf);
+      }
       DEBUG("Waiting for more data to copy.");
-      COND_WAIT(buf->playback_cond, buf->mutex);
+      sleep_until_ready(buf, get_ready);
+      continue;
     }
 
-    if (buf->abort_write)
-      break;
-
-    /* Note: Even if curfill is still 0, nothing bad will happen here */
-
     /* For simplicity, the number of bytes played must satisfy
        the following three requirements:
 
        1. Do not copy more bytes than are stored in the buffer.
        2. Do not copy more bytes than the reqested data size.
        3. Do not run off the end of the buffer. */
-    write_amount = compute_dequeue_size(buf, nbytes);
+    write_amount = dequeue_size(buf, nbytes);
 
-    UNLOCK_MUTEX(buf->mutex);
-    execute_actions(buf, &buf->actions, buf->position);
+    execute_actions(buf, buf->position);
 
-    /* No need to lock mutex here because the other thread will
+    /* No need to lock anything here because the other thread will
        NEVER reduce the number of bytes stored in the buffer */
     DEBUG1("Copying %d bytes from the buffer", write_amount);
     memcpy(data, buf->buffer + buf->start, write_amount);
-    LOCK_MUTEX(buf->mutex);
 
-    buf->curfill -= write_amount;
     data += write_amount;
     nbytes -= write_amount;
-    buf->start = (buf->start + write_amount) % buf->size;
-    DEBUG1("Updated buffer fill, curfill = %ld", buf->curfill);
-
-    /* Signal a waiting decoder thread that they can put more
-       audio into the buffer */
-    DEBUG("Signal decoder thread that buffer space is available");
-    COND_SIGNAL(buf->write_cond);
+    consume_data(buf, write_amount);
   }
 
-  UNLOCK_MUTEX(buf->mutex);
-
-  pthread_cleanup_pop(0);
-
   pthread_testcancel();
 
   DEBUG("Exit buffer_get_data");
@@ -627,6 +874,21 @@ size_t buffer_get_data (buf_t *buf, char *data, long nbytes)
   return orig_size - nbytes;
 }
 
+/* The writer has nbytes more of the stream that it will submit later,
+   like the end of a track kept back for a crossfade.  Only the writer
+   uses this, so it needs no lock. */
+void buffer_hold (buf_t *buf, long nbytes)
+{
+  buf->held = nbytes;
+}
+
+/* How far into the stream the writer has got, counting what it holds
+   back.  Only the writer uses this. */
+ogg_int64_t buffer_written (buf_t *buf)
+{
+  return buf->position_end + buf->held;
+}
+
 void buffer_mark_eos (buf_t *buf)
 {
   DEBUG("buffer_mark_eos");
@@ -650,7 +912,7 @@ void buffer_abort_write (buf_t *buf)
 
   LOCK_MUTEX(buf->mutex);
   buf->abort_write = 1;
-  COND_SIGNAL(buf->write_cond);
+  COND_BROADCAST(buf->write_cond);
   COND_SIGNAL(buf->playback_cond);
   UNLOCK_MUTEX(buf->mutex);  
 
@@ -658,24 +920,43 @@ void buffer_abort_write (buf_t *buf)
 }
 
 
+/* Have the playback thread throw away everything it hasn't played yet,
+   once it is back from the write it is in the middle of.  Doesn't wait
+   for that, so a writer blocked in the device can't hold the caller up;
+   the caller finds the room by waiting for space as usual.  Returns how
+   much was waiting, which includes any chunk still being written. */
+long buffer_discard (buf_t *buf)
+{
+  DEBUG("buffer_discard");
+
+  buf->discard = 1;
+  BARRIER();
+
+  if (buf->play_waiting) {
+    pthread_cleanup_push(buffer_mutex_unlock, buf);
+
+    LOCK_MUTEX(buf->mutex);
+    COND_SIGNAL(buf->playback_cond);
+    UNLOCK_MUTEX(buf->mutex);
+
+    pthread_cleanup_pop(0);
+  }
+
+  return FILL_GET(buf);
+}
+
+
 /* --- Action buffering functions --- */
 
 void buffer_action_now (buf_t *buf, action_func_t action_func, 
 			void *action_arg)
 {
-  action_t *action;
-
-  action = malloc_action(action_func, action_arg);
-
   pthread_cleanup_push(buffer_mutex_unlock, buf);
 
   LOCK_MUTEX(buf->mutex);
 
-  action->position = buf->position;
-
   /* Insert this action right at the front */
-  action->next = buf->actions;
-  buf->actions = action;
+  queue_action(buf, action_func, action_arg, buf->position, INSERT);
 
   UNLOCK_MUTEX(buf->mutex);
 
@@ -686,18 +967,14 @@ void buffer_action_now (buf_t *buf, action_func_t action_func,
 void buffer_insert_action_at_end (buf_t *buf, action_func_t action_func, 
 				  void *action_arg)
 {
-  action_t *action;
-
-  action = malloc_action(action_func, action_arg);
-
   pthread_cleanup_push(buffer_mutex_unlock, buf);
 
   LOCK_MUTEX(buf->mutex);
 
-  /* Stick after the last item in the buffer */
-  action->position = buf->position_end;
-
-  in_order_add_action(&buf->actions, action, INSERT);
+  /* Stick after the last item in the buffer, and whatever the writer
+     has yet to put there */
+  queue_action(buf, action_func, action_arg, buf->position_end + buf->held,
+	       INSERT);
 
   UNLOCK_MUTEX(buf->mutex);
 
@@ -708,18 +985,14 @@ void buffer_insert_action_at_end (buf_t *buf, action_func_t action_func,
 void buffer_append_action_at_end (buf_t *buf, action_func_t action_func, 
 				  void *action_arg)
 {
-  action_t *action;
-
-  action = malloc_action(action_func, action_arg);
-
   pthread_cleanup_push(buffer_mutex_unlock, buf);
 
   LOCK_MUTEX(buf->mutex);
 
-  /* Stick after the last item in the buffer */
-  action->position = buf->position_end;
-
-  in_order_add_action(&buf->actions, action, APPEND);
+  /* Stick after the last item in the buffer, and whatever the writer
+     has yet to put there */
+  queue_action(buf, action_func, action_arg, buf->position_end + buf->held,
+	       APPEND);
 
   UNLOCK_MUTEX(buf->mutex);
 
@@ -730,17 +1003,11 @@ void buffer_append_action_at_end (buf_t *buf, action_func_t action_func,
 void buffer_insert_action_at (buf_t *buf, action_func_t action_func, 
 			      void *action_arg, ogg_int64_t position)
 {
-  action_t *action;
-
-  action = malloc_action(action_func, action_arg);
-
   pthread_cleanup_push(buffer_mutex_unlock, buf);
 
   LOCK_MUTEX(buf->mutex);
-  
-  action->position = position;
 
-  in_order_add_action(&buf->actions, action, INSERT);
+  queue_action(buf, action_func, action_arg, position, INSERT);
 
   UNLOCK_MUTEX(buf->mutex);  
 
@@ -751,17 +1018,11 @@ void buffer_insert_action_at (buf_t *buf, action_func_t action_func,
 void buffer_append_action_at (buf_t *buf, action_func_t action_func, 
 			      void *action_arg, ogg_int64_t position)
 {
-  action_t *action;
-
-  action = malloc_action(action_func, action_arg);
-
   pthread_cleanup_push(buffer_mutex_unlock, buf);
 
   LOCK_MUTEX(buf->mutex);
 
-  action->position = position;
-
-  in_order_add_action(&buf->actions, action, APPEND);
+  queue_action(buf, action_func, action_arg, position, APPEND);
 
   UNLOCK_MUTEX(buf->mutex);
 
@@ -773,24 +1034,13 @@ void buffer_append_action_at (buf_t *buf, action_func_t action_func,
 
 void buffer_wait_for_empty (buf_t *buf)
 {
-  int empty = 0;
-
   DEBUG("Enter buffer_wait_for_empty");
 
-  pthread_cleanup_push(buffer_mutex_unlock, buf);
-
-  LOCK_MUTEX(buf->mutex);
-  while (!empty && !buf->abort_write && !buf->cancel_flag && !sig_request.cancel) {
-
-    if (buf->curfill > 0) {
-      DEBUG1("Buffer curfill = %ld, going back to sleep.", buf->curfill);
-      COND_WAIT(buf->write_cond, buf->mutex);
-    } else 
-      empty = 1;
+  while (buf->curfill > 0 && !buf->abort_write && !buf->cancel_flag &&
+         !sig_request.cancel) {
+    DEBUG1("Buffer curfill = %ld, going back to sleep.", buf->curfill);
+    sleep_until_space(buf, 0);
   }
-  UNLOCK_MUTEX(buf->mutex);
-
-  pthread_cleanup_pop(0);
 
   DEBUG("Exit buffer_wait_for_empty");
 }
@@ -802,26 +1052,30 @@ long buffer_full (buf_t *buf)
 }
 
 
-buffer_stats_t *buffer_statistics (buf_t *buf)
+void buffer_statistics (buf_t *buf, buffer_stats_t *stats)
 {
-  buffer_stats_t *stats;
-
   pthread_cleanup_push(buffer_mutex_unlock, buf);
 
   LOCK_MUTEX(buf->mutex);
 
-  stats = malloc_buffer_stats();
-
   stats->size = buf->size;
   stats->fill = (double) buf->curfill / (double) buf->size * 100.0;
   stats->prebuffer_fill = (double) buf->prebuffer_size / (double) buf->size;
   stats->prebuffering = buf->prebuffering;
   stats->paused = buf->paused;
   stats->eos = buf->eos;
+  stats->underruns = buf->underruns;
+  stats->rebuffers = buf->rebuffers;
+  stats->play_waits = buf->play_waits;
+  stats->write_waits = buf->write_waits;
+  stats->wakeups = buf->wakeups;
+  stats->actions_queued = buf->actions_queued;
+  stats->actions_max = buf->actions_max;
+  stats->action_insert_ns = buf->actions_queued > 0 ?
+    buf->action_insert_ns / buf->actions_queued : 0.0;
+  stats->position = buf->position;
 
   UNLOCK_MUTEX(buf->mutex);
 
   pthread_cleanup_pop(0);
-
-  return stats;
 }
@@ -26,11 +26,15 @@
 #include <ogg/os_types.h>
 
 
-struct action_t; /* forward declaration */
+struct action_t; /* forward declarations */
+struct buf_t;
 
 /* buffer_write_func(void *data, int nbytes, int eos, void *arg) */
 typedef int (*buffer_write_func_t) (void *, int, int, void *);
 
+/* buffer_space_func(struct buf_t *buf, void *arg) */
+typedef void (*buffer_space_func_t) (struct buf_t *, void *);
+
 typedef struct buf_t
 {
   /* generic buffer interface */
@@ -49,10 +53,39 @@ typedef struct buf_t
   /* buffer info (constant) */
   int  audio_chunk_size;  /* write data to audio device in this chunk size, 
 			     if possible */
-  long prebuffer_size;    /* number of bytes to prebuffer */
+  long prebuffer_size;    /* number of bytes to prebuffer (only changed
+			     with the mutex held) */
   long size;              /* buffer size, for reference */
 
   int cancel_flag;        /* When set, the playback thread should exit */
+  volatile int discard;   /* When set, the playback thread drops whatever
+			     it hasn't played yet */
+
+  /* ----- The ring itself is single producer, single consumer ----- */
+
+  /* The decoder only ever moves end and position_end, and the playback
+     thread only ever moves start and position.  curfill is the one
+     thing they share, and it is only changed atomically, so neither
+     side needs the mutex to move data.  It is taken to sleep when the
+     ring is full or empty, and by whoever has to wake a sleeper. */
+  volatile long curfill;    /* how much the buffer is currently filled */
+  long start;               /* offset in buffer of start of available data */
+  long end;                 /* offset in buffer of first free byte */
+  ogg_int64_t position;     /* How many bytes have we output so far */
+  ogg_int64_t position_end; /* Position right after end of data */
+  long held;                /* Bytes the writer is still holding back,
+			       which actions queued at the end go after */
+  int starved;              /* The reading end has counted running dry, and
+			       hasn't had anything since */
+
+  /* Called by the playback thread when the fill drops to low_water,
+     for a writer that doesn't wait on the buffer itself */
+  buffer_space_func_t space_func;
+  void *space_arg;
+  long low_water;
+
+  volatile int play_waiting;  /* playback thread is in COND_WAIT */
+  volatile int write_waiting; /* a writer is in COND_WAIT */
 
   /* ----- Everything after this point is protected by mutex ----- */
 
@@ -61,14 +94,27 @@ typedef struct buf_t
   int paused;
   int eos;
   int abort_write;
+  int rebuffer_reads;       /* buffer_get_data() prebuffers again when it
+			       runs dry */
+
+  long underruns;           /* times the reading end found it empty */
+  long rebuffers;           /* prebuffering sessions after an underrun */
+  long play_waits;          /* times the reading end went to sleep */
+  long write_waits;         /* times a writer went to sleep */
+  long wakeups;             /* times either side woke the other */
+
+  /* Actions to perform, a heap ordered by position.  The array doubles
+     as the pool of action nodes, so it only grows. */
+  struct action_t *actions;
+  volatile long nactions;   /* read without the lock to see if any */
+  long actions_size;        /* slots allocated */
+  ogg_int64_t action_seq;   /* orders actions at the same position */
+
+  long actions_queued;      /* actions ever queued */
+  long actions_max;         /* most waiting at once */
+  int time_actions;         /* time insertions, for --bench */
+  double action_insert_ns;  /* total time spent inserting */
 
-  /* buffer data */
-  long curfill;     /* how much the buffer is currently filled */
-  long start;       /* offset in buffer of start of available data */
-  ogg_int64_t position; /* How many bytes have we output so far */
-  ogg_int64_t position_end; /* Position right after end of data */
-
-  struct action_t *actions; /* Queue actions to perform */
   unsigned char buffer[1];   /* The buffer itself. It's more than one byte. */
 } buf_t;
 
@@ -78,9 +124,9 @@ typedef void (*action_func_t) (buf_t *, void *);
 
 typedef struct action_t {
   ogg_int64_t position;
+  ogg_int64_t seq;          /* Falls before or after others at position */
   action_func_t action_func;
   void *arg;
-  struct action_t *next;
 } action_t;
 
 
@@ -91,6 +137,15 @@ typedef struct buffer_stats_t {
   int prebuffering;
   int paused;
   int eos;
+  long underruns;
+  long rebuffers;
+  long play_waits;
+  long write_waits;
+  long wakeups;
+  long actions_queued;
+  long actions_max;
+  double action_insert_ns;  /* Mean, if timing was on */
+  ogg_int64_t position;  /* Bytes played so far */
 } buffer_stats_t;
 
 
@@ -102,6 +157,11 @@ buf_t *buffer_create (long size, long prebuffer,
 
 void buffer_reset (buf_t *buf);
 void buffer_destroy (buf_t *buf);
+void buffer_set_prebuffer (buf_t *buf, long prebuffer);
+void buffer_set_space_callback (buf_t *buf, long low_water,
+				buffer_space_func_t space_func, void *arg);
+void buffer_time_actions (buf_t *buf, int enable);
+void buffer_rebuffer_reads (buf_t *buf, int enable);
 
 /* --- Buffer thread control --- */
 int  buffer_thread_start   (buf_t *buf);
@@ -111,10 +171,15 @@ void buffer_thread_kill    (buf_t *buf);
 
 /* --- Data buffering functions --- */
 int buffer_submit_data (buf_t *buf, unsigned char *data, long nbytes);
+int buffer_reserve (buf_t *buf, unsigned char **ptr, long *len);
+int buffer_commit (buf_t *buf, long nbytes);
 size_t buffer_get_data (buf_t *buf, char *data, long nbytes);
 
+void buffer_hold (buf_t *buf, long nbytes);
+ogg_int64_t buffer_written (buf_t *buf);
 void buffer_mark_eos (buf_t *buf);
 void buffer_abort_write (buf_t *buf);
+long buffer_discard (buf_t *buf);
 
 /* --- Action buffering functions --- */
 void buffer_action_now (buf_t *buf, action_func_t action_func, 
@@ -131,6 +196,6 @@ void buffer_append_action_at (buf_t *buf, action_func_t action_func,
 /* --- Buffer status functions --- */
 void buffer_wait_for_empty (buf_t *buf);
 long buffer_full (buf_t *buf);
-buffer_stats_t *buffer_statistics (buf_t *buf);
+void buffer_statistics (buf_t *buf, buffer_stats_t *stats);
 
 #endif /* __BUFFER_H__ */
@@ -46,6 +46,8 @@ void audio_reopen_action (buf_t *buf, void *arg)
   audio_device_t *current;
   ao_sample_format format;
 
+  /* Devices with their own threads may still be playing the old format */
+  audio_devices_drain (reopen_arg->devices);
   close_audio_devices (reopen_arg->devices);
 
   /* Record audio device settings and open the devices */
@@ -148,54 +150,6 @@ audio_reopen_arg_t *new_audio_reopen_arg (audio_device_t *devices,
 }
 
 
-/* Statistics callbacks */
-
-void print_statistics_action (buf_t *buf, void *arg)
-{
-  print_statistics_arg_t *stats_arg = (print_statistics_arg_t *) arg;
-  buffer_stats_t *buffer_stats;
-
-  if (buf != NULL)
-    buffer_stats = buffer_statistics(buf);
-  else
-    buffer_stats = NULL;
-
-  status_print_statistics(stats_arg->stat_format,
-			  buffer_stats,
-			  stats_arg->data_source_statistics,
-			  stats_arg->decoder_statistics);
-
-  free(stats_arg->data_source_statistics);
-  stats_arg->data_source_statistics = NULL;
-  free(stats_arg->decoder_statistics);
-  stats_arg->decoder_statistics = NULL;
-  free(stats_arg);
-  stats_arg = NULL;
-  free(buffer_stats);
-  buffer_stats = NULL;
-}
-
-
-print_statistics_arg_t *new_print_statistics_arg (
-			       stat_format_t *stat_format,
-			       data_source_stats_t *data_source_statistics,
-			       decoder_stats_t *decoder_statistics)
-{
-  print_statistics_arg_t *arg;
-
-  if ( (arg = calloc(1,sizeof(print_statistics_arg_t))) == NULL ) {
-    status_error(_("Error: Out of memory in new_print_statistics_arg().\n"));
-    exit(1);
-  }
-
-  arg->stat_format = stat_format;
-  arg->data_source_statistics = data_source_statistics;
-  arg->decoder_statistics = decoder_statistics;
-
-  return arg;
-}
-
-
 /* Decoder callbacks */
 
 void decoder_error_callback (void *arg, int severity, char *message, ...)
@@ -44,21 +44,6 @@ audio_reopen_arg_t *new_audio_reopen_arg (audio_device_t *devices,
 					  audio_format_t *fmt);
 
 
-/* Statisitics callbacks */
-
-typedef struct print_statistics_arg_t {
-  stat_format_t *stat_format;
-  data_source_stats_t *data_source_statistics;
-  decoder_stats_t *decoder_statistics;
-} print_statistics_arg_t;
-
-void print_statistics_action (buf_t *buf, void *arg);
-print_statistics_arg_t *new_print_statistics_arg (
-			       stat_format_t *stat_format,
-			       data_source_stats_t *data_source_statistics,
-			       decoder_stats_t *decoder_statistics);
-
-
 /* Decoder callbacks */
 void decoder_error_callback (void *arg, int severity, char *message, ...);
 void decoder_metadata_callback (void *arg, int verbosity, char *message, ...);
@@ -61,6 +61,21 @@ struct option long_options[] = {
     {"album-gain", no_argument, 0, OPT_ALBUM_GAIN},
     {"track-gain", no_argument, 0, OPT_TRACK_GAIN},
     {"no-gain", no_argument, 0, OPT_NO_GAIN},
+    {"gapless", no_argument, 0, OPT_GAPLESS},
+    {"prefetch", required_argument, 0, OPT_PREFETCH},
+    {"prefetch-memory", required_argument, 0, OPT_PREFETCH_MEMORY},
+    {"slow-device", required_argument, 0, OPT_SLOW_DEVICE},
+    {"adaptive-prebuffer", no_argument, 0, OPT_ADAPTIVE_PREBUFFER},
+    {"output-bits", required_argument, 0, OPT_OUTPUT_BITS},
+    {"seek-cache", required_argument, 0, OPT_SEEK_CACHE},
+    {"crossfade", required_argument, 0, OPT_CROSSFADE},
+    {"crossfade-curve", required_argument, 0, OPT_CROSSFADE_CURVE},
+    {"remote-socket", required_argument, 0, OPT_REMOTE_SOCKET},
+    {"playlist-cache", required_argument, 0, OPT_PLAYLIST_CACHE},
+    {"bench", no_argument, 0, OPT_BENCH},
+    {"server", required_argument, 0, OPT_SERVER},
+    {"pcm-cache", required_argument, 0, OPT_PCM_CACHE},
+    {"pcm-cache-max", required_argument, 0, OPT_PCM_CACHE_MAX},
     {0, 0, 0, 0}
 };
 
@@ -74,7 +89,16 @@ int parse_cmdline_options (int argc, char **argv,
   ao_info *info;
   int temp_driver_id = -1;
   audio_device_t *current = NULL;
-  int ret;
+  char **playlist_files;
+  int nplaylist_files = 0;
+  int ret, i;
+
+  /* Read once the playlist cache is known, see below */
+  playlist_files = malloc(argc * sizeof(char *));
+  if (playlist_files == NULL) {
+    status_error(_("ERROR: Out of memory.\n"));
+    exit(1);
+  }
 
   while (-1 != (ret = getopt_long(argc, argv, "b:c::d:f:hl:k:K:o:p:qrRvVx:y:zZ@:",
 				  long_options, &option_index))) {
@@ -238,9 +262,7 @@ int parse_cmdline_options (int argc, char **argv,
 	break;
 
       case '@':
-	if (playlist_append_from_file(ogg123_opts->playlist, optarg) == 0)
-	  status_error(_("--- Cannot open playlist file %s.  Skipped.\n"),
-		       optarg);
+	playlist_files[nplaylist_files++] = optarg;
 	break;
 		
       case '?':
@@ -258,6 +280,110 @@ int parse_cmdline_options (int argc, char **argv,
         ogg123_opts->gain_mode = GAIN_NONE;
 	break;
 
+      case OPT_GAPLESS:
+        ogg123_opts->gapless = 1;
+	break;
+
+      case OPT_CROSSFADE:
+	ogg123_opts->crossfade = strtotime(optarg);
+	if (ogg123_opts->crossfade < 0.0) {
+	  status_error(_("=== Crossfade must be 0 seconds or more.\n"));
+	  exit(1);
+	}
+	break;
+
+      case OPT_CROSSFADE_CURVE:
+	if (!strcmp(optarg, "linear"))
+	  ogg123_opts->crossfade_curve = CURVE_LINEAR;
+	else if (!strcmp(optarg, "equal-power"))
+	  ogg123_opts->crossfade_curve = CURVE_EQUAL_POWER;
+	else {
+	  status_error(_("=== Crossfade curve must be linear or equal-power.\n"));
+	  exit(1);
+	}
+	break;
+
+      case OPT_REMOTE_SOCKET:
+	ogg123_opts->remote_socket = strdup(optarg);
+	ogg123_opts->remote = 1;
+	ogg123_opts->verbosity = 0;
+	break;
+
+      case OPT_PREFETCH:
+	ogg123_opts->prefetch = atoi(optarg);
+	if (ogg123_opts->prefetch < 0) {
+	  status_error(_("--- Cannot prefetch a negative number of files.\n"));
+	  ogg123_opts->prefetch = 0;
+	}
+	break;
+
+      case OPT_SLOW_DEVICE:
+	if (!strcmp(optarg, "block"))
+	  ogg123_opts->slow_device = SLOW_DEVICE_BLOCK;
+	else if (!strcmp(optarg, "drop"))
+	  ogg123_opts->slow_device = SLOW_DEVICE_DROP;
+	else if (!strcmp(optarg, "resync"))
+	  ogg123_opts->slow_device = SLOW_DEVICE_RESYNC;
+	else {
+	  status_error(_("=== Slow device policy must be block, drop or resync.\n"));
+	  exit(1);
+	}
+	break;
+
+      case OPT_OUTPUT_BITS:
+	ogg123_opts->output_bits = atoi(optarg);
+	if (ogg123_opts->output_bits != 16 && ogg123_opts->output_bits != 24 &&
+	    ogg123_opts->output_bits != 32) {
+	  status_error(_("=== Output bits must be 16, 24 or 32.\n"));
+	  exit(1);
+	}
+	break;
+
+      case OPT_ADAPTIVE_PREBUFFER:
+	ogg123_opts->adaptive_prebuffer = 1;
+	break;
+
+      case OPT_SERVER:
+	ogg123_opts->server = strdup(optarg);
+	break;
+
+      case OPT_BENCH:
+	ogg123_opts->bench = 1;
+	break;
+
+      case OPT_PLAYLIST_CACHE:
+	free(ogg123_opts->playlist_cache);  /* From the config file */
+	ogg123_opts->playlist_cache = strdup(optarg);
+	break;
+
+      case OPT_PCM_CACHE:
+	ogg123_opts->pcm_cache = 1024 * atol(optarg);
+	if (ogg123_opts->pcm_cache < 0) {
+	  status_error(_("--- Cannot cache a negative amount of audio.\n"));
+	  ogg123_opts->pcm_cache = 0;
+	}
+	break;
+
+      case OPT_PCM_CACHE_MAX:
+	ogg123_opts->pcm_cache_max = 1024 * atol(optarg);
+	if (ogg123_opts->pcm_cache_max <= 0) {
+	  status_error(_("=== The largest file to cache must be more than 0 kilobytes.\n"));
+	  exit(1);
+	}
+	break;
+
+      case OPT_SEEK_CACHE:
+	ogg123_opts->seek_cache = strdup(optarg);
+	break;
+
+      case OPT_PREFETCH_MEMORY:
+	ogg123_opts->prefetch_memory = 1024 * atol(optarg);
+	if (ogg123_opts->prefetch_memory <= 0) {
+	  status_error(_("--- Prefetch memory must be more than 0 kilobytes.\n"));
+	  exit(1);
+	}
+	break;
+
       default:
 	cmdline_usage();
 	exit(1);
@@ -272,8 +398,15 @@ int parse_cmdline_options (int argc, char **argv,
   }
 
 
+  /* A benchmark plays into its own sink, and a server's sessions each
+     name their own device, so no default device is needed */
+  if (ogg123_opts->bench || ogg123_opts->server != NULL) {
+    free_audio_devices(ogg123_opts->devices);
+    ogg123_opts->devices = NULL;
+  }
+
   /* Add last device to device list or use the default device */
-  if (temp_driver_id < 0) {
+  else if (temp_driver_id < 0) {
 
       /* First try config file setting */
       if (ogg123_opts->default_device) {
@@ -300,6 +433,18 @@ int parse_cmdline_options (int argc, char **argv,
 					     NULL);
     }
 
+  /* The cache, from here or the config file, has to be in place before
+     any directory is read, which a playlist file can name */
+  if (ogg123_opts->playlist_cache != NULL)
+    playlist_set_cache(ogg123_opts->playlist, ogg123_opts->playlist_cache);
+
+  for (i = 0; i < nplaylist_files; i++)
+    if (playlist_append_from_file(ogg123_opts->playlist,
+				  playlist_files[i]) == 0)
+      status_error(_("--- Cannot open playlist file %s.  Skipped.\n"),
+		   playlist_files[i]);
+  free(playlist_files);
+
   /* if verbosity has been altered, add options to drivers... */
   {
     audio_device_t *head = ogg123_opts->devices;
@@ -373,6 +518,10 @@ void cmdline_usage (void)
 	    "                          previously specified with --device.\n"));
   printf ("\n");
   printf (_("  --audio-buffer n        Use an output audio buffer of 'n' kilobytes\n"));
+  printf (_("  --output-bits n         Send 16, 24 or 32 bit samples to the devices\n"
+	    "                          (default 16)\n"));
+  printf (_("  --slow-device p         With several devices, what to do when one can't\n"
+	    "                          keep up: block, drop or resync (default block)\n"));
   printf (_("  -o k:v, --device-option k:v\n"
 	    "                          Pass special option 'k' with value 'v' to the\n"
 	    "                          device previously specified with --device. See\n"
@@ -381,8 +530,24 @@ void cmdline_usage (void)
 
   printf (_("Playlist options\n"));
   printf (_("  -@ file, --list file    Read playlist of files and URLs from \"file\"\n"));
+  printf (_("  --playlist-cache file   Keep directory listings in \"file\" and use them\n"
+	    "                          again while the directories are unchanged\n"));
   printf (_("  -r, --repeat            Repeat playlist indefinitely\n"));
+  printf (_("  --gapless               Start each file as soon as the last one ends,\n"
+	    "                          without draining the audio buffer in between\n"));
+  printf (_("  --crossfade n           Fade each file into the next over 'n' seconds\n"));
+  printf (_("  --crossfade-curve c     Shape of the fade: linear or equal-power\n"
+	    "                          (default equal-power)\n"));
+  printf (_("  --prefetch n            Open the next 'n' files in the background\n"));
+  printf (_("  --prefetch-memory n     Read ahead up to 'n' kilobytes of prefetched\n"
+	    "                          files (default 8192)\n"));
+  printf (_("  --pcm-cache n           Keep up to 'n' kilobytes of decoded audio, so\n"
+	    "                          files played again aren't decoded again\n"));
+  printf (_("  --pcm-cache-max n       Don't cache files that decode to more than 'n'\n"
+	    "                          kilobytes\n"));
   printf (_("  -R, --remote            Use remote control interface\n"));
+  printf (_("  --remote-socket path    Take remote control commands from any number of\n"
+	    "                          clients on the Unix domain socket \"path\"\n"));
   printf (_("  -z, --shuffle           Shuffle list of files before playing\n"));
   printf (_("  -Z, --random            Play files randomly until interrupted\n"));
   printf ("\n");
@@ -390,6 +555,7 @@ void cmdline_usage (void)
   printf (_("Input options\n"));
   printf (_("  -b n, --buffer n        Use an input buffer of 'n' kilobytes\n"));
   printf (_("  -p n, --prebuffer n     Load n%% of the input buffer before playing\n"));
+  printf (_("  --adaptive-prebuffer    Adjust the prebuffer to how steadily data arrives\n"));
   printf ("\n");
 
   printf (_("Decode options\n"));
@@ -400,6 +566,7 @@ void cmdline_usage (void)
   printf (_("  --album-gain            Use album gain value (ReplayGain)\n"));
   printf (_("  --track-gain            Use track gain value (ReplayGain)\n"));
   printf (_("  --no-gain               Disable ReplayGain\n"));
+  printf (_("  --seek-cache dir        Keep the seek indexes of large files in \"dir\"\n"));
   printf ("\n");
 
   printf (_("Miscellaneous options\n"));
@@ -407,6 +574,11 @@ void cmdline_usage (void)
 	    "                          will skip to the next song on SIGINT (Ctrl-C),\n"
 	    "                          and will terminate if two SIGINTs are received\n"
 	    "                          within the specified timeout 's'. (default 500)\n"));
+  printf (_("  --bench                 Decode as fast as possible into a null output in\n"
+	    "                          place of the devices, and report the throughput\n"
+	    "                          and latency\n"));
+  printf (_("  --server file           Play every session listed in \"file\", each to\n"
+	    "                          its own device, from one process\n"));
   printf ("\n");
   printf (_("  -h, --help              Display this help\n"));
   printf (_("  -q, --quiet             Don't display anything (no title)\n"));
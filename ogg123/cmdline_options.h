@@ -27,6 +27,21 @@ enum {
   OPT_ALBUM_GAIN,
   OPT_TRACK_GAIN,
   OPT_NO_GAIN,
+  OPT_GAPLESS,
+  OPT_PREFETCH,
+  OPT_PREFETCH_MEMORY,
+  OPT_SLOW_DEVICE,
+  OPT_ADAPTIVE_PREBUFFER,
+  OPT_OUTPUT_BITS,
+  OPT_SEEK_CACHE,
+  OPT_CROSSFADE,
+  OPT_CROSSFADE_CURVE,
+  OPT_REMOTE_SOCKET,
+  OPT_PLAYLIST_CACHE,
+  OPT_BENCH,
+  OPT_SERVER,
+  OPT_PCM_CACHE,
+  OPT_PCM_CACHE_MAX,
 };
 
 int parse_cmdline_options (int argc, char **argv,
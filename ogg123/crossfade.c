@@ -0,0 +1,467 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "crossfade.h"
+
+#ifdef WORDS_BIGENDIAN
+#define HOST_BIG_ENDIAN 1
+#else
+#define HOST_BIG_ENDIAN 0
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Mixing goes in blocks of a fixed size so gcc can vectorize it */
+#define MIX_BLOCK 16
+
+/* Only the decoding thread writes audio, so the state can be global */
+static double fade_seconds;
+static crossfade_curve_t fade_curve;
+
+/* The end of the track so far, in the format it was decoded in */
+static audio_format_t ring_fmt;
+static unsigned char *ring;
+static long ring_size;      /* Bytes, a whole number of frames */
+static long ring_start;
+static long ring_used;
+
+/* The next track has started, but hasn't written anything yet */
+static int pending;
+
+/* The held audio being mixed with the start of the new track, converted
+   to its format and scaled by the fade out.  fade_in has the gain of the
+   new track for each sample. */
+static int mixing;
+static audio_format_t mix_fmt;
+static float *tail;
+static float *fade_in;
+static long tail_samples;
+static long tail_pos;
+
+
+/* -------------------------- Sample conversion ------------------------- */
+
+static float get_sample (const unsigned char *in, audio_format_t *fmt)
+{
+  ogg_uint32_t v = 0;
+  int i;
+
+  if (fmt->big_endian)
+    for (i = 0; i < fmt->word_size; i++)
+      v = (v << 8) | in[i];
+  else
+    for (i = fmt->word_size - 1; i >= 0; i--)
+      v = (v << 8) | in[i];
+
+  /* Sign extend from the top of the word */
+  v <<= 32 - fmt->word_size * 8;
+
+  return (float) (ogg_int32_t) v * (1.0f / 2147483648.0f);
+}
+
+static void put_sample (unsigned char *out, audio_format_t *fmt, float x)
+{
+  double scale = ldexp(1.0, fmt->word_size * 8 - 1);
+  double y = floor(x * scale + 0.5);
+  ogg_uint32_t v;
+  int i;
+
+  if (y > scale - 1.0)
+    y = scale - 1.0;
+  else if (y < -scale)
+    y = -scale;
+  v = (ogg_uint32_t) (ogg_int32_t) y;
+
+  if (fmt->big_endian)
+    for (i = fmt->word_size - 1; i >= 0; i--, v >>= 8)
+      out[i] = v & 0xff;
+  else
+    for (i = 0; i < fmt->word_size; i++, v >>= 8)
+      out[i] = v & 0xff;
+}
+
+static int native16 (audio_format_t *fmt)
+{
+  return fmt->word_size == 2 && fmt->big_endian == HOST_BIG_ENDIAN;
+}
+
+static inline ogg_int16_t mix16 (float tail, ogg_int16_t in, float gain)
+{
+  float x = tail * 32768.0f + in * gain;
+
+  x = fminf(fmaxf(x, -32768.0f), 32767.0f);
+
+  return (ogg_int16_t) (x + copysignf(0.5f, x));
+}
+
+/* data[i] = tail[i] + data[i] * gain[i], for host order 16 bit samples */
+static void mix_int16 (ogg_int16_t *data, const float *tail,
+		       const float *gain, long n)
+{
+  long i;
+  int k;
+
+  for (i = 0; i + MIX_BLOCK <= n; i += MIX_BLOCK) {
+    for (k = 0; k < MIX_BLOCK; k++)
+      data[k] = mix16(tail[k], data[k], gain[k]);
+    data += MIX_BLOCK;
+    tail += MIX_BLOCK;
+    gain += MIX_BLOCK;
+  }
+
+  for (; i < n; i++, data++, tail++, gain++)
+    *data = mix16(*tail, *data, *gain);
+}
+
+static void mix_generic (unsigned char *data, audio_format_t *fmt,
+			 const float *tail, const float *gain, long n)
+{
+  long i;
+
+  for (i = 0; i < n; i++, data += fmt->word_size)
+    put_sample(data, fmt, tail[i] + get_sample(data, fmt) * gain[i]);
+}
+
+
+/* ---------------------------- The held audio -------------------------- */
+
+static int frame_size (audio_format_t *fmt)
+{
+  return fmt->word_size * fmt->channels;
+}
+
+/* Only called with the ring empty */
+static int set_ring_format (audio_format_t *fmt)
+{
+  long frames = (long) (fade_seconds * fmt->rate + 0.5);
+  unsigned char *new_ring;
+
+  if (ring != NULL && audio_format_equal(fmt, &ring_fmt))
+    return 1;
+
+  if (frames < 1)
+    frames = 1;
+
+  new_ring = realloc(ring, frames * frame_size(fmt));
+  if (new_ring == NULL)
+    return 0;
+
+  ring = new_ring;
+  ring_size = frames * frame_size(fmt);
+  ring_start = ring_used = 0;
+  ring_fmt = *fmt;
+
+  return 1;
+}
+
+/* Hand the oldest nbytes held to the buffer */
+static int submit_held (buf_t *buf, long nbytes)
+{
+  long first = ring_size - ring_start;
+
+  if (first > nbytes)
+    first = nbytes;
+
+  if (first > 0 && !buffer_submit_data(buf, ring + ring_start, first))
+    return 0;
+  if (nbytes > first && !buffer_submit_data(buf, ring, nbytes - first))
+    return 0;
+
+  ring_start = (ring_start + nbytes) % ring_size;
+  ring_used -= nbytes;
+
+  return 1;
+}
+
+/* Keep the newest audio, and submit whatever no longer fits */
+static int hold (buf_t *buf, unsigned char *data, long nbytes)
+{
+  long overflow = ring_used + nbytes - ring_size;
+  long end, first;
+
+  if (overflow > 0) {
+    long from_ring = overflow < ring_used ? overflow : ring_used;
+
+    if (!submit_held(buf, from_ring))
+      return 0;
+
+    overflow -= from_ring;
+    if (overflow > 0) {
+      if (!buffer_submit_data(buf, data, overflow))
+	return 0;
+      data += overflow;
+      nbytes -= overflow;
+    }
+  }
+
+  end = (ring_start + ring_used) % ring_size;
+  first = ring_size - end;
+  if (first > nbytes)
+    first = nbytes;
+
+  memcpy(ring + end, data, first);
+  memcpy(ring, data + first, nbytes - first);
+  ring_used += nbytes;
+
+  return 1;
+}
+
+/* Fade out gain at t from 0 to 1 through the fade, and the fade in gain
+   is the same curve backwards */
+static float fade_gain (double t)
+{
+  if (fade_curve == CURVE_LINEAR)
+    return 1.0 - t;
+  else
+    return cos(t * M_PI / 2);
+}
+
+/* Turn what is held into the tail to mix the new track into, in the new
+   track's format.  Channels are mapped simply (mono is copied to every
+   channel, and everything is averaged down to mono), and the rate is
+   changed by linear interpolation. */
+static int start_mix (audio_format_t *fmt)
+{
+  int in_channels = ring_fmt.channels;
+  int out_channels = fmt->channels;
+  int in_frame = frame_size(&ring_fmt);
+  long in_frames = ring_used / in_frame;
+  long out_frames, i;
+  double step;
+  float *in;
+  int c, j;
+
+  if (in_frames == 0)
+    return 1;
+
+  in = malloc(in_frames * out_channels * sizeof(float));
+  if (in == NULL)
+    return 0;
+
+  for (i = 0; i < in_frames; i++) {
+    unsigned char *frame = ring + (ring_start + i * in_frame) % ring_size;
+    float *out = in + i * out_channels;
+
+    if (in_channels == out_channels)
+      for (c = 0; c < out_channels; c++)
+	out[c] = get_sample(frame + c * ring_fmt.word_size, &ring_fmt);
+    else if (out_channels == 1) {
+      out[0] = 0.0f;
+      for (j = 0; j < in_channels; j++)
+	out[0] += get_sample(frame + j * ring_fmt.word_size, &ring_fmt);
+      out[0] /= in_channels;
+    } else
+      for (c = 0; c < out_channels; c++)
+	out[c] = in_channels == 1 || c < in_channels ?
+	  get_sample(frame + (in_channels == 1 ? 0 : c) * ring_fmt.word_size,
+		     &ring_fmt) : 0.0f;
+  }
+
+  out_frames = (long) ((double) in_frames * fmt->rate / ring_fmt.rate + 0.5);
+  if (out_frames < 1)
+    out_frames = 1;
+  tail_samples = out_frames * out_channels;
+
+  tail = malloc(tail_samples * sizeof(float));
+  fade_in = malloc(tail_samples * sizeof(float));
+  if (tail == NULL || fade_in == NULL) {
+    free(in);
+    free(tail);
+    free(fade_in);
+    tail = fade_in = NULL;
+    return 0;
+  }
+
+  step = (double) ring_fmt.rate / fmt->rate;
+  for (i = 0; i < out_frames; i++) {
+    double t = (double) i / out_frames;
+    double pos = i * step;
+    long k = (long) pos;
+    float frac = pos - k;
+    float out_gain = fade_gain(t);
+    float in_gain = fade_gain(1.0 - t);
+
+    if (k >= in_frames - 1) {
+      k = in_frames - 1;
+      frac = 0.0f;
+    }
+
+    for (c = 0; c < out_channels; c++) {
+      float a = in[k * out_channels + c];
+      float b = frac > 0.0f ? in[(k + 1) * out_channels + c] : a;
+
+      tail[i * out_channels + c] = (a + (b - a) * frac) * out_gain;
+      fade_in[i * out_channels + c] = in_gain;
+    }
+  }
+
+  free(in);
+
+  ring_start = ring_used = 0;
+  tail_pos = 0;
+  mix_fmt = *fmt;
+  mixing = 1;
+
+  return 1;
+}
+
+static void end_mix (void)
+{
+  free(tail);
+  free(fade_in);
+  tail = fade_in = NULL;
+  mixing = 0;
+}
+
+/* The new track ended before the fade did, so the rest of the old one
+   fades out over silence */
+static int finish_mix (buf_t *buf)
+{
+  long n = tail_samples - tail_pos;
+  unsigned char *data;
+  long i;
+  int ret;
+
+  data = malloc(n * mix_fmt.word_size);
+  if (data == NULL) {
+    end_mix();
+    return 0;
+  }
+
+  for (i = 0; i < n; i++)
+    put_sample(data + i * mix_fmt.word_size, &mix_fmt, tail[tail_pos + i]);
+  end_mix();
+
+  ret = hold(buf, data, n * mix_fmt.word_size);
+  free(data);
+
+  return ret;
+}
+
+
+/* ---------------------------- Public functions ------------------------ */
+
+void crossfade_init (double seconds, crossfade_curve_t curve)
+{
+  fade_seconds = seconds;
+  fade_curve = curve;
+}
+
+void crossfade_shutdown (void)
+{
+  end_mix();
+  free(ring);
+  ring = NULL;
+  ring_size = ring_start = ring_used = 0;
+  pending = 0;
+}
+
+void crossfade_next_track (buf_t *buf)
+{
+  if (mixing)
+    finish_mix(buf);
+
+  /* What is held now plays under the new track, so anything the new
+     track queues goes at the start of it */
+  pending = 1;
+  buffer_hold(buf, 0);
+}
+
+int crossfade_write (buf_t *buf, unsigned char *data, long nbytes,
+		     audio_format_t *fmt)
+{
+  int ret = 1;
+
+  if (pending) {
+    pending = 0;
+    if (ring_used > 0 && !start_mix(fmt))
+      ret = submit_held(buf, ring_used);
+  }
+
+  if (mixing) {
+    long n = nbytes / fmt->word_size;
+
+    if (n > tail_samples - tail_pos)
+      n = tail_samples - tail_pos;
+
+    if (native16(fmt))
+      mix_int16((ogg_int16_t *) data, tail + tail_pos, fade_in + tail_pos, n);
+    else
+      mix_generic(data, fmt, tail + tail_pos, fade_in + tail_pos, n);
+
+    tail_pos += n;
+    if (tail_pos == tail_samples)
+      end_mix();
+  }
+
+  if (ring_used == 0 && !set_ring_format(fmt))
+    ret = ret && buffer_submit_data(buf, data, nbytes);
+  else
+    ret = ret && hold(buf, data, nbytes);
+
+  buffer_hold(buf, ring_used);
+
+  return ret;
+}
+
+void crossfade_format_change (buf_t *buf)
+{
+  /* A new track mixes in what is held, whatever its format */
+  if (pending)
+    return;
+
+  if (mixing)
+    finish_mix(buf);
+
+  if (ring_used > 0)
+    submit_held(buf, ring_used);
+  buffer_hold(buf, 0);
+}
+
+int crossfade_flush (buf_t *buf)
+{
+  int ret = 1;
+
+  if (mixing)
+    ret = finish_mix(buf);
+
+  if (ring_used > 0)
+    ret = submit_held(buf, ring_used) && ret;
+
+  pending = 0;
+  buffer_hold(buf, 0);
+
+  return ret;
+}
+
+void crossfade_discard (buf_t *buf)
+{
+  end_mix();
+  ring_start = ring_used = 0;
+  pending = 0;
+  buffer_hold(buf, 0);
+}
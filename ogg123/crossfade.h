@@ -0,0 +1,51 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+/* Crossfading from one track into the next.  The last few seconds of
+   each track are held back from the audio buffer, and the start of the
+   next track is mixed into them as it is decoded.  If the next track has
+   a different rate or channel count, the held audio is converted to it
+   first, so the mix is played in the new track's format. */
+
+#ifndef __CROSSFADE_H__
+#define __CROSSFADE_H__
+
+#include "ogg123.h"
+#include "buffer.h"
+
+void crossfade_init (double seconds, crossfade_curve_t curve);
+void crossfade_shutdown (void);
+
+/* A track is starting: what it writes is mixed into the held audio */
+void crossfade_next_track (buf_t *buf);
+
+/* Write decoded audio in place of buffer_submit_data().  The data may
+   be modified. */
+int crossfade_write (buf_t *buf, unsigned char *data, long nbytes,
+		     audio_format_t *fmt);
+
+/* The decoder's format is about to change: play out what is held in
+   the old format first, unless a new track is about to mix it in */
+void crossfade_format_change (buf_t *buf);
+
+/* Play out what is held as it is, at the end of the playlist */
+int crossfade_flush (buf_t *buf);
+
+/* Throw away what is held, when playback is stopped */
+void crossfade_discard (buf_t *buf);
+
+#endif /* __CROSSFADE_H__ */
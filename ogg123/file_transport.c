@@ -22,15 +22,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <time.h>
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#define USE_MMAP 1
+#endif
 
 #include "transport.h"
 #include "i18n.h"
 
+/* How much of the start of a mapped file to ask the kernel for straight
+   away, to cover the headers and the first blocks of audio */
+#define FILE_READAHEAD (256 * 1024)
+
+/* A file modified this recently, in seconds, may still be being written
+   (recorded or downloaded), so it is read with stdio, which keeps up
+   with it growing */
+#define FILE_SETTLE 2
+
 
 typedef struct file_private_t {
   FILE *fp;
   data_source_stats_t stats;
   int seekable;
+
+  /* Regular files are mapped, which makes peeking and seeking free and
+     reads a memcpy.  Pipes and anything that can't be mapped use fp. */
+  unsigned char *map;
+  long map_len;
+  long pos;
 } file_private_t;
 
 
@@ -42,6 +70,124 @@ int file_can_transport (const char *source_string)
   return 1;  /* The file transport is tested last, so always try it */
 }
 
+
+#ifdef USE_MMAP
+/* A mapped file that is cut short, or can't be paged in (a failing disk
+   or network filesystem), raises SIGBUS where a read() would just come
+   up short.  Copies out of a map are made under this guard, and a fault
+   sends the source back to stdio. */
+static __thread sigjmp_buf *map_guard = NULL;
+static pthread_once_t map_guard_once = PTHREAD_ONCE_INIT;
+
+static void map_fault (int sig)
+{
+  if (map_guard != NULL)
+    siglongjmp(*map_guard, 1);
+
+  /* Not ours, so die of it as usual */
+  signal(SIGBUS, SIG_DFL);
+  raise(SIGBUS);
+}
+
+static void map_guard_install (void)
+{
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = map_fault;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, NULL);
+}
+
+
+/* Whether the file is still the size it was mapped at */
+static int map_current (file_private_t *private)
+{
+  struct stat st;
+
+  return fstat(fileno(private->fp), &st) == 0 &&
+    st.st_size == private->map_len;
+}
+
+
+/* Go over to stdio, carrying on from the same place */
+static void file_unmap (file_private_t *private)
+{
+  munmap(private->map, private->map_len);
+  private->map = NULL;
+  private->map_len = 0;
+  fseek(private->fp, private->pos, SEEK_SET);
+}
+
+
+/* Returns the items copied, or -1 if the map can't be used any more */
+static int map_peek (file_private_t *private, void *ptr, size_t size,
+		     size_t nmemb)
+{
+  sigjmp_buf guard;
+  size_t avail, items;
+
+  avail = private->pos < private->map_len ?
+    (private->map_len - private->pos) / size : 0;
+  items = avail < nmemb ? avail : nmemb;
+
+  /* Coming up short may only mean the file has grown since it was
+     mapped, so that is the one time to look at its size again */
+  if (items < nmemb && !map_current(private))
+    return -1;
+
+  if (items == 0)
+    return 0;
+
+  /* A file that has shrunk faults in the copy */
+  if (sigsetjmp(guard, 1)) {
+    map_guard = NULL;
+    return -1;
+  }
+  map_guard = &guard;
+  memcpy(ptr, private->map + private->pos, items * size);
+  map_guard = NULL;
+
+  return items;
+}
+#endif
+
+
+static void file_map (file_private_t *private)
+{
+  int fd = fileno(private->fp);
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return;
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+#ifdef USE_MMAP
+  if (st.st_size > 0 && st.st_size <= LONG_MAX &&
+      st.st_mtime < time(NULL) - FILE_SETTLE) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED)
+      return;
+
+#ifdef HAVE_MADVISE
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    madvise(map, st.st_size < FILE_READAHEAD ? st.st_size : FILE_READAHEAD,
+	    MADV_WILLNEED);
+#endif
+
+    pthread_once(&map_guard_once, map_guard_install);
+
+    private->map = map;
+    private->map_len = st.st_size;
+    private->pos = 0;
+  }
+#endif
+}
+
 data_source_t* file_open (const char *source_string, ogg123_options_t *ogg123_opts)
 {
   data_source_t *source;
@@ -57,6 +203,9 @@ data_source_t* file_open (const char *source_string, ogg123_options_t *ogg123_op
     source->private = private;
 
     private->seekable = 1;
+    private->map = NULL;
+    private->map_len = 0;
+    private->pos = 0;
     private->stats.transfer_rate = 0;
     private->stats.bytes_read = 0;
     private->stats.input_buffer_used = 0;
@@ -83,6 +232,9 @@ data_source_t* file_open (const char *source_string, ogg123_options_t *ogg123_op
     return NULL;
   }
 
+  if (private->seekable)
+    file_map(private);
+
   return source;
 }
 
@@ -96,6 +248,18 @@ int file_peek (data_source_t *source, void *ptr, size_t size, size_t nmemb)
 
   if (!private->seekable) return 0;
 
+#ifdef USE_MMAP
+  if (private->map != NULL) {
+    if (size == 0)
+      return 0;
+
+    if ( (items = map_peek(private, ptr, size, nmemb)) >= 0 )
+      return items;
+
+    file_unmap(private);
+  }
+#endif
+
   /* Record where we are */
   start = ftell(fp);
 
@@ -116,7 +280,20 @@ int file_read (data_source_t *source, void *ptr, size_t size, size_t nmemb)
   FILE *fp = private->fp;
   int bytes_read;
 
-  bytes_read = fread(ptr, size, nmemb, fp);
+  bytes_read = -1;
+
+#ifdef USE_MMAP
+  if (private->map != NULL) {
+    bytes_read = size == 0 ? 0 : map_peek(private, ptr, size, nmemb);
+    if (bytes_read >= 0)
+      private->pos += bytes_read * size;
+    else
+      file_unmap(private);
+  }
+#endif
+
+  if (bytes_read < 0)
+    bytes_read = fread(ptr, size, nmemb, fp);
 
   if (bytes_read > 0)
     private->stats.bytes_read += bytes_read;
@@ -132,15 +309,39 @@ int file_seek (data_source_t *source, long offset, int whence)
 
   if (!private->seekable) return -1;
 
+#ifdef USE_MMAP
+  /* The end may have moved */
+  if (private->map != NULL && whence == SEEK_END && !map_current(private))
+    file_unmap(private);
+#endif
+
+  if (private->map != NULL) {
+    long pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = private->pos + offset; break;
+    case SEEK_END: pos = private->map_len + offset; break;
+    default: return -1;
+    }
+
+    /* Like fseek(), going past the end is fine but before the start isn't */
+    if (pos < 0)
+      return -1;
+
+    private->pos = pos;
+    return 0;
+  }
+
   return fseek(fp, offset, whence);  
 }
 
 
-data_source_stats_t * file_statistics (data_source_t *source)
+void file_statistics (data_source_t *source, data_source_stats_t *stats)
 {
   file_private_t *private = source->private;
 
-  return malloc_data_source_stats(&private->stats);
+  *stats = private->stats;
 }
 
 
@@ -151,6 +352,9 @@ long file_tell (data_source_t *source)
 
   if (!private->seekable) return -1;
 
+  if (private->map != NULL)
+    return private->pos;
+
   return ftell(fp);
 }
 
@@ -160,6 +364,10 @@ void file_close (data_source_t *source)
   file_private_t *private = source->private;
   FILE *fp = private->fp;
 
+#ifdef USE_MMAP
+  if (private->map != NULL)
+    munmap(private->map, private->map_len);
+#endif
   fclose(fp);
 
   free(source->source_string);
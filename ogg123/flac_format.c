@@ -36,6 +36,7 @@
 #include "easyflac.h"
 #endif
 #include "vorbis_comments.h"
+#include "vgfilter.h"
 
 typedef struct {
 #if NEED_EASYFLAC
@@ -69,6 +70,13 @@ typedef struct {
   int buf_start; /* Offset to start of audio data */
   int buf_fill; /* Number of bytes of audio data in buffer */
 
+  /* ReplayGain works on float, so with any gain to apply the samples go
+     through here */
+  vgain_state vg;
+  float **pcm;
+  int pcm_channels;
+  int pcm_len;
+
   decoder_stats_t stats;
 
 } flac_private_t;
@@ -93,10 +101,12 @@ static FLAC__bool eof_callback(const FLAC__StreamDecoder *decoder, void *client_
 #endif
 
 void resize_buffer(flac_private_t *flac, int newchannels, int newsamples);
+void to_float(flac_private_t *flac, int samples);
 /*void copy_comments (vorbis_comment *v_comments, FLAC__StreamMetadata_VorbisComment *f_comments);*/
 void print_flac_stream_info (decoder_t *decoder);
 void print_flac_comments (FLAC__StreamMetadata_VorbisComment *comments,
-			  decoder_callbacks_t *cb, void *callback_arg);
+			  decoder_callbacks_t *cb, void *callback_arg,
+			  vorbis_comment *vc);
 
 
 
@@ -158,6 +168,7 @@ decoder_t* flac_init (data_source_t *source, ogg123_options_t *ogg123_opts,
     decoder->callbacks = callbacks;
     decoder->callback_arg = callback_arg;
     decoder->private = private;
+    decoder->options = ogg123_opts;
 
     private->stats.total_time = 0.0;
     private->stats.current_time = 0.0;
@@ -182,6 +193,9 @@ decoder_t* flac_init (data_source_t *source, ogg123_options_t *ogg123_opts,
   private->buf_len = 0;
   private->buf_fill = 0;
   private->buf_start = 0;
+  private->pcm = NULL;
+  private->pcm_channels = 0;
+  private->pcm_len = 0;
 
   /* Setup FLAC decoder */
 #if NEED_EASYFLAC
@@ -250,17 +264,15 @@ int flac_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
 {
   flac_private_t *priv = decoder->private;
   decoder_callbacks_t *cb = decoder->callbacks;
-  FLAC__int8 *buf8 = (FLAC__int8 *) ptr;
-  FLAC__int16 *buf16 = (FLAC__int16 *) ptr;
+  unsigned char *out = ptr;
   long samples, realsamples = 0;
   FLAC__bool ret;
-  int i,j;
+  vorbis_comment vc;
 
   /* Read comments and audio info at the start of a logical bitstream */
   if (priv->bos) {
     decoder->actual_fmt.rate = priv->rate;
     decoder->actual_fmt.channels = priv->channels;
-    decoder->actual_fmt.word_size = ((priv->bits_per_sample + 7) / 8);
 
     switch(decoder->actual_fmt.channels){
     case 1:
@@ -293,9 +305,12 @@ int flac_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
     }
 
     print_flac_stream_info(decoder);
+    vorbis_comment_init(&vc);
     if (priv->comments != NULL) 
       print_flac_comments(&priv->comments->data.vorbis_comment, cb,
-			  decoder->callback_arg);
+			  decoder->callback_arg, &vc);
+    vg_init(&priv->vg, &vc, decoder->options->gain_mode);
+    vorbis_comment_clear(&vc);
 
     priv->bos = 0;
   }
@@ -316,17 +331,18 @@ int flac_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
       int copy = priv->buf_fill < (samples - realsamples) ?
 	priv->buf_fill : (samples - realsamples);
 
-      /* Need sample mangling code here! */
-
-      if (audio_fmt->word_size == 1) {
-	for (i = 0; i < priv->channels; i++)
-	  for (j = 0; j < copy; j++)
-           buf8[(j+realsamples)*audio_fmt->channels+i] = (FLAC__int8) (0xFF & priv->buf[i][j+priv->buf_start]);
-      } else if (audio_fmt->word_size == 2) {
-	for (i = 0; i < priv->channels; i++)
-	  for (j = 0; j < copy; j++)
-           buf16[(j+realsamples)*audio_fmt->channels+i] = (FLAC__int16) (0xFFFF & priv->buf[i][j+priv->buf_start]);
-      }	
+      /* Samples go out at the requested width whatever their depth */
+      if (priv->vg.scale_factor == 1.0)
+	pcm_pack_int(out + realsamples * audio_fmt->channels *
+		     audio_fmt->word_size, audio_fmt,
+		     (ogg_int32_t **) priv->buf, priv->buf_start, copy,
+		     priv->bits_per_sample);
+      else {
+	to_float(priv, copy);
+	vg_filter(priv->pcm, priv->channels, copy, &priv->vg);
+	pcm_pack_planar(out + realsamples * audio_fmt->channels *
+			audio_fmt->word_size, audio_fmt, priv->pcm, copy);
+      }
 
       priv->buf_start += copy;
       priv->buf_fill -= copy;
@@ -364,7 +380,7 @@ int flac_seek (decoder_t *decoder, double offset, int whence)
 
 #define AVG_FACTOR 0.5
 
-decoder_stats_t *flac_statistics (decoder_t *decoder)
+void flac_statistics (decoder_t *decoder, decoder_stats_t *stats)
 {
   flac_private_t *priv = decoder->private;
   long instant_bitrate;
@@ -398,7 +414,7 @@ decoder_stats_t *flac_statistics (decoder_t *decoder)
   priv->stats.avg_bitrate = 0;
 
 
-  return malloc_decoder_stats(&priv->stats);
+  *stats = priv->stats;
 }
 
 
@@ -414,6 +430,11 @@ void flac_cleanup (decoder_t *decoder)
 
   free(priv->buf);
   priv->buf = NULL;
+
+  if (priv->pcm != NULL)
+    free(priv->pcm[0]);
+  free(priv->pcm);
+  priv->pcm = NULL;
 #if NEED_EASYFLAC
   EasyFLAC__finish(priv->decoder);
   EasyFLAC__stream_decoder_delete(priv->decoder);
@@ -584,6 +605,38 @@ void resize_buffer(flac_private_t *flac, int newchannels, int newsamples)
 }
 
 
+/* Copy samples from the start of the audio buffer into flac->pcm as
+   float, full scale at +/-1.0 */
+void to_float(flac_private_t *flac, int samples)
+{
+  float scale = ldexp(1.0, -(flac->bits_per_sample - 1));
+  int i, j;
+
+  if (flac->pcm_channels != flac->channels || flac->pcm_len < samples) {
+    if (flac->pcm != NULL)
+      free(flac->pcm[0]);
+    free(flac->pcm);
+
+    flac->pcm = malloc(sizeof(float *) * flac->channels);
+    if (flac->pcm == NULL ||
+	(flac->pcm[0] = malloc(sizeof(float) * flac->channels * samples))
+	== NULL) {
+      fprintf(stderr, _("Error: Out of memory.\n"));
+      exit(1);
+    }
+    for (i = 1; i < flac->channels; i++)
+      flac->pcm[i] = flac->pcm[0] + i * samples;
+
+    flac->pcm_channels = flac->channels;
+    flac->pcm_len = samples;
+  }
+
+  for (i = 0; i < flac->channels; i++)
+    for (j = 0; j < samples; j++)
+      flac->pcm[i][j] = flac->buf[i][j + flac->buf_start] * scale;
+}
+
+
 void print_flac_stream_info (decoder_t *decoder)
 {
   flac_private_t *priv = decoder->private;
@@ -613,8 +666,10 @@ void print_flac_stream_info (decoder_t *decoder)
 			priv->rate);  
 }
 
+/* Also collects the comments in vc, for ReplayGain */
 void print_flac_comments (FLAC__StreamMetadata_VorbisComment *f_comments,
-			  decoder_callbacks_t *cb, void *callback_arg)
+			  decoder_callbacks_t *cb, void *callback_arg,
+			  vorbis_comment *vc)
 {
   int i;
   char *temp = NULL;
@@ -633,6 +688,7 @@ void print_flac_comments (FLAC__StreamMetadata_VorbisComment *f_comments,
     temp[f_comments->comments[i].length] = '\0';
 
     print_vorbis_comment(temp, cb, callback_arg);
+    vorbis_comment_add(vc, temp);
   }
 
   free(temp);
@@ -21,11 +21,18 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include "transport.h"
 #include "format.h"
 #include "i18n.h"
 
+#ifdef WORDS_BIGENDIAN
+#define HOST_BIG_ENDIAN 1
+#else
+#define HOST_BIG_ENDIAN 0
+#endif
+
 extern format_t oggvorbis_format;
 extern format_t speex_format;
 
@@ -80,18 +87,136 @@ format_t *select_format (data_source_t *source)
 }
 
 
-decoder_stats_t *malloc_decoder_stats (decoder_stats_t *to_copy)
+/* --------------------------- Sample packing --------------------------- */
+
+/* Each decoding thread has its own generator, since a server decodes
+   on several at once */
+static __thread unsigned int dither_seed = 22222;
+
+/* Triangular noise of +/-1 LSB, the sum of two uniform values */
+static double tpdf_dither (void)
+{
+  double a, b;
+
+  dither_seed = dither_seed * 1664525 + 1013904223;
+  a = (dither_seed >> 8) / 16777216.0;
+  dither_seed = dither_seed * 1664525 + 1013904223;
+  b = (dither_seed >> 8) / 16777216.0;
+
+  return a - b;
+}
+
+/* The same noise in single precision, for the 16 bit path below */
+static inline float tpdf_dither_float (void)
+{
+  unsigned int a, b;
+
+  a = dither_seed = dither_seed * 1664525 + 1013904223;
+  b = dither_seed = dither_seed * 1664525 + 1013904223;
+
+  return ((int) (a >> 8) - (int) (b >> 8)) * (1.0f / 16777216.0f);
+}
+
+/* Dithered 16 bit output in host order, which is what almost everyone
+   plays: stored a word at a time, with no double precision and no
+   per-byte loop */
+static inline void put_native16 (unsigned char *out, float x)
+{
+  ogg_int16_t v;
+
+  x = x * 32768.0f + tpdf_dither_float();
+  x = fminf(fmaxf(x, -32768.0f), 32767.0f);
+  v = (ogg_int16_t) lrintf(x);
+  memcpy(out, &v, sizeof(v));
+}
+
+static int native16 (audio_format_t *fmt)
+{
+  return fmt->word_size == 2 && fmt->big_endian == HOST_BIG_ENDIAN;
+}
+
+static void put_sample (unsigned char *out, audio_format_t *fmt,
+			ogg_int32_t value)
 {
-  decoder_stats_t *new_stats;
+  ogg_uint32_t v = (ogg_uint32_t) value;
+  int i;
+
+  if (fmt->big_endian)
+    for (i = fmt->word_size - 1; i >= 0; i--, v >>= 8)
+      out[i] = v & 0xff;
+  else
+    for (i = 0; i < fmt->word_size; i++, v >>= 8)
+      out[i] = v & 0xff;
+}
 
-  new_stats = malloc(sizeof(decoder_stats_t));
+static ogg_int32_t quantize (double x, double scale, int dither)
+{
+  x *= scale;
+  if (dither)
+    x += tpdf_dither();
+  x = floor(x + 0.5);
+
+  if (x > scale - 1.0)
+    x = scale - 1.0;
+  else if (x < -scale)
+    x = -scale;
+
+  return (ogg_int32_t) x;
+}
 
-  if (new_stats == NULL) {
-    fprintf(stderr, _("ERROR: Could not allocate memory in malloc_decoder_stats()\n"));
-    exit(1);
+/* Float samples are full scale at +/-1.0 */
+void pcm_pack_planar (unsigned char *out, audio_format_t *fmt,
+		      float **pcm, long frames)
+{
+  double scale = ldexp(1.0, fmt->word_size * 8 - 1);
+  int dither = fmt->word_size <= 2;
+  long i;
+  int j;
+
+  if (native16(fmt)) {
+    for (i = 0; i < frames; i++)
+      for (j = 0; j < fmt->channels; j++, out += 2)
+	put_native16(out, pcm[j][i]);
+    return;
+  }
+
+  for (i = 0; i < frames; i++)
+    for (j = 0; j < fmt->channels; j++, out += fmt->word_size)
+      put_sample(out, fmt, quantize(pcm[j][i], scale, dither));
+}
+
+void pcm_pack_interleaved (unsigned char *out, audio_format_t *fmt,
+			   const float *pcm, long frames, float gain)
+{
+  double scale = ldexp(gain, fmt->word_size * 8 - 1);
+  int dither = fmt->word_size <= 2;
+  long i;
+
+  if (native16(fmt)) {
+    for (i = 0; i < frames * fmt->channels; i++, out += 2)
+      put_native16(out, pcm[i] * gain);
+    return;
   }
 
-  *new_stats = *to_copy;  /* Copy the data */
+  for (i = 0; i < frames * fmt->channels; i++, out += fmt->word_size)
+    put_sample(out, fmt, quantize(pcm[i], scale, dither));
+}
 
-  return new_stats;
+/* Integer samples of the given bit depth are moved up to the output
+   width as they are, and only dithered when they have to come down */
+void pcm_pack_int (unsigned char *out, audio_format_t *fmt,
+		   ogg_int32_t **pcm, long start, long frames, int bits)
+{
+  int shift = fmt->word_size * 8 - bits;
+  double scale = ldexp(1.0, fmt->word_size * 8 - 1);
+  double in_scale = ldexp(1.0, -(bits - 1));
+  long i;
+  int j;
+
+  for (i = start; i < start + frames; i++)
+    for (j = 0; j < fmt->channels; j++, out += fmt->word_size)
+      if (shift >= 0)
+	put_sample(out, fmt, (ogg_int32_t) ((ogg_uint32_t) pcm[j][i] << shift));
+      else
+	put_sample(out, fmt, quantize(pcm[j][i] * in_scale, scale, 1));
 }
@@ -68,13 +68,22 @@ typedef struct format_t {
   int (* read) (decoder_t *decoder, void *ptr, int nbytes, int *eos, 
 		audio_format_t *audio_fmt);
   int (* seek) (decoder_t *decoder, double offset, int whence);
-  decoder_stats_t* (* statistics) (decoder_t *decoder);
+  void (* statistics) (decoder_t *decoder, decoder_stats_t *stats);
   void (* cleanup) (decoder_t *decoder);
 } format_t;
 
 format_t *get_format_by_name (char *name);
 format_t *select_format (data_source_t *source);
 
-decoder_stats_t *malloc_decoder_stats (decoder_stats_t *to_copy);
+/* Write decoded samples into ptr as signed integers of fmt->word_size
+   bytes, in fmt's byte order.  Dither is only added where precision is
+   lost: float sources going out at 16 bits, and integer sources deeper
+   than the output. */
+void pcm_pack_planar (unsigned char *out, audio_format_t *fmt,
+		      float **pcm, long frames);
+void pcm_pack_interleaved (unsigned char *out, audio_format_t *fmt,
+			   const float *pcm, long frames, float gain);
+void pcm_pack_int (unsigned char *out, audio_format_t *fmt,
+		   ogg_int32_t **pcm, long start, long frames, int bits);
 
 #endif /* __FORMAT_H__ */
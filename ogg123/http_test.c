@@ -0,0 +1,332 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+/* Checks the HTTP transport against a small server on the loopback
+   interface that can be told to take byte ranges, to ignore them, or to
+   drop the first connection part way through.  Everything read back is
+   compared with what the server was serving. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ogg123.h"
+#include "transport.h"
+#include "status.h"
+
+#define RESOURCE_SIZE 200000
+#define DROP_AT       30000   /* Bytes sent before a dropped connection */
+
+enum server_mode { TAKES_RANGES, IGNORES_RANGES, NO_RANGES, DROPS_ONCE };
+
+static int listen_fd;
+static int port;
+static enum server_mode mode;
+static int drops_left;
+
+extern transport_t http_transport;
+
+signal_request_t sig_request = {0, 0, 0, 0, 0};
+
+
+/* ---------------- What http_transport.c needs from ogg123 ------------- */
+
+void status_error (const char *fmt, ...)
+{
+  /* Reconnects are expected here, and say so on their own */
+}
+
+
+/* ------------------------- The stand-in server ------------------------ */
+
+static unsigned char resource_byte (long pos)
+{
+  return (unsigned char) (pos * 7 + pos / 251);
+}
+
+static int send_all (int fd, const void *data, long len)
+{
+  const char *p = data;
+  long n;
+
+  while (len > 0) {
+    n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return 0;
+    p += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static void serve (int fd)
+{
+  char request[4096], header[512], *range;
+  unsigned char body[4096];
+  long got = 0, n, start = 0, end, pos;
+  int partial;
+
+  /* Read the request up to the blank line */
+  while (got < sizeof(request) - 1) {
+    n = recv(fd, request + got, sizeof(request) - 1 - got, 0);
+    if (n <= 0)
+      return;
+    got += n;
+    request[got] = '\0';
+    if (strstr(request, "\r\n\r\n"))
+      break;
+  }
+
+  for (range = request; (range = strchr(range, '\n')) != NULL; range++)
+    if (!strncasecmp(range + 1, "Range: bytes=", 13)) {
+      start = atol(range + 14);
+      break;
+    }
+
+  partial = start > 0 && (mode == TAKES_RANGES || mode == DROPS_ONCE);
+  if (!partial)
+    start = 0;
+
+  if (partial)
+    n = sprintf(header, "HTTP/1.1 206 Partial Content\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Content-Range: bytes %ld-%d/%d\r\n"
+		"Content-Length: %ld\r\n"
+		"Connection: close\r\n\r\n",
+		start, RESOURCE_SIZE - 1, RESOURCE_SIZE, RESOURCE_SIZE - start);
+  else
+    n = sprintf(header, "HTTP/1.1 200 OK\r\n"
+		"%s"
+		"Content-Length: %d\r\n"
+		"Connection: close\r\n\r\n",
+		mode == NO_RANGES ? "" : "Accept-Ranges: bytes\r\n",
+		RESOURCE_SIZE);
+  if (!send_all(fd, header, n))
+    return;
+
+  end = RESOURCE_SIZE;
+  if (mode == DROPS_ONCE && drops_left > 0) {
+    drops_left--;
+    end = start + DROP_AT;
+  }
+
+  for (pos = start; pos < end; pos += n) {
+    n = end - pos < sizeof(body) ? end - pos : sizeof(body);
+    for (got = 0; got < n; got++)
+      body[got] = resource_byte(pos + got);
+    if (!send_all(fd, body, n))
+      return;
+  }
+}
+
+static void *server_thread_func (void *arg)
+{
+  int fd;
+
+  while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+    serve(fd);
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+static int server_start (void)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  pthread_t thread;
+
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    return 0;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, 8) < 0 ||
+      getsockname(listen_fd, (struct sockaddr *) &addr, &len) < 0)
+    return 0;
+  port = ntohs(addr.sin_port);
+
+  if (pthread_create(&thread, NULL, server_thread_func, NULL) != 0)
+    return 0;
+  pthread_detach(thread);
+
+  return 1;
+}
+
+
+/* ------------------------------ The checks ---------------------------- */
+
+static int failures = 0;
+
+static void check (int ok, const char *what)
+{
+  if (ok)
+    printf("success: %s\n", what);
+  else {
+    printf("error: %s\n", what);
+    failures++;
+  }
+}
+
+static data_source_t *open_resource (enum server_mode how)
+{
+  ogg123_options_t opts;
+  char url[64];
+
+  mode = how;
+  drops_left = 1;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.input_buffer_size = 16384;  /* Small enough to keep curl waiting */
+  opts.input_prebuffer = 0.0;
+
+  sprintf(url, "http://127.0.0.1:%d/test.ogg", port);
+  return http_transport.open(url, &opts);
+}
+
+/* Read len bytes, or to the end if len is -1, and compare them with the
+   resource from pos on.  Returns how many bytes came back, or -1 if any
+   of them were wrong. */
+static long read_and_compare (data_source_t *source, long pos, long len)
+{
+  unsigned char data[4096];
+  long total = 0, want, got, i;
+
+  while (len < 0 || total < len) {
+    want = len < 0 || len - total > sizeof(data) ? sizeof(data) : len - total;
+    got = source->transport->read(source, data, 1, want);
+    if (got <= 0)
+      break;
+    for (i = 0; i < got; i++)
+      if (data[i] != resource_byte(pos + total + i))
+	return -1;
+    total += got;
+  }
+
+  return total;
+}
+
+static void test_range_seek (void)
+{
+  data_source_t *source = open_resource(TAKES_RANGES);
+
+  check(source != NULL, "opened a server that takes ranges");
+  if (source == NULL)
+    return;
+
+  check(read_and_compare(source, 0, 1000) == 1000, "read from the start");
+  check(source->transport->seek(source, 150000, SEEK_SET) == 0 &&
+	source->transport->tell(source) == 150000, "seek forward");
+  check(read_and_compare(source, 150000, 1000) == 1000,
+	"read after seeking forward");
+  check(source->transport->seek(source, 5000, SEEK_SET) == 0 &&
+	read_and_compare(source, 5000, 1000) == 1000, "seek back and read");
+  check(source->transport->seek(source, -100, SEEK_END) == 0 &&
+	read_and_compare(source, RESOURCE_SIZE - 100, -1) == 100,
+	"seek from the end and read to the end");
+
+  /* Nothing left to fetch: no transfer is started, and none should be
+     stopped again on the next seek or on close */
+  check(source->transport->seek(source, 0, SEEK_END) == 0 &&
+	read_and_compare(source, RESOURCE_SIZE, -1) == 0,
+	"seek to the very end");
+  check(source->transport->seek(source, 10, SEEK_SET) == 0 &&
+	read_and_compare(source, 10, 1000) == 1000,
+	"seek back in from the very end");
+  check(source->transport->seek(source, 0, SEEK_END) == 0,
+	"seek to the very end again");
+
+  source->transport->close(source);
+}
+
+static void test_ignored_range (void)
+{
+  data_source_t *source = open_resource(IGNORES_RANGES);
+
+  check(source != NULL, "opened a server that ignores ranges");
+  if (source == NULL)
+    return;
+
+  check(read_and_compare(source, 0, 1000) == 1000, "read from the start");
+  check(source->transport->seek(source, 120000, SEEK_SET) == 0,
+	"seek with the range ignored");
+  check(read_and_compare(source, 120000, -1) == RESOURCE_SIZE - 120000,
+	"read to the end with the range ignored");
+
+  source->transport->close(source);
+
+  source = open_resource(NO_RANGES);
+  check(source != NULL, "opened a server that doesn't do ranges");
+  if (source == NULL)
+    return;
+
+  check(read_and_compare(source, 0, 1000) == 1000, "read from the start");
+  check(source->transport->seek(source, 5000, SEEK_SET) == -1,
+	"seek refused without ranges");
+  check(read_and_compare(source, 1000, -1) == RESOURCE_SIZE - 1000,
+	"read on to the end after the refused seek");
+
+  source->transport->close(source);
+}
+
+static void test_resumed_connection (void)
+{
+  data_source_t *source = open_resource(DROPS_ONCE);
+
+  check(source != NULL, "opened a server that drops the connection");
+  if (source == NULL)
+    return;
+
+  check(read_and_compare(source, 0, -1) == RESOURCE_SIZE,
+	"read through a dropped connection");
+  check(drops_left == 0, "connection was dropped");
+
+  source->transport->close(source);
+}
+
+int main (int argc, char **argv)
+{
+  if (!server_start()) {
+    printf("error: could not start the test server\n");
+    return 1;
+  }
+
+  test_range_seek();
+  test_ignored_range();
+  test_resumed_connection();
+
+  return failures ? 1 : 0;
+}
@@ -23,7 +23,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include <curl/curl.h>
 #include <curl/easy.h>
@@ -38,7 +41,22 @@
 
 #define INPUT_BUFFER_SIZE 32768
 
-extern stat_format_t *stat_format;  /* FIXME Bad hack!  Will fix after RC3! */
+/* How many times a dropped connection is picked up again where it left
+   off, for servers that take byte ranges */
+#define HTTP_MAX_RECONNECTS 5
+
+/* Adaptive prebuffering: once a second the prebuffer is set to cover the
+   longest recent gap between arrivals, with room to spare, at the rate
+   data has been coming in.  The gap estimate decays so the prebuffer
+   shrinks again once the link settles, and each underrun widens the
+   margin. */
+#define ADAPT_INTERVAL     1.0   /* seconds between adjustments */
+#define ADAPT_JITTER_DECAY 0.9   /* per adjustment */
+#define ADAPT_MARGIN       2.0
+#define ADAPT_MARGIN_MAX   8.0
+#define ADAPT_MIN_FILL     0.05  /* of the buffer size */
+#define ADAPT_MAX_FILL     0.9
+
 extern signal_request_t sig_request;  /* Need access to global cancel flag */
 
 typedef struct http_private_t {
@@ -47,13 +65,38 @@ typedef struct http_private_t {
   buf_t *buf;
 
   pthread_t curl_thread;
+  int thread_running;   /* curl_thread is yet to be joined */
 
-  CURL *curl_handle;
+  CURL *curl_handle;    /* Only the curl thread touches it while it runs */
   struct curl_slist *header_list;
   char error[CURL_ERROR_SIZE];
 
   data_source_t *data_source;
   data_source_stats_t stats;
+
+  /* What the server told us, known once the body starts arriving */
+  pthread_mutex_t header_lock;
+  pthread_cond_t header_cond;
+  int headers_done;
+  int status;           /* HTTP status of the last response */
+  int ranges;           /* Server takes byte ranges, so we can seek */
+  long content_length;  /* Of the last response, -1 if not given */
+  long length;          /* Of the whole resource, -1 if unknown */
+
+  long offset;          /* Where the reader is, for tell */
+  long range_start;     /* Where the current transfer was asked to start */
+  long fetch_pos;       /* Offset of the next byte off the network */
+  long skip;            /* Bytes to throw away when a range was ignored */
+
+  /* Adaptive prebuffering, see adapt_prebuffer() */
+  int adaptive;
+  struct timeval last_arrival;
+  struct timeval last_adjust;
+  long window_bytes;    /* Arrived since the last adjustment */
+  double rate;          /* Bytes per second, smoothed */
+  double jitter;        /* Longest recent gap between arrivals, seconds */
+  double margin;
+  long underruns;       /* Buffer underruns as of the last adjustment */
 } http_private_t;
 
 
@@ -61,15 +104,159 @@ transport_t http_transport;  /* Forward declaration */
 
 /* -------------------------- curl callbacks ----------------------- */
 
+/* Called once the headers of the response we're keeping are in */
+static void headers_done (http_private_t *myarg)
+{
+  pthread_mutex_lock(&myarg->header_lock);
+
+  if (myarg->status == 206)
+    myarg->ranges = 1;  /* length came with Content-Range */
+  else {
+    /* A server that ignores the range sends the whole thing again */
+    if (myarg->range_start > 0)
+      myarg->skip = myarg->fetch_pos;
+    else
+      myarg->length = myarg->content_length;
+    if (myarg->status != 200)
+      myarg->ranges = 0;
+  }
+
+  myarg->headers_done = 1;
+  pthread_cond_broadcast(&myarg->header_cond);
+  pthread_mutex_unlock(&myarg->header_lock);
+}
+
+static void wait_for_headers (http_private_t *private)
+{
+  pthread_mutex_lock(&private->header_lock);
+  while (!private->headers_done)
+    pthread_cond_wait(&private->header_cond, &private->header_lock);
+  pthread_mutex_unlock(&private->header_lock);
+}
+
+static double seconds_since (struct timeval *then, struct timeval *now)
+{
+  return (now->tv_sec - then->tv_sec) + (now->tv_usec - then->tv_usec) / 1e6;
+}
+
+/* Measure the gap since the last data and the throughput, and retune the
+   prebuffer to suit.  Time spent blocked on a full buffer is not counted
+   as a gap, since last_arrival is taken after the data went in. */
+static void adapt_prebuffer (http_private_t *myarg, struct timeval *arrival,
+			     long bytes)
+{
+  buf_t *buf = myarg->buf;
+  buffer_stats_t stats;
+  struct timeval now;
+  double gap, elapsed;
+  long target;
+
+  gettimeofday(&now, NULL);
+
+  if (myarg->last_arrival.tv_sec == 0) {
+    myarg->last_adjust = now;
+    myarg->last_arrival = now;
+    return;
+  }
+
+  gap = seconds_since(&myarg->last_arrival, arrival);
+  if (gap > myarg->jitter)
+    myarg->jitter = gap;
+  myarg->window_bytes += bytes;
+  myarg->last_arrival = now;
+
+  elapsed = seconds_since(&myarg->last_adjust, &now);
+  if (elapsed < ADAPT_INTERVAL)
+    return;
+
+  if (myarg->rate == 0.0)
+    myarg->rate = myarg->window_bytes / elapsed;
+  else
+    myarg->rate = 0.8 * myarg->rate + 0.2 * myarg->window_bytes / elapsed;
+  myarg->window_bytes = 0;
+  myarg->last_adjust = now;
+
+  buffer_statistics(buf, &stats);
+  if (stats.underruns > myarg->underruns) {
+    myarg->margin *= 1.5;
+    if (myarg->margin > ADAPT_MARGIN_MAX)
+      myarg->margin = ADAPT_MARGIN_MAX;
+    myarg->underruns = stats.underruns;
+  } else if (myarg->margin > ADAPT_MARGIN)
+    myarg->margin *= 0.98;
+
+  target = (long) (myarg->rate * myarg->jitter * myarg->margin);
+  if (target < buf->size * ADAPT_MIN_FILL)
+    target = buf->size * ADAPT_MIN_FILL;
+  if (target > buf->size * ADAPT_MAX_FILL)
+    target = buf->size * ADAPT_MAX_FILL;
+
+  /* Not worth taking the lock for small changes */
+  if (labs(target - buf->prebuffer_size) > buf->size / 50)
+    buffer_set_prebuffer(buf, target);
+
+  myarg->jitter *= ADAPT_JITTER_DECAY;
+}
+
+size_t header_callback (char *ptr, size_t size, size_t nmemb, void *arg)
+{
+  http_private_t *myarg = arg;
+  size_t len = size * nmemb;
+  char line[256];
+  long first, last, total;
+
+  if (len >= sizeof(line))
+    return len;  /* Nothing we want is that long */
+  memcpy(line, ptr, len);
+  line[len] = '\0';
+
+  /* Each redirect starts a new set of headers */
+  if (!strncmp(line, "HTTP/", 5)) {
+    char *code = strchr(line, ' ');
+
+    myarg->status = code ? atoi(code + 1) : 0;
+    myarg->ranges = 0;
+    myarg->content_length = -1;
+  } else if (!strncasecmp(line, "Accept-Ranges:", 14)) {
+    myarg->ranges = strstr(line + 14, "bytes") != NULL;
+  } else if (!strncasecmp(line, "Content-Length:", 15)) {
+    myarg->content_length = atol(line + 15);
+  } else if (!strncasecmp(line, "Content-Range:", 14) &&
+	     sscanf(line + 14, " bytes %ld-%ld/%ld", &first, &last,
+		    &total) == 3) {
+    myarg->length = total;
+  }
+
+  return len;
+}
+
 size_t write_callback (void *ptr, size_t size, size_t nmemb, void *arg)
 {
   http_private_t *myarg = arg;
+  size_t len = size * nmemb, skip;
+  struct timeval arrival;
 
   if (myarg->cancel_flag || sig_request.cancel)
     return 0;
 
-  if (!buffer_submit_data(myarg->buf, ptr, size*nmemb))
+  if (myarg->adaptive)
+    gettimeofday(&arrival, NULL);
+
+  if (!myarg->headers_done)
+    headers_done(myarg);
+
+  /* Catch up to where we asked to start */
+  skip = myarg->skip < len ? myarg->skip : len;
+  myarg->skip -= skip;
+
+  if (len > skip &&
+      !buffer_submit_data(myarg->buf, (unsigned char *) ptr + skip,
+			  len - skip))
     return 0;
+  myarg->fetch_pos += len - skip;
+
+  if (myarg->adaptive)
+    adapt_prebuffer(myarg, &arrival, len - skip);
 
   if (myarg->cancel_flag || sig_request.cancel)
     return 0;
@@ -81,17 +268,6 @@ int progress_callback (void *arg, size_t dltotal, size_t dlnow,
 		       size_t ultotal, size_t ulnow)
 {
   http_private_t *myarg = arg;
-  print_statistics_arg_t *pstats_arg;
-  data_source_t *source = myarg->data_source;
-
-  if (myarg->cancel_flag || sig_request.cancel)
-    return -1;
-
-  pstats_arg = new_print_statistics_arg(stat_format,
-					source->transport->statistics(source),
-					NULL);
-
-  print_statistics_action(NULL, pstats_arg);
 
   if (myarg->cancel_flag || sig_request.cancel)
     return -1;
@@ -102,12 +278,29 @@ int progress_callback (void *arg, size_t dltotal, size_t dlnow,
 
 /* -------------------------- Private functions --------------------- */
 
+/* Ask for the rest of the resource from fetch_pos.  This is a plain
+   Range header rather than CURLOPT_RESUME_FROM, which has curl give up
+   on a server that answers with the whole thing instead. */
+void set_curl_range (http_private_t *private)
+{
+  char range[32];
+
+  if (private->fetch_pos > 0) {
+    snprintf(range, sizeof(range), "%ld-", private->fetch_pos);
+    curl_easy_setopt(private->curl_handle, CURLOPT_RANGE, range);
+  } else
+    curl_easy_setopt(private->curl_handle, CURLOPT_RANGE, NULL);
+}
+
 void set_curl_opts (http_private_t *private)
 {
   CURL *handle = private->curl_handle;
 
   curl_easy_setopt(handle, CURLOPT_FILE, private);
   curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_callback);
+  curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(handle, CURLOPT_HEADERDATA, private);
+  set_curl_range(private);
   curl_easy_setopt(handle, CURLOPT_URL, private->data_source->source_string);
   /*
   if (inputOpts.ProxyPort)
@@ -135,6 +328,7 @@ void *curl_thread_func (void *arg)
   http_private_t *myarg = (http_private_t *) arg;
   CURLcode ret;
   sigset_t set;
+  int reconnects = 0;
 
   /* Block signals to this thread */
   sigfillset (&set);
@@ -146,6 +340,27 @@ void *curl_thread_func (void *arg)
 
   ret = curl_easy_perform((CURL *) myarg->curl_handle);
 
+  /* Pick up a dropped connection from where it got to, if we can */
+  while (ret != CURLE_OK && reconnects < HTTP_MAX_RECONNECTS &&
+	 myarg->ranges && myarg->headers_done &&
+	 !myarg->cancel_flag && !sig_request.cancel &&
+	 (myarg->length < 0 || myarg->fetch_pos < myarg->length)) {
+
+    reconnects++;
+    status_error(_("Connection lost (%s), resuming at byte %ld.\n"),
+		 myarg->error, myarg->fetch_pos);
+    sleep(1);
+
+    myarg->headers_done = 0;
+    myarg->range_start = myarg->fetch_pos;
+    set_curl_range(myarg);
+    ret = curl_easy_perform((CURL *) myarg->curl_handle);
+  }
+
+  /* Don't leave a seek waiting on headers that won't come */
+  if (!myarg->headers_done)
+    headers_done(myarg);
+
   if (myarg->cancel_flag || sig_request.cancel) {
     buffer_abort_write(myarg->buf);
     ret = 0;  // "error" was on purpose
@@ -155,13 +370,49 @@ void *curl_thread_func (void *arg)
   if (ret != 0)
     status_error(myarg->error);
 
-  curl_easy_cleanup(myarg->curl_handle);
-  myarg->curl_handle = 0;
+  return (void *) ret;
+}
 
-  curl_slist_free_all(myarg->header_list);
-  myarg->header_list = NULL;
 
-  return (void *) ret;
+/* Start fetching from private->fetch_pos on a new handle and thread */
+int start_transfer (http_private_t *private)
+{
+  private->curl_handle = curl_easy_init();
+  if (private->curl_handle == NULL)
+    return 0;
+
+  private->cancel_flag = 0;
+  private->headers_done = 0;
+  private->range_start = private->fetch_pos;
+  private->skip = 0;
+
+  set_curl_opts(private);
+
+  if (pthread_create(&private->curl_thread, NULL, curl_thread_func,
+		     private) != 0) {
+    curl_easy_cleanup(private->curl_handle);
+    private->curl_handle = NULL;
+    return 0;
+  }
+  private->thread_running = 1;
+
+  return 1;
+}
+
+
+/* Safe to call whether or not a transfer was started */
+void stop_transfer (http_private_t *private)
+{
+  if (!private->thread_running)
+    return;
+
+  private->cancel_flag = 1;
+  buffer_abort_write(private->buf);
+  pthread_join(private->curl_thread, NULL);
+  private->thread_running = 0;
+
+  curl_easy_cleanup(private->curl_handle);
+  private->curl_handle = NULL;
 }
 
 
@@ -202,7 +453,9 @@ data_source_t* http_open (const char *source_string, ogg123_options_t *ogg123_op
       status_error(_("ERROR: Unable to create input buffer.\n"));
       exit(1);
     }
+    buffer_rebuffer_reads(private->buf, ogg123_opts->adaptive_prebuffer);
 
+    private->thread_running = 0;
     private->curl_handle = NULL;
     private->header_list = NULL;
     private->data_source = source;
@@ -210,6 +463,27 @@ data_source_t* http_open (const char *source_string, ogg123_options_t *ogg123_op
     private->stats.bytes_read = 0;
     private->stats.input_buffer_used = 0;
     private->cancel_flag = 0;
+    private->error[0] = '\0';
+
+    pthread_mutex_init(&private->header_lock, NULL);
+    pthread_cond_init(&private->header_cond, NULL);
+    private->headers_done = 0;
+    private->status = 0;
+    private->ranges = 0;
+    private->content_length = -1;
+    private->length = -1;
+    private->offset = 0;
+    private->range_start = 0;
+    private->fetch_pos = 0;
+    private->skip = 0;
+
+    private->adaptive = ogg123_opts->adaptive_prebuffer;
+    private->last_arrival.tv_sec = 0;
+    private->window_bytes = 0;
+    private->rate = 0.0;
+    private->jitter = 0.0;
+    private->margin = ADAPT_MARGIN;
+    private->underruns = 0;
 
   } else {
     fprintf(stderr, _("ERROR: Out of memory.\n"));
@@ -225,34 +499,22 @@ data_source_t* http_open (const char *source_string, ogg123_options_t *ogg123_op
   if (private->header_list == NULL)
     goto fail;
 
-  /* Open URL */
-  private->curl_handle = curl_easy_init();
-  if (private->curl_handle == NULL)
-    goto fail;
-
-  set_curl_opts(private);
-
-  /* Start thread */
-  if (pthread_create(&private->curl_thread, NULL, curl_thread_func, 
-		     private) != 0)
+  /* Open URL and start thread */
+  if (!start_transfer(private))
     goto fail;
 
 
-  stat_format[2].enabled = 0;  /* remaining playback time */
-  stat_format[3].enabled = 0;  /* total playback time  */
-  stat_format[6].enabled = 1;  /* Input buffer fill % */
-  stat_format[7].enabled = 1;  /* Input buffer state  */
-
   return source;
 
 
 fail:
-  if (private->curl_handle != NULL)
-    curl_easy_cleanup(private->curl_handle);
   if (private->header_list != NULL) {
     curl_slist_free_all(private->header_list);
     private->header_list = NULL;
   }
+  buffer_destroy(private->buf);
+  pthread_mutex_destroy(&private->header_lock);
+  pthread_cond_destroy(&private->header_cond);
   free(source->source_string);
   source->source_string = NULL;
   free(private);
@@ -291,39 +553,84 @@ int http_read (data_source_t *source, void *ptr, size_t size, size_t nmemb)
   bytes_read = buffer_get_data(private->buf, ptr, size * nmemb);
 
   private->stats.bytes_read += bytes_read;
+  private->offset += bytes_read;
 
   return bytes_read;
 }
 
 
+/* Only possible when the server takes byte ranges: the transfer under
+   way is dropped along with whatever is buffered, and a new one asks for
+   the rest of the resource from the new offset. */
 int http_seek (data_source_t *source, long offset, int whence)
 {
-  return -1;
+  http_private_t *private = source->private;
+  long target;
+
+  wait_for_headers(private);
+  if (!private->ranges)
+    return -1;
+
+  switch (whence) {
+  case SEEK_SET:
+    target = offset;
+    break;
+  case SEEK_CUR:
+    target = private->offset + offset;
+    break;
+  case SEEK_END:
+    if (private->length < 0)
+      return -1;
+    target = private->length + offset;
+    break;
+  default:
+    return -1;
+  }
+
+  if (target < 0)
+    return -1;
+  if (target == private->offset && private->thread_running)
+    return 0;
+
+  stop_transfer(private);
+  buffer_reset(private->buf);
+
+  private->offset = private->fetch_pos = target;
+
+  if (private->length >= 0 && target >= private->length) {
+    /* Nothing left to fetch, but the reader should still see the end */
+    private->cancel_flag = 0;
+    buffer_mark_eos(private->buf);
+    return 0;
+  }
+
+  if (!start_transfer(private)) {
+    status_error(_("ERROR: Unable to seek in %s.\n"), source->source_string);
+    buffer_mark_eos(private->buf);
+    return -1;
+  }
+
+  return 0;
 }
 
 
-data_source_stats_t *http_statistics (data_source_t *source)
+void http_statistics (data_source_t *source, data_source_stats_t *stats)
 {
   http_private_t *private = source->private;
-  data_source_stats_t *data_source_stats;
-  buffer_stats_t *buffer_stats;
-
-  data_source_stats = malloc_data_source_stats(&private->stats);
-  data_source_stats->input_buffer_used = 1;
-  data_source_stats->transfer_rate = 0;
 
-  buffer_stats = buffer_statistics(private->buf);
-  data_source_stats->input_buffer = *buffer_stats;
-  free(buffer_stats);
-  buffer_stats = NULL;
+  *stats = private->stats;
+  stats->input_buffer_used = 1;
+  stats->transfer_rate = 0;
 
-  return data_source_stats;
+  buffer_statistics(private->buf, &stats->input_buffer);
 }
 
 
 long http_tell (data_source_t *source)
 {
-  return 0;
+  http_private_t *private = source->private;
+
+  return private->offset;
 }
 
 
@@ -331,13 +638,16 @@ void http_close (data_source_t *source)
 {
   http_private_t *private = source->private;
 
-  private->cancel_flag = 1;
-  buffer_abort_write(private->buf);
-  pthread_join(private->curl_thread, NULL);
+  stop_transfer(private);
 
   buffer_destroy(private->buf);
   private->buf = NULL;
 
+  curl_slist_free_all(private->header_list);
+  private->header_list = NULL;
+  pthread_mutex_destroy(&private->header_lock);
+  pthread_cond_destroy(&private->header_cond);
+
   free(source->source_string);
   source->source_string = NULL;
   free(source->private);
@@ -47,6 +47,11 @@
 #include "playlist.h"
 #include "compat.h"
 #include "remote.h"
+#include "prefetch.h"
+#include "bench.h"
+#include "server.h"
+#include "crossfade.h"
+#include "pcmcache.h"
 
 #include "ogg123.h"
 #include "utf8.h"
@@ -56,9 +61,7 @@ extern int exit_status; /* from status.c */
 
 int play (const char *source_string);
 
-#define PRIMAGIC (2*2*2*2*3*3*3*5*7)
 /* take buffer out of the data segment, not the stack */
-#define AUDIO_CHUNK_SIZE ((16384 + PRIMAGIC - 1)/ PRIMAGIC * PRIMAGIC)
 static unsigned char convbuffer[AUDIO_CHUNK_SIZE];
 static int convsize = AUDIO_CHUNK_SIZE;
 
@@ -68,6 +71,14 @@ static buf_t *audio_buffer=NULL;
 
 static audio_play_arg_t audio_play_arg;
 
+/* Where the audio finally goes: the devices, or the --bench sink */
+static buffer_write_func_t play_callback = audio_play_callback;
+
+/* With --gapless the buffer thread keeps running from one file to the
+   next, and is only stopped at the end of the playlist or when a file is
+   skipped */
+static int buffer_running = 0;
+
 
 /* ------------------------- config file options -------------------------- */
 
@@ -75,6 +86,7 @@ static audio_play_arg_t audio_play_arg;
    for the options. */
 #define INIT(type, value) static type type##_##value = value
 INIT(int, 0);
+INIT(double, 0);
 
 file_option_t file_opts[] = {
   /* found, name, description, type, ptr, default */
@@ -84,6 +96,18 @@ file_option_t file_opts[] = {
    &options.shuffle,        &int_0},
   {0, "repeat",         N_("repeat playlist forever"),   opt_type_bool,
    &options.repeat,         &int_0}, 
+  {0, "gapless",        N_("play without gaps between files"), opt_type_bool,
+   &options.gapless,        &int_0},
+  {0, "crossfade",      N_("seconds to crossfade between files"), opt_type_double,
+   &options.crossfade,      &double_0},
+  {0, "prefetch",       N_("number of files to open ahead"), opt_type_int,
+   &options.prefetch,       &int_0},
+  {0, "adaptive_prebuffer", N_("adapt the input prebuffer to the network"),
+   opt_type_bool, &options.adaptive_prebuffer, &int_0},
+  {0, "seek_cache",     N_("directory to keep seek indexes in"),
+   opt_type_string, &options.seek_cache, NULL},
+  {0, "playlist_cache", N_("file to keep directory listings in"),
+   opt_type_string, &options.playlist_cache, NULL},
   {0, NULL,             NULL,                    0,               NULL,                NULL}
 };
 
@@ -158,14 +182,51 @@ void options_init (ogg123_options_t *opts)
   opts->prebuffer = 0.0f;
   opts->input_buffer_size = 64 * 1024;
   opts->input_prebuffer = 50.0f;
+  opts->adaptive_prebuffer = 0;
   opts->default_device = NULL;
 
   opts->status_freq = 10.0;
   opts->playlist = NULL;
   opts->remote = 0;
+  opts->remote_socket = NULL;
   opts->repeat = 0;
 
   opts->gain_mode = GAIN_AUTO;
+
+  opts->gapless = 0;
+  opts->crossfade = 0.0;
+  opts->crossfade_curve = CURVE_EQUAL_POWER;
+  opts->slow_device = SLOW_DEVICE_BLOCK;
+  opts->output_bits = 16;
+
+  opts->prefetch = 0;
+  opts->prefetch_memory = 8192 * 1024;
+
+  opts->pcm_cache = 0;
+  opts->pcm_cache_max = 0;
+
+  opts->seek_cache = NULL;
+  opts->playlist_cache = NULL;
+  opts->bench = 0;
+  opts->server = NULL;
+}
+
+/* Stop the buffer thread, first letting it play out what it has if
+   drain is set */
+void stop_audio_buffer (int drain)
+{
+  if (audio_buffer == NULL || !buffer_running)
+    return;
+
+  if (drain) {
+    crossfade_flush(audio_buffer);
+    buffer_mark_eos(audio_buffer);
+    buffer_wait_for_empty(audio_buffer);
+  } else
+    crossfade_discard(audio_buffer);
+
+  buffer_thread_kill(audio_buffer);
+  buffer_running = 0;
 }
 
 double strtotime(char *s)
@@ -205,7 +266,11 @@ void set_seek_opt(ogg123_options_t *ogg123_opts, char *buf) {
 
 int handle_seek_opt(ogg123_options_t *options, decoder_t *decoder, format_t *format) {
 
-  float pos=decoder->format->statistics(decoder)->current_time;
+  decoder_stats_t stats;
+  float pos;
+
+  decoder->format->statistics(decoder, &stats);
+  pos = stats.current_time;
 
   /* this functions handles a seek request. It prevents seeking out
      of band, i.e. before the beginning or after the end. Instead,
@@ -223,17 +288,16 @@ int handle_seek_opt(ogg123_options_t *options, decoder_t *decoder, format_t *for
       pos = 0;
     }
 
-    if (pos > decoder->format->statistics(decoder)->total_time) {
+    if (pos > stats.total_time) {
       /* seek to almost the end of the stream */
-      pos = decoder->format->statistics(decoder)->total_time - 0.01;
+      pos = stats.total_time - 0.01;
     }
 
     if (!format->seek(decoder, pos, DECODER_SEEK_START)) {
       status_error(_("Could not skip to %f in audio stream."), options->seekoff);
 #if 0
       /* Handle this fatally -- kill the audio thread */
-      if (audio_buffer != NULL)
-	buffer_thread_kill(audio_buffer);
+      stop_audio_buffer(0);
 #endif
     }
   }
@@ -243,131 +307,45 @@ int handle_seek_opt(ogg123_options_t *options, decoder_t *decoder, format_t *for
   return 1;
 }
 
-/* This function selects which statistics to display for our
-   particular configuration.  This does not have anything to do with
-   verbosity, but rather with which stats make sense to display. */
-void select_stats (stat_format_t *stats, ogg123_options_t *opts, 
-		   data_source_t *source, decoder_t *decoder, 
-		   buf_t *audio_buffer)
-{
-  data_source_stats_t *data_source_stats;
-
-  if (audio_buffer != NULL) {
-    /* Turn on output buffer stats */
-    stats[8].enabled = 1; /* Fill */
-    stats[9].enabled = 1; /* State */
-  } else {
-    stats[8].enabled = 0;
-    stats[9].enabled = 0;
-  }
-
-  data_source_stats = source->transport->statistics(source);
-  if (data_source_stats->input_buffer_used) {
-    /* Turn on input buffer stats */
-    stats[6].enabled = 1; /* Fill */
-    stats[7].enabled = 1; /* State */
-  } else {
-    stats[6].enabled = 0;
-    stats[7].enabled = 0;
-  }
-  free(data_source_stats);
-  data_source_stats = NULL;
-
-  /* Assume we need total time display, and let display_statistics()
-     determine at what point it should be turned off during playback */
-  stats[2].enabled = 1;  /* Remaining playback time */
-  stats[3].enabled = 1;  /* Total playback time */
-}
-
-
-/* Handles printing statistics depending upon whether or not we have 
-   buffering going on */
-void display_statistics (stat_format_t *stat_format,
-			 buf_t *audio_buffer, 
+/* Hands the statistics to the status thread, or the remote interface.
+   This is called from the decoding loop, so it neither prints nor
+   allocates anything. */
+void display_statistics (buf_t *audio_buffer,
 			 data_source_t *source,
 			 decoder_t *decoder)
 {
-  print_statistics_arg_t *pstats_arg;
-  buffer_stats_t *buffer_stats;
+  decoder_stats_t decoder_stats;
+  data_source_stats_t data_source_stats;
+  buffer_stats_t buffer_stats;
+  audio_format_t *fmt = &decoder->actual_fmt;
 
-  pstats_arg = new_print_statistics_arg(stat_format,
-					source->transport->statistics(source),
-					decoder->format->statistics(decoder));
+  decoder->format->statistics(decoder, &decoder_stats);
 
   if (options.remote) {
 
     /* Display statistics via the remote interface */
-    remote_time(pstats_arg->decoder_statistics->current_time,
-                pstats_arg->decoder_statistics->total_time);
-
-  } else {
-
-	/* Disable/Enable statistics as needed */
+    remote_time(decoder_stats.current_time, decoder_stats.total_time);
 
-	if (pstats_arg->decoder_statistics->total_time <
-    	pstats_arg->decoder_statistics->current_time) {
-      stat_format[2].enabled = 0;  /* Remaining playback time */
-      stat_format[3].enabled = 0;  /* Total playback time */
-	}
-
-	if (pstats_arg->data_source_statistics->input_buffer_used) {
-      stat_format[6].enabled = 1;  /* Input buffer fill % */
-      stat_format[7].enabled = 1;  /* Input buffer state  */
-	}
-
-	if (audio_buffer) {
-      /* Place a status update into the buffer */
-      buffer_append_action_at_end(audio_buffer,
-				  &print_statistics_action,
-				  pstats_arg);
-
-      /* And if we are not playing right now, do an immediate
-    	 update just the output buffer */
-      buffer_stats = buffer_statistics(audio_buffer);
-      if (buffer_stats->paused || buffer_stats->prebuffering) {
-    	pstats_arg = new_print_statistics_arg(stat_format,
-					      NULL,
-					      NULL);
-    	print_statistics_action(audio_buffer, pstats_arg);
-      }
-      free(buffer_stats);
-      buffer_stats = NULL;
+    if (audio_buffer != NULL) {
+      buffer_statistics(audio_buffer, &buffer_stats);
+      remote_buffer(buffer_stats.fill, buffer_stats.underruns);
+    }
 
-	} else
-      print_statistics_action(NULL, pstats_arg);
+  } else {
+    source->transport->statistics(source, &data_source_stats);
+    status_publish(&decoder_stats, &data_source_stats,
+		   audio_buffer != NULL ? buffer_written(audio_buffer) : -1,
+		   (long) fmt->rate * fmt->channels * fmt->word_size);
   }
 }
 
-
-void display_statistics_quick (stat_format_t *stat_format,
-			       buf_t *audio_buffer, 
-			       data_source_t *source,
-			       decoder_t *decoder)
-{
-  print_statistics_arg_t *pstats_arg;
-
-  pstats_arg = new_print_statistics_arg(stat_format,
-					source->transport->statistics(source),
-					decoder->format->statistics(decoder));
-
-  if (audio_buffer) {
-    print_statistics_action(audio_buffer, pstats_arg);
-  } else
-    print_statistics_action(NULL, pstats_arg);
-}
-
 double current_time (decoder_t *decoder)
 {
-  decoder_stats_t *stats;
-  double ret;
-
-  stats = decoder->format->statistics(decoder);
-  ret = stats->current_time;
+  decoder_stats_t stats;
 
-  free(stats);
-  stats = NULL;
+  decoder->format->statistics(decoder, &stats);
 
-  return ret;
+  return stats.current_time;
 }
 
 void print_audio_devices_info(audio_device_t *d)
@@ -395,8 +373,8 @@ void print_audio_devices_info(audio_device_t *d)
 int main(int argc, char **argv)
 {
   int optind;
-  char **playlist_array;
-  int items;
+  char **upcoming;
+  char *source;
   struct stat stat_buf;
   int i;
 
@@ -415,6 +393,8 @@ int main(int argc, char **argv)
 
   audio_play_arg.devices = options.devices;
   audio_play_arg.stat_format = stat_format;
+  if (options.bench)
+    play_callback = bench_play_callback;
 
   /* Add remaining arguments to playlist */
   for (i = optind; i < argc; i++) {
@@ -434,14 +414,12 @@ int main(int argc, char **argv)
   }
 
 
-  /* Do we have anything left to play? */
-  if (playlist_length(options.playlist) == 0) {
+  /* Do we have anything left to play?  Directories are still being read
+     in the background, but only the first entry is needed to start.  A
+     server gets its playlists from the session file. */
+  if (options.server == NULL && playlist_get(options.playlist, 0) == NULL) {
     cmdline_usage();
     exit(1);
-  } else {
-    playlist_array = playlist_to_array(options.playlist, &items);
-    playlist_destroy(options.playlist);
-    options.playlist = NULL;
   }
 
   /* Don't use status_message until after this point! */
@@ -450,21 +428,31 @@ int main(int argc, char **argv)
   print_audio_devices_info(options.devices);
 
 
-  /* Setup buffer */
-  if (options.buffer_size > 0) {
+  /* Setup buffer.  A server makes one for each session. */
+  if (options.buffer_size > 0 && options.server == NULL) {
     /* Keep sample size alignment for surround sound with up to 10 channels */
     options.buffer_size = (options.buffer_size + PRIMAGIC - 1) / PRIMAGIC * PRIMAGIC;
     audio_buffer = buffer_create(options.buffer_size,
 				 options.buffer_size * options.prebuffer / 100,
-				 audio_play_callback, &audio_play_arg,
+				 play_callback, &audio_play_arg,
 				 AUDIO_CHUNK_SIZE);
     if (audio_buffer == NULL) {
       status_error(_("Error: Could not create audio buffer.\n"));
       exit(1);
     }
+    if (options.bench)
+      buffer_time_actions(audio_buffer, 1);
   } else
     audio_buffer = NULL;
 
+  /* Give each device its own thread, so one slow device doesn't hold up
+     the rest */
+  if (options.devices != NULL && options.devices->next_device != NULL)
+    audio_devices_start_threads(options.devices,
+				options.buffer_size > 4 * AUDIO_CHUNK_SIZE ?
+				options.buffer_size : 4 * AUDIO_CHUNK_SIZE,
+				AUDIO_CHUNK_SIZE, options.slow_device);
+
 
   /* Setup signal handlers and callbacks */
 
@@ -477,36 +465,64 @@ int main(int argc, char **argv)
     /* run the mainloop for the remote interface */
     remote_mainloop();
 
+  } else if (options.server != NULL) {
+    if (server_run(&options) != 0)
+      exit_status = EXIT_FAILURE;
+
   } else {
     int at_least_one;
 
+    upcoming = calloc(options.prefetch + 1, sizeof(char *));
+    if (upcoming == NULL) {
+      status_error(_("ERROR: Out of memory.\n"));
+      exit(1);
+    }
+
+    prefetch_init(&options);
+    pcm_cache_init(options.pcm_cache, options.pcm_cache_max);
+    if (options.bench)
+      bench_start();
+    status_thread_start(stat_format, audio_buffer, options.status_freq);
+    crossfade_init(options.crossfade, options.crossfade_curve);
+
     do {
       at_least_one = 0;
 
       /* Shuffle playlist */
       if (options.shuffle) {
-        int i;
-
         srandom(time(NULL));
-
-        for (i = 0; i < items; i++) {
-          int j = i + random() % (items - i);
-          char *temp = playlist_array[i];
-          playlist_array[i] = playlist_array[j];
-          playlist_array[j] = temp;
-        }
+        playlist_shuffle(options.playlist);
       }
 
-      /* Play the files/streams */
+      /* Play the files/streams, with the next few being opened in the
+         background */
       i = 0;
-      while (i < items && !sig_request.exit) {
-        at_least_one |= (play(playlist_array[i]) != 0);
+      while ((source = playlist_get(options.playlist, i)) != NULL
+	     && !sig_request.exit) {
+        prefetch_schedule(upcoming,
+			  playlist_peek(options.playlist, i + 1, upcoming,
+					options.prefetch));
+        at_least_one |= (play(source) != 0);
         i++;
       }
     } while (at_least_one && options.repeat);
 
+    /* Let the end of the last file play out */
+    stop_audio_buffer(!sig_request.exit);
+    status_thread_stop();
+    crossfade_shutdown();
+    prefetch_shutdown();
+    pcm_cache_shutdown();
+    free(upcoming);
+
+    if (options.bench)
+      bench_report(audio_buffer);
+
   }
-  playlist_array_destroy(playlist_array, items);
+  audio_devices_stop_threads(options.devices, !sig_request.exit);
+
+  playlist_destroy(options.playlist);
+  options.playlist = NULL;
   status_deinit();
 
   if (audio_buffer != NULL) {
@@ -529,6 +545,8 @@ int play (const char *source_string)
 
   decoder_callbacks_t decoder_callbacks;
   void *decoder_callbacks_arg;
+  decoder_callbacks_t recording_callbacks;
+  pcm_recorder_t *recorder = NULL;
 
   /* Preserve between calls so we only open the audio device when we 
      have to */
@@ -539,9 +557,19 @@ int play (const char *source_string)
   /* Flags and counters galore */
   int eof = 0, eos = 0, ret = 1;
   int nthc = 0, ntimesc = 0;
+  int direct, crossfading, complete = 0;
+  unsigned char *block;
+  long blocksize;
   int next_status = 0;
   static int status_interval = 0;
 
+  /* A cancel also stops any streams being fetched in the background, and
+     the output threads */
+  if (sig_request.cancel) {
+    prefetch_drop_streams();
+    audio_devices_flush(options.devices);
+  }
+
   /* Reset all of the signal flags */
   sig_request.cancel   = 0;
   sig_request.skipfile = 0;
@@ -551,7 +579,7 @@ int play (const char *source_string)
   /* Set preferred audio format (used by decoder) */
   new_audio_fmt.big_endian = ao_is_big_endian();
   new_audio_fmt.signed_sample = 1;
-  new_audio_fmt.word_size = 2;
+  new_audio_fmt.word_size = options.output_bits / 8;
 
   /* Select appropriate callbacks */
   if (audio_buffer != NULL) {
@@ -564,46 +592,82 @@ int play (const char *source_string)
     decoder_callbacks_arg = NULL;
   }
 
-  /* Locate and use transport for this data source */  
-  if ( (transport = select_transport(source_string)) == NULL ) {
-    status_error(_("No module could be found to read from %s.\n"), source_string);
-    return 0;
-  }
-  
-  if ( (source = transport->open(source_string, &options)) == NULL ) {
-    status_error(_("Cannot open %s.\n"), source_string);
-    return 0;
-  }
+  /* Use the source if it was opened in the background, otherwise locate
+     and use transport for this data source */
+  if ( (source = prefetch_take(source_string)) != NULL )
+    transport = source->transport;
+  else {
+    if ( (transport = select_transport(source_string)) == NULL ) {
+      status_error(_("No module could be found to read from %s.\n"), source_string);
+      return 0;
+    }
 
-  /* Detect the file format and initialize a decoder */
-  if ( (format = select_format(source)) == NULL ) {
-    status_error(_("The file format of %s is not supported.\n"), source_string);
-    return 0;
+    if ( (source = transport->open(source_string, &options)) == NULL ) {
+      status_error(_("Cannot open %s.\n"), source_string);
+      return 0;
+    }
   }
 
-  if ( (decoder = format->init(source, &options, &new_audio_fmt, 
-			       &decoder_callbacks,
-			       decoder_callbacks_arg)) == NULL ) {
+  /* The status line shows its input from here on */
+  status_set_input(source);
 
-    /* We may have failed because of user command */
-    if (!sig_request.cancel)
-      status_error(_("Error opening %s using the %s module."
-		     "  The file may be corrupted.\n"), source_string,
-		   format->name);
-    return 0;
-  }
+  /* Play it from the audio cache if it has been decoded before */
+  if ( (decoder = pcm_cache_open(source, &options, &new_audio_fmt,
+				 &decoder_callbacks,
+				 decoder_callbacks_arg)) != NULL )
+    format = decoder->format;
+  else {
+
+    /* Detect the file format and initialize a decoder */
+    if ( (format = select_format(source)) == NULL ) {
+      status_error(_("The file format of %s is not supported.\n"), source_string);
+      status_set_input(NULL);
+      return 0;
+    }
 
-  /* Decide which statistics are valid */
-  select_stats(stat_format, &options, source, decoder, audio_buffer);
+    /* Keep the decoded audio, unless only part of the file is wanted */
+    if (options.seekoff == 0.0 && options.endpos <= 0.0 && !options.remote)
+      recorder = pcm_cache_record(source, &decoder_callbacks,
+				  decoder_callbacks_arg, &recording_callbacks);
 
-  /* Start the audio playback thread before we begin sending data */    
-  if (audio_buffer != NULL) {
+    if (recorder != NULL)
+      decoder = format->init(source, &options, &new_audio_fmt,
+			     &recording_callbacks, recorder);
+    else
+      decoder = format->init(source, &options, &new_audio_fmt,
+			     &decoder_callbacks, decoder_callbacks_arg);
+
+    if (decoder == NULL) {
+
+      /* We may have failed because of user command */
+      if (!sig_request.cancel)
+	status_error(_("Error opening %s using the %s module."
+		       "  The file may be corrupted.\n"), source_string,
+		     format->name);
+      if (recorder != NULL)
+	pcm_cache_finish(recorder, NULL, 0);
+      status_set_input(NULL);
+      return 0;
+    }
+  }
+
+  /* Start the audio playback thread before we begin sending data,
+     unless it's still playing the end of the last file */
+  if (audio_buffer != NULL && !buffer_running) {
 
     /* First reset mutexes and other synchronization variables */
     buffer_reset (audio_buffer);
     buffer_thread_start (audio_buffer);
+    buffer_running = 1;
   }
 
+  /* Mix the start of this file into the end of the last one.  Not with
+     the remote interface, which stops the buffer between files. */
+  crossfading = audio_buffer != NULL && options.crossfade > 0.0 &&
+    options.nth == 1 && options.ntimes == 1 && !options.remote;
+  if (crossfading)
+    crossfade_next_track(audio_buffer);
+
   /* Show which file we are playing */
   decoder_callbacks.printf_metadata(decoder_callbacks_arg, 1,
 				    _("Playing: %s"), source_string);
@@ -618,8 +682,8 @@ int play (const char *source_string)
      */
     if (!format->seek(decoder, options.seekoff, DECODER_SEEK_START)) {
       status_error(_("Could not skip %f seconds of audio."), options.seekoff);
-      if (audio_buffer != NULL)
-	buffer_thread_kill(audio_buffer);
+      stop_audio_buffer(0);
+      status_set_input(NULL);
       return 0;
     }
   }
@@ -664,18 +728,46 @@ int play (const char *source_string)
       }
 
 
-      /* Read another block of audio data */
-      ret = format->read(decoder, convbuffer, convsize, &eos, &new_audio_fmt);
+      /* Read another block of audio data.  When every block is played
+	 exactly once it is decoded straight into the buffer, as long as
+	 there's enough room before the buffer wraps around. */
+      direct = audio_buffer && options.nth == 1 && options.ntimes == 1 &&
+	!crossfading;
+      block = convbuffer;
+      blocksize = convsize;
+      if (direct) {
+	long len = PRIMAGIC;
+
+	if (!buffer_reserve(audio_buffer, &block, &len)) {
+	  status_error(_("ERROR: buffer write failed.\n"));
+	  eof = eos = 1;
+	  break;
+	}
+
+	/* Keep to a multiple of every possible frame size */
+	if (len >= PRIMAGIC)
+	  blocksize = (len < convsize ? len : convsize) / PRIMAGIC * PRIMAGIC;
+	else {
+	  block = convbuffer;
+	  direct = 0;
+	}
+      }
+
+      ret = format->read(decoder, block, blocksize, &eos, &new_audio_fmt);
 
       /* Bail if we need to */
       if (ret == 0) {
 	ret = eof = eos = 1;
+	complete = 1;
 	break;
       } else if (ret < 0) {
 	status_error(_("ERROR: Decoding failure.\n"));
 	break;
       }
 
+      if (recorder != NULL)
+	pcm_cache_add(recorder, block, ret, &new_audio_fmt);
+
       /* Check to see if the audio format has changed */
       if (!audio_format_equal(&new_audio_fmt, &old_audio_fmt)) {
 	old_audio_fmt = new_audio_fmt;
@@ -685,6 +777,9 @@ int play (const char *source_string)
 	  new_audio_fmt.rate / options.status_freq;
 	next_status = 0;
 
+	if (crossfading)
+	  crossfade_format_change(audio_buffer);
+
 	reopen_arg = new_audio_reopen_arg(options.devices, &new_audio_fmt);
 
 	if (audio_buffer)
@@ -697,7 +792,7 @@ int play (const char *source_string)
 
       /* Update statistics display if needed */
       if (next_status <= 0) {
-	display_statistics(stat_format, audio_buffer, source, decoder); 
+	display_statistics(audio_buffer, source, decoder);
 	next_status = status_interval;
       } else
 	next_status -= ret;
@@ -715,10 +810,18 @@ int play (const char *source_string)
 	if (nthc-- == 0) {
           int r;
 
-          if (audio_buffer)
+          if (options.bench)
+            bench_decoded(ret, &new_audio_fmt);
+
+          if (crossfading)
+            r = crossfade_write(audio_buffer, convbuffer, ret,
+                                &new_audio_fmt);
+          else if (direct)
+            r = buffer_commit(audio_buffer, ret);
+          else if (audio_buffer)
             r = buffer_submit_data(audio_buffer, convbuffer, ret);
           else
-            r = audio_play_callback(convbuffer, ret, eos, &audio_play_arg);
+            r = play_callback(convbuffer, ret, eos, &audio_play_arg);
 
           if (!r) {
               status_error(_("ERROR: buffer write failed.\n"));
@@ -741,19 +844,21 @@ int play (const char *source_string)
 
   /* Done playing this logical bitstream.  Clean up house. */
 
-  if (audio_buffer) {
-
-    if (!sig_request.exit && !sig_request.skipfile) {
-      buffer_mark_eos(audio_buffer);
-      buffer_wait_for_empty(audio_buffer);
-    }
-
-    buffer_thread_kill(audio_buffer);
-  }
-
-  /* Print final stats */
-  display_statistics_quick(stat_format, audio_buffer, source, decoder); 
-
+  if (sig_request.exit || sig_request.skipfile)
+    stop_audio_buffer(0);
+  else if ((!options.gapless && !crossfading) || options.remote)
+    stop_audio_buffer(1);
+  /* else the next file carries on into the same buffer */
+
+  /* Final stats */
+  if (!options.remote)
+    display_statistics(audio_buffer, source, decoder);
+  if (options.bench)
+    bench_file_done(source);
+  if (recorder != NULL)
+    pcm_cache_finish(recorder, decoder, complete);
+
+  status_set_input(NULL);
   format->cleanup(decoder);
   transport->close(source);
   status_reset_output_lock();  /* In case we were killed mid-output */
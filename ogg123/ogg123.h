@@ -22,6 +22,11 @@
 #include "audio.h"
 #include "playlist.h"
 
+/* A whole number of frames of up to 8 channels of up to 4 bytes each */
+#define PRIMAGIC (2*2*2*2*2*3*3*3*5*7)
+/* The most audio decoded, and sent to the devices, at once */
+#define AUDIO_CHUNK_SIZE ((16384 + PRIMAGIC - 1)/ PRIMAGIC * PRIMAGIC)
+
 typedef enum gain_mode_t {
   GAIN_AUTO,
   GAIN_ALBUM,
@@ -29,6 +34,11 @@ typedef enum gain_mode_t {
   GAIN_NONE,
 } gain_mode_t;
 
+typedef enum crossfade_curve_t {
+  CURVE_LINEAR,
+  CURVE_EQUAL_POWER,
+} crossfade_curve_t;
+
 typedef struct ogg123_options_t {
   int verbosity;              /* Verbose output if > 1, quiet if 0 */
 
@@ -45,18 +55,39 @@ typedef struct ogg123_options_t {
   float prebuffer;            /* Percent of buffer to fill before playing */
   long input_buffer_size;     /* Size of input audio buffer */
   float input_prebuffer;
+  int adaptive_prebuffer;     /* Tune input_prebuffer to the network */
 
   char *default_device;       /* Name of default driver to use */
 
   audio_device_t *devices;    /* Audio devices to use */
+  slow_device_t slow_device;  /* Policy for a device that falls behind */
+  int output_bits;            /* Sample width sent to the devices */
 
   double status_freq;         /* Number of status updates per second */
 
   int remote;                 /* Remotely controlled */
+  char *remote_socket;        /* Unix socket to take remote commands on */
 
   playlist_t *playlist;       /* List of files to play */
+  char *playlist_cache;       /* File to keep directory listings in */
 
   gain_mode_t gain_mode;      /* ReplayGain mode */
+
+  int gapless;                /* Keep the audio buffer playing between files */
+  double crossfade;           /* Seconds to overlap consecutive files by */
+  crossfade_curve_t crossfade_curve;
+
+  int prefetch;               /* Number of playlist entries to open ahead */
+  long prefetch_memory;       /* Bytes to read ahead, over all of them */
+
+  long pcm_cache;             /* Bytes of decoded audio to keep */
+  long pcm_cache_max;         /* Most to keep for any one file */
+
+  char *seek_cache;           /* Directory to keep seek indexes in */
+
+  int bench;                  /* Play into a null sink and time it */
+
+  char *server;               /* File listing the sessions to host */
 } ogg123_options_t;
 
 typedef struct signal_request_t {
@@ -32,9 +32,11 @@
 #include "utf8.h"
 #include "i18n.h"
 
-#ifdef HAVE_OV_READ_FILTER
 #include "vgfilter.h"
-#endif
+#include "seekindex.h"
+
+/* Samples to decode at a time on the way to a seek target */
+#define SEEK_DISCARD 4096
 
 typedef struct ovf_private_t {
   OggVorbis_File vf;
@@ -45,9 +47,17 @@ typedef struct ovf_private_t {
   int bos; /* At beginning of logical bitstream */
 
   decoder_stats_t stats;
-#ifdef HAVE_OV_READ_FILTER
   vgain_state vg;
-#endif
+
+  seek_index_t *index;
+
+  /* Audio from the start of a new link that came back along with the
+     end of the last one, kept until the new format is in effect */
+  float *held;
+  float **held_pcm;        /* Where each channel has got to in held */
+  long held_samples;       /* Samples per channel still to go */
+  long held_size;          /* Floats allocated */
+  int held_channels;
 } ovf_private_t;
 
 /* Forward declarations */
@@ -58,6 +68,7 @@ ov_callbacks vorbisfile_callbacks;
 void print_vorbis_stream_info (decoder_t *decoder);
 void print_vorbis_comments (vorbis_comment *vc, decoder_callbacks_t *cb, 
 			    void *callback_arg);
+static int seek_indexed (decoder_t *decoder, double offset);
 
 
 /* ----------------------------------------------------------- */
@@ -99,10 +110,16 @@ decoder_t* ovf_init (data_source_t *source, ogg123_options_t *ogg123_opts,
     private->stats.instant_bitrate = 0;
     private->stats.avg_bitrate = 0;
 
-#ifdef HAVE_OV_READ_FILTER
     private->vg.scale_factor = 1.0;
     private->vg.max_scale = 1.0;
-#endif
+
+    private->index = NULL;
+
+    private->held = NULL;
+    private->held_pcm = NULL;
+    private->held_samples = 0;
+    private->held_size = 0;
+    private->held_channels = 0;
   } else {
     fprintf(stderr, _("ERROR: Out of memory.\n"));
     exit(1);
@@ -120,82 +137,195 @@ decoder_t* ovf_init (data_source_t *source, ogg123_options_t *ogg123_opts,
     return NULL;
   }
 
+  if (ov_seekable(&private->vf))
+    private->index = seek_index_open(source->source_string,
+				     ov_serialnumber(&private->vf, 0),
+				     ogg123_opts);
+
   return decoder;
 }
 
 
-int ovf_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
-	      audio_format_t *audio_fmt)
+/* Read comments and audio info at the start of a logical bitstream */
+static void start_link (decoder_t *decoder)
 {
   ovf_private_t *priv = decoder->private;
   decoder_callbacks_t *cb = decoder->callbacks;
-  int bytes_read = 0;
-  int ret;
-  int old_section;
 
-  /* Read comments and audio info at the start of a logical bitstream */
-  if (priv->bos) {
-    priv->vc = ov_comment(&priv->vf, -1);
-    priv->vi = ov_info(&priv->vf, -1);
+  priv->vc = ov_comment(&priv->vf, -1);
+  priv->vi = ov_info(&priv->vf, -1);
+
+  decoder->actual_fmt.rate = priv->vi->rate;
+  decoder->actual_fmt.channels = priv->vi->channels;
+
+  switch(decoder->actual_fmt.channels){
+  case 1:
+    decoder->actual_fmt.matrix="M";
+    break;
+  case 2:
+    decoder->actual_fmt.matrix="L,R";
+    break;
+  case 3:
+    decoder->actual_fmt.matrix="L,C,R";
+    break;
+  case 4:
+    decoder->actual_fmt.matrix="L,R,BL,BR";
+    break;
+  case 5:
+    decoder->actual_fmt.matrix="L,C,R,BL,BR";
+    break;
+  case 6:
+    decoder->actual_fmt.matrix="L,C,R,BL,BR,LFE";
+    break;
+  case 7:
+    decoder->actual_fmt.matrix="L,C,R,SL,SR,BC,LFE";
+    break;
+  case 8:
+    decoder->actual_fmt.matrix="L,C,R,SL,SR,BL,BR,LFE";
+    break;
+  default:
+    decoder->actual_fmt.matrix=NULL;
+    break;
+  }
 
-    decoder->actual_fmt.rate = priv->vi->rate;
-    decoder->actual_fmt.channels = priv->vi->channels;
+  vg_init(&priv->vg, priv->vc, decoder->options->gain_mode);
 
-    switch(decoder->actual_fmt.channels){
-    case 1:
-      decoder->actual_fmt.matrix="M";
-      break;
-    case 2:
-      decoder->actual_fmt.matrix="L,R";
-      break;
-    case 3:
-      decoder->actual_fmt.matrix="L,C,R";
-      break;
-    case 4:
-      decoder->actual_fmt.matrix="L,R,BL,BR";
-      break;
-    case 5:
-      decoder->actual_fmt.matrix="L,C,R,BL,BR";
-      break;
-    case 6:
-      decoder->actual_fmt.matrix="L,C,R,BL,BR,LFE";
-      break;
-    case 7:
-      decoder->actual_fmt.matrix="L,C,R,SL,SR,BC,LFE";
-      break;
-    case 8:
-      decoder->actual_fmt.matrix="L,C,R,SL,SR,BL,BR,LFE";
-      break;
-    default:
-      decoder->actual_fmt.matrix=NULL;
-      break;
-    }
+  print_vorbis_stream_info(decoder);
+  print_vorbis_comments(priv->vc, cb, decoder->callback_arg);
+  priv->bos = 0;
+}
 
-#ifdef HAVE_OV_READ_FILTER
-    vg_init(&priv->vg, priv->vc, decoder->options->gain_mode);
-#endif
 
-    print_vorbis_stream_info(decoder);
-    print_vorbis_comments(priv->vc, cb, decoder->callback_arg);
-    priv->bos = 0;
+/* Make room to hold samples per channel */
+static float *hold_space (ovf_private_t *priv, int channels, long samples)
+{
+  float *held = priv->held;
+  float **held_pcm = priv->held_pcm;
+  int i;
+
+  if (channels * samples > priv->held_size) {
+    held = realloc(held, channels * samples * sizeof(float));
+    if (held == NULL) {
+      fprintf(stderr, _("ERROR: Out of memory.\n"));
+      exit(1);
+    }
+    priv->held = held;
+    priv->held_size = channels * samples;
+  }
+
+  if (channels > priv->held_channels) {
+    held_pcm = realloc(held_pcm, channels * sizeof(float *));
+    if (held_pcm == NULL) {
+      fprintf(stderr, _("ERROR: Out of memory.\n"));
+      exit(1);
+    }
+    priv->held_pcm = held_pcm;
+    priv->held_channels = channels;
   }
 
+  for (i = 0; i < channels; i++)
+    held_pcm[i] = held + i * samples;
+  priv->held_samples = samples;
+
+  return held;
+}
+
+static void hold_float (ovf_private_t *priv, float **pcm, int channels,
+			long samples)
+{
+  int i;
+
+  hold_space(priv, channels, samples);
+  for (i = 0; i < channels; i++)
+    memcpy(priv->held_pcm[i], pcm[i], samples * sizeof(float));
+}
+
+/* ov_read() has already packed it, in the channels of the new link, so
+   take it back to float to be filtered and packed again in its turn */
+static void hold_packed (ovf_private_t *priv, unsigned char *data,
+			 audio_format_t *fmt, int channels, long samples)
+{
+  float *held = hold_space(priv, channels, samples);
+  int hi = fmt->big_endian ? 0 : 1;
+  long i;
+  int j, v;
+
+  for (i = 0; i < samples; i++)
+    for (j = 0; j < channels; j++, data += 2) {
+      v = (data[hi] << 8) | data[1 - hi];
+      if (fmt->signed_sample)
+	v = v >= 32768 ? v - 65536 : v;
+      else
+	v -= 32768;
+      held[j * samples + i] = v / 32768.0f;
+    }
+}
+
+/* Filter and pack up to samples of what is held, returning how many */
+static long release_held (ovf_private_t *priv, unsigned char *out,
+			  audio_format_t *fmt, long samples)
+{
+  int i;
+
+  if (samples > priv->held_samples)
+    samples = priv->held_samples;
+
+  vg_filter(priv->held_pcm, fmt->channels, samples, &priv->vg);
+  pcm_pack_planar(out, fmt, priv->held_pcm, samples);
+
+  for (i = 0; i < fmt->channels; i++)
+    priv->held_pcm[i] += samples;
+  priv->held_samples -= samples;
+
+  return samples;
+}
+
+
+int ovf_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
+	      audio_format_t *audio_fmt)
+{
+  ovf_private_t *priv = decoder->private;
+  decoder_callbacks_t *cb = decoder->callbacks;
+  int bytes_read = 0;
+  int frame_size;
+  long ret;
+  int old_section;
+  int channels;
+  int plain16;
+  float **pcm;
+
+ again:
+  if (priv->bos)
+    start_link(decoder);
+
   *audio_fmt = decoder->actual_fmt;
+  frame_size = audio_fmt->word_size * audio_fmt->channels;
+
+  /* 16 bit output with no gain to apply is what libvorbis packs
+     itself, and faster than we can */
+  plain16 = audio_fmt->word_size == 2 &&
+    priv->vg.scale_factor == 1.0 && priv->vg.max_scale >= 1.0;
+
+  if (priv->held_samples > 0 && nbytes >= frame_size) {
+    ret = release_held(priv, ptr, audio_fmt, nbytes / frame_size);
+    bytes_read += ret * frame_size;
+    ptr = (void *)((unsigned char *)ptr + ret * frame_size);
+    nbytes -= ret * frame_size;
+  }
 
-  /* Attempt to read as much audio as is requested */
-  while (nbytes >= audio_fmt->word_size * audio_fmt->channels) {
+  /* Attempt to read as much audio as is requested.  Otherwise it comes
+     out as float and is packed here, so the gain is applied before the
+     one and only conversion to the output width. */
+  while (nbytes >= frame_size && priv->held_samples == 0) {
 
     old_section = priv->current_section;
-#ifdef HAVE_OV_READ_FILTER
-    ret = ov_read_filter(&priv->vf, ptr, nbytes, audio_fmt->big_endian,
-			 audio_fmt->word_size, audio_fmt->signed_sample,
-			 &priv->current_section,
-			 vg_filter, &priv->vg);
-#else
-    ret = ov_read(&priv->vf, ptr, nbytes, audio_fmt->big_endian,
-		  audio_fmt->word_size, audio_fmt->signed_sample,
-		  &priv->current_section);
-#endif
+    if (plain16)
+      ret = ov_read(&priv->vf, ptr, nbytes - nbytes % frame_size,
+		    audio_fmt->big_endian, 2, audio_fmt->signed_sample,
+		    &priv->current_section);
+    else
+      ret = ov_read_float(&priv->vf, &pcm, nbytes / frame_size,
+			  &priv->current_section);
 
     if (ret == 0) {
 
@@ -218,19 +348,38 @@ int ovf_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
       /* EOF */
       *eos = 1;
       break;
-    } else {
 
-      bytes_read += ret;
-      ptr = (void *)((unsigned char *)ptr + ret);
-      nbytes -= ret;
+    } else if (old_section != priv->current_section && old_section != -1) {
+
+      /* We entered a new logical bitstream, and what came back is the
+	 start of it, in its channels and wanting its gain */
+      channels = ov_info(&priv->vf, -1)->channels;
+      if (plain16)
+	hold_packed(priv, ptr, audio_fmt, channels, ret / (2 * channels));
+      else
+	hold_float(priv, pcm, channels, ret);
+
+      priv->bos = 1; /* Read new headers next time through */
 
-      /* did we enter a new logical bitstream? */
-      if (old_section != priv->current_section && old_section != -1) {
-	
-	*eos = 1;
-	priv->bos = 1; /* Read new headers next time through */
-	break;
+      /* Nothing of the old one to hand back, so go on with the new */
+      if (bytes_read == 0)
+	goto again;
+
+      *eos = 1;
+      break;
+
+    } else {
+
+      if (plain16)
+	ret /= frame_size;
+      else {
+	vg_filter(pcm, audio_fmt->channels, ret, &priv->vg);
+	pcm_pack_planar(ptr, audio_fmt, pcm, ret);
       }
+
+      bytes_read += ret * frame_size;
+      ptr = (void *)((unsigned char *)ptr + ret * frame_size);
+      nbytes -= ret * frame_size;
     }
 
   }
@@ -253,6 +402,12 @@ int ovf_seek (decoder_t *decoder, double offset, int whence)
       return 0;
   }
 
+  /* Whatever was held back is from before the seek */
+  priv->held_samples = 0;
+
+  if (seek_indexed(decoder, offset))
+    return 1;
+
   ret = ov_time_seek(&priv->vf, offset);
   if (ret == 0)
     return 1;
@@ -261,7 +416,37 @@ int ovf_seek (decoder_t *decoder, double offset, int whence)
 }
 
 
-decoder_stats_t *ovf_statistics (decoder_t *decoder)
+/* Start from the indexed page before the target, and decode forward to
+   it.  Returns 0 if the index can't help, to seek the usual way. */
+static int seek_indexed (decoder_t *decoder, double offset)
+{
+  ovf_private_t *priv = decoder->private;
+  ogg_int64_t target, cur;
+  long pos, ret;
+  float **pcm;
+  int section;
+
+  /* Only the first link is indexed */
+  if (priv->index == NULL || ov_streams(&priv->vf) != 1)
+    return 0;
+
+  target = offset * ov_info(&priv->vf, 0)->rate;
+  if (!seek_index_lookup(priv->index, target + priv->vf.pcmlengths[0], &pos)
+      || ov_raw_seek(&priv->vf, pos) != 0)
+    return 0;
+
+  while ((cur = ov_pcm_tell(&priv->vf)) < target) {
+    ret = ov_read_float(&priv->vf, &pcm, target - cur < SEEK_DISCARD ?
+			target - cur : SEEK_DISCARD, &section);
+    if (ret <= 0 && ret != OV_HOLE)
+      return 0;
+  }
+
+  return cur == target;
+}
+
+
+void ovf_statistics (decoder_t *decoder, decoder_stats_t *stats)
 {
   ovf_private_t *priv = decoder->private;
   long instant_bitrate;
@@ -284,7 +469,7 @@ decoder_stats_t *ovf_statistics (decoder_t *decoder)
   priv->stats.avg_bitrate = avg_bitrate > 0 ? avg_bitrate : 0;
 
 
-  return malloc_decoder_stats(&priv->stats);
+  *stats = priv->stats;
 }
 
 
@@ -292,7 +477,10 @@ void ovf_cleanup (decoder_t *decoder)
 {
   ovf_private_t *priv = decoder->private;
 
+  seek_index_close(priv->index);
   ov_clear(&priv->vf);
+  free(priv->held);
+  free(priv->held_pcm);
 
   free(decoder->private);
   decoder->private = NULL;
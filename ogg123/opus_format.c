@@ -31,6 +31,14 @@
 #include "utf8.h"
 #include "i18n.h"
 #include "ogg123.h"
+#include "seekindex.h"
+
+/* Samples to decode at a time on the way to a seek target */
+#define SEEK_DISCARD 4096
+
+/* Start decoding this far before a seek target, so the decoder has
+   settled by the time it gets there (80 ms, as opusfile does) */
+#define SEEK_PREROLL 3840
 
 typedef struct opf_private_t {
   OggOpusFile *of;
@@ -40,6 +48,11 @@ typedef struct opf_private_t {
 
   int bos; /* At beginning of logical bitstream */
 
+  float *pcm;   /* For output wider than 16 bits */
+  int pcm_size;
+
+  seek_index_t *index;
+
   decoder_stats_t stats;
 } opf_private_t;
 
@@ -51,6 +64,7 @@ OpusFileCallbacks opusfile_callbacks;
 void print_opus_stream_info (decoder_t *decoder);
 void print_opus_comments (const OpusTags *ot, decoder_callbacks_t *cb, 
 			    void *callback_arg);
+static int seek_indexed (decoder_t *decoder, ogg_int64_t target);
 
 
 /* ----------------------------------------------------------- */
@@ -95,6 +109,9 @@ decoder_t* opf_init (data_source_t *source, ogg123_options_t *ogg123_opts,
 
     private->bos = 1;
     private->current_section = -1;
+    private->pcm = NULL;
+    private->pcm_size = 0;
+    private->index = NULL;
 
     private->stats.total_time = 0.0;
     private->stats.current_time = 0.0;
@@ -117,6 +134,11 @@ decoder_t* opf_init (data_source_t *source, ogg123_options_t *ogg123_opts,
     return NULL;
   }
 
+  if (op_seekable(private->of))
+    private->index = seek_index_open(source->source_string,
+				     op_serialno(private->of, 0),
+				     ogg123_opts);
+
   return decoder;
 }
 
@@ -198,7 +220,25 @@ int opf_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
   while (nbytes >= audio_fmt->word_size * audio_fmt->channels) {
 
     old_section = priv->current_section;
-    ret = op_read(priv->of, ptr, nbytes/2, NULL);
+    if (audio_fmt->word_size == 2)
+      /* opusfile dithers this itself */
+      ret = op_read(priv->of, ptr, nbytes/2, NULL);
+    else {
+      int size = nbytes / audio_fmt->word_size;
+
+      if (size > priv->pcm_size) {
+	priv->pcm = realloc(priv->pcm, size * sizeof(float));
+	if (priv->pcm == NULL) {
+	  fprintf(stderr, _("ERROR: Out of memory.\n"));
+	  exit(1);
+	}
+	priv->pcm_size = size;
+      }
+
+      ret = op_read_float(priv->of, priv->pcm, size, NULL);
+      if (ret > 0)
+	pcm_pack_interleaved(ptr, audio_fmt, priv->pcm, ret, 1.0f);
+    }
 
     if (ret == 0) {
 
@@ -223,9 +263,11 @@ int opf_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
       break;
     } else {
 
-      bytes_read += ret*2*audio_fmt->channels;
-      ptr = (void *)((unsigned char *)ptr + ret*2*audio_fmt->channels);
-      nbytes -= ret*2*audio_fmt->channels;
+      int frame_size = audio_fmt->word_size * audio_fmt->channels;
+
+      bytes_read += ret*frame_size;
+      ptr = (void *)((unsigned char *)ptr + ret*frame_size);
+      nbytes -= ret*frame_size;
 
       /* did we enter a new logical bitstream? */
       if (old_section != priv->current_section && old_section != -1) {
@@ -246,8 +288,8 @@ int opf_seek (decoder_t *decoder, double offset, int whence)
 {
   opf_private_t *priv = decoder->private;
   int ret;
-  int cur;
-  int samples = offset * 48000;
+  ogg_int64_t cur;
+  ogg_int64_t samples = offset * 48000;
 
   if (whence == DECODER_SEEK_CUR) {
     cur = op_pcm_tell(priv->of);
@@ -257,6 +299,9 @@ int opf_seek (decoder_t *decoder, double offset, int whence)
       return 0;
   }
 
+  if (seek_indexed(decoder, samples))
+    return 1;
+
   ret = op_pcm_seek(priv->of, samples);
   if (ret == 0)
     return 1;
@@ -265,7 +310,47 @@ int opf_seek (decoder_t *decoder, double offset, int whence)
 }
 
 
-decoder_stats_t *opf_statistics (decoder_t *decoder)
+/* Start from the indexed page a little before the target, and decode
+   forward to it.  Returns 0 if the index can't help, to seek the usual
+   way. */
+static int seek_indexed (decoder_t *decoder, ogg_int64_t target)
+{
+  opf_private_t *priv = decoder->private;
+  int channels = op_channel_count(priv->of, 0);
+  ogg_int64_t granulepos, cur;
+  long pos;
+  int ret;
+
+  /* Only the first link is indexed */
+  if (priv->index == NULL || op_link_count(priv->of) != 1)
+    return 0;
+
+  granulepos = target + op_head(priv->of, 0)->pre_skip - SEEK_PREROLL;
+  if (!seek_index_lookup(priv->index, granulepos, &pos) ||
+      op_raw_seek(priv->of, pos) != 0)
+    return 0;
+
+  if (priv->pcm_size < SEEK_DISCARD * channels) {
+    priv->pcm = realloc(priv->pcm, SEEK_DISCARD * channels * sizeof(float));
+    if (priv->pcm == NULL) {
+      fprintf(stderr, _("ERROR: Out of memory.\n"));
+      exit(1);
+    }
+    priv->pcm_size = SEEK_DISCARD * channels;
+  }
+
+  while ((cur = op_pcm_tell(priv->of)) >= 0 && cur < target) {
+    ret = op_read_float(priv->of, priv->pcm, target - cur < SEEK_DISCARD ?
+			(target - cur) * channels : priv->pcm_size, NULL);
+    if (ret <= 0 && ret != OP_HOLE)
+      return 0;
+  }
+
+  return cur == target;
+}
+
+
+void opf_statistics (decoder_t *decoder, decoder_stats_t *stats)
 {
   opf_private_t *priv = decoder->private;
   long instant_bitrate;
@@ -288,7 +373,7 @@ decoder_stats_t *opf_statistics (decoder_t *decoder)
   priv->stats.avg_bitrate = avg_bitrate > 0 ? avg_bitrate : 0;
 
 
-  return malloc_decoder_stats(&priv->stats);
+  *stats = priv->stats;
 }
 
 
@@ -296,8 +381,10 @@ void opf_cleanup (decoder_t *decoder)
 {
   opf_private_t *priv = decoder->private;
 
+  seek_index_close(priv->index);
   op_free(priv->of);
   priv->of = NULL;
+  free(priv->pcm);
 
   free(decoder->private);
   decoder->private = NULL;
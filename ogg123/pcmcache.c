@@ -0,0 +1,550 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pcmcache.h"
+#include "status.h"
+#include "i18n.h"
+
+/* Room for the first few seconds of audio, before it has to grow */
+#define RECORD_START (256 * 1024)
+
+typedef struct cache_message_t {
+  ogg_int64_t position;     /* Bytes of audio decoded before it */
+  int verbosity;
+  char *text;
+} cache_message_t;
+
+typedef struct cache_entry_t {
+  char *name;
+
+  /* The file as it was when decoded */
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+
+  audio_format_t fmt;
+  unsigned char *data;
+  long length;
+  long allocated;
+
+  cache_message_t *messages;
+  int nmessages;
+
+  long avg_bitrate;
+  int users;                /* Decoders playing it */
+
+  struct cache_entry_t *prev;   /* Least recently played last */
+  struct cache_entry_t *next;
+} cache_entry_t;
+
+struct pcm_recorder_t {
+  cache_entry_t *entry;
+  int have_fmt;
+  int abandoned;            /* Too big, or the format changed */
+
+  decoder_callbacks_t callbacks;  /* The ones being passed through to */
+  void *callback_arg;
+};
+
+typedef struct cache_private_t {
+  cache_entry_t *entry;
+  long offset;
+  int next_message;
+} cache_private_t;
+
+static struct {
+  long budget;
+  long max_entry;
+  long used;
+  cache_entry_t *head;
+  cache_entry_t *tail;
+} cache = { 0, 0, 0, NULL, NULL };
+
+format_t pcm_cache_format;
+
+
+/* ------------------------------ entries -------------------------------- */
+
+static void free_entry (cache_entry_t *entry)
+{
+  int i;
+
+  for (i = 0; i < entry->nmessages; i++)
+    free(entry->messages[i].text);
+  free(entry->messages);
+  free(entry->data);
+  free(entry->name);
+  free(entry);
+}
+
+
+static void unlink_entry (cache_entry_t *entry)
+{
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    cache.head = entry->next;
+
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    cache.tail = entry->prev;
+
+  entry->prev = entry->next = NULL;
+}
+
+
+static void link_entry_first (cache_entry_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache.head;
+  if (cache.head != NULL)
+    cache.head->prev = entry;
+  else
+    cache.tail = entry;
+  cache.head = entry;
+}
+
+
+static void drop_entry (cache_entry_t *entry)
+{
+  unlink_entry(entry);
+  cache.used -= entry->length;
+  free_entry(entry);
+}
+
+
+/* Make room for nbytes more, dropping the least recently played files
+   that aren't being played right now */
+static void evict (long nbytes)
+{
+  cache_entry_t *entry, *prev;
+
+  for (entry = cache.tail; entry != NULL && cache.used + nbytes > cache.budget;
+       entry = prev) {
+    prev = entry->prev;
+    if (entry->users == 0) {
+      status_message(3, _("Dropping %s from the audio cache"), entry->name);
+      drop_entry(entry);
+    }
+  }
+}
+
+
+static int same_file (cache_entry_t *entry, struct stat *st)
+{
+  return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+    entry->size == st->st_size && entry->mtime == st->st_mtime;
+}
+
+
+static char *format_message (char *message, va_list ap)
+{
+  va_list again;
+  char *text;
+  int n;
+
+  va_copy(again, ap);
+  n = vsnprintf(NULL, 0, message, again);
+  va_end(again);
+
+  if (n < 0 || (text = malloc(n + 1)) == NULL) {
+    status_error(_("ERROR: Out of memory.\n"));
+    exit(1);
+  }
+  vsnprintf(text, n + 1, message, ap);
+
+  return text;
+}
+
+
+/* ----------------------------- recording ------------------------------- */
+
+static void record_metadata (void *arg, int verbosity, char *message, ...)
+{
+  pcm_recorder_t *rec = arg;
+  cache_entry_t *entry = rec->entry;
+  cache_message_t *messages;
+  va_list ap;
+  char *text;
+
+  va_start(ap, message);
+  text = format_message(message, ap);
+  va_end(ap);
+
+  rec->callbacks.printf_metadata(rec->callback_arg, verbosity, "%s", text);
+
+  messages = realloc(entry->messages,
+		     (entry->nmessages + 1) * sizeof(cache_message_t));
+  if (messages == NULL) {
+    status_error(_("ERROR: Out of memory.\n"));
+    exit(1);
+  }
+  entry->messages = messages;
+  messages[entry->nmessages].position = entry->length;
+  messages[entry->nmessages].verbosity = verbosity;
+  messages[entry->nmessages].text = text;
+  entry->nmessages++;
+}
+
+
+/* Errors are only passed on, since playing from the cache won't have
+   them */
+static void record_error (void *arg, int severity, char *message, ...)
+{
+  pcm_recorder_t *rec = arg;
+  va_list ap;
+  char *text;
+
+  va_start(ap, message);
+  text = format_message(message, ap);
+  va_end(ap);
+
+  rec->callbacks.printf_error(rec->callback_arg, severity, "%s", text);
+  free(text);
+}
+
+
+pcm_recorder_t *pcm_cache_record (data_source_t *source,
+				  decoder_callbacks_t *callbacks,
+				  void *callback_arg,
+				  decoder_callbacks_t *recording)
+{
+  pcm_recorder_t *rec;
+  struct stat st;
+
+  if (cache.budget <= 0)
+    return NULL;
+
+  /* Only local files can be checked for changes */
+  if (stat(source->source_string, &st) != 0 || !S_ISREG(st.st_mode))
+    return NULL;
+
+  if ( (rec = calloc(1, sizeof(pcm_recorder_t))) == NULL ||
+       (rec->entry = calloc(1, sizeof(cache_entry_t))) == NULL ||
+       (rec->entry->name = strdup(source->source_string)) == NULL ) {
+    status_error(_("ERROR: Out of memory.\n"));
+    exit(1);
+  }
+
+  rec->entry->dev = st.st_dev;
+  rec->entry->ino = st.st_ino;
+  rec->entry->size = st.st_size;
+  rec->entry->mtime = st.st_mtime;
+
+  rec->callbacks = *callbacks;
+  rec->callback_arg = callback_arg;
+  recording->printf_error = &record_error;
+  recording->printf_metadata = &record_metadata;
+
+  return rec;
+}
+
+
+void pcm_cache_add (pcm_recorder_t *rec, const void *data, long nbytes,
+		    audio_format_t *fmt)
+{
+  cache_entry_t *entry = rec->entry;
+  unsigned char *grown;
+  long size;
+
+  if (rec->abandoned)
+    return;
+
+  /* A chain of streams in different formats isn't worth the trouble */
+  if (!rec->have_fmt) {
+    entry->fmt = *fmt;
+    rec->have_fmt = 1;
+  } else if (!audio_format_equal(fmt, &entry->fmt)) {
+    rec->abandoned = 1;
+    return;
+  }
+
+  if (entry->length + nbytes > cache.max_entry) {
+    rec->abandoned = 1;
+    return;
+  }
+
+  if (entry->length + nbytes > entry->allocated) {
+    size = entry->allocated > 0 ? entry->allocated : RECORD_START;
+    while (size < entry->length + nbytes)
+      size *= 2;
+    if (size > cache.max_entry)
+      size = cache.max_entry;
+
+    if ( (grown = realloc(entry->data, size)) == NULL ) {
+      /* Not worth stopping playback over */
+      rec->abandoned = 1;
+      return;
+    }
+    entry->data = grown;
+    entry->allocated = size;
+  }
+
+  memcpy(entry->data + entry->length, data, nbytes);
+  entry->length += nbytes;
+}
+
+
+void pcm_cache_finish (pcm_recorder_t *rec, decoder_t *decoder,
+		       int complete)
+{
+  cache_entry_t *entry = rec->entry, *old;
+  decoder_stats_t stats;
+  struct stat st;
+  unsigned char *data;
+
+  /* Keep it only if the file didn't change while it was decoded */
+  if (!complete || rec->abandoned || !rec->have_fmt || entry->length == 0 ||
+      stat(entry->name, &st) != 0 || !same_file(entry, &st)) {
+    free_entry(entry);
+    free(rec);
+    return;
+  }
+
+  decoder->format->statistics(decoder, &stats);
+  entry->avg_bitrate = stats.avg_bitrate;
+
+  if ( (data = realloc(entry->data, entry->length)) != NULL )
+    entry->data = data;
+  entry->allocated = entry->length;
+
+  for (old = cache.head; old != NULL; old = old->next)
+    if (strcmp(old->name, entry->name) == 0 && old->users == 0) {
+      drop_entry(old);
+      break;
+    }
+
+  evict(entry->length);
+  if (cache.used + entry->length > cache.budget) {
+    free_entry(entry);
+    free(rec);
+    return;
+  }
+
+  link_entry_first(entry);
+  cache.used += entry->length;
+  status_message(3, _("Keeping %ld kB of decoded audio for %s"),
+		 entry->length / 1024, entry->name);
+
+  free(rec);
+}
+
+
+/* ------------------------------ playback ------------------------------- */
+
+static long bytes_per_second (audio_format_t *fmt)
+{
+  return (long) fmt->rate * fmt->channels * fmt->word_size;
+}
+
+
+decoder_t *pcm_cache_open (data_source_t *source, ogg123_options_t *opts,
+			   audio_format_t *audio_fmt,
+			   decoder_callbacks_t *callbacks, void *callback_arg)
+{
+  cache_entry_t *entry;
+  cache_private_t *private;
+  decoder_t *decoder;
+  struct stat st;
+
+  for (entry = cache.head; entry != NULL; entry = entry->next)
+    if (strcmp(entry->name, source->source_string) == 0)
+      break;
+
+  if (entry == NULL)
+    return NULL;
+
+  if (stat(entry->name, &st) != 0 || !same_file(entry, &st)) {
+    if (entry->users == 0)
+      drop_entry(entry);
+    return NULL;
+  }
+
+  /* Decoded for some other output width */
+  if (audio_fmt->word_size != entry->fmt.word_size)
+    return NULL;
+
+  if ( (decoder = calloc(1, sizeof(decoder_t))) == NULL ||
+       (private = calloc(1, sizeof(cache_private_t))) == NULL ) {
+    status_error(_("ERROR: Out of memory.\n"));
+    exit(1);
+  }
+
+  decoder->source = source;
+  decoder->options = opts;
+  decoder->request_fmt = *audio_fmt;
+  decoder->actual_fmt = entry->fmt;
+  decoder->format = &pcm_cache_format;
+  decoder->callbacks = callbacks;
+  decoder->callback_arg = callback_arg;
+  decoder->private = private;
+
+  private->entry = entry;
+  entry->users++;
+
+  unlink_entry(entry);
+  link_entry_first(entry);
+
+  /* What the decoder printed on opening the file */
+  while (private->next_message < entry->nmessages &&
+	 entry->messages[private->next_message].position == 0) {
+    cache_message_t *m = &entry->messages[private->next_message++];
+    callbacks->printf_metadata(callback_arg, m->verbosity, "%s", m->text);
+  }
+
+  return decoder;
+}
+
+
+static int cached_can_decode (data_source_t *source)
+{
+  return 0;  /* Only chosen by pcm_cache_open() */
+}
+
+
+static decoder_t *cached_init (data_source_t *source, ogg123_options_t *opts,
+			       audio_format_t *audio_fmt,
+			       decoder_callbacks_t *callbacks, void *callback_arg)
+{
+  return pcm_cache_open(source, opts, audio_fmt, callbacks, callback_arg);
+}
+
+
+static int cached_read (decoder_t *decoder, void *ptr, int nbytes,
+			int *eos, audio_format_t *audio_fmt)
+{
+  cache_private_t *private = decoder->private;
+  cache_entry_t *entry = private->entry;
+  cache_message_t *m;
+  long left = entry->length - private->offset;
+
+  /* Metadata comes out just before the audio it was decoded with */
+  while (private->next_message < entry->nmessages &&
+	 entry->messages[private->next_message].position <= private->offset) {
+    m = &entry->messages[private->next_message++];
+    decoder->callbacks->printf_metadata(decoder->callback_arg, m->verbosity,
+					"%s", m->text);
+  }
+  if (private->next_message < entry->nmessages)
+    left = entry->messages[private->next_message].position - private->offset;
+
+  *eos = 0;
+  *audio_fmt = entry->fmt;
+
+  if (left <= 0)
+    return 0;
+  if (nbytes > left)
+    nbytes = left;
+
+  memcpy(ptr, entry->data + private->offset, nbytes);
+  private->offset += nbytes;
+
+  return nbytes;
+}
+
+
+static int cached_seek (decoder_t *decoder, double offset, int whence)
+{
+  cache_private_t *private = decoder->private;
+  cache_entry_t *entry = private->entry;
+  long frame = entry->fmt.channels * entry->fmt.word_size;
+  double target;
+  long position;
+
+  target = offset * bytes_per_second(&entry->fmt);
+  if (whence == DECODER_SEEK_CUR)
+    target += private->offset;
+
+  if (target < 0.0)
+    target = 0.0;
+  if (target > entry->length)
+    target = entry->length;
+
+  position = (long) target / frame * frame;
+  private->offset = position;
+
+  /* Don't say again what has been said already */
+  private->next_message = 0;
+  while (private->next_message < entry->nmessages &&
+	 entry->messages[private->next_message].position <= position)
+    private->next_message++;
+
+  return 1;
+}
+
+
+static void cached_statistics (decoder_t *decoder, decoder_stats_t *stats)
+{
+  cache_private_t *private = decoder->private;
+  cache_entry_t *entry = private->entry;
+  double rate = bytes_per_second(&entry->fmt);
+
+  stats->total_time = entry->length / rate;
+  stats->current_time = private->offset / rate;
+  stats->instant_bitrate = entry->avg_bitrate;
+  stats->avg_bitrate = entry->avg_bitrate;
+}
+
+
+static void cached_cleanup (decoder_t *decoder)
+{
+  cache_private_t *private = decoder->private;
+
+  private->entry->users--;
+  free(private);
+  free(decoder);
+}
+
+
+format_t pcm_cache_format = {
+  "pcmcache",
+  &cached_can_decode,
+  &cached_init,
+  &cached_read,
+  &cached_seek,
+  &cached_statistics,
+  &cached_cleanup,
+};
+
+
+/* ------------------------------- setup --------------------------------- */
+
+void pcm_cache_init (long budget, long max_entry)
+{
+  cache.budget = budget;
+  cache.max_entry = max_entry > 0 && max_entry < budget ? max_entry : budget;
+}
+
+
+void pcm_cache_shutdown (void)
+{
+  while (cache.head != NULL)
+    drop_entry(cache.head);
+}
@@ -0,0 +1,66 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+/* A cache of decoded audio, for playlists that go round more than once.
+   The first time a local file is played all the way through, what the
+   decoder produced is kept in memory, along with the metadata it
+   printed.  The next time the file is played from there instead,
+   through a format of its own, without parsing or decoding it again.
+
+   Files are dropped least recently played first to stay within the
+   memory budget, and an entry is thrown away if the file's size,
+   modification time or inode have changed.  Only the main thread uses
+   the cache. */
+
+#ifndef __PCMCACHE_H__
+#define __PCMCACHE_H__
+
+#include "format.h"
+
+typedef struct pcm_recorder_t pcm_recorder_t;
+
+/* budget is the most decoded audio to keep, in bytes, and max_entry the
+   most for any one file */
+void pcm_cache_init (long budget, long max_entry);
+void pcm_cache_shutdown (void);
+
+/* A decoder playing the cached audio of source, or NULL if there isn't
+   any that is still good */
+decoder_t *pcm_cache_open (data_source_t *source, ogg123_options_t *opts,
+			   audio_format_t *audio_fmt,
+			   decoder_callbacks_t *callbacks, void *callback_arg);
+
+/* Start recording source as it is decoded, or return NULL if it can't
+   be cached.  The decoder should be given the recording callbacks, with
+   the recorder as their argument, so the metadata is kept as well as
+   passed on to callbacks. */
+pcm_recorder_t *pcm_cache_record (data_source_t *source,
+				  decoder_callbacks_t *callbacks,
+				  void *callback_arg,
+				  decoder_callbacks_t *recording);
+
+/* Keep a block of decoded audio */
+void pcm_cache_add (pcm_recorder_t *rec, const void *data, long nbytes,
+		    audio_format_t *fmt);
+
+/* The decoder is done, but not yet cleaned up.  If the whole file was
+   played, the recording goes in the cache, otherwise it is thrown away.
+   decoder may be NULL if complete is 0. */
+void pcm_cache_finish (pcm_recorder_t *rec, decoder_t *decoder,
+		       int complete);
+
+#endif /* __PCMCACHE_H__ */
@@ -23,7 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -31,210 +32,785 @@
 #include "playlist.h"
 #include "i18n.h"
 
-/* Work with *BSD differences */
-#if !defined(NAME_MAX) && defined(MAXNAMLEN) 
-#define NAME_MAX MAXNAMLEN
-#endif
+/* Most threads reading directories at once.  They spend nearly all of
+   their time waiting on the disk or the network, not the CPU. */
+#define SCAN_THREADS 8
+
+/* A directory changed less than this many seconds before it was read
+   isn't cached, since a second change within the same second wouldn't
+   show in its mtime */
+#define CACHE_SETTLE 2
+
+#define CACHE_MAGIC "ogg123 playlist cache 1\n"
+
+
+typedef struct scan_dir_t scan_dir_t;
+
+typedef struct scan_entry_t {
+  char *filename;       /* Full path.  Files move into the items from here,
+			   subdirectories share it with their scan_dir_t. */
+  scan_dir_t *dir;      /* The listing of a subdirectory, NULL for files */
+} scan_entry_t;
+
+struct scan_dir_t {
+  char *path;
+  dev_t dev;            /* To notice links that lead back up the tree */
+  ino_t ino;
+
+  int done;             /* The entries have been read */
+  scan_entry_t *entries;
+  int count;
+  int size;
+  int pos;              /* Next entry to move into the items */
+
+  scan_dir_t *parent;
+  scan_dir_t *next;     /* On the work stack */
+};
+
+/* A directory listing in the cache.  Each name is prefixed with 'd' for
+   a directory or 'f' for anything else. */
+typedef struct cache_dir_t {
+  char *path;
+  time_t mtime;
+  char **names;
+  int count;
+  struct cache_dir_t *next;
+} cache_dir_t;
+
+struct playlist_t {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;      /* signalled when a directory has been read
+			       or a scanning thread exits */
+
+  /* Entries that are known, in order */
+  char **items;
+  int length;
+  int size;
+
+  /* What has been appended, as a tree of directories which fills in as
+     they are read.  Files are moved from it into items in order, as far
+     as the first directory that hasn't been read yet. */
+  scan_dir_t root;
+  scan_dir_t *cursor;
+
+  scan_dir_t *work;         /* Directories waiting to be read */
+  int pending;              /* Directories waiting or being read */
+  int workers;
+  int cancel;
+
+  /* The directory cache has its own lock, so looking things up in it
+     doesn't hold up the player */
+  char *cache_filename;
+  pthread_mutex_t cache_mutex;
+  cache_dir_t **cache;
+  int cache_buckets;
+  int cache_count;
+  int cache_dirty;
+};
 
-playlist_element_t *playlist_element_create(char *filename)
+
+/* --------------------------- helper functions -------------------------- */
+
+static void *check_alloc (void *ptr)
 {
-  playlist_element_t *element = (playlist_element_t *) 
-                                   malloc(sizeof(playlist_t));
+  if (ptr == NULL) {
+    fprintf(stderr, _("ERROR: Out of memory in playlist.\n"));
+    exit(1);
+  }
+
+  return ptr;
+}
+
+
+static char *join_path (const char *dirname, const char *name)
+{
+  int dir_len = strlen(dirname);
+  char *path = check_alloc(malloc(dir_len + strlen(name) + 2));
+
+  strcpy(path, dirname);
+  if (dir_len == 0 || dirname[dir_len - 1] != '/')
+    path[dir_len++] = '/';
+  strcpy(path + dir_len, name);
+
+  return path;
+}
+
 
-  if (element == NULL) {
-      fprintf(stderr,
-	      _("ERROR: Out of memory in create_playlist_member().\n"));
-      exit(1);
+/* Read a line of any length, growing the buffer as needed.  Returns the
+   length of the line, or -1 at the end of the file. */
+static long read_line (FILE *fp, char **line, long *size)
+{
+  long length = 0;
+
+  if (*line == NULL) {
+    *size = 256;
+    *line = check_alloc(malloc(*size));
   }
 
-  if (filename == NULL)
-    element->filename = NULL;
-  else {
-    element->filename = strdup(filename);
+  while (fgets(*line + length, *size - length, fp) != NULL) {
+    length += strlen(*line + length);
+
+    if ((*line)[length - 1] == '\n')
+      break;
 
-    if (element->filename == NULL) {
-	fprintf(stderr,
-		_("ERROR: Out of memory in create_playlist_member().\n"));
-	exit(1);
+    if (length == *size - 1) {
+      *size *= 2;
+      *line = check_alloc(realloc(*line, *size));
     }
   }
 
-  element->next = NULL;
-
-  return element;
+  return length > 0 ? length : -1;
 }
 
 
-/* Only destroys the current node.  Does not affect linked nodes. */
-void playlist_element_destroy(playlist_element_t *element)
+/* Crop off trailing newlines if present. Handle DOS (\r\n), Unix (\n)
+ * and MacOS<9 (\r) line endings. */
+static void chomp (char *line, long length)
 {
-  free(element->filename);
-  element->filename = NULL;
-  free(element);
-  element = NULL;
+  if (length >= 2 && line[length - 2] == '\r' && line[length - 1] == '\n')
+    line[length - 2] = '\0';
+  else if (length >= 1 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+    line[length - 1] = '\0';
 }
 
 
+/* --------------------------- directory tree ---------------------------- */
 
-playlist_t *playlist_create()
+static scan_dir_t *new_dir (char *path, scan_dir_t *parent)
 {
-  playlist_t *list = (playlist_t *) malloc(sizeof(playlist_t));
+  scan_dir_t *dir = check_alloc(calloc(1, sizeof(scan_dir_t)));
 
-  if (list != NULL) {
-    list->head = playlist_element_create(NULL);
-    list->last = list->head;
-  }
+  dir->path = path;
+  dir->parent = parent;
 
-  return list;
+  return dir;
 }
 
 
-void playlist_destroy(playlist_t *list) {
-  playlist_element_t *next_element;
+static void add_entry (scan_dir_t *dir, char *filename, scan_dir_t *sub)
+{
+  if (dir->count == dir->size) {
+    dir->size = dir->size ? dir->size * 2 : 16;
+    dir->entries = check_alloc(realloc(dir->entries,
+				       dir->size * sizeof(scan_entry_t)));
+  }
 
-  while (list->head != NULL) {
-    next_element = list->head->next;
+  dir->entries[dir->count].filename = filename;
+  dir->entries[dir->count].dir = sub;
+  dir->count++;
+}
 
-    playlist_element_destroy(list->head);
 
-    list->head = next_element;
+static void free_dir (scan_dir_t *dir);
+
+/* Free the entries that haven't been moved into the items yet */
+static void free_listing (scan_dir_t *dir)
+{
+  int i;
+
+  for (i = dir->pos; i < dir->count; i++) {
+    if (dir->entries[i].dir != NULL)
+      free_dir(dir->entries[i].dir);
+    else
+      free(dir->entries[i].filename);
   }
 
-  free(list);
-  list = NULL;
+  free(dir->entries);
+  dir->entries = NULL;
+  dir->count = dir->size = dir->pos = 0;
 }
 
 
-/* All of the playlist_append_* functions return 
-   1 if append was successful
-   0 if failure (either directory could not be accessed or playlist on disk
-   could not be opened)
-*/
+static void free_dir (scan_dir_t *dir)
+{
+  free_listing(dir);
+  free(dir->path);
+  free(dir);
+}
 
 
-/* Add this filename to the playlist.  Filename will be strdup()'ed.  Note
-   that this function will never fail. */
-int playlist_append_file(playlist_t *list, char *filename)
+static int entry_compare (const void *a, const void *b)
 {
-  list->last->next = playlist_element_create(filename);
-  list->last = list->last->next;
+  const char *name_a = strrchr(((const scan_entry_t *) a)->filename, '/');
+  const char *name_b = strrchr(((const scan_entry_t *) b)->filename, '/');
 
-  return 1; /* No way to fail */
+  return strcoll(name_a + 1, name_b + 1);
 }
 
-/* Recursively adds files from the directory and subdirectories */
-#if defined(HAVE_ALPHASORT) && defined(HAVE_SCANDIR)
-int playlist_append_directory(playlist_t *list, char *dirname)
+
+/* 1 for a directory, 0 for anything else, or -1 if it has gone away or
+   is a dangling link.  Only links and filesystems that don't fill in
+   d_type need a stat() to tell. */
+static int entry_is_dir (const char *filename, const struct dirent *entry)
 {
-  int dir_len = strlen(dirname);
-  int num_entries = 0, i = 0;
-  struct dirent **entries;
   struct stat stat_buf;
-  char nextfile[NAME_MAX + 1];
 
-  num_entries = scandir(dirname, &entries, 0, alphasort);
-
-  if (num_entries < 0) {
+#ifdef DT_DIR
+  if (entry->d_type == DT_DIR)
+    return 1;
+  if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK)
     return 0;
+#endif
+
+  if (stat(filename, &stat_buf) != 0)
+    return -1;
+
+  return S_ISDIR(stat_buf.st_mode);
+}
+
+
+/* ------------------------------- cache --------------------------------- */
+
+static unsigned long hash_path (const char *path)
+{
+  unsigned long hash = 2166136261UL;
+
+  while (*path)
+    hash = ((hash ^ (unsigned char) *path++) * 16777619UL) & 0xffffffffUL;
+
+  return hash;
+}
+
+
+static cache_dir_t **cache_find (playlist_t *list, const char *path)
+{
+  cache_dir_t **rec;
+
+  rec = &list->cache[hash_path(path) & (list->cache_buckets - 1)];
+  while (*rec != NULL && strcmp((*rec)->path, path) != 0)
+    rec = &(*rec)->next;
+
+  return rec;
+}
+
+
+static void cache_free_record (cache_dir_t *rec)
+{
+  int i;
+
+  for (i = 0; i < rec->count; i++)
+    free(rec->names[i]);
+  free(rec->names);
+  free(rec->path);
+  free(rec);
+}
+
+
+/* Add rec to the cache, in place of any record for the same directory */
+static void cache_insert (playlist_t *list, cache_dir_t *rec)
+{
+  cache_dir_t **slot, *old, *next;
+  int i;
+
+  if (list->cache_count >= list->cache_buckets) {
+    cache_dir_t **table = list->cache;
+    int buckets = list->cache_buckets;
+
+    list->cache_buckets *= 2;
+    list->cache = check_alloc(calloc(list->cache_buckets,
+				     sizeof(cache_dir_t *)));
+    for (i = 0; i < buckets; i++)
+      for (old = table[i]; old != NULL; old = next) {
+	next = old->next;
+	slot = &list->cache[hash_path(old->path) & (list->cache_buckets - 1)];
+	old->next = *slot;
+	*slot = old;
+      }
+    free(table);
+  }
+
+  slot = cache_find(list, rec->path);
+  if (*slot != NULL) {
+    old = *slot;
+    rec->next = old->next;
+    cache_free_record(old);
+    list->cache_count--;
+  } else
+    rec->next = NULL;
+  *slot = rec;
+  list->cache_count++;
+}
+
+
+static void cache_load (playlist_t *list)
+{
+  FILE *fp;
+  char *line = NULL;
+  long size, length;
+  cache_dir_t *rec = NULL;
+  char *path;
+
+  fp = fopen(list->cache_filename, "r");
+  if (fp == NULL)
+    return;
+
+  length = read_line(fp, &line, &size);
+  if (length < 0 || strcmp(line, CACHE_MAGIC) != 0) {
+    fclose(fp);
+    free(line);
+    return;
   }
 
-  for (i=0; i<num_entries; i++) {
-    int sub_len = strlen(entries[i]->d_name);
-
-    /* Make sure full pathname is within limits and we don't parse the
-       relative directory entries. */
-    if (dir_len + sub_len + 1 < NAME_MAX 
-        && strcmp(entries[i]->d_name, ".") != 0  
-        && strcmp(entries[i]->d_name, "..") != 0  ) {
-
-      /* Build the new full pathname */
-      strcpy(nextfile, dirname);
-      strcat(nextfile, "/");
-      strcat(nextfile, entries[i]->d_name);
-
-      if (stat(nextfile, &stat_buf) == 0) {
-        
-        /* Decide what type of entry this is */
-        if (S_ISDIR(stat_buf.st_mode)) {
-          
-        /* Recursively follow directories */
-          if ( playlist_append_directory(list, nextfile) == 0 ) {
-            fprintf(stderr,
-                  _("Warning: Could not read directory %s.\n"), 
-                    nextfile);
-          }
-        } else {
-        /* Assume everything else is a file of some sort */
-          playlist_append_file(list, nextfile);
-        }
+  while ( (length = read_line(fp, &line, &size)) >= 0 ) {
+    chomp(line, length);
+
+    if (line[0] == 'D' && line[1] == ' ') {
+      rec = check_alloc(calloc(1, sizeof(cache_dir_t)));
+      rec->mtime = (time_t) strtol(line + 2, &path, 10);
+      if (*path++ != ' ') {
+	free(rec);
+	rec = NULL;
+	continue;
       }
+      rec->path = check_alloc(strdup(path));
+      cache_insert(list, rec);
+
+    } else if ((line[0] == 'd' || line[0] == 'f') && line[1] == ' '
+	       && rec != NULL) {
+      if ((rec->count & (rec->count - 1)) == 0)
+	rec->names = check_alloc(realloc(rec->names, (rec->count ? 2 * rec->count : 1)
+					 * sizeof(char *)));
+      line[1] = line[0];
+      rec->names[rec->count++] = check_alloc(strdup(line + 1));
+    }
+  }
+
+  fclose(fp);
+  free(line);
+}
+
+
+/* Written to a new file that then replaces the old one, so a reader
+   never sees half of it */
+static void cache_save (playlist_t *list)
+{
+  FILE *fp;
+  char *tmpname;
+  cache_dir_t *rec;
+  int i, j, ok;
+
+  pthread_mutex_lock(&list->cache_mutex);
+
+  if (!list->cache_dirty) {
+    pthread_mutex_unlock(&list->cache_mutex);
+    return;
+  }
+
+  tmpname = check_alloc(malloc(strlen(list->cache_filename) + 5));
+  sprintf(tmpname, "%s.tmp", list->cache_filename);
+
+  fp = fopen(tmpname, "w");
+  if (fp == NULL) {
+    fprintf(stderr, _("Warning: Could not write playlist cache %s.\n"),
+	    tmpname);
+    free(tmpname);
+    list->cache_dirty = 0;
+    pthread_mutex_unlock(&list->cache_mutex);
+    return;
+  }
+
+  fputs(CACHE_MAGIC, fp);
+  for (i = 0; i < list->cache_buckets; i++)
+    for (rec = list->cache[i]; rec != NULL; rec = rec->next) {
+      fprintf(fp, "D %ld %s\n", (long) rec->mtime, rec->path);
+      for (j = 0; j < rec->count; j++)
+	fprintf(fp, "%c %s\n", rec->names[j][0], rec->names[j] + 1);
     }
 
-    free(entries[i]);
-    entries[i] = NULL;
+  ok = !ferror(fp);
+  if (fclose(fp) != 0)
+    ok = 0;
+
+  if (!ok || rename(tmpname, list->cache_filename) != 0) {
+    fprintf(stderr, _("Warning: Could not write playlist cache %s.\n"),
+	    list->cache_filename);
+    unlink(tmpname);
+  }
+
+  free(tmpname);
+  list->cache_dirty = 0;
+  pthread_mutex_unlock(&list->cache_mutex);
+}
+
+
+/* Fill in dir from the cache if its listing there is still current */
+static int cache_lookup (playlist_t *list, scan_dir_t *dir, time_t mtime)
+{
+  cache_dir_t *rec;
+  char *filename;
+  int i;
+
+  pthread_mutex_lock(&list->cache_mutex);
+
+  rec = *cache_find(list, dir->path);
+  if (rec == NULL || rec->mtime != mtime) {
+    pthread_mutex_unlock(&list->cache_mutex);
+    return 0;
+  }
+
+  for (i = 0; i < rec->count; i++) {
+    filename = join_path(dir->path, rec->names[i] + 1);
+    add_entry(dir, filename,
+	      rec->names[i][0] == 'd' ? new_dir(filename, dir) : NULL);
   }
 
-  free(entries);
-  entries = NULL;
+  pthread_mutex_unlock(&list->cache_mutex);
 
   return 1;
 }
-#else
-int playlist_append_directory(playlist_t *list, char *dirname)
+
+
+static void cache_store (playlist_t *list, scan_dir_t *dir, time_t mtime)
 {
-  DIR *dir;
-  int dir_len = strlen(dirname);
+  cache_dir_t *rec;
+  const char *name;
+  int i;
+
+  /* The file is line based, so names with newlines can't go in it */
+  if (strchr(dir->path, '\n') != NULL)
+    return;
+  for (i = 0; i < dir->count; i++)
+    if (strchr(dir->entries[i].filename, '\n') != NULL)
+      return;
+
+  rec = check_alloc(calloc(1, sizeof(cache_dir_t)));
+  rec->path = check_alloc(strdup(dir->path));
+  rec->mtime = mtime;
+  rec->count = dir->count;
+  rec->names = check_alloc(malloc((dir->count + 1) * sizeof(char *)));
+
+  for (i = 0; i < dir->count; i++) {
+    name = strrchr(dir->entries[i].filename, '/') + 1;
+    rec->names[i] = check_alloc(malloc(strlen(name) + 2));
+    rec->names[i][0] = dir->entries[i].dir != NULL ? 'd' : 'f';
+    strcpy(rec->names[i] + 1, name);
+  }
+
+  pthread_mutex_lock(&list->cache_mutex);
+  cache_insert(list, rec);
+  list->cache_dirty = 1;
+  pthread_mutex_unlock(&list->cache_mutex);
+}
+
+
+/* ------------------------------ scanning ------------------------------- */
+
+/* Fill in the entries of dir.  Called without the mutex held, since dir
+   isn't visible to anyone else until it is marked done. */
+static int read_directory (playlist_t *list, scan_dir_t *dir)
+{
+  DIR *handle;
   struct dirent *entry;
   struct stat stat_buf;
-  char nextfile[NAME_MAX + 1];
+  scan_dir_t *up;
+  char *filename;
+  int is_dir;
+
+  if (stat(dir->path, &stat_buf) != 0 || !S_ISDIR(stat_buf.st_mode))
+    return 0;
+
+  dir->dev = stat_buf.st_dev;
+  dir->ino = stat_buf.st_ino;
+
+  /* A link back up the tree would go round forever */
+  for (up = dir->parent; up != NULL; up = up->parent)
+    if (up->dev == dir->dev && up->ino == dir->ino)
+      return 1;
 
-  dir = opendir(dirname);
+  if (list->cache_filename != NULL
+      && cache_lookup(list, dir, stat_buf.st_mtime))
+    return 1;
 
-  if (dir == NULL) {
+  handle = opendir(dir->path);
+  if (handle == NULL)
     return 0;
+
+  while ( (entry = readdir(handle)) != NULL ) {
+
+    /* Don't parse the relative directory entries */
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    filename = join_path(dir->path, entry->d_name);
+    is_dir = entry_is_dir(filename, entry);
+
+    if (is_dir < 0)
+      free(filename);
+    else
+      add_entry(dir, filename, is_dir ? new_dir(filename, dir) : NULL);
   }
 
-  entry = readdir(dir);
-  while (entry != NULL) {
-    int sub_len = strlen(entry->d_name);
-
-    /* Make sure full pathname is within limits and we don't parse the
-       relative directory entries. */
-    if (dir_len + sub_len + 1 < NAME_MAX 
-	&& strcmp(entry->d_name, ".") != 0  
-	&& strcmp(entry->d_name, "..") != 0  ) {
-
-      /* Build the new full pathname */
-      strcpy(nextfile, dirname);
-      strcat(nextfile, "/");
-      strcat(nextfile, entry->d_name);
-
-      if (stat(nextfile, &stat_buf) == 0) {
-	
-	/* Decide what type of entry this is */
-	if (S_ISDIR(stat_buf.st_mode)) {
-	  
-	/* Recursively follow directories */
-	  if ( playlist_append_directory(list, nextfile) == 0 ) {
-	    fprintf(stderr,
-		  _("Warning: Could not read directory %s.\n"), 
-		    nextfile);
-	  }
-	} else {
-	/* Assume everything else is a file of some sort */
-	  playlist_append_file(list, nextfile);
-	}
-      }
+  closedir(handle);
+
+  if (dir->count > 1)
+    qsort(dir->entries, dir->count, sizeof(scan_entry_t), entry_compare);
+
+  if (list->cache_filename != NULL
+      && stat_buf.st_mtime < time(NULL) - CACHE_SETTLE)
+    cache_store(list, dir, stat_buf.st_mtime);
+
+  return 1;
+}
+
+
+static void *scan_thread (void *arg);
+
+/* dir has been read: queue its subdirectories, with the first one on
+   top so they are read roughly in playing order.  Called with the
+   mutex held. */
+static void finish_directory (playlist_t *list, scan_dir_t *dir)
+{
+  pthread_t thread;
+  int i;
+
+  for (i = dir->count - 1; i >= 0; i--)
+    if (dir->entries[i].dir != NULL) {
+      dir->entries[i].dir->next = list->work;
+      list->work = dir->entries[i].dir;
+      list->pending++;
+    }
+
+  dir->done = 1;
+  list->pending--;
+
+  while (list->workers < SCAN_THREADS && list->workers < list->pending
+	 && !list->cancel) {
+    if (pthread_create(&thread, NULL, scan_thread, list) != 0)
+      break;
+    pthread_detach(thread);
+    list->workers++;
+  }
+
+  pthread_cond_broadcast(&list->cond);
+}
+
+
+/* Read the directory on top of the work stack.  Called, and returns,
+   with the mutex held. */
+static void scan_one (playlist_t *list)
+{
+  scan_dir_t *dir = list->work;
+  int done;
+
+  list->work = dir->next;
+  pthread_mutex_unlock(&list->mutex);
+
+  if (!read_directory(list, dir))
+    fprintf(stderr, _("Warning: Could not read directory %s.\n"),
+	    dir->path);
+
+  pthread_mutex_lock(&list->mutex);
+  finish_directory(list, dir);
+  done = list->pending == 0;
+  pthread_mutex_unlock(&list->mutex);
+
+  if (done && list->cache_filename != NULL)
+    cache_save(list);
+
+  pthread_mutex_lock(&list->mutex);
+}
+
+
+static void *scan_thread (void *arg)
+{
+  playlist_t *list = arg;
+
+  pthread_mutex_lock(&list->mutex);
+
+  while (list->work != NULL && !list->cancel)
+    scan_one(list);
+
+  list->workers--;
+  pthread_cond_broadcast(&list->cond);
+  pthread_mutex_unlock(&list->mutex);
+
+  return NULL;
+}
+
+
+/* Move files from the tree into the items, as far as the first directory
+   that hasn't been read yet.  Called with the mutex held. */
+static void take_items (playlist_t *list)
+{
+  scan_dir_t *dir = list->cursor;
+  scan_entry_t *entry;
+
+  while (dir->done) {
+
+    if (dir->pos == dir->count) {
+      if (dir == &list->root)
+	break;
+
+      list->cursor = dir->parent;
+      free_dir(dir);
+      dir = list->cursor;
+      continue;
     }
 
-    entry = readdir(dir);
+    entry = &dir->entries[dir->pos++];
+
+    if (entry->dir != NULL) {
+      dir = list->cursor = entry->dir;
+      continue;
+    }
+
+    if (list->length == list->size) {
+      list->size = list->size ? list->size * 2 : 64;
+      list->items = check_alloc(realloc(list->items,
+					list->size * sizeof(char *)));
+    }
+    list->items[list->length++] = entry->filename;
+    entry->filename = NULL;
+  }
+}
+
+
+/* Called with the mutex held */
+static int scan_complete (playlist_t *list)
+{
+  return list->cursor == &list->root && list->root.pos == list->root.count;
+}
+
+
+/* Wait until entry n is known or the playlist is known to be shorter.
+   Called with the mutex held. */
+static void wait_for_item (playlist_t *list, int n)
+{
+  take_items(list);
+
+  while (n >= list->length && !scan_complete(list)) {
+
+    /* If no thread could be started, read the directories here */
+    if (list->workers == 0 && list->work != NULL)
+      scan_one(list);
+    else
+      pthread_cond_wait(&list->cond, &list->mutex);
+
+    take_items(list);
+  }
+}
+
+
+/* ----------------------------- public API ------------------------------ */
+
+playlist_t *playlist_create()
+{
+  playlist_t *list = (playlist_t *) calloc(1, sizeof(playlist_t));
+
+  if (list != NULL) {
+    pthread_mutex_init(&list->mutex, NULL);
+    pthread_cond_init(&list->cond, NULL);
+    pthread_mutex_init(&list->cache_mutex, NULL);
+
+    list->root.done = 1;
+    list->cursor = &list->root;
+  }
+
+  return list;
+}
+
+
+void playlist_destroy(playlist_t *list) {
+  scan_dir_t *dir, *parent;
+  int i;
+
+  /* Stop the scanning threads before taking the tree apart */
+  pthread_mutex_lock(&list->mutex);
+  list->cancel = 1;
+  while (list->workers > 0)
+    pthread_cond_wait(&list->cond, &list->mutex);
+  pthread_mutex_unlock(&list->mutex);
+
+  for (dir = list->cursor; dir != &list->root; dir = parent) {
+    parent = dir->parent;
+    free_dir(dir);
+  }
+  free_listing(&list->root);
+
+  for (i = 0; i < list->length; i++)
+    free(list->items[i]);
+  free(list->items);
+
+  if (list->cache != NULL) {
+    cache_dir_t *rec, *next;
+
+    for (i = 0; i < list->cache_buckets; i++)
+      for (rec = list->cache[i]; rec != NULL; rec = next) {
+	next = rec->next;
+	cache_free_record(rec);
+      }
+    free(list->cache);
+  }
+  free(list->cache_filename);
+
+  pthread_mutex_destroy(&list->mutex);
+  pthread_cond_destroy(&list->cond);
+  pthread_mutex_destroy(&list->cache_mutex);
+
+  free(list);
+  list = NULL;
+}
+
+
+void playlist_set_cache(playlist_t *list, char *cache_filename)
+{
+  if (list->cache_filename != NULL)
+    return;
+
+  list->cache_filename = check_alloc(strdup(cache_filename));
+  list->cache_buckets = 1024;
+  list->cache = check_alloc(calloc(list->cache_buckets,
+				   sizeof(cache_dir_t *)));
+
+  cache_load(list);
+}
+
+
+/* All of the playlist_append_* functions return
+   1 if append was successful
+   0 if failure (either directory could not be accessed or playlist on disk
+   could not be opened)
+*/
+
+
+/* Add this filename to the playlist.  Filename will be strdup()'ed.  Note
+   that this function will never fail. */
+int playlist_append_file(playlist_t *list, char *filename)
+{
+  char *copy = check_alloc(strdup(filename));
+
+  pthread_mutex_lock(&list->mutex);
+  add_entry(&list->root, copy, NULL);
+  pthread_mutex_unlock(&list->mutex);
+
+  return 1; /* No way to fail */
+}
+
+
+/* Recursively adds files from the directory and subdirectories */
+int playlist_append_directory(playlist_t *list, char *dirname)
+{
+  scan_dir_t *dir = new_dir(check_alloc(strdup(dirname)), &list->root);
+  int done;
+
+  /* The top directory is read right away, so a bad one can be reported */
+  if (!read_directory(list, dir)) {
+    free_dir(dir);
+    return 0;
   }
 
-  closedir(dir);
+  pthread_mutex_lock(&list->mutex);
+  add_entry(&list->root, dir->path, dir);
+  list->pending++;
+  finish_directory(list, dir);
+  done = list->pending == 0;
+  pthread_mutex_unlock(&list->mutex);
+
+  if (done && list->cache_filename != NULL)
+    cache_save(list);
 
   return 1;
 }
-#endif
 
 
 /* Opens a file containing filenames, one per line, and adds them to the
@@ -242,9 +818,10 @@ int playlist_append_directory(playlist_t *list, char *dirname)
 int playlist_append_from_file(playlist_t *list, char *playlist_filename)
 {
   FILE *fp;
-  char filename[NAME_MAX+1];
+  char *filename = NULL;
+  long size;
   struct stat stat_buf;
-  int length;
+  long length;
   int i;
 
   if (strcmp(playlist_filename, "-") == 0)
@@ -255,35 +832,20 @@ int playlist_append_from_file(playlist_t *list, char *playlist_filename)
   if (fp == NULL)
     return 0;
 
-  while (!feof(fp)) {
-
-    if ( fgets(filename, NAME_MAX+1 /* no, really! */, fp) == NULL )
-      continue;
-
-    filename[NAME_MAX] = '\0'; /* Just to make sure */
-    length = strlen(filename);
+  while ( (length = read_line(fp, &filename, &size)) >= 0 ) {
 
     /* Skip blank lines */
     for (i = 0; i < length && isspace(filename[i]); i++);
     if (i == length)
       continue;
 
-    /* Crop off trailing newlines if present. Handle DOS (\r\n), Unix (\n)
-     * and MacOS<9 (\r) line endings. */
-    if (length >= 2 && filename[length - 2] == '\r'
-     && filename[length - 1] == '\n') {
-      filename[length - 2] = '\0';
-    }
-    else if (length >= 1 && (
-     filename[length - 1] == '\n' || filename[length - 1] == '\r')) {
-      filename[length - 1] = '\0';
-    }
+    chomp(filename, length);
 
     if (stat(filename, &stat_buf) == 0) {
 
       if (S_ISDIR(stat_buf.st_mode)) {
 	if (playlist_append_directory(list, filename) == 0)
-	  fprintf(stderr, 
+	  fprintf(stderr,
 		  _("Warning from playlist %s: "
 		    "Could not read directory %s.\n"), playlist_filename,
 		  filename);
@@ -295,72 +857,70 @@ int playlist_append_from_file(playlist_t *list, char *playlist_filename)
 
   }
 
+  if (fp != stdin)
+    fclose(fp);
+  free(filename);
+
   return 1;
 }
 
 
-/* Return the number of items in the playlist */
-int playlist_length(playlist_t *list)
+char *playlist_get(playlist_t *list, int n)
 {
-  int length;
-  playlist_element_t *element;
+  char *item = NULL;
 
-  element = list->head;
-  length = 0; /* don't count head node */
-  while (element->next != NULL) {
-    length++;
-    element = element->next;
-  }
+  pthread_mutex_lock(&list->mutex);
+  wait_for_item(list, n);
+  if (n < list->length)
+    item = list->items[n];
+  pthread_mutex_unlock(&list->mutex);
 
-  return length;
+  return item;
 }
 
 
-/* Convert the playlist to an array of strings.  Strings are deep copied. 
-   Size will be set to the number of elements in the array. */
-char **playlist_to_array(playlist_t *list, int *size)
+int playlist_peek(playlist_t *list, int n, char **names, int max)
 {
-  char **array;
-  int i;
-  playlist_element_t *element;
+  int count;
 
-  *size = playlist_length(list);
-  array = calloc(*size, sizeof(char *));
+  pthread_mutex_lock(&list->mutex);
+  take_items(list);
+  for (count = 0; count < max && n + count < list->length; count++)
+    names[count] = list->items[n + count];
+  pthread_mutex_unlock(&list->mutex);
 
-  if (array == NULL) {
-    fprintf(stderr,
-	    _("ERROR: Out of memory in playlist_to_array().\n"));
-    exit(1);
-  }
-
-  for (i = 0, element = list->head->next; 
-       i < *size; 
-       i++, element = element->next) {
+  return count;
+}
 
-    array[i] = strdup(element->filename);
 
-    if (array[i] == NULL) {
-      fprintf(stderr,
-	      _("ERROR: Out of memory in playlist_to_array().\n"));
-      exit(1);
-    }
-  }
+/* Return the number of items in the playlist */
+int playlist_length(playlist_t *list)
+{
+  int length;
 
+  pthread_mutex_lock(&list->mutex);
+  while (!scan_complete(list))
+    wait_for_item(list, list->length);
+  length = list->length;
+  pthread_mutex_unlock(&list->mutex);
 
-  return array;
+  return length;
 }
 
 
-/* Deallocate array and all contained strings created by playlist_to_array. */
-void playlist_array_destroy(char **array, int size)
+void playlist_shuffle(playlist_t *list)
 {
-  int i;
+  int i, j, items;
+  char *temp;
 
-  for (i = 0; i < size; i++) {
-    free(array[i]);
-    array[i] = NULL;
-  }
+  items = playlist_length(list);
 
-  free(array);
-  array = NULL;
+  pthread_mutex_lock(&list->mutex);
+  for (i = 0; i < items; i++) {
+    j = i + random() % (items - i);
+    temp = list->items[i];
+    list->items[i] = list->items[j];
+    list->items[j] = temp;
+  }
+  pthread_mutex_unlock(&list->mutex);
 }
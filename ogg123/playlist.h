@@ -15,28 +15,26 @@
 
  ********************************************************************/
 
+/* The list of files to play.  Directories are read by a few threads in
+   the background, so the first entries can be played while the rest of
+   a large library is still being scanned.  Their contents still come out
+   in the same order as a plain recursive walk, each directory sorted by
+   name.  Optionally, directory listings are kept in a cache file and
+   used again for as long as the directory's mtime hasn't changed. */
+
 #ifndef __PLAYLIST_H__
 #define __PLAYLIST_H__
 
-typedef struct playlist_element_t {
-  char *filename;
-  struct playlist_element_t *next;
-} playlist_element_t;
-
-/* Actual playlist structure */
-typedef struct playlist_t {
-
-  /* Linked list with empty head node */
-  playlist_element_t *head;
-
-  /* Keep track of this for speedy appends */
-  playlist_element_t *last;
-} playlist_t;
+typedef struct playlist_t playlist_t;
 
 playlist_t *playlist_create();
 void playlist_destroy(playlist_t *list);
 
-/* All of the playlist_append_* functions return 
+/* Keep directory listings in this file.  Set it before any directories
+   are appended. */
+void playlist_set_cache(playlist_t *list, char *cache_filename);
+
+/* All of the playlist_append_* functions return
    1 if append was successful
    0 if failure (either directory could not be accessed or playlist on disk
    could not be opened)
@@ -47,22 +45,31 @@ void playlist_destroy(playlist_t *list);
    that this function will never fail. */
 int playlist_append_file(playlist_t *list, char *filename);
 
-/* Recursively adds files from the directory and subdirectories */
+/* Recursively adds files from the directory and subdirectories.  Only
+   the directory itself is read before this returns; the subdirectories
+   are read in the background. */
 int playlist_append_directory(playlist_t *list, char *dirname);
 
 /* Opens a file containing filenames, one per line, and adds them to the
    playlist */
 int playlist_append_from_file(playlist_t *list, char *playlist_filename);
 
-/* Return the number of items in the playlist */
-int playlist_length(playlist_t *list);
+/* Return entry n, waiting for directories to be read if it isn't known
+   yet, or NULL if the playlist is shorter than that.  The string belongs
+   to the playlist. */
+char *playlist_get(playlist_t *list, int n);
 
-/* Convert the playlist to an array of strings.  Strings are deep copied. 
-   Size will be set to the number of elements in the array. */
-char **playlist_to_array(playlist_t *list, int *size);
+/* Copy up to max of the entries from n on that are already known into
+   names, without waiting.  Returns how many were copied. */
+int playlist_peek(playlist_t *list, int n, char **names, int max);
+
+/* Return the number of items in the playlist, once every directory has
+   been read */
+int playlist_length(playlist_t *list);
 
-/* Deallocate array and all contained strings created by playlist_to_array. */
-void playlist_array_destroy(char **array, int size);
+/* Put the whole playlist in random order, once every directory has been
+   read */
+void playlist_shuffle(playlist_t *list);
 
 
 #endif /* __PLAYLIST_H__ */
@@ -0,0 +1,545 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "prefetch.h"
+#include "status.h"
+#include "i18n.h"
+
+/* Most of a source's share of the memory goes on the start.  The end
+   only needs to hold the last page, which is where the decoder finds the
+   length of the stream. */
+#define PREFETCH_TAIL         (64 * 1024)
+
+/* Streams have their own input buffer, so only take enough of them to
+   get through the headers without stalling the track change */
+#define PREFETCH_STREAM_HEAD  (64 * 1024)
+
+#define MIN(x,y)       ( (x) < (y) ? (x) : (y) )
+
+typedef enum {
+  PREFETCH_WAITING,
+  PREFETCH_OPENING,
+  PREFETCH_READY,
+  PREFETCH_FAILED
+} prefetch_state_t;
+
+typedef struct prefetch_entry_t {
+  char *source_string;
+  prefetch_state_t state;
+  int dropped;              /* No longer wanted, free it once opened */
+
+  data_source_t *source;    /* The real source, once open */
+  int seekable;
+  long length;              /* -1 if unknown */
+
+  unsigned char *head;      /* Bytes [0, head_len) of the source */
+  long head_len;
+  unsigned char *tail;      /* Bytes [tail_start, tail_start + tail_len) */
+  long tail_start;
+  long tail_len;
+
+  long pos;                 /* Where the decoder thinks it is */
+  long source_pos;          /* Where the real source is */
+
+  struct prefetch_entry_t *next;
+} prefetch_entry_t;
+
+static struct {
+  ogg123_options_t *opts;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;      /* Signalled when the list or a state changes */
+  int running;
+  int quit;
+  prefetch_entry_t *entries;
+} prefetcher;
+
+transport_t prefetch_transport;  /* Forward declaration */
+
+
+/* -------------------------- Private functions ------------------------- */
+
+static void free_entry (prefetch_entry_t *entry)
+{
+  if (entry->source != NULL)
+    entry->source->transport->close(entry->source);
+
+  free(entry->source_string);
+  free(entry->head);
+  free(entry->tail);
+  free(entry);
+}
+
+
+static long read_fully (data_source_t *source, unsigned char *ptr, long len)
+{
+  long total = 0;
+  int ret;
+
+  while (total < len &&
+	 (ret = source->transport->read(source, ptr + total, 1,
+					len - total)) > 0)
+    total += ret;
+
+  return total;
+}
+
+
+/* Open the source and read in what we can.  Called without the lock. */
+static int fetch (prefetch_entry_t *entry, long budget)
+{
+  const transport_t *transport;
+  data_source_t *source;
+  long head_max;
+
+  if ( (transport = select_transport(entry->source_string)) == NULL ||
+       (source = transport->open(entry->source_string,
+				 prefetcher.opts)) == NULL )
+    return 0;
+
+  entry->source = source;
+  entry->seekable = transport->tell(source) >= 0 &&
+    transport->seek(source, 0, SEEK_END) == 0;
+  entry->length = entry->seekable ? transport->tell(source) : -1;
+  head_max = entry->seekable ? budget : MIN(budget, PREFETCH_STREAM_HEAD);
+
+  /* Read the end first, unless the whole thing fits in the head */
+  if (entry->length > head_max) {
+    entry->tail_len = MIN(PREFETCH_TAIL, budget / 4);
+    head_max -= entry->tail_len;
+    entry->tail_start = entry->length - entry->tail_len;
+    entry->tail = malloc(entry->tail_len);
+
+    if (entry->tail == NULL ||
+	transport->seek(source, entry->tail_start, SEEK_SET) != 0)
+      return 0;
+    entry->tail_len = read_fully(source, entry->tail, entry->tail_len);
+  }
+
+  if (entry->seekable && transport->seek(source, 0, SEEK_SET) != 0)
+    return 0;
+
+  if (entry->length >= 0)
+    head_max = MIN(head_max, entry->length);
+  if ( (entry->head = malloc(head_max > 0 ? head_max : 1)) == NULL )
+    return 0;
+  entry->head_len = read_fully(source, entry->head, head_max);
+
+  entry->pos = 0;
+  entry->source_pos = entry->head_len;
+
+  return 1;
+}
+
+
+static void *prefetch_thread_func (void *arg)
+{
+  prefetch_entry_t *entry, **prev;
+  long budget = prefetcher.opts->prefetch_memory / prefetcher.opts->prefetch;
+  int ok;
+
+  pthread_mutex_lock(&prefetcher.mutex);
+
+  while (!prefetcher.quit) {
+
+    /* Take the first source that hasn't been started */
+    for (entry = prefetcher.entries; entry != NULL; entry = entry->next)
+      if (entry->state == PREFETCH_WAITING)
+	break;
+
+    if (entry == NULL) {
+      pthread_cond_wait(&prefetcher.cond, &prefetcher.mutex);
+      continue;
+    }
+
+    entry->state = PREFETCH_OPENING;
+    pthread_mutex_unlock(&prefetcher.mutex);
+
+    ok = fetch(entry, budget);
+
+    pthread_mutex_lock(&prefetcher.mutex);
+    entry->state = ok ? PREFETCH_READY : PREFETCH_FAILED;
+
+    if (entry->dropped) {
+      for (prev = &prefetcher.entries; *prev != entry; prev = &(*prev)->next);
+      *prev = entry->next;
+      free_entry(entry);
+    }
+
+    pthread_cond_broadcast(&prefetcher.cond);
+  }
+
+  pthread_mutex_unlock(&prefetcher.mutex);
+
+  return NULL;
+}
+
+
+/* Unlink an entry, or leave it for the thread to free if it's busy */
+static void drop_entry (prefetch_entry_t **prev)
+{
+  prefetch_entry_t *entry = *prev;
+
+  if (entry->state == PREFETCH_OPENING) {
+    entry->dropped = 1;
+  } else {
+    *prev = entry->next;
+    free_entry(entry);
+  }
+}
+
+
+/* ------------------------ Prefetching interface ----------------------- */
+
+void prefetch_init (ogg123_options_t *opts)
+{
+  if (opts->prefetch <= 0 || prefetcher.running)
+    return;
+
+  prefetcher.opts = opts;
+  prefetcher.quit = 0;
+  prefetcher.entries = NULL;
+  pthread_mutex_init(&prefetcher.mutex, NULL);
+  pthread_cond_init(&prefetcher.cond, NULL);
+
+  if (pthread_create(&prefetcher.thread, NULL, prefetch_thread_func, NULL)) {
+    status_error(_("Warning: Could not start the prefetch thread.\n"));
+    return;
+  }
+
+  prefetcher.running = 1;
+}
+
+
+void prefetch_shutdown (void)
+{
+  if (!prefetcher.running)
+    return;
+
+  pthread_mutex_lock(&prefetcher.mutex);
+  prefetcher.quit = 1;
+  pthread_cond_broadcast(&prefetcher.cond);
+  pthread_mutex_unlock(&prefetcher.mutex);
+
+  pthread_join(prefetcher.thread, NULL);
+
+  while (prefetcher.entries != NULL)
+    drop_entry(&prefetcher.entries);
+
+  pthread_mutex_destroy(&prefetcher.mutex);
+  pthread_cond_destroy(&prefetcher.cond);
+  prefetcher.running = 0;
+}
+
+
+void prefetch_schedule (char **source_strings, int count)
+{
+  prefetch_entry_t *entry, **prev;
+  int i;
+
+  if (!prefetcher.running)
+    return;
+
+  if (count > prefetcher.opts->prefetch)
+    count = prefetcher.opts->prefetch;
+
+  pthread_mutex_lock(&prefetcher.mutex);
+
+  /* Forget anything that's no longer coming up */
+  prev = &prefetcher.entries;
+  while (*prev != NULL) {
+    entry = *prev;
+
+    for (i = 0; i < count; i++)
+      if (!strcmp(entry->source_string, source_strings[i]))
+	break;
+
+    if (i == count && !entry->dropped)
+      drop_entry(prev);
+    if (*prev == entry)
+      prev = &entry->next;
+  }
+
+  /* Add the new ones at the end, in playlist order.  stdin can only be
+     read once, so it's left for play() to open. */
+  for (i = 0; i < count; i++) {
+
+    if (!strcmp(source_strings[i], "-"))
+      continue;
+
+    for (entry = prefetcher.entries; entry != NULL; entry = entry->next)
+      if (!entry->dropped && !strcmp(entry->source_string, source_strings[i]))
+	break;
+    if (entry != NULL)
+      continue;
+
+    entry = calloc(1, sizeof(prefetch_entry_t));
+    if (entry == NULL) {
+      status_error(_("ERROR: Out of memory.\n"));
+      exit(1);
+    }
+    entry->source_string = strdup(source_strings[i]);
+    entry->state = PREFETCH_WAITING;
+
+    for (prev = &prefetcher.entries; *prev != NULL; prev = &(*prev)->next);
+    *prev = entry;
+  }
+
+  pthread_cond_broadcast(&prefetcher.cond);
+  pthread_mutex_unlock(&prefetcher.mutex);
+}
+
+
+data_source_t *prefetch_take (const char *source_string)
+{
+  prefetch_entry_t *entry, **prev;
+  data_source_t *source;
+
+  if (!prefetcher.running)
+    return NULL;
+
+  pthread_mutex_lock(&prefetcher.mutex);
+
+  for (prev = &prefetcher.entries; *prev != NULL; prev = &(*prev)->next)
+    if (!(*prev)->dropped && !strcmp((*prev)->source_string, source_string))
+      break;
+
+  entry = *prev;
+  if (entry == NULL) {
+    pthread_mutex_unlock(&prefetcher.mutex);
+    return NULL;
+  }
+
+  /* Already half way there, so it's quicker to wait than start again */
+  while (entry->state == PREFETCH_OPENING)
+    pthread_cond_wait(&prefetcher.cond, &prefetcher.mutex);
+
+  /* The list may have changed while we waited */
+  for (prev = &prefetcher.entries; *prev != entry; prev = &(*prev)->next);
+  *prev = entry->next;
+
+  pthread_mutex_unlock(&prefetcher.mutex);
+
+  if (entry->state != PREFETCH_READY) {
+    free_entry(entry);
+    return NULL;
+  }
+
+  source = malloc(sizeof(data_source_t));
+  if (source == NULL) {
+    status_error(_("ERROR: Out of memory.\n"));
+    exit(1);
+  }
+
+  source->source_string = strdup(source_string);
+  source->transport = &prefetch_transport;
+  source->private = entry;
+
+  return source;
+}
+
+
+void prefetch_drop_streams (void)
+{
+  prefetch_entry_t **prev;
+
+  if (!prefetcher.running)
+    return;
+
+  pthread_mutex_lock(&prefetcher.mutex);
+
+  prev = &prefetcher.entries;
+  while (*prev != NULL) {
+    prefetch_entry_t *entry = *prev;
+
+    /* Not yet known to be seekable counts as a stream */
+    if (!entry->dropped && entry->state != PREFETCH_WAITING &&
+	!(entry->state == PREFETCH_READY && entry->seekable))
+      drop_entry(prev);
+    if (*prev == entry)
+      prev = &entry->next;
+  }
+
+  pthread_mutex_unlock(&prefetcher.mutex);
+}
+
+
+/* ----------------- Transport for a prefetched source ------------------ */
+
+/* Reads come from the copies in memory where they can, and from the
+   real source, moved to the right place first, where they can't */
+
+int prefetch_can_transport (const char *source_string)
+{
+  return 0;  /* Only ever made by prefetch_take() */
+}
+
+
+data_source_t *prefetch_open (const char *source_string,
+			      ogg123_options_t *ogg123_opts)
+{
+  return NULL;
+}
+
+
+int prefetch_read (data_source_t *source, void *ptr, size_t size,
+		   size_t nmemb)
+{
+  prefetch_entry_t *entry = source->private;
+  data_source_t *real = entry->source;
+  unsigned char *data = ptr;
+  long len = size * nmemb;
+  long done = 0, n;
+  int ret;
+
+  while (done < len) {
+
+    if (entry->pos < entry->head_len) {
+      n = MIN(len - done, entry->head_len - entry->pos);
+      memcpy(data + done, entry->head + entry->pos, n);
+    } else if (entry->tail != NULL && entry->pos >= entry->tail_start &&
+	       entry->pos < entry->tail_start + entry->tail_len) {
+      n = MIN(len - done, entry->tail_start + entry->tail_len - entry->pos);
+      memcpy(data + done, entry->tail + entry->pos - entry->tail_start, n);
+    } else {
+      if (entry->source_pos != entry->pos) {
+	if (real->transport->seek(real, entry->pos, SEEK_SET) != 0)
+	  break;
+	entry->source_pos = entry->pos;
+      }
+
+      /* Hand back whatever the real source gives us in one go */
+      ret = real->transport->read(real, data + done, 1, len - done);
+      if (ret > 0) {
+	entry->pos += ret;
+	entry->source_pos += ret;
+	done += ret;
+      }
+      break;
+    }
+
+    entry->pos += n;
+    done += n;
+  }
+
+  return size > 0 ? done / size : 0;
+}
+
+
+int prefetch_seek (data_source_t *source, long offset, int whence)
+{
+  prefetch_entry_t *entry = source->private;
+  long target;
+
+  switch (whence) {
+  case SEEK_SET:
+    target = offset;
+    break;
+  case SEEK_CUR:
+    target = entry->pos + offset;
+    break;
+  case SEEK_END:
+    if (entry->length < 0)
+      return -1;
+    target = entry->length + offset;
+    break;
+  default:
+    return -1;
+  }
+
+  if (target < 0)
+    return -1;
+
+  /* Streams can only go to what we have in memory, or where they are */
+  if (!entry->seekable && target > entry->head_len &&
+      target != entry->source_pos)
+    return -1;
+
+  /* The real source gets moved on the next read that needs it */
+  entry->pos = target;
+
+  return 0;
+}
+
+
+int prefetch_peek (data_source_t *source, void *ptr, size_t size,
+		   size_t nmemb)
+{
+  prefetch_entry_t *entry = source->private;
+  long pos = entry->pos;
+  int items;
+
+  if (!entry->seekable && pos + (long) (size * nmemb) > entry->head_len)
+    return 0;
+
+  items = prefetch_read(source, ptr, size, nmemb);
+  entry->pos = pos;
+
+  return items;
+}
+
+
+void prefetch_statistics (data_source_t *source, data_source_stats_t *stats)
+{
+  prefetch_entry_t *entry = source->private;
+
+  entry->source->transport->statistics(entry->source, stats);
+}
+
+
+long prefetch_tell (data_source_t *source)
+{
+  prefetch_entry_t *entry = source->private;
+
+  if (!entry->seekable)
+    return entry->source->transport->tell(entry->source);
+
+  return entry->pos;
+}
+
+
+void prefetch_close (data_source_t *source)
+{
+  free_entry(source->private);
+
+  free(source->source_string);
+  source->source_string = NULL;
+  source->private = NULL;
+  free(source);
+}
+
+
+transport_t prefetch_transport = {
+  "prefetch",
+  &prefetch_can_transport,
+  &prefetch_open,
+  &prefetch_peek,
+  &prefetch_read,
+  &prefetch_seek,
+  &prefetch_statistics,
+  &prefetch_tell,
+  &prefetch_close
+};
@@ -0,0 +1,43 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+/* Opening of upcoming playlist entries in the background.  A thread
+   opens the next few sources and reads the start of each (and the end,
+   where the decoder will look for the length) into memory, so play()
+   can start on a track without waiting for the disk or network. */
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "transport.h"
+
+void prefetch_init (ogg123_options_t *opts);
+void prefetch_shutdown (void);
+
+/* Replace the set of sources to fetch with these ones, in order */
+void prefetch_schedule (char **source_strings, int count);
+
+/* Hand over the prefetched source, waiting for it if it is still being
+   opened.  Returns NULL if it isn't one of the scheduled sources, in
+   which case the caller should open it as usual. */
+data_source_t *prefetch_take (const char *source_string);
+
+/* Forget sources that can't be reopened by seeking, like network
+   streams, which stop downloading on a cancel */
+void prefetch_drop_streams (void);
+
+#endif /* __PREFETCH_H__ */
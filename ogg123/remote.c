@@ -25,8 +25,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #if HAVE_SELECT
 #include <sys/select.h>
@@ -34,12 +41,22 @@
 
 #include "ogg123.h"
 #include "format.h"
+#include "remote.h"
 
 /* Maximum size of the input buffer */
 #define MAXBUF 1024
 /* Undefine logfile if you don't want it */
 //#define LOGFILE "/tmp/ogg123.log"
 
+/* Socket clients connected at once */
+#define MAX_CLIENTS 16
+/* Most events a client can ask for each second */
+#define MAX_EVENT_RATE 100.0
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 /* The play function in ogg123.c */
 extern void play (char *source_string);
 extern ogg123_options_t options;
@@ -57,7 +74,47 @@ static Status status = STOP;
 static pthread_mutex_t main_lock;
 static sem_t sem_command;
 static sem_t sem_processed;
-static pthread_mutex_t output_lock;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The file to play when the status is NEXT */
+static char fname[MAXBUF+1];
+
+/* Files to play once the current one ends (under main_lock) */
+typedef struct queue_entry_t {
+  char *name;
+  struct queue_entry_t *next;
+} queue_entry_t;
+
+static queue_entry_t *queue_head = NULL;
+static queue_entry_t *queue_tail = NULL;
+
+/* Set (under main_lock) while the main loop waits with nothing playing */
+static int idle = 0;
+
+/* With --remote-socket, any number of clients connect to a Unix domain
+   socket instead of using stdin and stdout.  Messages go to all of them,
+   except replies to a command, which go to the client that sent it.
+   The clients and the state they are sent events about are kept under
+   output_lock. */
+typedef struct remote_client_t {
+  int fd;
+  int dead;           /* Stopped reading, and is being disconnected */
+  double rate;        /* Events a second, or 0 if not watching */
+  double next_event;
+  long underruns;     /* Last count of buffer underruns sent */
+} remote_client_t;
+
+static int listen_fd = -1;
+static remote_client_t *clients[MAX_CLIENTS];
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+
+static double time_current = 0.0, time_total = 0.0;
+static double buffer_fill = 0.0;
+static long buffer_underruns = 0;
+
+/* Commands from different clients are handled one at a time */
+static pthread_mutex_t command_lock = PTHREAD_MUTEX_INITIALIZER;
+static remote_client_t *current_client = NULL;
 
 #ifdef LOGFILE
 void send_log(const char* fmt, ...) {
@@ -78,15 +135,63 @@ void send_log(const char* fmt, ...) {
   #define send_log(...)
 #endif
 
+/* Called with output_lock held.  A client that has stopped reading is
+   disconnected rather than allowed to hold up playback. */
+static void send_line(remote_client_t *client, const char *line) {
+
+  size_t len = strlen(line);
+
+  if (client->dead)
+    return;
+
+  if (send(client->fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t) len) {
+    client->dead = 1;
+    shutdown(client->fd, SHUT_RDWR);
+  }
+}
+
+/* Called with output_lock held.  With the socket, goes to one client, or
+   all of them if client is NULL. */
+static void vsend_locked(FILE *fp, remote_client_t *client,
+                         const char* fmt, va_list ap) {
+
+  char line[MAXBUF+3];
+  int i;
+
+  if (listen_fd < 0) {
+    fprintf(fp, "@");
+    vfprintf(fp, fmt, ap);
+    fprintf(fp, "\n");
+    return;
+  }
+
+  line[0] = '@';
+  vsnprintf(line + 1, MAXBUF, fmt, ap);
+  strcat(line, "\n");
+
+  if (client != NULL)
+    send_line(client, line);
+  else
+    for (i = 0; i < MAX_CLIENTS; i++)
+      if (clients[i] != NULL)
+        send_line(clients[i], line);
+}
+
+static void send_locked(remote_client_t *client, const char* fmt, ...) {
+
+  va_list ap;
+  va_start(ap, fmt);
+  vsend_locked(stdout, client, fmt, ap);
+  va_end(ap);
+}
+
 static void send_msg(const char* fmt, ...) {
 
   va_list ap;
   pthread_mutex_lock (&output_lock);
-  fprintf(stdout, "@");
   va_start(ap, fmt);
-  vfprintf(stdout, fmt, ap);
+  vsend_locked(stdout, NULL, fmt, ap);
   va_end(ap);
-  fprintf(stdout, "\n");
   pthread_mutex_unlock (&output_lock);
   return;
 }
@@ -94,11 +199,20 @@ static void send_msg(const char* fmt, ...) {
 static void send_err(const char* fmt, ...) {
   va_list ap;
   pthread_mutex_lock (&output_lock);
-  fprintf(stderr, "@");
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
+  vsend_locked(stderr, current_client, fmt, ap);
+  va_end(ap);
+  pthread_mutex_unlock (&output_lock);
+  return;
+}
+
+/* The answer to a command, for whoever sent it */
+static void send_reply(const char* fmt, ...) {
+  va_list ap;
+  pthread_mutex_lock (&output_lock);
+  va_start(ap, fmt);
+  vsend_locked(stdout, current_client, fmt, ap);
   va_end(ap);
-  fprintf(stderr, "\n");
   pthread_mutex_unlock (&output_lock);
   return;
 }
@@ -124,14 +238,235 @@ static void invertpause() {
   return;
 }
 
-static void * remotethread(void * arg) {
+/* The queue functions are called with main_lock held */
+static void queue_add(const char *name, int first) {
+
+  queue_entry_t *entry = malloc(sizeof(queue_entry_t));
+
+  if (entry == NULL || (entry->name = strdup(name)) == NULL) {
+    free(entry);
+    send_err("E Out of memory queueing '%s'", name);
+    return;
+  }
+
+  if (first) {
+    entry->next = queue_head;
+    queue_head = entry;
+    if (queue_tail == NULL)
+      queue_tail = entry;
+  } else {
+    entry->next = NULL;
+    if (queue_tail != NULL)
+      queue_tail->next = entry;
+    else
+      queue_head = entry;
+    queue_tail = entry;
+  }
+}
+
+static int queue_pop(char *name) {
+
+  queue_entry_t *entry = queue_head;
+
+  if (entry == NULL)
+    return 0;
+
+  queue_head = entry->next;
+  if (queue_head == NULL)
+    queue_tail = NULL;
+
+  strncpy(name, entry->name, MAXBUF);
+  name[MAXBUF] = 0;
+  free(entry->name);
+  free(entry);
+
+  return 1;
+}
+
+static void queue_clear(void) {
+
+  while (queue_head != NULL) {
+    queue_entry_t *entry = queue_head;
+
+    queue_head = entry->next;
+    free(entry->name);
+    free(entry);
+  }
+  queue_tail = NULL;
+}
+
+/* Handle one line of input, or the end of the input if buf is NULL.
+   Returns 1 when no more commands should be read. */
+static int remote_command(char *buf) {
 
   int done = 0;
   int error = 0;
   int ignore = 0;
-  char buf[MAXBUF+1];
   char *b;
 
+  /* Lock on */
+  pthread_mutex_lock (&main_lock);
+
+  if (buf != NULL) {
+    send_log("Input: %s", buf);
+
+    if (!strncasecmp(buf,"l",1)) {
+        /* prepare to load */
+      if ((b=strchr(buf,' ')) != NULL) {
+        /* Prepare to load a new song */
+        strcpy(fname, b+1);
+        setstatus(NEXT);
+      }
+      else {
+        /* Invalid load command */
+        error = 1;
+      }
+    }
+    else
+    if (!strncasecmp(buf,"e",1) || !strncasecmp(buf,"i",1)) {
+      /* Queue a song, and play it now if nothing is playing */
+      if ((b=strchr(buf,' ')) != NULL) {
+        if (idle) {
+          strcpy(fname, b+1);
+          setstatus(NEXT);
+        }
+        else {
+          queue_add(b+1, !strncasecmp(buf,"i",1));
+          ignore = 1;
+        }
+      }
+      else {
+        error = 1;
+      }
+    }
+    else
+    if (!strncasecmp(buf,"n",1)) {
+      /* Prepare to play the next song queued */
+      if (!queue_pop(fname)) {
+        send_err("E Nothing queued");
+        ignore = 1;
+      }
+      else {
+        setstatus(NEXT);
+      }
+    }
+    else
+    if (!strncasecmp(buf,"c",1)) {
+      /* Clear the queue, leaving the current song playing */
+      queue_clear();
+      ignore = 1;
+    }
+    else
+    if (!strncasecmp(buf,"w",1)) {
+      /* Subscribe to events */
+      if (current_client == NULL) {
+        send_err("E Watch needs --remote-socket");
+      }
+      else {
+        double rate = (b=strchr(buf,' ')) != NULL ? atof(b+1) : 0.0;
+
+        pthread_mutex_lock (&output_lock);
+        current_client->rate = rate < 0.0 ? 0.0 :
+          (rate > MAX_EVENT_RATE ? MAX_EVENT_RATE : rate);
+        current_client->next_event = 0.0;
+        pthread_cond_signal (&event_cond);
+        pthread_mutex_unlock (&output_lock);
+      }
+      ignore = 1;
+    }
+    else
+    if (!strncasecmp(buf,"p",1)) {
+      /* Prepare to (un)pause */
+      invertpause();
+    }
+    else
+    if (!strncasecmp(buf,"j",1)) {
+      /* Prepare to seek */
+      if ((b=strchr(buf,' ')) != NULL) {
+        set_seek_opt(&options, b+1);
+      }
+      ignore = 1;
+    }
+    else
+    if (!strncasecmp(buf,"s",1)) {
+      /* Prepare to stop */
+      setstatus(STOP);
+    }
+        else
+    if (!strncasecmp(buf,"r",1)) {
+      /* Prepare to reload */
+      setstatus(NEXT);
+    }
+    else
+    if (!strncasecmp(buf,"h",1)) {
+      /* Send help */
+      send_reply("H +----------------------------------------------------+");
+      send_reply("H | Ogg123 remote interface                            |");
+      send_reply("H |----------------------------------------------------|");
+      send_reply("H | Load <file>     -  load a file and starts playing  |");
+      send_reply("H | Enqueue <file>  -  play a file after those queued  |");
+      send_reply("H | Insert <file>   -  play a file before those queued |");
+      send_reply("H | Next            -  play the next queued file       |");
+      send_reply("H | Clear           -  empty the queue                 |");
+      send_reply("H | Pause           -  pause or unpause playing        |");
+      send_reply("H | Jump [+|-]<f>   -  jump <f> seconds forth or back  |");
+      send_reply("H | Stop            -  stop playing                    |");
+      send_reply("H | Reload          -  reload last song                |");
+      send_reply("H | Watch <n>       -  send status <n> times a second  |");
+      send_reply("H | Quit            -  quit ogg123                     |");
+      send_reply("H |----------------------------------------------------|");
+      send_reply("H | refer to README.remote for documentation           |");
+      send_reply("H +----------------------------------------------------+");
+      ignore = 1;
+    }
+    else
+    if (!strncasecmp(buf,"q",1)) {
+      /* Prepare to quit */
+      setstatus(QUIT);
+      done = 1;
+    }
+    else {
+      /* Unknown input received */
+      error = 1;
+    }
+  }
+  else {
+    send_err("E EOF or error reading commands");
+    send_log("EOF or error reading commands");
+    /* Treat EOF or error as a quit command. */
+    setstatus(QUIT);
+    done = 1;
+  }
+
+  if (ignore) {
+    /* Unlock */
+    pthread_mutex_unlock (&main_lock);
+  } else {
+    if (error) {
+      /* Send the error and unlock */
+      send_err("E Unknown command '%s'", buf);
+      send_log("Unknown command '%s'", buf);
+      /* Unlock */
+      pthread_mutex_unlock (&main_lock);
+    }
+    else {
+      /* Signal the main thread */
+      sem_post(&sem_command);
+      /* Unlock */
+      pthread_mutex_unlock (&main_lock);
+      /* Wait until the change has been noticed */
+      sem_wait(&sem_processed);
+    }
+  }
+
+  return done;
+}
+
+static void * remotethread(void * arg) {
+
+  int done = 0;
+  char buf[MAXBUF+1];
+
 #if HAVE_SELECT
   fd_set fd;
 #endif
@@ -152,131 +487,258 @@ static void * remotethread(void * arg) {
 
     ret = fgets(buf, MAXBUF, stdin);
 
-    /* Lock on */
-    pthread_mutex_lock (&main_lock);
-
-    if (ret != NULL) {
+    if (ret != NULL)
       buf[strcspn(buf, "\n")] = 0;
-      send_log("Input: %s", buf);
-      error = 0;
-
-      if (!strncasecmp(buf,"l",1)) {
-          /* prepare to load */
-        if ((b=strchr(buf,' ')) != NULL) {
-          /* Prepare to load a new song */
-          strcpy((char*)arg, b+1);
-          setstatus(NEXT);
-        }
-        else {
-          /* Invalid load command */
-          error = 1;
-        }
-      }
-      else
-      if (!strncasecmp(buf,"p",1)) {
-        /* Prepare to (un)pause */
-        invertpause();
-      }
-      else
-      if (!strncasecmp(buf,"j",1)) {
-        /* Prepare to seek */
-        if ((b=strchr(buf,' ')) != NULL) {
-          set_seek_opt(&options, b+1);
-        }
-        ignore = 1;
-      }
-      else
-      if (!strncasecmp(buf,"s",1)) {
-        /* Prepare to stop */
-        setstatus(STOP);
-      }
-          else
-      if (!strncasecmp(buf,"r",1)) {
-        /* Prepare to reload */
-        setstatus(NEXT);
-      }
-      else
-      if (!strncasecmp(buf,"h",1)) {
-        /* Send help */
-        send_msg("H +----------------------------------------------------+");
-        send_msg("H | Ogg123 remote interface                            |");
-        send_msg("H |----------------------------------------------------|");
-        send_msg("H | Load <file>     -  load a file and starts playing  |");
-        send_msg("H | Pause           -  pause or unpause playing        |");
-        send_msg("H | Jump [+|-]<f>   -  jump <f> seconds forth or back  |");
-        send_msg("H | Stop            -  stop playing                    |");
-        send_msg("H | Reload          -  reload last song                |");
-        send_msg("H | Quit            -  quit ogg123                     |");
-        send_msg("H |----------------------------------------------------|");
-        send_msg("H | refer to README.remote for documentation           |");
-        send_msg("H +----------------------------------------------------+");
-        ignore = 1;
-      }
-      else
-      if (!strncasecmp(buf,"q",1)) {
-        /* Prepare to quit */
-        setstatus(QUIT);
-        done = 1;
-      }
-      else {
-        /* Unknown input received */
-        error = 1;
-      }
+
+    done = remote_command(ret != NULL ? buf : NULL);
+  }
+
+  return NULL;
+}
+
+/* ------------------------------ Socket clients ------------------------- */
+
+static double now_seconds(void) {
+
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void * clientthread(void * arg) {
+
+  remote_client_t *client = arg;
+  char buf[MAXBUF+1];
+  char *nl;
+  ssize_t ret;
+  int len = 0;
+  int done = 0;
+  int i;
+
+  pthread_mutex_lock (&output_lock);
+  send_locked(client, "R ogg123 from " PACKAGE " " VERSION);
+  pthread_mutex_unlock (&output_lock);
+
+  while (!done && (ret = read(client->fd, buf + len, MAXBUF - len)) != 0) {
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
     }
-    else {
-      send_err("E EOF or error reading commands");
-      send_log("EOF or error reading commands");
-      /* Treat EOF or error as a quit command. */
-      setstatus(QUIT);
-      done = 1;
+
+    len += ret;
+    buf[len] = 0;
+
+    while (!done && (nl = strchr(buf, '\n')) != NULL) {
+      *nl = 0;
+      if (nl > buf && nl[-1] == '\r')
+        nl[-1] = 0;
+
+      pthread_mutex_lock (&command_lock);
+      current_client = client;
+      done = remote_command(buf);
+      current_client = NULL;
+      pthread_mutex_unlock (&command_lock);
+
+      len -= nl + 1 - buf;
+      memmove(buf, nl + 1, len + 1);
     }
 
-    if (ignore) {
-      /* Unlock */
-      pthread_mutex_unlock (&main_lock);
-      ignore = 0;
-    } else {
-      if (error) {
-    	/* Send the error and unlock */
-    	send_err("E Unknown command '%s'", buf);
-    	send_log("Unknown command '%s'", buf);
-		/* Unlock */
-    	pthread_mutex_unlock (&main_lock);
-      } 
-      else {
-    	/* Signal the main thread */
-    	sem_post(&sem_command);
-    	/* Unlock */
-    	pthread_mutex_unlock (&main_lock);
-    	/* Wait until the change has been noticed */
-    	sem_wait(&sem_processed);
+    /* Nowhere to put the rest of an overlong line */
+    if (len == MAXBUF)
+      len = 0;
+  }
+
+  pthread_mutex_lock (&output_lock);
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (clients[i] == client)
+      clients[i] = NULL;
+  pthread_mutex_unlock (&output_lock);
+
+  close(client->fd);
+  free(client);
+
+  return NULL;
+}
+
+static void * acceptthread(void * arg) {
+
+  pthread_t th;
+  pthread_attr_t attr;
+  remote_client_t *client;
+  int fd, i;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  while (1) {
+
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      send_err("E Could not accept a connection: %s", strerror(errno));
+      break;
+    }
+
+    if ((client = calloc(1, sizeof(remote_client_t))) == NULL) {
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+
+    pthread_mutex_lock (&output_lock);
+    for (i = 0; i < MAX_CLIENTS && clients[i] != NULL; i++);
+    if (i < MAX_CLIENTS)
+      clients[i] = client;
+    pthread_mutex_unlock (&output_lock);
+
+    if (i == MAX_CLIENTS ||
+        pthread_create(&th, &attr, clientthread, client) != 0) {
+      pthread_mutex_lock (&output_lock);
+      if (i < MAX_CLIENTS)
+        clients[i] = NULL;
+      pthread_mutex_unlock (&output_lock);
+      close(fd);
+      free(client);
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+
+  return NULL;
+}
+
+/* Send each watching client the position, buffer fill and any new
+   underruns at the rate it asked for, so it never has to poll */
+static void * eventthread(void * arg) {
+
+  struct timespec until;
+  double now, wait, next;
+  int i;
+
+  pthread_mutex_lock (&output_lock);
+
+  while (1) {
+    now = now_seconds();
+    wait = 1.0;
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+      remote_client_t *client = clients[i];
+
+      if (client == NULL || client->rate <= 0.0)
+        continue;
+
+      if (now >= client->next_event) {
+        send_locked(client, "F 0 0 %.2f %.2f", time_current,
+                    time_total - time_current);
+        send_locked(client, "B %.1f", buffer_fill);
+        if (client->underruns != buffer_underruns) {
+          send_locked(client, "U %ld", buffer_underruns);
+          client->underruns = buffer_underruns;
+        }
+
+        /* Keep to the rate, unless we've fallen behind it */
+        client->next_event += 1.0 / client->rate;
+        if (client->next_event < now)
+          client->next_event = now + 1.0 / client->rate;
       }
+
+      if (client->next_event - now < wait)
+        wait = client->next_event - now;
     }
+
+    next = now + wait;
+    until.tv_sec = (time_t) next;
+    until.tv_nsec = (long) ((next - until.tv_sec) * 1e9);
+    pthread_cond_timedwait (&event_cond, &output_lock, &until);
   }
 
   return NULL;
 }
 
+static int open_socket(const char *path) {
+
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    send_err("E Socket path too long: %s", path);
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* Replace a socket left by an ogg123 that didn't get to remove it,
+     but nothing else */
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(fd, MAX_CLIENTS) < 0) {
+    send_err("E Could not listen on %s: %s", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
 void remote_mainloop(void) {
 
   int r;
   pthread_t th;
   Status s;
-  char fname[MAXBUF+1];
-
-  /* Need to output line by line! */
-  setlinebuf(stdout);
-
-  /* Send a greeting */
-  send_msg("R ogg123 from " PACKAGE " " VERSION);
+  int advance = 0;
+  int start;
+  char playing[MAXBUF+1];  /* fname belongs to the command thread */
 
   /* Initialize the thread controlling variables */
   pthread_mutex_init(&main_lock, NULL);
   sem_init(&sem_command, 0, 0);
   sem_init(&sem_processed, 0, 0);
 
-  /* Start the thread */
-  r = pthread_create(&th, NULL, remotethread, (void*)fname);
+  if (options.remote_socket != NULL) {
+
+    int fd = open_socket(options.remote_socket);
+
+    if (fd < 0)
+      return;
+
+    /* Writes to a client that has gone fail rather than kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_lock (&output_lock);
+    listen_fd = fd;
+    pthread_mutex_unlock (&output_lock);
+
+    /* Start the threads */
+    r = pthread_create(&th, NULL, acceptthread, NULL);
+    if (r == 0) {
+      pthread_detach(th);
+      r = pthread_create(&th, NULL, eventthread, NULL);
+      if (r == 0)
+        pthread_detach(th);
+    }
+  }
+  else {
+
+    /* Need to output line by line! */
+    setlinebuf(stdout);
+
+    /* Send a greeting */
+    send_msg("R ogg123 from " PACKAGE " " VERSION);
+
+    /* Start the thread */
+    r = pthread_create(&th, NULL, remotethread, NULL);
+  }
+
   if (r != 0) {
     send_err("E Could not create a thread (code %d)", r);
     return;
@@ -296,38 +758,74 @@ void remote_mainloop(void) {
     /* wait for a new command */
     if (s != NEXT) {
 
-      /* Wait until a new status is available,
+      /* At the end of a song, carry on with the next one queued.
+         Otherwise wait until a new status is available,
          This puts the main tread asleep and
          saves resources
        */
-       
-      sem_wait(&sem_command);
 
       pthread_mutex_lock(&main_lock);
+      if (getstatus() == PLAY && queue_pop(playing)) {
+        setstatus(NEXT);
+        advance = 1;
+      }
+      else {
+        idle = 1;
+      }
       s = getstatus();
       pthread_mutex_unlock(&main_lock);
+
+      if (!advance) {
+        sem_wait(&sem_command);
+
+        pthread_mutex_lock(&main_lock);
+        idle = 0;
+        s = getstatus();
+        pthread_mutex_unlock(&main_lock);
+      }
     }
 
     send_log("Status: %d", s);
 
+    start = 0;
     if (s == NEXT) {
 
       /* The status is to play a new song. Set
          the status to PLAY and signal the thread
-         that the status has been processed.
+         that the status has been processed
+         (unless it came from the queue).  The
+         command's post is still there if the
+         player stopped for it, so take it.  If we
+         were going on with the queue, a command
+         may have come in since: answer that one
+         too, and let it have its way.
        */
-       
-      send_msg("I %s", fname);
-      send_msg("S 0.0 0 00000 xxxxxx 0 0 0 0 0 0 0 0");
-      send_msg("P 2");
+
       pthread_mutex_lock(&main_lock);
-      setstatus(PLAY);
-      s = getstatus();
-      send_log("mainloop s=%d", s);
-      sem_post(&sem_processed);
-      s = getstatus();
-      send_log("mainloop s=%d", s);
+      if (sem_trywait(&sem_command) == 0 && advance) {
+        advance = 0;
+        s = getstatus();
+      }
+      if (s == NEXT) {
+        if (!advance)
+          strcpy(playing, fname);
+        else
+          strcpy(fname, playing);  /* For Reload */
+        send_msg("I %s", playing);
+        send_msg("S 0.0 0 00000 xxxxxx 0 0 0 0 0 0 0 0");
+        send_msg("P 2");
+        setstatus(PLAY);
+        s = getstatus();
+        send_log("mainloop s=%d", s);
+        if (!advance)
+          sem_post(&sem_processed);
+        start = 1;
+      }
+      advance = 0;
       pthread_mutex_unlock(&main_lock);
+    }
+
+    if (start) {
 
       /* Start the player. The player calls the playloop
          frequently to check for a new status (e.g. NEXT,
@@ -338,7 +836,7 @@ void remote_mainloop(void) {
       s = getstatus();
       pthread_mutex_unlock(&main_lock);
       send_log("mainloop s=%d", s);
-      play(fname);
+      play(playing);
       
       /* Retrieve the new status */
       pthread_mutex_lock(&main_lock);
@@ -373,6 +871,11 @@ void remote_mainloop(void) {
   send_msg("Q");
   send_log("Quit");
 
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(options.remote_socket);
+  }
+
   /* Cleanup the semaphores */
   sem_destroy(&sem_command);
   sem_destroy(&sem_processed);
@@ -427,8 +930,27 @@ int remote_playloop(void) {
 
 void remote_time(double current, double total) {
 
+  /* Socket clients get the time as an event, if they ask */
+  if (listen_fd >= 0) {
+    pthread_mutex_lock (&output_lock);
+    time_current = current;
+    time_total = total;
+    pthread_mutex_unlock (&output_lock);
+    return;
+  }
+
   /* Send the frame (not implemented yet) and the time */
   send_msg("F 0 0 %.2f %.2f", current, (total-current));
 
   return;
 }
+
+void remote_buffer(double fill, long underruns) {
+
+  pthread_mutex_lock (&output_lock);
+  buffer_fill = fill;
+  buffer_underruns = underruns;
+  pthread_mutex_unlock (&output_lock);
+
+  return;
+}
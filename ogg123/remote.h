@@ -20,3 +20,4 @@
 void remote_mainloop(void);
 int remote_playloop(void);
 void remote_time(double current, double total);
+void remote_buffer(double fill, long underruns);
@@ -0,0 +1,333 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "seekindex.h"
+
+/* Bisecting a smaller file is quick enough */
+#define SEEK_INDEX_MIN_SIZE   (16 * 1024 * 1024)
+
+/* Bytes of file between entries.  A seek decodes at most about this
+   much to get from the indexed page to the target. */
+#define SEEK_INDEX_SPACING    (32 * 1024)
+
+#define SEEK_INDEX_READ_SIZE  (64 * 1024)
+
+#define SEEK_INDEX_MAGIC      "ogg123 seek index 1"
+
+typedef struct seek_entry_t {
+  ogg_int64_t granulepos;   /* Of the page starting at offset */
+  long offset;
+} seek_entry_t;
+
+struct seek_index_t {
+  char *path;
+  long serialno;
+  char *cache_dir;          /* NULL if indexes aren't kept */
+  char *cache_file;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int running;
+  int quit;
+
+  seek_entry_t *entries;
+  int count;
+  int size;
+  ogg_int64_t scanned;      /* Granule position the scan has got to */
+  int complete;
+};
+
+
+/* -------------------------- Private functions ------------------------- */
+
+/* Called with the lock held */
+static void add_entry (seek_index_t *index, ogg_int64_t granulepos,
+		       long offset)
+{
+  if (index->count == index->size) {
+    int size = index->size ? index->size * 2 : 256;
+    seek_entry_t *entries = realloc(index->entries,
+				    size * sizeof(seek_entry_t));
+
+    if (entries == NULL)
+      return;  /* The index is just sparser than it could be */
+
+    index->entries = entries;
+    index->size = size;
+  }
+
+  index->entries[index->count].granulepos = granulepos;
+  index->entries[index->count].offset = offset;
+  index->count++;
+}
+
+
+static int load_index (seek_index_t *index)
+{
+  FILE *fp;
+  char magic[sizeof(SEEK_INDEX_MAGIC)];
+  long serialno, offset;
+  long long granulepos;
+  int count, i;
+
+  if ( (fp = fopen(index->cache_file, "r")) == NULL )
+    return 0;
+
+  if (fgets(magic, sizeof(magic), fp) == NULL ||
+      strcmp(magic, SEEK_INDEX_MAGIC) != 0 ||
+      fscanf(fp, "%ld %d", &serialno, &count) != 2 ||
+      serialno != index->serialno || count <= 0) {
+    fclose(fp);
+    return 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (fscanf(fp, "%lld %ld", &granulepos, &offset) != 2 ||
+	(index->count > 0 &&
+	 granulepos < index->entries[index->count - 1].granulepos)) {
+      /* Damaged; build it again */
+      index->count = 0;
+      break;
+    }
+    add_entry(index, granulepos, offset);
+  }
+
+  fclose(fp);
+
+  if (index->count == 0)
+    return 0;
+
+  index->scanned = index->entries[index->count - 1].granulepos;
+  index->complete = 1;
+
+  return 1;
+}
+
+
+/* Write to a temporary file first, so another ogg123 reading the cache
+   never sees half an index */
+static void save_index (seek_index_t *index)
+{
+  FILE *fp;
+  char *temp;
+  int i, ok;
+
+  temp = malloc(strlen(index->cache_file) + 16);
+  if (temp == NULL)
+    return;
+  sprintf(temp, "%s.%ld", index->cache_file, (long) getpid());
+
+  mkdir(index->cache_dir, 0755);  /* Most likely there already */
+
+  if ( (fp = fopen(temp, "w")) == NULL ) {
+    free(temp);
+    return;
+  }
+
+  ok = fprintf(fp, "%s\n%ld %d\n", SEEK_INDEX_MAGIC, index->serialno,
+	       index->count) > 0;
+  for (i = 0; ok && i < index->count; i++)
+    ok = fprintf(fp, "%lld %ld\n",
+		 (long long) index->entries[i].granulepos,
+		 index->entries[i].offset) > 0;
+
+  if (fclose(fp) != 0 || !ok || rename(temp, index->cache_file) != 0)
+    unlink(temp);
+
+  free(temp);
+}
+
+
+static void *scan_thread_func (void *arg)
+{
+  seek_index_t *index = arg;
+  ogg_sync_state oy;
+  ogg_page og;
+  FILE *fp;
+  long offset = 0, next_entry = 0, ret;
+  size_t nb_read;
+  char *data;
+  int done = 0, quit = 0;
+
+  if ( (fp = fopen(index->path, "r")) == NULL )
+    return NULL;
+
+  ogg_sync_init(&oy);
+
+  while (!done && !quit) {
+    ret = ogg_sync_pageseek(&oy, &og);
+
+    if (ret < 0) {
+      offset -= ret;  /* Skipped over something that isn't a page */
+    } else if (ret == 0) {
+      data = ogg_sync_buffer(&oy, SEEK_INDEX_READ_SIZE);
+      nb_read = fread(data, 1, SEEK_INDEX_READ_SIZE, fp);
+      if (nb_read == 0)
+	done = 1;
+      ogg_sync_wrote(&oy, nb_read);
+
+      pthread_mutex_lock(&index->mutex);
+      quit = index->quit;
+      pthread_mutex_unlock(&index->mutex);
+    } else {
+      /* Header pages have a granule position of 0, and aren't anywhere
+	 a decoder could resume from */
+      if (ogg_page_serialno(&og) == index->serialno &&
+	  ogg_page_granulepos(&og) > 0) {
+	pthread_mutex_lock(&index->mutex);
+	if (offset >= next_entry) {
+	  add_entry(index, ogg_page_granulepos(&og), offset);
+	  next_entry = offset + SEEK_INDEX_SPACING;
+	}
+	index->scanned = ogg_page_granulepos(&og);
+	pthread_mutex_unlock(&index->mutex);
+
+	if (ogg_page_eos(&og))
+	  done = 1;
+      }
+
+      offset += ret;
+    }
+  }
+
+  ogg_sync_clear(&oy);
+  fclose(fp);
+
+  if (done) {
+    pthread_mutex_lock(&index->mutex);
+    index->complete = 1;
+    pthread_mutex_unlock(&index->mutex);
+
+    /* Nothing else touches the entries once the index is complete */
+    if (index->cache_file != NULL && index->count > 0)
+      save_index(index);
+  }
+
+  return NULL;
+}
+
+
+/* ---------------------------- Public functions ------------------------ */
+
+seek_index_t *seek_index_open (const char *path, long serialno,
+			       ogg123_options_t *opts)
+{
+  seek_index_t *index;
+  struct stat st;
+
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < SEEK_INDEX_MIN_SIZE)
+    return NULL;
+
+  if ( (index = calloc(1, sizeof(seek_index_t))) == NULL ||
+       (index->path = strdup(path)) == NULL ) {
+    free(index);
+    return NULL;
+  }
+
+  index->serialno = serialno;
+  pthread_mutex_init(&index->mutex, NULL);
+
+  if (opts->seek_cache != NULL) {
+    index->cache_dir = strdup(opts->seek_cache);
+    index->cache_file = malloc(strlen(opts->seek_cache) + 64);
+    if (index->cache_dir != NULL && index->cache_file != NULL)
+      sprintf(index->cache_file, "%s/%lx-%lx-%lx.idx", opts->seek_cache,
+	      (unsigned long) st.st_ino, (unsigned long) st.st_size,
+	      (unsigned long) st.st_mtime);
+    else {
+      free(index->cache_file);
+      index->cache_file = NULL;
+    }
+  }
+
+  if (index->cache_file != NULL && load_index(index))
+    return index;
+
+  if (pthread_create(&index->thread, NULL, scan_thread_func, index) == 0)
+    index->running = 1;
+
+  return index;
+}
+
+
+void seek_index_close (seek_index_t *index)
+{
+  if (index == NULL)
+    return;
+
+  if (index->running) {
+    pthread_mutex_lock(&index->mutex);
+    index->quit = 1;
+    pthread_mutex_unlock(&index->mutex);
+    pthread_join(index->thread, NULL);
+  }
+
+  pthread_mutex_destroy(&index->mutex);
+  free(index->entries);
+  free(index->cache_file);
+  free(index->cache_dir);
+  free(index->path);
+  free(index);
+}
+
+
+int seek_index_lookup (seek_index_t *index, ogg_int64_t granulepos,
+		       long *offset)
+{
+  int lo, hi, mid;
+  int found = 0;
+
+  if (index == NULL)
+    return 0;
+
+  pthread_mutex_lock(&index->mutex);
+
+  /* Until the scan gets past the target, there may be a closer page
+     still to come */
+  if (index->count > 0 && index->entries[0].granulepos <= granulepos &&
+      (index->complete || granulepos <= index->scanned)) {
+    lo = 0;
+    hi = index->count - 1;
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (index->entries[mid].granulepos <= granulepos)
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+
+    *offset = index->entries[lo].offset;
+    found = 1;
+  }
+
+  pthread_mutex_unlock(&index->mutex);
+
+  return found;
+}
@@ -0,0 +1,44 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+/* A sparse index of where the pages of a large local file start, by
+   granule position, so seeking doesn't have to bisect the file.  A
+   thread reads through the file to build it while the file plays.  If
+   there is a seek cache directory, finished indexes are kept there,
+   named after the file's inode, size and modification time. */
+
+#ifndef __SEEKINDEX_H__
+#define __SEEKINDEX_H__
+
+#include <ogg/ogg.h>
+#include "ogg123.h"
+
+typedef struct seek_index_t seek_index_t;
+
+/* Returns NULL for anything that isn't a large enough regular file.
+   Only pages of the logical stream with this serial number count. */
+seek_index_t *seek_index_open (const char *path, long serialno,
+			       ogg123_options_t *opts);
+void seek_index_close (seek_index_t *index);
+
+/* Find the start of the last indexed page with a granule position no
+   later than granulepos.  Returns 0 if the index can't tell yet, and
+   the caller should seek the usual way. */
+int seek_index_lookup (seek_index_t *index, ogg_int64_t granulepos,
+		       long *offset);
+
+#endif /* __SEEKINDEX_H__ */
@@ -0,0 +1,596 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "server.h"
+#include "callbacks.h"
+#include "format.h"
+#include "transport.h"
+#include "status.h"
+#include "i18n.h"
+
+/* Most a session decodes before giving the next one a turn */
+#define SLICE_BYTES (4 * AUDIO_CHUNK_SIZE)
+
+/* How often the main thread looks for a signal, in milliseconds */
+#define SIGNAL_POLL 250
+
+extern signal_request_t sig_request;
+
+typedef enum session_state_t {
+  SESSION_IDLE,      /* Buffer full enough, or finished */
+  SESSION_QUEUED,    /* Waiting for a worker */
+  SESSION_RUNNING    /* Being decoded by a worker */
+} session_state_t;
+
+typedef struct session_t {
+  char *name;
+  playlist_t *playlist;
+  int index;                /* Next playlist entry to open */
+  int played_one;           /* Some entry opened this time through */
+
+  audio_device_t *devices;
+  audio_play_arg_t play_arg;
+  buf_t *buffer;
+
+  /* Only touched by the worker running the session */
+  data_source_t *source;
+  format_t *format;
+  decoder_t *decoder;
+  audio_format_t old_fmt;
+
+  /* Protected by server.mutex */
+  session_state_t state;
+  int again;                /* Woken up while it was running */
+  int finished;             /* Everything has been decoded */
+
+  struct session_t *next;       /* All sessions */
+  struct session_t *next_run;   /* Run queue */
+} session_t;
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;   /* A session was queued, or shutdown */
+  pthread_cond_t done_cond;   /* A session finished */
+
+  ogg123_options_t *opts;
+  session_t *sessions;
+  session_t *run_head;
+  session_t *run_tail;
+  int unfinished;
+  int shutdown;
+
+  pthread_t *workers;
+  int nworkers;
+} server = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	     PTHREAD_COND_INITIALIZER };
+
+/* Kept by every decoder for as long as it is open, and the same for all
+   of them: messages go through the session's buffer */
+static decoder_callbacks_t session_callbacks = {
+  &decoder_buffered_error_callback,
+  &decoder_buffered_metadata_callback
+};
+
+
+/* ---------------------------- scheduling ------------------------------- */
+
+/* Called with the mutex held */
+static void queue_session (session_t *s)
+{
+  if (s->finished)
+    return;
+
+  if (s->state == SESSION_RUNNING) {
+    s->again = 1;
+    return;
+  }
+
+  if (s->state == SESSION_QUEUED)
+    return;
+
+  s->state = SESSION_QUEUED;
+  s->next_run = NULL;
+  if (server.run_tail != NULL)
+    server.run_tail->next_run = s;
+  else
+    server.run_head = s;
+  server.run_tail = s;
+
+  pthread_cond_signal(&server.work_cond);
+}
+
+
+/* The buffer's playback thread has taken it down to the low water mark */
+static void session_wake (buf_t *buf, void *arg)
+{
+  pthread_mutex_lock(&server.mutex);
+  queue_session((session_t *) arg);
+  pthread_mutex_unlock(&server.mutex);
+}
+
+
+/* ----------------------------- decoding -------------------------------- */
+
+static void session_close (session_t *s)
+{
+  if (s->decoder != NULL) {
+    s->format->cleanup(s->decoder);
+    s->decoder = NULL;
+  }
+
+  if (s->source != NULL) {
+    s->source->transport->close(s->source);
+    s->source = NULL;
+  }
+}
+
+
+/* Open the next playlist entry that can be played.  Returns 0 at the end
+   of the playlist. */
+static int session_open_next (session_t *s)
+{
+  ogg123_options_t *opts = server.opts;
+  const transport_t *transport;
+  audio_format_t fmt;
+  char *source_string;
+
+  while (!sig_request.cancel) {
+
+    source_string = playlist_get(s->playlist, s->index);
+
+    if (source_string == NULL) {
+      if (!opts->repeat || !s->played_one)
+	return 0;
+
+      s->index = 0;
+      s->played_one = 0;
+      if (opts->shuffle)
+	playlist_shuffle(s->playlist);
+      continue;
+    }
+
+    s->index++;
+
+    if ( (transport = select_transport(source_string)) == NULL ) {
+      status_error(_("%s: No module could be found to read from %s.\n"),
+		   s->name, source_string);
+      continue;
+    }
+
+    if ( (s->source = transport->open(source_string, opts)) == NULL ) {
+      status_error(_("%s: Cannot open %s.\n"), s->name, source_string);
+      continue;
+    }
+
+    if ( (s->format = select_format(s->source)) == NULL ) {
+      status_error(_("%s: The file format of %s is not supported.\n"),
+		   s->name, source_string);
+      session_close(s);
+      continue;
+    }
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.big_endian = ao_is_big_endian();
+    fmt.signed_sample = 1;
+    fmt.word_size = opts->output_bits / 8;
+
+    s->decoder = s->format->init(s->source, opts, &fmt, &session_callbacks,
+				 s->buffer);
+    if (s->decoder == NULL) {
+      status_error(_("%s: Error opening %s using the %s module."
+		     "  The file may be corrupted.\n"), s->name,
+		   source_string, s->format->name);
+      session_close(s);
+      continue;
+    }
+
+    s->played_one = 1;
+    status_message(1, _("%s: Playing %s"), s->name, source_string);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* Decode into the session's buffer until it is nearly full, or for one
+   slice, whichever comes first */
+static void session_run (session_t *s, unsigned char *scratch)
+{
+  buf_t *buf = s->buffer;
+  audio_format_t fmt;
+  unsigned char *block;
+  long blocksize, len, decoded = 0;
+  int ret, eos, direct, ok;
+
+  while (decoded < SLICE_BYTES && !sig_request.cancel) {
+
+    if (s->decoder == NULL && !session_open_next(s)) {
+      buffer_mark_eos(buf);
+      pthread_mutex_lock(&server.mutex);
+      s->finished = 1;
+      pthread_mutex_unlock(&server.mutex);
+      return;
+    }
+
+    if (buf->size - buffer_full(buf) < AUDIO_CHUNK_SIZE)
+      return;
+
+    /* Decode straight into the buffer when it doesn't wrap too soon,
+       as play() does */
+    block = scratch;
+    blocksize = AUDIO_CHUNK_SIZE;
+    len = PRIMAGIC;
+    direct = buffer_reserve(buf, &block, &len) && len >= PRIMAGIC;
+    if (direct)
+      blocksize = (len < AUDIO_CHUNK_SIZE ? len : AUDIO_CHUNK_SIZE)
+	/ PRIMAGIC * PRIMAGIC;
+    else
+      block = scratch;
+
+    ret = s->format->read(s->decoder, block, blocksize, &eos, &fmt);
+
+    if (ret <= 0) {
+      if (ret < 0)
+	status_error(_("%s: Decoding failure.\n"), s->name);
+      session_close(s);
+      continue;
+    }
+
+    if (!audio_format_equal(&fmt, &s->old_fmt)) {
+      s->old_fmt = fmt;
+      buffer_insert_action_at_end(buf, &audio_reopen_action,
+				  new_audio_reopen_arg(s->devices, &fmt));
+    }
+
+    if (direct)
+      ok = buffer_commit(buf, ret);
+    else
+      ok = buffer_submit_data(buf, scratch, ret);
+
+    if (!ok) {
+      status_error(_("%s: Output failed, stopping.\n"), s->name);
+      session_close(s);
+      pthread_mutex_lock(&server.mutex);
+      s->finished = 1;
+      pthread_mutex_unlock(&server.mutex);
+      return;
+    }
+
+    decoded += ret;
+  }
+}
+
+
+static void *server_worker (void *arg)
+{
+  unsigned char *scratch;
+  session_t *s;
+
+  if ( (scratch = malloc(AUDIO_CHUNK_SIZE)) == NULL ) {
+    status_error(_("ERROR: Out of memory.\n"));
+    exit(1);
+  }
+
+  pthread_mutex_lock(&server.mutex);
+
+  while (!server.shutdown) {
+
+    if (server.run_head == NULL) {
+      pthread_cond_wait(&server.work_cond, &server.mutex);
+      continue;
+    }
+
+    s = server.run_head;
+    server.run_head = s->next_run;
+    if (server.run_head == NULL)
+      server.run_tail = NULL;
+    s->state = SESSION_RUNNING;
+    s->again = 0;
+
+    pthread_mutex_unlock(&server.mutex);
+    session_run(s, scratch);
+    pthread_mutex_lock(&server.mutex);
+
+    /* Go round again if the slice ran out before the buffer filled, or
+       the buffer has been drained since */
+    s->state = SESSION_IDLE;
+    if (s->finished) {
+      server.unfinished--;
+      pthread_cond_broadcast(&server.done_cond);
+    } else if (s->again
+	       || s->buffer->size - buffer_full(s->buffer) >= AUDIO_CHUNK_SIZE)
+      queue_session(s);
+  }
+
+  pthread_mutex_unlock(&server.mutex);
+  free(scratch);
+
+  return NULL;
+}
+
+
+/* ---------------------------- session file ----------------------------- */
+
+/* driver[,key=value...], where file=path names the output file */
+static audio_device_t *parse_device (char *spec, const char *name)
+{
+  audio_device_t *device;
+  ao_option *ao_options = NULL;
+  char *filename = NULL;
+  char *option, *value;
+  int driver_id;
+
+  option = strchr(spec, ',');
+  if (option != NULL)
+    *option++ = '\0';
+
+  driver_id = strcmp(spec, "default") == 0 ?
+    ao_default_driver_id() : ao_driver_id(spec);
+  if (driver_id < 0) {
+    status_error(_("%s: No such device %s.\n"), name, spec);
+    return NULL;
+  }
+
+  while (option != NULL) {
+    char *next = strchr(option, ',');
+
+    if (next != NULL)
+      *next++ = '\0';
+
+    value = strchr(option, '=');
+    if (value != NULL)
+      *value++ = '\0';
+
+    if (strcmp(option, "file") == 0 && value != NULL) {
+      free(filename);
+      filename = strdup(value);
+    } else
+      ao_append_option(&ao_options, option, value);
+
+    option = next;
+  }
+
+  device = append_audio_device(NULL, driver_id, ao_options, filename);
+  if (server.opts->verbosity == 0)
+    ao_append_option(&device->options, "quiet", NULL);
+
+  return device;
+}
+
+
+static session_t *parse_session (char *line, const char *filename,
+				 int lineno)
+{
+  session_t *s;
+  char *name, *device, *what;
+  struct stat stat_buf;
+  int ok;
+
+  name = strtok(line, " \t");
+  device = strtok(NULL, " \t");
+  what = strtok(NULL, "");
+  while (what != NULL && isspace((unsigned char) *what))
+    what++;
+
+  if (device == NULL || what == NULL || *what == '\0') {
+    status_error(_("%s:%d: A session needs a name, a device and something"
+		   " to play.\n"), filename, lineno);
+    return NULL;
+  }
+
+  if ( (s = calloc(1, sizeof(session_t))) == NULL ||
+       (s->name = strdup(name)) == NULL ||
+       (s->playlist = playlist_create()) == NULL ) {
+    status_error(_("ERROR: Out of memory.\n"));
+    exit(1);
+  }
+
+  if ( (s->devices = parse_device(device, s->name)) == NULL ) {
+    playlist_destroy(s->playlist);
+    free(s->name);
+    free(s);
+    return NULL;
+  }
+
+  if (what[0] == '@')
+    ok = playlist_append_from_file(s->playlist, what + 1);
+  else if (stat(what, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode))
+    ok = playlist_append_directory(s->playlist, what);
+  else
+    ok = playlist_append_file(s->playlist, what);
+
+  if (!ok)
+    status_error(_("%s: Cannot read %s.\n"), s->name, what);
+
+  return s;
+}
+
+
+static int load_sessions (const char *filename)
+{
+  FILE *fp;
+  char line[4096];
+  session_t *s, **tail = &server.sessions;
+  int lineno = 0, errors = 0;
+  char *p;
+
+  if ( (fp = fopen(filename, "r")) == NULL ) {
+    status_error(_("=== Cannot open session file %s.\n"), filename);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    for (p = line; isspace((unsigned char) *p); p++);
+    if (*p == '\0' || *p == '#')
+      continue;
+
+    if ( (s = parse_session(p, filename, lineno)) == NULL ) {
+      errors++;
+      continue;
+    }
+
+    *tail = s;
+    tail = &s->next;
+  }
+
+  fclose(fp);
+
+  return errors;
+}
+
+
+/* ------------------------------ main loop ------------------------------ */
+
+static void start_session (session_t *s)
+{
+  ogg123_options_t *opts = server.opts;
+  long size;
+
+  size = opts->buffer_size > 4 * AUDIO_CHUNK_SIZE ?
+    opts->buffer_size : 4 * AUDIO_CHUNK_SIZE;
+  size = (size + PRIMAGIC - 1) / PRIMAGIC * PRIMAGIC;
+
+  s->play_arg.devices = s->devices;
+  s->buffer = buffer_create(size, size * opts->prebuffer / 100,
+			    audio_play_callback, &s->play_arg,
+			    AUDIO_CHUNK_SIZE);
+  if (s->buffer == NULL) {
+    status_error(_("Error: Could not create audio buffer.\n"));
+    exit(1);
+  }
+
+  buffer_set_space_callback(s->buffer, size / 2, session_wake, s);
+  buffer_thread_start(s->buffer);
+
+  pthread_mutex_lock(&server.mutex);
+  server.unfinished++;
+  queue_session(s);
+  pthread_mutex_unlock(&server.mutex);
+}
+
+
+static void stop_session (session_t *s)
+{
+  if (!sig_request.cancel && !sig_request.exit) {
+    buffer_mark_eos(s->buffer);
+    buffer_wait_for_empty(s->buffer);
+  }
+
+  buffer_thread_kill(s->buffer);
+  close_audio_devices(s->devices);
+  free_audio_devices(s->devices);
+  buffer_destroy(s->buffer);
+
+  session_close(s);
+  playlist_destroy(s->playlist);
+  free(s->name);
+  free(s);
+}
+
+
+int server_run (ogg123_options_t *opts)
+{
+  struct timeval now;
+  struct timespec until;
+  session_t *s, *next;
+  long cpus;
+  int errors, count = 0, i;
+
+  server.opts = opts;
+
+  errors = load_sessions(opts->server);
+  if (errors < 0)
+    return 1;
+
+  for (s = server.sessions; s != NULL; s = s->next)
+    count++;
+  if (count == 0) {
+    status_error(_("=== No sessions to play in %s.\n"), opts->server);
+    return 1;
+  }
+
+  /* One decoding thread per CPU is enough to keep them all busy */
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  server.nworkers = cpus > 0 ? cpus : 1;
+  if (server.nworkers > count)
+    server.nworkers = count;
+
+  server.workers = calloc(server.nworkers, sizeof(pthread_t));
+  if (server.workers == NULL) {
+    status_error(_("ERROR: Out of memory.\n"));
+    exit(1);
+  }
+  for (i = 0; i < server.nworkers; i++)
+    if (pthread_create(&server.workers[i], NULL, server_worker, NULL) != 0) {
+      status_error(_("Error: Could not create a decoding thread.\n"));
+      exit(1);
+    }
+
+  status_message(2, _("Playing %d sessions on %d decoding threads."),
+		 count, server.nworkers);
+
+  for (s = server.sessions; s != NULL; s = s->next)
+    start_session(s);
+
+  /* Signals can't wake a condition variable, so look for them now and
+     then */
+  pthread_mutex_lock(&server.mutex);
+  while (server.unfinished > 0 && !sig_request.exit && !sig_request.cancel) {
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + SIGNAL_POLL / 1000;
+    until.tv_nsec = (now.tv_usec + (SIGNAL_POLL % 1000) * 1000L) * 1000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&server.done_cond, &server.mutex, &until);
+  }
+
+  server.shutdown = 1;
+  pthread_cond_broadcast(&server.work_cond);
+  pthread_mutex_unlock(&server.mutex);
+
+  for (i = 0; i < server.nworkers; i++)
+    pthread_join(server.workers[i], NULL);
+  free(server.workers);
+
+  for (s = server.sessions; s != NULL; s = next) {
+    next = s->next;
+    stop_session(s);
+  }
+  server.sessions = NULL;
+
+  return errors > 0;
+}
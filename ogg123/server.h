@@ -0,0 +1,43 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+/* Server mode: one process playing many independent sessions, each with
+   its own playlist, audio buffer and output device.  Decoding is done by
+   a pool of threads, one per CPU, which take turns on whichever sessions
+   have room in their buffers.  Each session keeps the buffer's playback
+   thread, since writing to a device blocks, but that thread spends its
+   time asleep in the driver.
+
+   The sessions are listed in a file, one per line:
+
+     name  driver[,key=value...]  what to play
+
+   where what to play is the rest of the line: a file, directory or URL,
+   or @file for a playlist file.  The file=path option sends a file
+   driver's output to path.  Blank lines and lines starting with # are
+   skipped. */
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include "ogg123.h"
+
+/* Play every session to the end, or until interrupted.  Returns 1 if
+   the session file couldn't be read or had errors in it, 0 otherwise. */
+int server_run (ogg123_options_t *opts);
+
+#endif /* __SERVER_H__ */
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 #include <ogg/ogg.h>
 #include <speex/speex.h>
 #include <speex/speex_header.h>
@@ -31,6 +32,8 @@
 #include "transport.h"
 #include "format.h"
 #include "vorbis_comments.h"
+#include "vgfilter.h"
+#include "seekindex.h"
 #include "utf8.h"
 #include "i18n.h"
 
@@ -40,6 +43,26 @@
 /* Use speex's audio enhancement feature */
 #define ENHANCE_AUDIO 1
 
+/* How much to ask the transport for at a time */
+#define SPEEX_READ_SIZE 4096
+
+/* A seek stops bisecting once the target is within this many bytes, and
+   decodes the rest of the way */
+#define SEEK_SPAN 4096
+
+/* The length is looked for in this much of the end of the stream, then
+   twice as much, and so on */
+#define LENGTH_SPAN 65536
+
+/* Samples are converted in blocks of this many, which gcc vectorizes */
+#define SPX_BLOCK 16
+
+#ifdef WORDS_BIGENDIAN
+#define HOST_BIG_ENDIAN 1
+#else
+#define HOST_BIG_ENDIAN 0
+#endif
+
 
 typedef struct speex_private_t {
   ogg_sync_state oy;
@@ -74,6 +97,14 @@ typedef struct speex_private_t {
 
   long totalsamples;
   long currentsample;
+  long skip;  /* Samples still to drop on the way to a seek target */
+
+  long offset;      /* Transport position of the next page to be read */
+  long data_start;  /* Where the first audio page starts */
+  long length;      /* Size of the source, or -1 if it can't seek */
+  seek_index_t *index;
+
+  vgain_state vg;
 
   decoder_stats_t stats;
 } speex_private_t;
@@ -87,12 +118,23 @@ format_t speex_format;
 void print_speex_info(SpeexHeader *header, decoder_callbacks_t *cb, 
 		      void *callback_arg);
 void print_speex_comments(char *comments, int length, 
-			  decoder_callbacks_t *cb, void *callback_arg);
+			  decoder_callbacks_t *cb, void *callback_arg,
+			  vorbis_comment *vc);
 void *process_header(ogg_packet *op, int *frame_size,
 		     SpeexHeader **header,
 		     SpeexStereoState *stereo, decoder_callbacks_t *cb,
 		     void *callback_arg);
 int read_speex_header(decoder_t *decoder);
+static int start_stream(decoder_t *decoder);
+static int next_page(decoder_t *decoder);
+static int next_packet(decoder_t *decoder);
+static int reposition(decoder_t *decoder, long pos);
+static ogg_int64_t probe_granule(decoder_t *decoder, long pos, long limit);
+static void find_length(decoder_t *decoder);
+static void decode_packet(speex_private_t *priv, int channels);
+static void decode_packet_int(speex_private_t *priv, spx_int16_t *out,
+			      int channels);
+static void float_to_int16(ogg_int16_t *out, const float *pcm, int n);
 
 /* ----------------------------------------------------------- */
 
@@ -132,13 +174,22 @@ decoder_t* speex_init (data_source_t *source, ogg123_options_t *ogg123_opts,
     decoder->callbacks = callbacks;
     decoder->callback_arg = callback_arg;
     decoder->private = private;
+    decoder->options = ogg123_opts;
 
 
     private->bos = 1;
     private->eof = 0;
     private->samples_decoded = private->samples_decoded_previous = 0;
     private->bytes_read = private->bytes_read_previous = 0;
+    private->totalsamples = 0;
     private->currentsample = 0;
+    private->skip = 0;
+    private->offset = 0;
+    private->data_start = 0;
+    private->length = -1;
+    private->index = NULL;
+    private->vg.scale_factor = 1.0;
+    private->vg.max_scale = 1.0;
     private->comment_packet = NULL;
     private->comment_packet_len = 0;
     private->header = NULL;
@@ -173,107 +224,84 @@ int speex_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
 	      audio_format_t *audio_fmt)
 {
   speex_private_t *priv = decoder->private;
-  decoder_callbacks_t *cb = decoder->callbacks;
-  transport_t *trans = decoder->source->transport;
   int bytes_requested = nbytes;
-  int ret;
-  short *out = (short *) ptr;
+  unsigned char *out = ptr;
+  int native16;
 
   /* Read comments and audio info at the start of a logical bitstream */
-  if (priv->bos) {
-
-    ret = read_speex_header(decoder);
-
-    if (!ret) {
-      *eos = 1;
-      return 0; /* Bail out! */
-    }
-
-    print_speex_info(priv->header, cb, decoder->callback_arg);
-    if (priv->comment_packet != NULL)
-      print_speex_comments(priv->comment_packet, priv->comment_packet_len,
-			   cb, decoder->callback_arg);
-
-    priv->bos = 0;
+  if (priv->bos && !start_stream(decoder)) {
+    *eos = 1;
+    return 0; /* Bail out! */
   }
 
   *audio_fmt = decoder->actual_fmt;
 
+  /* Speex decodes at 16 bit scale, so 16 bit output without gain needs
+     nothing more than rounding */
+  native16 = audio_fmt->word_size == 2 &&
+    audio_fmt->big_endian == HOST_BIG_ENDIAN &&
+    priv->vg.scale_factor == 1.0;
+
   while (nbytes) {
-    char *data;
-    int i, j, nb_read;
+    int frames = nbytes / (audio_fmt->word_size * audio_fmt->channels);
+    int packet_frames = priv->frame_size * priv->frames_per_packet;
+
+    if (frames == 0)
+      break;
 
     /* First see if there is anything left in the output buffer and 
        empty it out */
     if (priv->output_left > 0) {
-      int to_copy = nbytes / (2 * audio_fmt->channels);
-
-      to_copy *= audio_fmt->channels;
+      int to_copy = frames * audio_fmt->channels;
+      float *pcm = priv->output + priv->output_start;
+      int i;
 
       to_copy = priv->output_left < to_copy ? priv->output_left : to_copy;
 
-      /* Integerify it! */
-      for (i = 0; i < to_copy; i++)
-	out[i]=(ogg_int16_t)priv->output[i+priv->output_start];
+      if (priv->skip > 0) {
+	/* Still short of a seek target */
+	if (to_copy > priv->skip * audio_fmt->channels)
+	  to_copy = priv->skip * audio_fmt->channels;
+	priv->skip -= to_copy / audio_fmt->channels;
+      } else if (native16) {
+	float_to_int16((ogg_int16_t *) out, pcm, to_copy);
+	out += to_copy * 2;
+	nbytes -= to_copy * 2;
+      } else {
+	/* ReplayGain works at 1.0 */
+	float gain = 1.0f / 32768.0f;
+
+	if (priv->vg.scale_factor != 1.0) {
+	  for (i = 0; i < to_copy; i++)
+	    pcm[i] *= 1.0f / 32768.0f;
+	  vg_filter(&pcm, 1, to_copy, &priv->vg);
+	  gain = 1.0f;
+	}
+	pcm_pack_interleaved(out, audio_fmt, pcm,
+			     to_copy / audio_fmt->channels, gain);
+	out += to_copy * audio_fmt->word_size;
+	nbytes -= to_copy * audio_fmt->word_size;
+      }
 
-      out += to_copy;
       priv->output_start += to_copy;
       priv->output_left -= to_copy;
 
       priv->currentsample += to_copy / audio_fmt->channels;
+    } else if (!next_packet(decoder)) {
+      *eos = 1;
+      break;
+    } else if (native16 && priv->skip == 0 && frames >= packet_frames) {
+      /* Room for the whole packet, so decode it in place */
+      decode_packet_int(priv, (spx_int16_t *) out, audio_fmt->channels);
 
-      nbytes -= to_copy * 2;
-    } else if (ogg_stream_packetout(&priv->os, &priv->op) == 1) {
-      float *temp_output = priv->output;
-      /* Decode some more samples */
-
-      /*Copy Ogg packet to Speex bitstream*/
-      speex_bits_read_from(&priv->bits, (char*)priv->op.packet, 
-			   priv->op.bytes);
-
-      for (j = 0;j < priv->frames_per_packet; j++) {
-	/*Decode frame*/
-	speex_decode(priv->st, &priv->bits, temp_output);
-
-	if (audio_fmt->channels==2)
-	  speex_decode_stereo(temp_output, priv->frame_size, priv->stereo);
-	
-	priv->samples_decoded += priv->frame_size;
-
-	/*PCM saturation (just in case)*/
-	for (i=0;i < priv->frame_size * audio_fmt->channels; i++) {
-	  if (temp_output[i]>32000.0)
-	    temp_output[i]=32000.0;
-	  else if (temp_output[i]<-32000.0)
-	    temp_output[i]=-32000.0;
-	}
-
-	temp_output += priv->frame_size * audio_fmt->channels;
-      }
+      out += packet_frames * audio_fmt->channels * 2;
+      nbytes -= packet_frames * audio_fmt->channels * 2;
+      priv->currentsample += packet_frames;
+    } else {
+      decode_packet(priv, audio_fmt->channels);
 
       priv->output_start = 0;
-      priv->output_left = priv->frame_size * audio_fmt->channels *
-	priv->frames_per_packet;
-    } else if (ogg_sync_pageout(&priv->oy, &priv->og) == 1) {
-      /* Read in another ogg page */
-      ogg_stream_pagein(&priv->os, &priv->og);
-    } else if (!priv->eof) {
-      /* Finally, pull in some more data and try again on the next pass */
-
-      /*Get the ogg buffer for writing*/
-      data = ogg_sync_buffer(&priv->oy, 200);
-      /*Read bitstream from input file*/
-      nb_read = trans->read(decoder->source, data, sizeof(char), 200);
-
-      if (nb_read == 0)
-	priv->eof = 1;  /* We've read the end of the file */
-
-      ogg_sync_wrote(&priv->oy, nb_read);
-
-      priv->bytes_read += nb_read;
-    } else {
-      *eos = 1;
-      break;
+      priv->output_left = packet_frames * audio_fmt->channels;
     }
   }
 
@@ -284,16 +312,72 @@ int speex_read (decoder_t *decoder, void *ptr, int nbytes, int *eos,
 int speex_seek (decoder_t *decoder, double offset, int whence)
 {
   speex_private_t *priv = decoder->private;
+  ogg_int64_t target, granule;
+  long lo, hi, mid;
 
-  (void)priv;
+  if (priv->bos && !start_stream(decoder))
+    return 0;
+  if (priv->length < 0)
+    return 0;
 
-  return 0;
+  if (whence == DECODER_SEEK_CUR)
+    offset += (double) priv->currentsample / decoder->actual_fmt.rate;
+
+  target = offset * decoder->actual_fmt.rate;
+  if (target < 0)
+    target = 0;
+
+  /* Narrow down on the last stretch of pages that starts no later than
+     the target */
+  lo = priv->data_start;
+  hi = priv->length;
+  if (seek_index_lookup(priv->index, target, &lo))
+    hi = lo;
+  while (hi - lo > SEEK_SPAN) {
+    mid = lo + (hi - lo) / 2;
+    granule = probe_granule(decoder, mid, hi);
+
+    if (granule >= 0 && granule <= target)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  if (!reposition(decoder, lo))
+    return 0;
+  ogg_stream_reset(&priv->os);
+#ifdef SPEEX_RESET_STATE
+  speex_decoder_ctl(priv->st, SPEEX_RESET_STATE, NULL);
+#endif
+  priv->output_left = 0;
+
+  if (lo == priv->data_start)
+    priv->currentsample = 0;
+  else {
+    /* Packets only have a position once the page they end on is known,
+       so drop pages up to the first one that gives one */
+    do {
+      if (!next_page(decoder))
+	return 0;
+      ogg_stream_pagein(&priv->os, &priv->og);
+      while (ogg_stream_packetout(&priv->os, &priv->op) != 0)
+	;
+    } while (ogg_page_granulepos(&priv->og) < 0 ||
+	     ogg_page_serialno(&priv->og) != priv->os.serialno);
+
+    priv->currentsample = ogg_page_granulepos(&priv->og);
+  }
+
+  priv->skip = target > priv->currentsample ?
+    target - priv->currentsample : 0;
+
+  return 1;
 }
 
 
 #define AVG_FACTOR 0.7
 
-decoder_stats_t *speex_statistics (decoder_t *decoder)
+void speex_statistics (decoder_t *decoder, decoder_stats_t *stats)
 {
   speex_private_t *priv = decoder->private;
   long instant_bitrate;
@@ -323,7 +407,7 @@ decoder_stats_t *speex_statistics (decoder_t *decoder)
   priv->stats.avg_bitrate = 0;
 
 
-  return malloc_decoder_stats(&priv->stats);
+  *stats = priv->stats;
 }
 
 
@@ -331,6 +415,7 @@ void speex_cleanup (decoder_t *decoder)
 {
   speex_private_t *priv = decoder->private;
 
+  seek_index_close(priv->index);
   speex_stereo_state_destroy(priv->stereo);
   free(priv->comment_packet);
   free(priv->output);
@@ -385,8 +470,10 @@ void print_speex_info(SpeexHeader *header, decoder_callbacks_t *cb,
 }
 
 
+/* Also collects the comments in vc, for ReplayGain */
 void print_speex_comments(char *comments, int length, 
-			  decoder_callbacks_t *cb, void *callback_arg)
+			  decoder_callbacks_t *cb, void *callback_arg,
+			  vorbis_comment *vc)
 {
   char *c = comments;
   int len, i, nb_fields;
@@ -461,6 +548,7 @@ void print_speex_comments(char *comments, int length,
     temp[len] = '\0';
 
     print_vorbis_comment(temp, cb, callback_arg);
+    vorbis_comment_add(vc, temp);
 
     c += len;
   }
@@ -521,86 +609,300 @@ void *process_header(ogg_packet *op, int *frame_size,
 
 
 int read_speex_header (decoder_t *decoder)
+{
+  speex_private_t *priv = decoder->private;
+
+  /* The first page decides which stream we are playing */
+  if (!next_page(decoder))
+    return 0;
+  ogg_stream_init(&priv->os, ogg_page_serialno(&priv->og));
+  ogg_stream_pagein(&priv->os, &priv->og);
+
+  /* First packet is the Speex header */
+  if (!next_packet(decoder))
+    return 0;
+
+  priv->st = process_header(&priv->op, 
+			    &priv->frame_size,
+			    &priv->header,
+			    priv->stereo,
+			    decoder->callbacks,
+			    decoder->callback_arg);
+
+  if (!priv->st)
+    return 0;
+
+  decoder->actual_fmt.rate = priv->header->rate;
+  priv->frames_per_packet = priv->header->frames_per_packet; 
+  decoder->actual_fmt.channels = priv->header->nb_channels;
+  priv->vbr = priv->header->vbr;
+
+  if (!priv->frames_per_packet)
+    priv->frames_per_packet=1;
+
+  switch(decoder->actual_fmt.channels) {
+  case 1:
+    decoder->actual_fmt.matrix="M";
+    break;
+  case 2:
+    decoder->actual_fmt.matrix="L,R";
+    break;
+  default:
+    decoder->actual_fmt.matrix=NULL;
+    break;
+  }
+
+  priv->output = calloc(priv->frame_size * 
+			decoder->actual_fmt.channels * 
+			priv->frames_per_packet, sizeof(float));
+  priv->output_start = 0;
+  priv->output_left = 0;
+
+  /* Then the comments */
+  if (next_packet(decoder)) {
+    priv->comment_packet_len = priv->op.bytes;
+    priv->comment_packet = malloc(sizeof(char) * 
+				  priv->comment_packet_len);
+    memcpy(priv->comment_packet, priv->op.packet,
+	   priv->comment_packet_len);
+  }
+
+  priv->data_start = priv->offset;
+
+  return 1;
+}
+
+
+/* Read the headers and show them, at the start of a logical bitstream */
+static int start_stream (decoder_t *decoder)
+{
+  speex_private_t *priv = decoder->private;
+  decoder_callbacks_t *cb = decoder->callbacks;
+  vorbis_comment vc;
+
+  if (!read_speex_header(decoder))
+    return 0;
+
+  print_speex_info(priv->header, cb, decoder->callback_arg);
+  vorbis_comment_init(&vc);
+  if (priv->comment_packet != NULL)
+    print_speex_comments(priv->comment_packet, priv->comment_packet_len,
+			 cb, decoder->callback_arg, &vc);
+  vg_init(&priv->vg, &vc, decoder->options->gain_mode);
+  vorbis_comment_clear(&vc);
+
+  find_length(decoder);
+  if (priv->length >= 0)
+    priv->index = seek_index_open(decoder->source->source_string,
+				  priv->os.serialno, decoder->options);
+
+  priv->bos = 0;
+
+  return 1;
+}
+
+
+/* Pull the next page out of the transport into priv->og, keeping count
+   of where pages start.  Returns 0 at the end of the data. */
+static int next_page (decoder_t *decoder)
 {
   speex_private_t *priv = decoder->private;
   transport_t *trans = decoder->source->transport;
-  int packet_count = 0;
-  int stream_init = 0;
   char *data;
+  long ret;
   int nb_read;
 
-  while (packet_count < 2) {
-    /*Get the ogg buffer for writing*/
-    data = ogg_sync_buffer(&priv->oy, 200);
+  while ((ret = ogg_sync_pageseek(&priv->oy, &priv->og)) <= 0) {
+    if (ret < 0) {
+      /* Skipped over something that isn't a page */
+      priv->offset -= ret;
+      continue;
+    }
+
+    if (priv->eof)
+      return 0;
+
+    data = ogg_sync_buffer(&priv->oy, SPEEX_READ_SIZE);
+    nb_read = trans->read(decoder->source, data, sizeof(char),
+			  SPEEX_READ_SIZE);
+
+    if (nb_read <= 0) {
+      priv->eof = 1;  /* We've read the end of the file */
+      nb_read = 0;
+    }
 
-    /*Read bitstream from input file*/
-    nb_read = trans->read(decoder->source, data, sizeof(char), 200);
     ogg_sync_wrote(&priv->oy, nb_read);
+    priv->bytes_read += nb_read;
+  }
 
-    /*Loop for all complete pages we got (most likely only one)*/
-    while (ogg_sync_pageout(&priv->oy, &priv->og)==1) {
+  priv->offset += ret;
+
+  return 1;
+}
 
-      if (stream_init == 0) {
-	ogg_stream_init(&priv->os, ogg_page_serialno(&priv->og));
-	stream_init = 1;
-      }
 
-      /*Add page to the bitstream*/
+/* The next packet of our stream into priv->op, reading pages as needed.
+   Returns 0 at the end of the data. */
+static int next_packet (decoder_t *decoder)
+{
+  speex_private_t *priv = decoder->private;
+  int ret;
+
+  /* A hole (-1) just loses the packets in it */
+  while ((ret = ogg_stream_packetout(&priv->os, &priv->op)) != 1)
+    if (ret == 0) {
+      if (!next_page(decoder))
+	return 0;
       ogg_stream_pagein(&priv->os, &priv->og);
+    }
 
-      /*Extract all available packets FIXME: EOS!*/
-      while (ogg_stream_packetout(&priv->os, &priv->op)==1) {
-	/*If first packet, process as Speex header*/
-	if (packet_count==0) {
-	  priv->st = process_header(&priv->op, 
-				    &priv->frame_size,
-				    &priv->header,
-				    priv->stereo,
-				    decoder->callbacks,
-				    decoder->callback_arg);
-
-	  if (!priv->st)
-	    return 0;
-
-	  decoder->actual_fmt.rate = priv->header->rate;
-	  priv->frames_per_packet = priv->header->frames_per_packet; 
-	  decoder->actual_fmt.channels = priv->header->nb_channels;
-	  priv->vbr = priv->header->vbr;
-
-	  if (!priv->frames_per_packet)
-	    priv->frames_per_packet=1;
-
-      switch(decoder->actual_fmt.channels) {
-      case 1:
-        decoder->actual_fmt.matrix="M";
-        break;
-      case 2:
-        decoder->actual_fmt.matrix="L,R";
-        break;
-      default:
-        decoder->actual_fmt.matrix=NULL;
-        break;
-      }
+  return 1;
+}
 
 
-	  priv->output = calloc(priv->frame_size * 
-				decoder->actual_fmt.channels * 
-				priv->frames_per_packet, sizeof(float));
-	  priv->output_start = 0;
-	  priv->output_left = 0;
+/* Continue reading pages from pos */
+static int reposition (decoder_t *decoder, long pos)
+{
+  speex_private_t *priv = decoder->private;
+  transport_t *trans = decoder->source->transport;
 
-	} else if (packet_count==1){
-	  priv->comment_packet_len = priv->op.bytes;
-	  priv->comment_packet = malloc(sizeof(char) * 
-					priv->comment_packet_len);
-	  memcpy(priv->comment_packet, priv->op.packet,
-		 priv->comment_packet_len);
-	}
-	
-	packet_count++;
-      }
-    }
-  }
+  if (trans->seek(decoder->source, pos, SEEK_SET) != 0)
+    return 0;
+
+  ogg_sync_reset(&priv->oy);
+  priv->offset = pos;
+  priv->eof = 0;
+
+  /* What gets read after a jump says nothing about the bitrate */
+  priv->bytes_read_previous = priv->bytes_read;
+  priv->samples_decoded_previous = priv->samples_decoded;
 
   return 1;
 }
+
+
+/* Granule position of the first page of our stream that ends one
+   starting between pos and limit, or -1 if there isn't one */
+static ogg_int64_t probe_granule (decoder_t *decoder, long pos, long limit)
+{
+  speex_private_t *priv = decoder->private;
+
+  if (!reposition(decoder, pos))
+    return -1;
+
+  while (next_page(decoder) &&
+	 priv->offset - priv->og.header_len - priv->og.body_len < limit)
+    if (ogg_page_serialno(&priv->og) == priv->os.serialno &&
+	ogg_page_granulepos(&priv->og) >= 0)
+      return ogg_page_granulepos(&priv->og);
+
+  return -1;
+}
+
+
+/* Total samples from the granule position of the last page, if the
+   transport can seek.  Leaves priv->length at -1 if it can't. */
+static void find_length (decoder_t *decoder)
+{
+  speex_private_t *priv = decoder->private;
+  transport_t *trans = decoder->source->transport;
+  long resume = priv->offset;
+  long length, start, span;
+  ogg_int64_t last = -1;
+
+  if (trans->seek(decoder->source, 0, SEEK_END) != 0)
+    return;
+  length = trans->tell(decoder->source);
+
+  start = length;
+  for (span = LENGTH_SPAN; last < 0 && start > priv->data_start; span *= 2) {
+    start = length - span > priv->data_start ? length - span
+      : priv->data_start;
+
+    if (!reposition(decoder, start))
+      break;
+    while (next_page(decoder))
+      if (ogg_page_serialno(&priv->og) == priv->os.serialno &&
+	  ogg_page_granulepos(&priv->og) >= 0)
+	last = ogg_page_granulepos(&priv->og);
+  }
+
+  if (!reposition(decoder, resume)) {
+    priv->eof = 1;
+    return;
+  }
+
+  if (length >= 0 && last >= 0) {
+    priv->length = length;
+    priv->totalsamples = last;
+  }
+}
+
+
+/* Decode priv->op into priv->output */
+static void decode_packet (speex_private_t *priv, int channels)
+{
+  float *output = priv->output;
+  int j;
+
+  /*Copy Ogg packet to Speex bitstream*/
+  speex_bits_read_from(&priv->bits, (char*)priv->op.packet, 
+		       priv->op.bytes);
+
+  for (j = 0; j < priv->frames_per_packet; j++) {
+    speex_decode(priv->st, &priv->bits, output);
+
+    if (channels == 2)
+      speex_decode_stereo(output, priv->frame_size, priv->stereo);
+
+    output += priv->frame_size * channels;
+  }
+
+  priv->samples_decoded += priv->frame_size * priv->frames_per_packet;
+}
+
+
+/* The same, straight to 16 bit samples; speex saturates them itself */
+static void decode_packet_int (speex_private_t *priv, spx_int16_t *out,
+			       int channels)
+{
+  int j;
+
+  speex_bits_read_from(&priv->bits, (char*)priv->op.packet, 
+		       priv->op.bytes);
+
+  for (j = 0; j < priv->frames_per_packet; j++) {
+    speex_decode_int(priv->st, &priv->bits, out);
+
+    if (channels == 2)
+      speex_decode_stereo_int(out, priv->frame_size, priv->stereo);
+
+    out += priv->frame_size * channels;
+  }
+
+  priv->samples_decoded += priv->frame_size * priv->frames_per_packet;
+}
+
+
+static inline ogg_int16_t to_int16 (float x)
+{
+  x = fminf(fmaxf(x, -32768.0f), 32767.0f);
+
+  return (ogg_int16_t) (x + copysignf(0.5f, x));
+}
+
+/* Saturate and round decoded samples to 16 bits */
+static void float_to_int16 (ogg_int16_t *out, const float *pcm, int n)
+{
+  int i, k;
+
+  for (i = 0; i + SPX_BLOCK <= n; i += SPX_BLOCK) {
+    for (k = 0; k < SPX_BLOCK; k++)
+      out[k] = to_int16(pcm[k]);
+    out += SPX_BLOCK;
+    pcm += SPX_BLOCK;
+  }
+
+  for (; i < n; i++)
+    *out++ = to_int16(*pcm++);
+}
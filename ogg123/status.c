@@ -21,7 +21,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
 
 #ifdef HAVE_UNISTD_H
 #include <sys/ioctl.h>
@@ -42,6 +45,39 @@ int exit_status = EXIT_SUCCESS;
 
 pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* The latest statistics, published without locking by the decoding
+   thread.  The copy has a sequence number that is odd while it is being
+   written, so the status thread can tell when it changed while it was
+   reading it. */
+typedef struct status_snapshot_t {
+  unsigned long stamp;        /* Order of publishing, 0 if never */
+  decoder_stats_t decoder;
+  data_source_stats_t source;
+  ogg_int64_t written;        /* Bytes written to the audio buffer, or -1 */
+  long byte_rate;
+} status_snapshot_t;
+
+static unsigned long publish_stamp = 0;
+static volatile unsigned int playing_seq = 0;
+static status_snapshot_t playing_snapshot;
+
+/* The source being played.  The status thread asks it for its input
+   statistics itself, since a stream's input buffer fills before the
+   decoder has anything to publish.  Held while asking, so the source
+   can't be closed under it. */
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+static data_source_t *input_source = NULL;
+
+/* The thread that draws the status line */
+static pthread_t status_thread;
+static int status_thread_running = 0;
+static int status_thread_quit = 0;
+static pthread_mutex_t status_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t status_thread_cond = PTHREAD_COND_INITIALIZER;
+static stat_format_t *thread_stats;
+static buf_t *thread_buffer;
+static double thread_freq;
+
 
 /* ------------------- Private functions ------------------ */
 
@@ -70,6 +106,10 @@ void write_buffer_state_string (char *dest, buffer_stats_t *buf_stats)
     cur += sprintf (cur, _("%sEOS"), sep);
     sep = comma;
   }
+  if (buf_stats->underruns) {
+    cur += sprintf (cur, _("%s%ld underruns"), sep, buf_stats->underruns);
+    sep = comma;
+  }
   if (cur != dest)
     cur += sprintf (cur, ")");
   else
@@ -211,10 +251,125 @@ void vstatus_print_nolock (const char *fmt, va_list ap)
 }
 
 
+/* Only one thread writes the snapshot */
+void snapshot_write (volatile unsigned int *seq, status_snapshot_t *slot,
+		     status_snapshot_t *snapshot)
+{
+  snapshot->stamp = __sync_add_and_fetch(&publish_stamp, 1);
+
+  (*seq)++;
+  __sync_synchronize();
+  *slot = *snapshot;
+  __sync_synchronize();
+  (*seq)++;
+}
+
+
+void snapshot_read (volatile unsigned int *seq, status_snapshot_t *slot,
+		    status_snapshot_t *snapshot)
+{
+  unsigned int before;
+
+  while (1) {
+    before = *seq;
+    __sync_synchronize();
+    *snapshot = *slot;
+    __sync_synchronize();
+
+    if (!(before & 1) && before == *seq)
+      break;
+
+    sched_yield();  /* Let the writer finish */
+  }
+}
+
+
+void render_statistics (void)
+{
+  status_snapshot_t playing;
+  data_source_stats_t input, *source = &playing.source;
+  int have_input = 0;
+  decoder_stats_t decoder;
+  buffer_stats_t buffer_stats, *buffer = NULL;
+  ogg_int64_t delay;
+
+  snapshot_read(&playing_seq, &playing_snapshot, &playing);
+
+  pthread_mutex_lock(&input_lock);
+  if (input_source != NULL) {
+    input_source->transport->statistics(input_source, &input);
+    source = &input;
+    have_input = 1;
+  }
+  pthread_mutex_unlock(&input_lock);
+
+  if (playing.stamp == 0 && !have_input)
+    return;  /* Nothing to show yet */
+
+  if (thread_buffer != NULL) {
+    buffer_statistics(thread_buffer, &buffer_stats);
+    buffer = &buffer_stats;
+  }
+
+  /* Show the time of what is being heard, which is behind what was
+     decoded by however much is still in the buffer */
+  decoder = playing.decoder;
+  if (buffer != NULL && playing.written > buffer->position &&
+      playing.byte_rate > 0) {
+    delay = playing.written - buffer->position;
+    decoder.current_time -= (double) delay / playing.byte_rate;
+    if (decoder.current_time < 0.0)
+      decoder.current_time = 0.0;
+  }
+
+  /* Streams have no length, and only some sources have an input buffer */
+  thread_stats[2].enabled = thread_stats[3].enabled =
+    playing.stamp != 0 && decoder.total_time >= decoder.current_time;
+  thread_stats[6].enabled = thread_stats[7].enabled =
+    source->input_buffer_used;
+  thread_stats[8].enabled = thread_stats[9].enabled = buffer != NULL;
+
+  status_print_statistics(thread_stats, buffer, source,
+			  playing.stamp != 0 ? &decoder : NULL);
+}
+
+
+void *status_thread_func (void *arg)
+{
+  struct timeval now;
+  struct timespec until;
+  double next;
+
+  pthread_mutex_lock(&status_thread_mutex);
+
+  while (!status_thread_quit) {
+    pthread_mutex_unlock(&status_thread_mutex);
+    render_statistics();
+    pthread_mutex_lock(&status_thread_mutex);
+
+    gettimeofday(&now, NULL);
+    next = now.tv_sec + now.tv_usec / 1e6 + 1.0 / thread_freq;
+    until.tv_sec = (time_t) next;
+    until.tv_nsec = (long) ((next - until.tv_sec) * 1e9);
+
+    if (!status_thread_quit)
+      pthread_cond_timedwait(&status_thread_cond, &status_thread_mutex,
+			     &until);
+  }
+
+  pthread_mutex_unlock(&status_thread_mutex);
+
+  /* Leave the line showing how things ended */
+  render_statistics();
+
+  return NULL;
+}
+
+
 /* ------------------- Public interface -------------------- */
 
 #define TIME_STR_SIZE 20
-#define STATE_STR_SIZE 25
+#define STATE_STR_SIZE 80
 #define NUM_STATS 10
 
 stat_format_t *stat_format_create ()
@@ -513,3 +668,79 @@ void vstatus_error (const char *fmt, va_list ap)
 
   exit_status = EXIT_FAILURE;
 }
+
+
+/* Draw the status line on a thread of its own, freq times a second, so
+   nothing that decodes or plays audio waits for the terminal */
+void status_thread_start (stat_format_t *stats, buf_t *audio_buffer,
+			  double freq)
+{
+  pthread_attr_t attr;
+#ifdef SCHED_IDLE
+  struct sched_param param;
+#endif
+
+  if (status_thread_running || max_verbosity == 0 || freq <= 0.0)
+    return;
+
+  thread_stats = stats;
+  thread_buffer = audio_buffer;
+  thread_freq = freq;
+  status_thread_quit = 0;
+
+  pthread_attr_init(&attr);
+#ifdef SCHED_IDLE
+  /* Only run when there's nothing better to do */
+  param.sched_priority = 0;
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_IDLE);
+  pthread_attr_setschedparam(&attr, &param);
+#endif
+
+  if (pthread_create(&status_thread, &attr, status_thread_func, NULL) == 0 ||
+      pthread_create(&status_thread, NULL, status_thread_func, NULL) == 0)
+    status_thread_running = 1;
+
+  pthread_attr_destroy(&attr);
+}
+
+
+void status_thread_stop ()
+{
+  if (!status_thread_running)
+    return;
+
+  pthread_mutex_lock(&status_thread_mutex);
+  status_thread_quit = 1;
+  pthread_cond_signal(&status_thread_cond);
+  pthread_mutex_unlock(&status_thread_mutex);
+
+  pthread_join(status_thread, NULL);
+  status_thread_running = 0;
+}
+
+
+/* Only the decoding thread calls this.  written is how far into the
+   audio buffer's stream the decoder has got, or -1 without a buffer. */
+void status_publish (decoder_stats_t *decoder, data_source_stats_t *source,
+		     ogg_int64_t written, long byte_rate)
+{
+  status_snapshot_t snapshot;
+
+  snapshot.decoder = *decoder;
+  snapshot.source = *source;
+  snapshot.written = written;
+  snapshot.byte_rate = byte_rate;
+
+  snapshot_write(&playing_seq, &playing_snapshot, &snapshot);
+}
+
+
+/* Only the main thread calls this, with NULL before the source is
+   closed */
+void status_set_input (data_source_t *source)
+{
+  pthread_mutex_lock(&input_lock);
+  input_source = source;
+  pthread_mutex_unlock(&input_lock);
+}
@@ -67,6 +67,12 @@ void status_print_statistics (stat_format_t *stats,
 			      buffer_stats_t *audio_statistics,
 			      data_source_stats_t *data_source_statistics,
 			      decoder_stats_t *decoder_statistics);
+void status_thread_start (stat_format_t *stats, buf_t *audio_buffer,
+			  double freq);
+void status_thread_stop ();
+void status_publish (decoder_stats_t *decoder, data_source_stats_t *source,
+		     ogg_int64_t written, long byte_rate);
+void status_set_input (data_source_t *source);
 void status_message (int verbosity, const char *fmt, ...);
 void vstatus_message (int verbosity, const char *fmt, va_list ap);
 void status_error (const char *fmt, ...);
@@ -59,20 +59,3 @@ const transport_t *select_transport (const char *source)
 
   return transports[i];
 }
-
-
-data_source_stats_t *malloc_data_source_stats (data_source_stats_t *to_copy)
-{
-  data_source_stats_t *new_stats;
-
-  new_stats = malloc(sizeof(data_source_stats_t));
-
-  if (new_stats == NULL) {
-    fprintf(stderr, _("ERROR: Could not allocate memory in malloc_data_source_stats()\n"));
-    exit(1);
-  }
-
-  *new_stats = *to_copy;  /* Copy the data */
-
-  return new_stats;
-}
@@ -49,7 +49,7 @@ typedef struct transport_t {
   int (* peek) (data_source_t *source, void *ptr, size_t size, size_t nmemb);
   int (* read) (data_source_t *source, void *ptr, size_t size, size_t nmemb);
   int (* seek) (data_source_t *source, long offset, int whence);
-  data_source_stats_t * (* statistics) (data_source_t *source);
+  void (* statistics) (data_source_t *source, data_source_stats_t *stats);
   long (* tell) (data_source_t *source);
   void (* close) (data_source_t *source);
 } transport_t;
@@ -57,6 +57,4 @@ typedef struct transport_t {
 const transport_t *get_transport_by_name (const char *name);
 const transport_t *select_transport (const char *source);
 
-data_source_stats_t *malloc_data_source_stats (data_source_stats_t *to_copy);
-
 #endif /* __TRANSPORT_H__ */
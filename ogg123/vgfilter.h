@@ -41,7 +41,7 @@
  *
  **********************************************************************
  *
- * vgfilter - a filter for ov_read_filter to enable replay gain.
+ * vgfilter - ReplayGain applied to decoded float samples.
  *
  */
 
@@ -49,6 +49,7 @@
 #ifndef __VGPLAY_H
 #define __VGPLAY_H
 
+#include <vorbis/codec.h>
 #include "ogg123.h"
 
 /* Default pre-amp in dB */
@@ -0,0 +1,172 @@
+/********************************************************************
+ *                                                                  *
+ * THIS FILE IS PART OF THE OggVorbis SOFTWARE CODEC SOURCE CODE.   *
+ * USE, DISTRIBUTION AND REPRODUCTION OF THIS SOURCE IS GOVERNED BY *
+ * THE GNU PUBLIC LICENSE 2, WHICH IS INCLUDED WITH THIS SOURCE.    *
+ * PLEASE READ THESE TERMS BEFORE DISTRIBUTING.                     *
+ *                                                                  *
+ * THE Ogg123 SOURCE CODE IS (C) COPYRIGHT 2000-2001                *
+ * by Stan Seibert <volsung@xiph.org> AND OTHER CONTRIBUTORS        *
+ * http://www.xiph.org/                                             *
+ *                                                                  *
+ ********************************************************************
+
+ last mod: $Id$
+
+ ********************************************************************/
+
+/* Times vg_filter() against the per-sample tanh() limiter it replaced,
+   on 8 channels of 10 seconds at 48 kHz, and measures how far the
+   limiter strays from the tanh() curve over every float input from the
+   knee up.  Built along with ogg123, but not installed. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "vgfilter.h"
+
+#define CHANNELS 8
+#define SAMPLES  (10 * 48000)
+#define PASSES   10
+
+#define SWEEP_TOP 16.0f   /* tanh() is 1 to well within a float ulp */
+#define SWEEP_BLOCK 4096
+
+/* The filter as it was before the limiter was reworked */
+static void old_vg_filter (float **pcm, long channels, long samples,
+			   void *filter_param)
+{
+  int i, j;
+  float cur_sample;
+  vgain_state *param = filter_param;
+  float scale_factor = param->scale_factor;
+  float max_scale = param->max_scale;
+
+  if (scale_factor > max_scale) {
+    for(i = 0; i < channels; i++)
+      for(j = 0; j < samples; j++) {
+	cur_sample = pcm[i][j] * scale_factor;
+	if (cur_sample < -0.5)
+	  cur_sample = tanh((cur_sample + 0.5) / (1-0.5)) * (1-0.5) - 0.5;
+	else if (cur_sample > 0.5)
+	  cur_sample = tanh((cur_sample - 0.5) / (1-0.5)) * (1-0.5) + 0.5;
+	pcm[i][j] = cur_sample;
+      }
+  } else if (scale_factor > 0.0) {
+    for(i = 0; i < channels; i++)
+      for(j = 0; j < samples; j++)
+	pcm[i][j] *= scale_factor;
+  }
+}
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Best of PASSES, in milliseconds, each on a fresh copy of the input */
+static double time_filter (void (*filter) (float **, long, long, void *),
+			   vgain_state *vg, float **input, float **pcm)
+{
+  double best = -1.0, start, elapsed;
+  int pass, i;
+
+  for (pass = 0; pass < PASSES; pass++) {
+    for (i = 0; i < CHANNELS; i++)
+      memcpy(pcm[i], input[i], SAMPLES * sizeof(float));
+
+    start = now();
+    filter(pcm, CHANNELS, SAMPLES, vg);
+    elapsed = (now() - start) * 1000.0;
+
+    if (best < 0.0 || elapsed < best)
+      best = elapsed;
+  }
+
+  return best;
+}
+
+/* Largest difference from the tanh() curve, worked in double, over
+   every float from the knee to SWEEP_TOP */
+static double sweep_error (void)
+{
+  vgain_state vg = { 1.0f, 0.5f };  /* Limit, with no gain to round */
+  float block[SWEEP_BLOCK], *pcm = block;
+  float x = 0.5f, first;
+  double worst = 0.0, want, err;
+  int i, n;
+
+  while (x < SWEEP_TOP) {
+    first = x;
+    for (n = 0; n < SWEEP_BLOCK && x < SWEEP_TOP; n++) {
+      block[n] = x;
+      x = nextafterf(x, SWEEP_TOP);
+    }
+
+    vg_filter(&pcm, 1, n, &vg);
+
+    for (x = first, i = 0; i < n; i++, x = nextafterf(x, SWEEP_TOP)) {
+      want = tanh((x - 0.5) / 0.5) * 0.5 + 0.5;
+      err = fabs(block[i] - want);
+      if (err > worst)
+	worst = err;
+    }
+  }
+
+  return worst;
+}
+
+int main (int argc, char **argv)
+{
+  float *input[CHANNELS], *pcm[CHANNELS];
+  vgain_state limiting = { 2.0f, 1.25f };
+  vgain_state gain = { 0.8f, 1.25f };
+  double before, after;
+  int i;
+  long j;
+
+  for (i = 0; i < CHANNELS; i++) {
+    input[i] = malloc(SAMPLES * sizeof(float));
+    pcm[i] = malloc(SAMPLES * sizeof(float));
+    if (input[i] == NULL || pcm[i] == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+
+    /* Loud enough that most samples are over the knee once gained */
+    for (j = 0; j < SAMPLES; j++)
+      input[i][j] = 0.9f * sinf(j * (0.01f + i * 0.003f));
+  }
+
+  printf("%d channels, %d samples each, best of %d\n",
+	 CHANNELS, SAMPLES, PASSES);
+
+  before = time_filter(old_vg_filter, &limiting, input, pcm);
+  after = time_filter(vg_filter, &limiting, input, pcm);
+  printf("limiter:    %8.2f ms before, %8.2f ms after, %5.1fx\n",
+	 before, after, before / after);
+
+  before = time_filter(old_vg_filter, &gain, input, pcm);
+  after = time_filter(vg_filter, &gain, input, pcm);
+  printf("plain gain: %8.2f ms before, %8.2f ms after, %5.1fx\n",
+	 before, after, before / after);
+
+  printf("limiter error against tanh(): %.3g\n", sweep_error());
+
+  for (i = 0; i < CHANNELS; i++) {
+    free(input[i]);
+    free(pcm[i]);
+  }
+
+  return 0;
+}
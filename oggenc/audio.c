@@ -19,11 +19,17 @@
 #include <string.h>
 #include <sys/types.h>
 #include <math.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "audio.h"
 #include "platform.h"
 #include "i18n.h"
 #include "resample.h"
+#include "scratch.h"
 
 #ifdef HAVE_LIBFLAC
 #include "flac.h"
@@ -232,6 +238,13 @@ int aiff_id(unsigned char *buf, int len)
     return 1;
 }
 
+/* Size the read buffer for the largest read the encoder may ask for, so
+   an adaptive read size growing mid-stream doesn't grow it again */
+static void size_read_buffer(oe_enc_opt *opt, wavfile *wav, int bytes)
+{
+    scratch_get(SCRATCH_READ, (size_t)opt->read_size_max * bytes * wav->channels);
+}
+
 static int aiff_permute_matrix[6][6] = 
 {
   {0},              /* 1.0 mono   */
@@ -353,6 +366,7 @@ static int aiff_open_impl(FILE *in, oe_enc_opt *opt, unsigned char *buf, int buf
         aiff->channels = format.channels;
         aiff->samplesize = format.samplesize;
         aiff->totalsamples = format.totalframes;
+        aiff->live = opt->live;
 
         if(aiff->channels>3)
           fprintf(stderr,"WARNING: AIFF[-C] files with greater than three channels use\n"
@@ -361,7 +375,8 @@ static int aiff_open_impl(FILE *in, oe_enc_opt *opt, unsigned char *buf, int buf
 
         opt->readdata = (void *)aiff;
 
-        aiff->channel_permute = malloc(aiff->channels * sizeof(int));
+        aiff->channel_permute = scratch_get(SCRATCH_PERMUTE,
+                aiff->channels * sizeof(int));
         if (aiff->channels <= 6)
             /* Where we know the mappings, use them. */
             memcpy(aiff->channel_permute, aiff_permute_matrix[aiff->channels-1], 
@@ -371,6 +386,8 @@ static int aiff_open_impl(FILE *in, oe_enc_opt *opt, unsigned char *buf, int buf
             for (i=0; i < aiff->channels; i++)
                 aiff->channel_permute[i] = i;
 
+        size_read_buffer(opt, aiff, format.samplesize/8);
+
         seek_forward(in, format.offset); /* Swallow some data */
         return 1;
     }
@@ -385,13 +402,9 @@ static int aiff_open_impl(FILE *in, oe_enc_opt *opt, unsigned char *buf, int buf
 
 int aiff_open(FILE *in, oe_enc_opt *opt, unsigned char *buf, int buflen)
 {
-    aifffile *aiff = malloc(sizeof(aifffile));
-    int ret = aiff_open_impl(in, opt, buf, buflen, aiff);
+    aifffile *aiff = scratch_get(SCRATCH_INPUT, sizeof(aifffile));
 
-    if(ret == 0) {
-        free(aiff);
-    }
-    return ret;
+    return aiff_open_impl(in, opt, buf, buflen, aiff);
 }
 
 
@@ -571,6 +584,7 @@ static int wav_open_impl(FILE *in, oe_enc_opt *opt, unsigned char *oldbuf, int b
         wav->channels = format.channels; /* This is in several places. The price
                                             of trying to abstract stuff. */
         wav->samplesize = format.samplesize;
+        wav->live = opt->live;
 
         if(opt->ignorelength)
         {
@@ -604,7 +618,8 @@ static int wav_open_impl(FILE *in, oe_enc_opt *opt, unsigned char *oldbuf, int b
 
         opt->readdata = (void *)wav;
 
-        wav->channel_permute = malloc(wav->channels * sizeof(int));
+        wav->channel_permute = scratch_get(SCRATCH_PERMUTE,
+                wav->channels * sizeof(int));
         if (wav->channels <= 8)
             /* Where we know the mappings, use them. */
             memcpy(wav->channel_permute, wav_permute_matrix[wav->channels-1], 
@@ -614,6 +629,8 @@ static int wav_open_impl(FILE *in, oe_enc_opt *opt, unsigned char *oldbuf, int b
             for (i=0; i < wav->channels; i++)
                 wav->channel_permute[i] = i;
 
+        size_read_buffer(opt, wav, samplesize);
+
         return 1;
     }
     else
@@ -627,21 +644,47 @@ static int wav_open_impl(FILE *in, oe_enc_opt *opt, unsigned char *oldbuf, int b
 
 int wav_open(FILE *in, oe_enc_opt *opt, unsigned char *oldbuf, int buflen)
 {
-    wavfile *wav = malloc(sizeof(wavfile));
-    int ret = wav_open_impl(in, opt, oldbuf, buflen, wav);
+    wavfile *wav = scratch_get(SCRATCH_INPUT, sizeof(wavfile));
+
+    return wav_open_impl(in, opt, oldbuf, buflen, wav);
+}
+
+/* Live mode: hand back whatever the input has ready instead of blocking
+ * until the whole request is filled. We only wait for more if we'd
+ * otherwise split a sample frame. The input must be unbuffered (see
+ * oggenc.c), or data stdio has already pulled in would be skipped.
+ */
+static long read_available(wavfile *f, void *buf, long len, int framesize)
+{
+#ifndef _WIN32
+    long got = 0;
 
-    if(ret == 0) {
-        free(wav);
+    while(got < len)
+    {
+        long ret = read(fileno(f->f), (char *)buf + got, len - got);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            break;
+        got += ret;
+        if(got % framesize == 0)
+            break;
     }
-    return ret;
+
+    return got;
+#else
+    return fread(buf, 1, len, f->f);
+#endif
 }
 
 long wav_read(void *in, float **buffer, int samples)
 {
     wavfile *f = (wavfile *)in;
     int sampbyte = f->samplesize / 8;
-    signed char *buf = alloca(samples*sampbyte*f->channels);
-    long bytes_read = fread(buf, 1, samples*sampbyte*f->channels, f->f);
+    signed char *buf = scratch_get(SCRATCH_READ, samples*sampbyte*f->channels);
+    long bytes_read = f->live ?
+        read_available(f, buf, samples*sampbyte*f->channels, sampbyte*f->channels) :
+        fread(buf, 1, samples*sampbyte*f->channels, f->f);
     int i,j;
     long realsamples;
     int *ch_permute = f->channel_permute;
@@ -723,8 +766,10 @@ long wav_read(void *in, float **buffer, int samples)
 long wav_ieee_read(void *in, float **buffer, int samples)
 {
     wavfile *f = (wavfile *)in;
-    float *buf = alloca(samples*4*f->channels); /* de-interleave buffer */
-    long bytes_read = fread(buf,1,samples*4*f->channels, f->f);
+    float *buf = scratch_get(SCRATCH_READ, samples*4*f->channels); /* de-interleave buffer */
+    long bytes_read = f->live ?
+        read_available(f, buf, samples*4*f->channels, 4*f->channels) :
+        fread(buf,1,samples*4*f->channels, f->f);
     int i,j;
     long realsamples;
 
@@ -743,18 +788,16 @@ long wav_ieee_read(void *in, float **buffer, int samples)
 }
 
 
+/* The reader state and its permute table are scratch slots, kept for
+   the next file */
 void wav_close(void *info)
 {
-    wavfile *f = (wavfile *)info;
-    free(f->channel_permute);
-
-    free(f);
 }
 
 int raw_open(FILE *in, oe_enc_opt *opt, unsigned char *buf, int buflen)
 {
     wav_fmt format; /* fake wave header ;) */
-    wavfile *wav = malloc(sizeof(wavfile));
+    wavfile *wav = scratch_get(SCRATCH_INPUT, sizeof(wavfile));
     int i;
 
     /* construct fake wav header ;) */
@@ -770,10 +813,14 @@ int raw_open(FILE *in, oe_enc_opt *opt, unsigned char *buf, int buflen)
     wav->channels =      format.channels;
     wav->samplesize =    opt->samplesize;
     wav->totalsamples =  -1;
-    wav->channel_permute = malloc(wav->channels * sizeof(int));
+    wav->live =          opt->live;
+    wav->channel_permute = scratch_get(SCRATCH_PERMUTE,
+            wav->channels * sizeof(int));
     for (i=0; i < wav->channels; i++)
       wav->channel_permute[i] = i;
 
+    size_read_buffer(opt, wav, wav->samplesize/8);
+
     opt->read_samples = wav_read;
     opt->readdata = (void *)wav;
     opt->total_samples_per_channel = -1; /* raw mode, don't bother */
@@ -821,13 +868,11 @@ static long read_resampled(void *d, float **buffer, int samples)
 }
 
 int setup_resample(oe_enc_opt *opt) {
-    resampler *rs = calloc(1, sizeof(resampler));
-    int c;
+    resampler *rs = scratch_get(SCRATCH_RESAMPLER, sizeof(resampler));
 
-    rs->bufsize = 4096; /* Shrug */
+    memset(rs, 0, sizeof(resampler));
     rs->real_reader = opt->read_samples;
     rs->real_readdata = opt->readdata;
-    rs->bufs = malloc(sizeof(float *) * opt->channels);
     rs->channels = opt->channels;
     rs->done = 0;
     if(res_init(&rs->resampler, rs->channels, opt->resamplefreq, opt->rate, RES_END))
@@ -836,8 +881,9 @@ int setup_resample(oe_enc_opt *opt) {
         return -1;
     }
 
-    for(c=0; c < opt->channels; c++)
-        rs->bufs[c] = malloc(sizeof(float) * rs->bufsize);
+    /* Enough input to produce the largest read we'll be asked for in one go */
+    rs->bufsize = res_push_max_input(&rs->resampler, opt->read_size_max);
+    rs->bufs = scratch_channels(SCRATCH_RESAMPLE_BUFS, opt->channels, rs->bufsize);
 
     opt->read_samples = read_resampled;
     opt->readdata = rs;
@@ -851,18 +897,10 @@ int setup_resample(oe_enc_opt *opt) {
 
 void clear_resample(oe_enc_opt *opt) {
     resampler *rs = opt->readdata;
-    int i;
 
     opt->read_samples = rs->real_reader;
     opt->readdata = rs->real_readdata;
     res_clear(&rs->resampler);
-
-    for(i = 0; i < rs->channels; i++)
-        free(rs->bufs[i]);
-
-    free(rs->bufs);
-
-    free(rs);
 }
 
 typedef struct {
@@ -888,7 +926,7 @@ static long read_scaler(void *data, float **buffer, int samples) {
 
 
 void setup_scaler(oe_enc_opt *opt, float scale) {
-    scaler *d = calloc(1, sizeof(scaler));
+    scaler *d = scratch_get(SCRATCH_SCALER, sizeof(scaler));
 
     d->real_reader = opt->read_samples;
     d->real_readdata = opt->readdata;
@@ -904,8 +942,6 @@ void clear_scaler(oe_enc_opt *opt) {
 
     opt->read_samples = d->real_reader;
     opt->readdata = d->real_readdata;
-
-    free(d);
 }
 
 typedef struct {
@@ -928,16 +964,15 @@ static long read_downmix(void *data, float **buffer, int samples)
 }
 
 void setup_downmix(oe_enc_opt *opt) {
-    downmix *d = calloc(1, sizeof(downmix));
+    downmix *d;
 
     if(opt->channels != 2) {
         fprintf(stderr, "Internal error! Please report this bug.\n");
         return;
     }
     
-    d->bufs = malloc(2 * sizeof(float *));
-    d->bufs[0] = malloc(4096 * sizeof(float));
-    d->bufs[1] = malloc(4096 * sizeof(float));
+    d = scratch_get(SCRATCH_DOWNMIX, sizeof(downmix));
+    d->bufs = scratch_channels(SCRATCH_DOWNMIX_BUFS, 2, opt->read_size_max);
     d->real_reader = opt->read_samples;
 
     d->real_readdata = opt->readdata;
@@ -953,10 +988,184 @@ void clear_downmix(oe_enc_opt *opt) {
     opt->read_samples = d->real_reader;
     opt->readdata = d->real_readdata;
     opt->channels = 2; /* other things in cleanup rely on this */
+}
 
-    free(d->bufs[0]);
-    free(d->bufs[1]);
-    free(d->bufs);
-    free(d);
+/* Silence splitter. This goes last in the input chain and ends the input
+   (as far as oe_encode() can tell) partway into each gap of at least
+   min_gap frames; splitter_next_track() then lets the rest through as the
+   next track. Silence is held back rather than passed on as it's read,
+   since we can't know it's a gap until min_gap of it has gone by. Gaps
+   longer than min_gap are shortened to it, with half ending one track and
+   half starting the next; otherwise nothing is dropped. */
+typedef struct {
+    audio_read_func real_reader;
+    void *real_readdata;
+    int channels;
+    float threshold;
+    long min_gap;
+
+    float **in;         /* chunk read from the real input */
+    long in_size, in_len, in_pos;
+
+    float **held;       /* ring of silent frames not yet passed on */
+    long held_start, held_len;
+
+    long flush;         /* held frames to pass on before anything else */
+    int end_after_flush;
+    int sound;          /* heard anything yet in this track */
+    int ended;          /* current track finished */
+    int eof;
+} splitter;
+
+static int split_fill(splitter *s)
+{
+    if(s->in_pos < s->in_len)
+        return 1;
+    if(s->eof)
+        return 0;
+
+    s->in_len = s->real_reader(s->real_readdata, s->in, s->in_size);
+    s->in_pos = 0;
+    if(s->in_len <= 0) {
+        s->in_len = 0;
+        s->eof = 1;
+        return 0;
+    }
+    return 1;
 }
 
+static int split_silent(splitter *s)
+{
+    int i;
+
+    for(i = 0; i < s->channels; i++) {
+        float v = s->in[i][s->in_pos];
+        if(v > s->threshold || v < -s->threshold)
+            return 0;
+    }
+    return 1;
+}
+
+static void split_hold(splitter *s)
+{
+    long pos = (s->held_start + s->held_len) % s->min_gap;
+    int i;
+
+    for(i = 0; i < s->channels; i++)
+        s->held[i][pos] = s->in[i][s->in_pos];
+    s->held_len++;
+    s->in_pos++;
+}
+
+static long read_splitter(void *data, float **buffer, int samples)
+{
+    splitter *s = data;
+    long out = 0;
+    int i;
+
+    while(out < samples && !s->ended)
+    {
+        if(s->flush > 0)
+        {
+            for(i = 0; i < s->channels; i++)
+                buffer[i][out] = s->held[i][s->held_start];
+            s->held_start = (s->held_start + 1) % s->min_gap;
+            s->held_len--;
+            s->flush--;
+            out++;
+
+            if(s->flush == 0 && s->end_after_flush) {
+                s->end_after_flush = 0;
+                s->ended = 1;
+            }
+            continue;
+        }
+
+        if(!split_fill(s))
+        {
+            /* Whatever silence trails the last track goes out with it */
+            s->flush = s->held_len;
+            if(!s->flush)
+                break;
+            continue;
+        }
+
+        if(split_silent(s))
+        {
+            split_hold(s);
+            if(s->held_len == s->min_gap) {
+                if(s->sound) {
+                    s->flush = s->min_gap / 2;
+                    s->end_after_flush = 1;
+                }
+                else
+                    s->flush = 1; /* Still leading silence; let it through */
+            }
+        }
+        else if(s->held_len)
+            s->flush = s->held_len;
+        else
+        {
+            for(i = 0; i < s->channels; i++)
+                buffer[i][out] = s->in[i][s->in_pos];
+            s->in_pos++;
+            s->sound = 1;
+            out++;
+        }
+    }
+
+    return out;
+}
+
+void setup_splitter(oe_enc_opt *opt, float threshold_db, float min_gap) {
+    splitter *s = scratch_get(SCRATCH_SPLITTER, sizeof(splitter));
+
+    memset(s, 0, sizeof(splitter));
+    s->real_reader = opt->read_samples;
+    s->real_readdata = opt->readdata;
+    s->channels = opt->channels;
+    s->threshold = pow(10.0, threshold_db / 20.0);
+    s->min_gap = (long)(min_gap * opt->rate);
+    if(s->min_gap < 2)
+        s->min_gap = 2;
+
+    s->in_size = opt->read_size_max;
+    s->in = scratch_channels(SCRATCH_SPLIT_BUFS, s->channels, s->in_size);
+    s->held = scratch_channels(SCRATCH_SPLIT_HELD, s->channels, s->min_gap);
+
+    opt->read_samples = read_splitter;
+    opt->readdata = s;
+}
+
+/* Called once oe_encode() is done with a track. Skips ahead through the
+   rest of the gap, keeping half a gap's worth of it to lead into the next
+   track. Returns 0 if there's nothing but silence left. */
+int splitter_next_track(oe_enc_opt *opt) {
+    splitter *s = opt->readdata;
+
+    if(!s->ended)
+        return 0;
+
+    while(split_fill(s) && split_silent(s))
+    {
+        split_hold(s);
+        if(s->held_len > s->min_gap / 2) {
+            s->held_start = (s->held_start + 1) % s->min_gap;
+            s->held_len--;
+        }
+    }
+
+    if(s->in_pos >= s->in_len)
+        return 0;
+
+    s->ended = 0;
+    s->sound = 0;
+    return 1;
+}
+
+void clear_splitter(oe_enc_opt *opt) {
+    splitter *s = opt->readdata;
+
+    opt->read_samples = s->real_reader;
+    opt->readdata = s->real_readdata;
+}
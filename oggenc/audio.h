@@ -11,6 +11,9 @@ void setup_downmix(oe_enc_opt *opt);
 void clear_downmix(oe_enc_opt *opt);
 void setup_scaler(oe_enc_opt *opt, float scale);
 void clear_scaler(oe_enc_opt *opt);
+void setup_splitter(oe_enc_opt *opt, float threshold_db, float min_gap);
+int splitter_next_track(oe_enc_opt *opt);
+void clear_splitter(oe_enc_opt *opt);
 
 typedef struct
 {
@@ -41,6 +44,7 @@ typedef struct {
     FILE *f;
     short bigendian;
         int *channel_permute;
+    int live; /* Return short reads rather than waiting for a full buffer */
 } wavfile;
 
 typedef struct {
@@ -24,14 +24,13 @@
 #include "encode.h"
 #include "i18n.h"
 #include "skeleton.h"
+#include "scratch.h"
 
 #ifdef HAVE_KATE
 #include "lyrics.h"
 #include <kate/oggkate.h>
 #endif
 
-#define READSIZE 1024
-
 
 int oe_write_page(ogg_page *page, FILE *fp);
 
@@ -227,6 +226,16 @@ int oe_encode(oe_enc_opt *opt)
 #endif
 
     long samplesdone=0;
+    ogg_int64_t last_granule=0;
+    long live_page_samples=0;
+    double page_start=-1.0;
+    long blocks=0, growths_at_first_block=0;
+    int read_size = opt->read_size;
+    int window_blocks = 0;
+    double window_start = 0.0, window_read = 0.0;
+    rg_state *rg = NULL;
+    unsigned char *rg_pages = NULL;
+    long rg_pages_len = 0;
     int eos;
     long bytes_written = 0, packetsdone=0;
     double time_elapsed;
@@ -234,6 +243,11 @@ int oe_encode(oe_enc_opt *opt)
     TIMER *timer;
     int result;
 
+    opt->block_growths = 0;
+    opt->read_calls = 0;
+    opt->read_time = 0.0;
+    opt->rg_offset = -1;
+
     if(opt->channels > 255) {
         fprintf(stderr, _("255 channels should be enough for anyone. (Sorry, but Vorbis doesn't support more)\n"));
         return 1;
@@ -357,6 +371,17 @@ int oe_encode(oe_enc_opt *opt)
     vorbis_analysis_init(&vd,&vi);
     vorbis_block_init(&vd,&vb);
 
+    if(opt->replaygain) {
+        /* The tags get filled in by seeking back, so that has to work */
+        if(ftell(opt->out) < 0 || fseek(opt->out, 0, SEEK_CUR))
+            fprintf(stderr, _("WARNING: Output is not seekable, ReplayGain tags will not be added\n"));
+        else {
+            rg = rg_new(opt->channels, opt->rate);
+            rg_add_placeholders(opt->comments, "TRACK");
+            rg_add_placeholders(opt->comments, "ALBUM");
+        }
+    }
+
 #ifdef HAVE_KATE
     if (opt->lyrics) {
         /* load lyrics */
@@ -470,6 +495,9 @@ int oe_encode(oe_enc_opt *opt)
         ogg_stream_packetin(&os,&header_comments);
         ogg_stream_packetin(&os,&header_codebooks);
 
+        if(rg)
+            opt->rg_offset = ftell(opt->out);
+
         while((result = ogg_stream_flush(&os, &og)))
         {
             if(!result) break;
@@ -480,6 +508,15 @@ int oe_encode(oe_enc_opt *opt)
                 ret = 1;
                 goto cleanup; /* Bail and try to clean up stuff */
             }
+
+            /* Keep a copy to put the track gain into at the end */
+            if(rg) {
+                rg_pages = realloc(rg_pages, rg_pages_len + ret);
+                memcpy(rg_pages + rg_pages_len, og.header, og.header_len);
+                memcpy(rg_pages + rg_pages_len + og.header_len, og.body,
+                        og.body_len);
+                rg_pages_len += ret;
+            }
         }
     }
 
@@ -512,14 +549,51 @@ int oe_encode(oe_enc_opt *opt)
         }
     }
 
+    if(opt->live) {
+        /* Push the headers out now; a listener can't start without them */
+        fflush(opt->out);
+        live_page_samples = opt->rate * opt->live_page_ms / 1000;
+    }
+
     eos = 0;
 
     /* Main encode loop - continue until end of file */
     while(!eos)
     {
-        float **buffer = vorbis_analysis_buffer(&vd, READSIZE);
+        float **buffer = vorbis_analysis_buffer(&vd, read_size);
+        double read_start = timer_time(timer);
         long samples_read = opt->read_samples(opt->readdata, 
-                buffer, READSIZE);
+                buffer, read_size);
+        double read_time = timer_time(timer) - read_start;
+
+        opt->read_calls++;
+        opt->read_time += read_time;
+
+        if(rg)
+            rg_analyze(rg, buffer, samples_read);
+
+        /* If most of the last few blocks went on waiting for input, ask
+           for more at a time */
+        if(opt->read_adaptive && read_size < opt->read_size_max)
+        {
+            if(window_blocks++ == 0)
+                window_start = read_start;
+            window_read += read_time;
+            if(window_blocks == 16)
+            {
+                if(window_read > (timer_time(timer) - window_start) / 2)
+                    read_size *= 2;
+                if(read_size > opt->read_size_max)
+                    read_size = opt->read_size_max;
+                window_blocks = 0;
+                window_read = 0.0;
+            }
+        }
+
+        /* By now the input chain has sized its buffers; nothing after
+           this should need to grow a scratch slot */
+        if(blocks++ == 0)
+            growths_at_first_block = scratch_growths();
 
         if(samples_read ==0)
             /* Tell the library that we wrote 0 bytes - signalling the end */
@@ -528,6 +602,9 @@ int oe_encode(oe_enc_opt *opt)
         {
             samplesdone += samples_read;
 
+            if(opt->live && page_start < 0)
+                page_start = timer_time(timer);
+
             /* Call progress update every 40 pages */
             if(packetsdone>=40)
             {
@@ -565,7 +642,16 @@ int oe_encode(oe_enc_opt *opt)
 
                 while(!eos)
                 {
-                    int result = ogg_stream_pageout(&os,&og);
+                    int result;
+
+                    /* In live mode, don't let the stream hold more than
+                       live_page_samples of audio back waiting for a page
+                       to fill up */
+                    if(live_page_samples > 0 &&
+                            op.granulepos - last_granule >= live_page_samples)
+                        result = ogg_stream_flush(&os,&og);
+                    else
+                        result = ogg_stream_pageout(&os,&og);
                     if(!result) break;
 
                     /* now that we have a new Vorbis page, we scan lyrics for any that is due */
@@ -625,6 +711,16 @@ int oe_encode(oe_enc_opt *opt)
                     else
                         bytes_written += ret; 
 
+                    if(opt->live)
+                    {
+                        fflush(opt->out);
+                        if(ogg_page_granulepos(&og) >= 0)
+                            last_granule = ogg_page_granulepos(&og);
+                        opt->page_written(opt->filename, (long)last_granule, ret,
+                                page_start<0?0.0:timer_time(timer)-page_start);
+                        page_start = -1.0;
+                    }
+
                     if(ogg_page_eos(&og))
                         eos = 1;
                 }
@@ -671,6 +767,30 @@ int oe_encode(oe_enc_opt *opt)
     ret = 0; /* Success.  Set return value to 0 since other things reuse it
               * for nefarious purposes. */
 
+    opt->block_growths = scratch_growths() - growths_at_first_block;
+
+    if(rg) {
+        opt->track_gain = rg_gain(rg);
+        opt->track_peak = rg_peak(rg);
+
+        /* With no album to add it to, the track is the album */
+        if(rg_patch_pages(rg_pages, rg_pages_len, "TRACK",
+                    opt->track_gain, opt->track_peak) ||
+                (!opt->rg_album && rg_patch_pages(rg_pages, rg_pages_len,
+                    "ALBUM", opt->track_gain, opt->track_peak)) ||
+                fseek(opt->out, opt->rg_offset, SEEK_SET) ||
+                fwrite(rg_pages, 1, rg_pages_len, opt->out) != rg_pages_len)
+        {
+            opt->error(_("Failed writing ReplayGain tags to output stream\n"));
+            opt->rg_offset = -1;
+            ret = 1;  /* The file is left with placeholder values */
+        }
+        fseek(opt->out, 0, SEEK_END);
+
+        if(opt->rg_album && opt->rg_offset >= 0)
+            rg_merge(opt->rg_album, rg);
+    }
+
     /* Cleanup time */
 cleanup:
 
@@ -689,6 +809,9 @@ cleanup:
 
     ogg_stream_clear(&os);
 
+    rg_free(rg);
+    free(rg_pages);
+
     vorbis_block_clear(&vb);
     vorbis_dsp_clear(&vd);
     vorbis_info_clear(&vi);
@@ -728,6 +851,19 @@ void update_statistics_notime(char *fn, long total, long done, double time)
             spinner[spinpoint++%4]);
 }
 
+void update_page_latency(char *fn, long granulepos, long bytes, double latency)
+{
+    fprintf(stderr, "\r");
+    fprintf(stderr, _("\tLive: page at sample %ld, %ld bytes, latency %.0f ms "),
+            granulepos, bytes, latency*1000.0);
+}
+
+void update_page_latency_null(char *fn, long granulepos, long bytes,
+        double latency)
+{
+    /* Placeholder for quiet mode */
+}
+
 int oe_write_page(ogg_page *page, FILE *fp)
 {
     int written;
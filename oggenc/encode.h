@@ -3,6 +3,12 @@
 
 #include <stdio.h>
 #include <vorbis/codec.h>
+#include "replaygain.h"
+
+/* Frames requested from the input per block. With an adaptive read size
+   this is the starting point, and reads grow up to READSIZE_MAX */
+#define READSIZE 1024
+#define READSIZE_MAX 16384
 
 typedef void TIMER;
 typedef long (*audio_read_func)(void *src, float **buffer, int samples);
@@ -13,6 +19,8 @@ typedef void (*enc_end_func)(char *fn, double time, int rate,
 typedef void (*enc_start_func)(char *fn, char *outfn, int bitrate, 
         float quality, int qset, int managed, int min_br, int max_br);
 typedef void (*error_func)(char *errormessage);
+typedef void (*page_func)(char *fn, long granulepos, long bytes,
+        double latency);
 
 
 void *timer_start(void);
@@ -32,6 +40,9 @@ void final_statistics(char *fn, double time, int rate, long total_samples,
 void final_statistics_null(char *fn, double time, int rate, long total_samples,
         long bytes);
 void encode_error(char *errmsg);
+void update_page_latency(char *fn, long granulepos, long bytes, double latency);
+void update_page_latency_null(char *fn, long granulepos, long bytes,
+        double latency);
 
 typedef struct {
     char *arg;
@@ -98,6 +109,17 @@ typedef struct
     int ignorelength;
 
     int isutf8;
+
+    int live;
+    int live_page_ms; /* Upper bound on audio per page in live mode */
+
+    int read_size;
+    int read_adaptive;
+
+    int replaygain;
+
+    float split_gap; /* Seconds; 0 to not split */
+    float split_threshold; /* dBFS */
 } oe_options;
 
 typedef struct
@@ -112,6 +134,7 @@ typedef struct
     enc_end_func end_encode;
     enc_start_func start_encode;
     error_func error;
+    page_func page_written;
 
     void *readdata;
 
@@ -138,9 +161,34 @@ typedef struct
     char *filename;
     char *infilename;
     int ignorelength;
+    int live;
+    int live_page_ms;
+
+    /* Frames per read; read_size_max bounds what the input chain will
+       be asked for if read_adaptive lets it grow */
+    int read_size;
+    int read_size_max;
+    int read_adaptive;
+
+    /* Analyse loudness and tag the output; the track is also added to
+       rg_album, if given, and rg_offset is left pointing at the comment
+       header so the album values can be filled in later (-1 if the output
+       couldn't be tagged) */
+    int replaygain;
+    rg_state *rg_album;
+    long rg_offset;
+    double track_gain;
+    double track_peak;
 
     char *lyrics;
     char *lyrics_language;
+
+    /* Set by oe_encode(): how often the scratch slots grew after the
+       first block (libvorbis and the per-file setup allocate on their
+       own, and aren't counted), and how the input was read */
+    long block_growths;
+    long read_calls;
+    double read_time;
 } oe_enc_opt;
 
 
@@ -34,6 +34,7 @@
 #include "platform.h"
 #include "encode.h"
 #include "audio.h"
+#include "scratch.h"
 #include "utf8.h"
 #include "i18n.h"
 
@@ -83,6 +84,11 @@ struct option long_options[] = {
     {"ignorelength", 0, 0, 0},
     {"lyrics",1,0,'L'},
     {"lyrics-language",1,0,'Y'},
+    {"live", 2, 0, 0},
+    {"read-size", 1, 0, 0},
+    {"replaygain", 0, 0, 0},
+    {"split-gap", 1, 0, 0},
+    {"split-threshold", 1, 0, 0},
     {NULL,0,0,0}
 };
 
@@ -94,6 +100,9 @@ static void build_comments(vorbis_comment *vc, oe_options *opt, int filenum,
         char **artist,char **album, char **title, char **tracknum, char **date,
         char **genre);
 static void usage(void);
+static char *split_name(char *base, int track);
+static void track_comments(vorbis_comment *vc, vorbis_comment *base,
+        oe_options *opt, int track);
 
 int main(int argc, char **argv)
 {
@@ -108,7 +117,12 @@ int main(int argc, char **argv)
               0, -1,-1,-1,
               .3,-1,
               0,0,0.f,
-              0, 0, 0, 0, 0};
+              0, 0, 0, 0, 0,
+              0,
+              0, 250,
+              READSIZE, 0,
+              0,
+              0.f, -60.f};
     input_format raw_format = {NULL, 0, raw_open, wav_close, "raw", 
       N_("RAW file reader")};
 
@@ -117,6 +131,14 @@ int main(int argc, char **argv)
     char **infiles;
     int numfiles;
     int errors=0;
+    long block_growths=0;
+    rg_state *rg_album=NULL;
+    char *split_base=NULL;
+    struct {
+        char *fn;
+        long offset;
+    } *tagged = NULL;
+    int tagged_count = 0;
 
     get_args_from_ucs16(&argc, &argv);
 
@@ -165,6 +187,11 @@ int main(int argc, char **argv)
     opt.skeleton_serial = opt.serial + numfiles;
     opt.kate_serial = opt.skeleton_serial + numfiles;
 
+    /* A single file is its own album, and oe_encode() deals with that. The
+       tracks split out of one file are an album too. */
+    if(opt.replaygain && (numfiles > 1 || opt.split_gap > 0.f))
+        rg_album = rg_new(0, 0);
+
     for(i = 0; i < numfiles; i++)
     {
         /* Once through the loop for each file */
@@ -180,6 +207,8 @@ int main(int argc, char **argv)
         char *lyrics=NULL, *lyrics_language=NULL;
         input_format *format;
         int resampled = 0;
+        vorbis_comment split_vc;
+        int tracknum;
 
         /* Set various encoding defaults */
 
@@ -194,6 +223,14 @@ int main(int argc, char **argv)
         enc_opts.copy_comments = opt.copy_comments;
         enc_opts.with_skeleton = opt.with_skeleton;
         enc_opts.ignorelength = opt.ignorelength;
+        enc_opts.live = opt.live;
+        enc_opts.live_page_ms = opt.live_page_ms;
+        enc_opts.page_written = update_page_latency;
+        enc_opts.read_size = opt.read_size;
+        enc_opts.read_size_max = opt.read_adaptive ? READSIZE_MAX : opt.read_size;
+        enc_opts.read_adaptive = opt.read_adaptive;
+        enc_opts.replaygain = opt.replaygain;
+        enc_opts.rg_album = rg_album;
 
         /* OK, let's build the vorbis_comments structure */
         build_comments(&vc, &opt, i, &artist, &album, &title, &track,
@@ -239,7 +276,6 @@ int main(int argc, char **argv)
             if(in == NULL)
             {
                 fprintf(stderr, _("ERROR: Cannot open input file \"%s\": %s\n"), infiles[i], strerror(errno));
-                free(out_fn);
                 errors++;
                 continue;
             }
@@ -247,6 +283,11 @@ int main(int argc, char **argv)
             closein = 1;
         }
 
+        /* Live reads go straight to the descriptor, so there must be
+           nothing hiding in a stdio buffer */
+        if(opt.live)
+            setvbuf(in, NULL, _IONBF, 0);
+
         /* Now, we need to select an input audio format - we do this before opening
            the output file so that we don't end up with a 0-byte file if the input
            file can't be read */
@@ -306,7 +347,7 @@ int main(int argc, char **argv)
         {
             if(opt.outfile)
             {
-                out_fn = strdup(opt.outfile);
+                out_fn = scratch_string(SCRATCH_OUTNAME, opt.outfile);
             }
             else if(opt.namefmt)
             {
@@ -336,7 +377,7 @@ int main(int argc, char **argv)
                 end = strrchr(infiles[i], '.');
                 end = end?end:(start + strlen(infiles[i])+1);
 
-                out_fn = malloc(end - start + 5);
+                out_fn = scratch_get(SCRATCH_OUTNAME, end - start + 5);
                 strncpy(out_fn, start, end-start);
                 out_fn[end-start] = 0;
                 strcat(out_fn, extension);
@@ -344,19 +385,25 @@ int main(int argc, char **argv)
             else {
                 /* if adding skeleton or kate, we're not Vorbis I anymore */
                 if (opt.with_skeleton || opt.lyrics_count>0)
-                    out_fn = strdup("default.oga");
+                    out_fn = scratch_string(SCRATCH_OUTNAME, "default.oga");
                 else
-                    out_fn = strdup("default.ogg");
+                    out_fn = scratch_string(SCRATCH_OUTNAME, "default.ogg");
                 fprintf(stderr, _("WARNING: No filename, defaulting to \"%s\"\n"), out_fn);
             }
 
+            /* Split tracks get numbered names, starting with this one */
+            if(opt.split_gap > 0.f) {
+                free(split_base);
+                split_base = strdup(out_fn);
+                out_fn = split_name(split_base, 1);
+            }
+
             /* Create any missing subdirectories, if possible */
             if(create_directories(out_fn, opt.isutf8)) {
                 if(closein)
                     fclose(in);
                 fprintf(stderr, _("ERROR: Could not create required subdirectories for output filename \"%s\"\n"), out_fn);
                 errors++;
-                free(out_fn);
                 format->close_func(enc_opts.readdata);
                 continue;
             }
@@ -364,7 +411,6 @@ int main(int argc, char **argv)
             if(infiles[i] && !strcmp(infiles[i], out_fn)) {
                 fprintf(stderr, _("ERROR: Input filename is the same as output filename \"%s\"\n"), out_fn);
                 errors++;
-                free(out_fn);
                 format->close_func(enc_opts.readdata);
                 continue;
             }
@@ -376,7 +422,6 @@ int main(int argc, char **argv)
                     fclose(in);
                 fprintf(stderr, _("ERROR: Cannot open output file \"%s\": %s\n"), out_fn, strerror(errno));
                 errors++;
-                free(out_fn);
                 format->close_func(enc_opts.readdata);
                 continue;
             }
@@ -455,21 +500,96 @@ int main(int argc, char **argv)
         }
 
 
-        if(enc_opts.total_samples_per_channel <= 0) {
+        if(opt.split_gap > 0.f) {
+            setup_splitter(&enc_opts, opt.split_threshold, opt.split_gap);
+
+            /* Each track gets the same comments, plus its number */
+            split_vc = vc;
+            track_comments(&vc, &split_vc, &opt, 1);
+        }
+
+        if(enc_opts.total_samples_per_channel <= 0 || opt.split_gap > 0.f) {
             enc_opts.progress_update = update_statistics_notime;
         }
 
+        if(opt.live) {
+            /* The per-page latency report replaces the progress meter */
+            enc_opts.progress_update = update_statistics_null;
+        }
+
         if(opt.quiet)
         {
             enc_opts.start_encode = start_encode_null;
             enc_opts.progress_update = update_statistics_null;
             enc_opts.end_encode = final_statistics_null;
+            enc_opts.page_written = update_page_latency_null;
         }
 
-        if(oe_encode(&enc_opts)) {
-            errors++;
+        for(tracknum = 1; ; tracknum++)
+        {
+            if(oe_encode(&enc_opts)) {
+                errors++;
+            }
+            else if(enc_opts.replaygain && enc_opts.rg_offset >= 0) {
+                if(rg_album) {
+                    tagged = realloc(tagged, (tagged_count+1) * sizeof(*tagged));
+                    tagged[tagged_count].fn = strdup(out_fn);
+                    tagged[tagged_count].offset = enc_opts.rg_offset;
+                    tagged_count++;
+                }
+
+                if(!opt.quiet)
+                    fprintf(stderr, _("\tReplayGain:   %+.2f dB, peak %.6f\n\n"),
+                            enc_opts.track_gain, enc_opts.track_peak);
+            }
+            block_growths += enc_opts.block_growths;
+
+            if(!opt.quiet && enc_opts.read_calls > 0)
+                fprintf(stderr, _("\tInput:        %ld reads of up to %d frames, %.2fs waiting\n\n"),
+                        enc_opts.read_calls, enc_opts.read_size_max, enc_opts.read_time);
+
+            if(opt.split_gap <= 0.f || !splitter_next_track(&enc_opts))
+                break;
+
+            /* Found a gap with more to come after it: carry on with the next
+               track as a new stream, in its own file unless we're writing
+               to stdout, where it just gets chained on */
+            enc_opts.serialno = opt.serial++;
+            enc_opts.skeleton_serialno = opt.skeleton_serial++;
+            enc_opts.kate_serialno = opt.kate_serial++;
+            vorbis_comment_clear(&vc);
+            track_comments(&vc, &split_vc, &opt, tracknum + 1);
+
+            if(closeout) {
+                fclose(out);
+                closeout = 0;
+                out_fn = split_name(split_base, tracknum + 1);
+                out = oggenc_fopen(out_fn, "wb", opt.isutf8);
+                if(out == NULL)
+                {
+                    fprintf(stderr, _("ERROR: Cannot open output file \"%s\": %s\n"), out_fn, strerror(errno));
+                    errors++;
+                    break;
+                }
+                closeout = 1;
+                enc_opts.out = out;
+#ifdef _WIN32
+                free(enc_opts.filename);
+                enc_opts.filename = NULL;
+                if (opt.isutf8)
+                    utf8_decode(out_fn, &enc_opts.filename);
+                else
+                    enc_opts.filename = strdup(out_fn);
+#else
+                enc_opts.filename = out_fn;
+#endif
+            }
         }
 
+        if(opt.split_gap > 0.f) {
+            clear_splitter(&enc_opts);
+            vorbis_comment_clear(&split_vc);
+        }
         if(opt.scale > 0) {
             clear_scaler(&enc_opts);
         }
@@ -481,7 +601,6 @@ int main(int argc, char **argv)
         }
 clear_all:
 
-        if(out_fn) free(out_fn);
         if(opt.outfile) free(opt.outfile);
 #ifdef _WIN32
         if(enc_opts.filename) free(enc_opts.filename);
@@ -498,6 +617,37 @@ clear_all:
         }
     }/* Finished this file, loop around to next... */
 
+    free(split_base);
+
+    if(!opt.quiet && numfiles > 1)
+        fprintf(stderr, _("Scratch buffer growth: %ld for %d files, %ld after the first block of a file\n"),
+                scratch_growths(), numfiles, block_growths);
+
+    /* Now that the whole batch has been seen, go back and fill in the
+       album values */
+    if(tagged_count) {
+        double gain = rg_gain(rg_album), peak = rg_peak(rg_album);
+
+        for(i = 0; i < tagged_count; i++) {
+            FILE *f = oggenc_fopen(tagged[i].fn, "r+b", opt.isutf8);
+
+            if(f == NULL || rg_patch_file(f, tagged[i].offset, "ALBUM", gain, peak)) {
+                fprintf(stderr, _("ERROR: Could not write album gain to \"%s\"\n"),
+                        tagged[i].fn);
+                errors++;
+            }
+            if(f)
+                fclose(f);
+            free(tagged[i].fn);
+        }
+
+        if(!opt.quiet)
+            fprintf(stderr, _("Album ReplayGain: %+.2f dB, peak %.6f\n"), gain, peak);
+    }
+    free(tagged);
+    rg_free(rg_album);
+
+    scratch_free_all();
     convert_free_charset();
     return errors?1:0;
 
@@ -567,6 +717,23 @@ static void usage(void)
         "                      being copied to the output Ogg Vorbis file.\n"
         " --ignorelength       Ignore the datalength in Wave headers. This allows\n"
         "                      support for files > 4GB and STDIN data streams. \n"
+        " --live[=ms]          Low latency mode for live sources. Encode whatever\n"
+        "                      input is available instead of waiting for full\n"
+        "                      reads, hold at most ms milliseconds of audio in a\n"
+        "                      page (default 250) and flush each page to the output\n"
+        "                      immediately, reporting its encode latency.\n"
+        " --read-size=n        Read n sample frames from the input at a time\n"
+        "                      (default 1024). \"auto\" starts there and reads\n"
+        "                      larger blocks while waiting on the input dominates,\n"
+        "                      which helps with slow or network storage.\n"
+        " --replaygain         Analyse the audio while encoding and add ReplayGain\n"
+        "                      track gain and peak tags. All the files encoded in\n"
+        "                      one run are treated as an album for the album gain.\n"
+        " --split-gap=s        Start a new output file at each gap of at least s\n"
+        "                      seconds of silence. Files are numbered (name-01.ogg,\n"
+        "                      name-02.ogg, ...); on stdout the tracks are chained.\n"
+        " --split-threshold=n  Level in dBFS below which input counts as silence\n"
+        "                      for --split-gap (default -60).\n"
         "\n"));
     fprintf(stdout, _(
         " Naming:\n"
@@ -629,6 +796,38 @@ static void usage(void)
         "\n"));
 }
 
+/* name.ogg -> name-NN.ogg */
+static char *split_name(char *base, int track)
+{
+    char *ext = strrchr(base, '.');
+    char *slash = strrchr(base, '/');
+    char *name;
+
+    if(ext == NULL || (slash && ext < slash))
+        ext = base + strlen(base);
+
+    name = scratch_get(SCRATCH_OUTNAME, strlen(base) + 16);
+    sprintf(name, "%.*s-%02d%s", (int)(ext - base), base, track, ext);
+
+    return name;
+}
+
+static void track_comments(vorbis_comment *vc, vorbis_comment *base,
+        oe_options *opt, int track)
+{
+    char num[16];
+    int i;
+
+    vorbis_comment_init(vc);
+    for(i = 0; i < base->comments; i++)
+        vorbis_comment_add(vc, base->user_comments[i]);
+
+    if(!opt->track_count) {
+        sprintf(num, "%d", track);
+        vorbis_comment_add_tag(vc, "tracknumber", num);
+    }
+}
+
 static int strncpy_filtered(char *dst, char *src, int len, char *remove_list,
         char *replace_list)
 {
@@ -676,7 +875,8 @@ static char *generate_name_string(char *format, char *remove_list,
     int used=0;
     int buflen;
 
-    buffer = calloc(CHUNK+1,1);
+    buffer = scratch_get(SCRATCH_OUTNAME, CHUNK+1);
+    memset(buffer, 0, CHUNK+1);
     buflen = CHUNK;
 
     while(*format && used < buflen)
@@ -820,6 +1020,45 @@ static void parse_options(int argc, char **argv, oe_options *opt)
                 else if(!strcmp(long_options[option_index].name, "ignorelength")) {
                     opt->ignorelength = 1;
                 }
+                else if(!strcmp(long_options[option_index].name, "read-size")) {
+                    if(!strcmp(optarg, "auto")) {
+                        opt->read_adaptive = 1;
+                        opt->read_size = READSIZE;
+                    }
+                    else if(sscanf(optarg, "%d", &opt->read_size) != 1 ||
+                            opt->read_size < 64 || opt->read_size > READSIZE_MAX) {
+                        fprintf(stderr, _("WARNING: Read size \"%s\" must be \"auto\" or between 64 and %d, using %d\n"),
+                                optarg, READSIZE_MAX, READSIZE);
+                        opt->read_size = READSIZE;
+                    }
+                    else {
+                        opt->read_adaptive = 0;
+                    }
+                }
+                else if(!strcmp(long_options[option_index].name, "replaygain")) {
+                    opt->replaygain = 1;
+                }
+                else if(!strcmp(long_options[option_index].name, "split-gap")) {
+                    if(sscanf(optarg, "%f", &opt->split_gap) != 1 || opt->split_gap < 0.f) {
+                        fprintf(stderr, _("WARNING: Couldn't read split gap \"%s\", not splitting\n"), optarg);
+                        opt->split_gap = 0.f;
+                    }
+                }
+                else if(!strcmp(long_options[option_index].name, "split-threshold")) {
+                    if(sscanf(optarg, "%f", &opt->split_threshold) != 1 || opt->split_threshold > 0.f) {
+                        fprintf(stderr, _("WARNING: Couldn't read split threshold \"%s\", using -60 dB\n"), optarg);
+                        opt->split_threshold = -60.f;
+                    }
+                }
+                else if(!strcmp(long_options[option_index].name, "live")) {
+                    opt->live = 1;
+                    if(optarg && (sscanf(optarg, "%d", &opt->live_page_ms) != 1 ||
+                                opt->live_page_ms <= 0)) {
+                        fprintf(stderr, _("WARNING: Couldn't read live page duration \"%s\", using 250 ms\n"),
+                                optarg);
+                        opt->live_page_ms = 250;
+                    }
+                }
 
                 else {
                     fprintf(stderr, _("Internal error parsing command line options\n"));
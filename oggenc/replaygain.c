@@ -0,0 +1,481 @@
+/* OggEnc
+ **
+ ** This program is distributed under the GNU General Public License, version 2.
+ ** A copy of this license is included with this source.
+ **/
+
+/* ReplayGain analysis - see replaygain.h */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <ogg/ogg.h>
+#include "replaygain.h"
+#include "i18n.h"
+
+#ifndef M_PI
+#define M_PI       3.14159265358979323846
+#endif
+
+#define RG_REFERENCE   -18.0   /* LUFS */
+#define RG_ABS_GATE    -70.0   /* LUFS */
+#define RG_REL_GATE    -10.0   /* LU below the ungated average */
+
+/* Block loudness is kept as a histogram rather than a list of blocks, so
+   an album's worth of audio costs no more than a single track */
+#define RG_HIST_MIN    RG_ABS_GATE
+#define RG_HIST_STEP   0.01
+#define RG_HIST_BINS   7500
+
+#define RG_GAIN_PLACEHOLDER "+00.00 dB"
+#define RG_PEAK_PLACEHOLDER "0.000000"
+
+typedef struct {
+    double b0, b1, b2, a1, a2;
+} biquad;
+
+struct rg_state {
+    int channels;
+    long rate;
+    biquad shelf, highpass;
+    double *z;          /* 4 words of filter state per channel */
+    double *weight;
+
+    long step;          /* samples in 100 ms */
+    long step_fill;
+    double step_energy;
+    double steps[4];    /* energy of the last four 100 ms steps */
+    int steps_filled;
+
+    double peak;
+    unsigned long hist[RG_HIST_BINS];
+};
+
+/* Pre-filter and RLB high-pass of BS.1770, recomputed for our rate */
+static void k_weighting(rg_state *rg)
+{
+    double f0 = 1681.974450955533;
+    double G = 3.999843853973347;
+    double Q = 0.7071752369554196;
+    double K = tan(M_PI * f0 / rg->rate);
+    double Vh = pow(10.0, G / 20.0);
+    double Vb = pow(Vh, 0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+
+    rg->shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+    rg->shelf.b1 = 2.0 * (K * K - Vh) / a0;
+    rg->shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+    rg->shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+    rg->shelf.a2 = (1.0 - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = tan(M_PI * f0 / rg->rate);
+    a0 = 1.0 + K / Q + K * K;
+
+    rg->highpass.b0 = 1.0;
+    rg->highpass.b1 = -2.0;
+    rg->highpass.b2 = 1.0;
+    rg->highpass.a1 = 2.0 * (K * K - 1.0) / a0;
+    rg->highpass.a2 = (1.0 - K / Q + K * K) / a0;
+}
+
+/* Channel weights for the Vorbis channel orders; surrounds count for
+   +1.5 dB and the LFE isn't counted at all */
+static void channel_weights(rg_state *rg)
+{
+    int i;
+
+    for(i = 0; i < rg->channels; i++)
+        rg->weight[i] = 1.0;
+
+    switch(rg->channels) {
+        case 4: /* L R RL RR */
+            rg->weight[2] = rg->weight[3] = 1.41;
+            break;
+        case 5: /* L C R RL RR */
+            rg->weight[3] = rg->weight[4] = 1.41;
+            break;
+        case 6: /* L C R RL RR LFE */
+            rg->weight[3] = rg->weight[4] = 1.41;
+            rg->weight[5] = 0.0;
+            break;
+        case 7: /* L C R SL SR RC LFE */
+            rg->weight[3] = rg->weight[4] = rg->weight[5] = 1.41;
+            rg->weight[6] = 0.0;
+            break;
+        case 8: /* L C R SL SR RL RR LFE */
+            for(i = 3; i < 7; i++)
+                rg->weight[i] = 1.41;
+            rg->weight[7] = 0.0;
+            break;
+    }
+}
+
+rg_state *rg_new(int channels, long rate)
+{
+    rg_state *rg = calloc(1, sizeof(rg_state));
+
+    rg->channels = channels;
+    rg->rate = rate;
+
+    if(channels > 0) {
+        rg->z = calloc(channels * 4, sizeof(double));
+        rg->weight = malloc(channels * sizeof(double));
+        channel_weights(rg);
+        k_weighting(rg);
+        rg->step = rate / 10;
+    }
+
+    return rg;
+}
+
+void rg_free(rg_state *rg)
+{
+    if(rg) {
+        free(rg->z);
+        free(rg->weight);
+        free(rg);
+    }
+}
+
+static void add_block(rg_state *rg, double energy)
+{
+    double loudness;
+    int bin;
+
+    if(energy <= 0.0)
+        return;
+
+    loudness = -0.691 + 10.0 * log10(energy);
+    if(loudness < RG_HIST_MIN)
+        return;
+
+    bin = (int)((loudness - RG_HIST_MIN) / RG_HIST_STEP);
+    if(bin >= RG_HIST_BINS)
+        bin = RG_HIST_BINS - 1;
+    rg->hist[bin]++;
+}
+
+void rg_analyze(rg_state *rg, float **pcm, long samples)
+{
+    long i;
+    int c;
+
+    for(i = 0; i < samples; i++)
+    {
+        double sum = 0.0;
+
+        for(c = 0; c < rg->channels; c++)
+        {
+            double *z = rg->z + c * 4;
+            double x = pcm[c][i];
+            double y;
+
+            if(fabs(x) > rg->peak)
+                rg->peak = fabs(x);
+
+            if(rg->weight[c] == 0.0)
+                continue;
+
+            /* Two transposed direct form II sections */
+            y = rg->shelf.b0 * x + z[0];
+            z[0] = rg->shelf.b1 * x - rg->shelf.a1 * y + z[1];
+            z[1] = rg->shelf.b2 * x - rg->shelf.a2 * y;
+
+            x = y;
+            y = rg->highpass.b0 * x + z[2];
+            z[2] = rg->highpass.b1 * x - rg->highpass.a1 * y + z[3];
+            z[3] = rg->highpass.b2 * x - rg->highpass.a2 * y;
+
+            sum += rg->weight[c] * y * y;
+        }
+
+        rg->step_energy += sum;
+
+        /* 400 ms gating blocks, overlapping by 75% */
+        if(++rg->step_fill == rg->step)
+        {
+            rg->steps[0] = rg->steps[1];
+            rg->steps[1] = rg->steps[2];
+            rg->steps[2] = rg->steps[3];
+            rg->steps[3] = rg->step_energy;
+            rg->step_energy = 0.0;
+            rg->step_fill = 0;
+
+            if(++rg->steps_filled >= 4)
+                add_block(rg, (rg->steps[0] + rg->steps[1] + rg->steps[2] +
+                            rg->steps[3]) / (4.0 * rg->step));
+        }
+    }
+}
+
+void rg_merge(rg_state *album, rg_state *track)
+{
+    int i;
+
+    for(i = 0; i < RG_HIST_BINS; i++)
+        album->hist[i] += track->hist[i];
+
+    if(track->peak > album->peak)
+        album->peak = track->peak;
+}
+
+static double bin_energy(int bin)
+{
+    double loudness = RG_HIST_MIN + (bin + 0.5) * RG_HIST_STEP;
+
+    return pow(10.0, (loudness + 0.691) / 10.0);
+}
+
+double rg_gain(rg_state *rg)
+{
+    double energy = 0.0, threshold;
+    unsigned long count = 0;
+    int i, start;
+
+    for(i = 0; i < RG_HIST_BINS; i++) {
+        energy += rg->hist[i] * bin_energy(i);
+        count += rg->hist[i];
+    }
+
+    if(!count)
+        return 0.0; /* Silent, or shorter than a gating block */
+
+    threshold = -0.691 + 10.0 * log10(energy / count) + RG_REL_GATE;
+    start = (int)((threshold - RG_HIST_MIN) / RG_HIST_STEP);
+    if(start < 0)
+        start = 0;
+
+    energy = 0.0;
+    count = 0;
+    for(i = start; i < RG_HIST_BINS; i++) {
+        energy += rg->hist[i] * bin_energy(i);
+        count += rg->hist[i];
+    }
+
+    if(!count)
+        return 0.0;
+
+    return RG_REFERENCE - (-0.691 + 10.0 * log10(energy / count));
+}
+
+double rg_peak(rg_state *rg)
+{
+    return rg->peak;
+}
+
+void rg_add_placeholders(vorbis_comment *vc, const char *which)
+{
+    char tag[32];
+
+    sprintf(tag, "REPLAYGAIN_%s_GAIN", which);
+    vorbis_comment_add_tag(vc, tag, RG_GAIN_PLACEHOLDER);
+    sprintf(tag, "REPLAYGAIN_%s_PEAK", which);
+    vorbis_comment_add_tag(vc, tag, RG_PEAK_PLACEHOLDER);
+}
+
+typedef struct {
+    long header;    /* offsets into the page data */
+    long header_len;
+    long body;
+    long body_len;
+    int dirty;
+} rg_page;
+
+static long page_length(unsigned char *header, long *header_len)
+{
+    long body_len = 0;
+    int i;
+
+    *header_len = 27 + header[26];
+    for(i = 0; i < header[26]; i++)
+        body_len += header[27 + i];
+
+    return body_len;
+}
+
+/* Overwrite the end of the first match of find with value, which is no
+   longer. The comment packet may cross pages, so the bodies are searched
+   as one run of bytes, and each page the value lands in is marked for a
+   new checksum. */
+static int replace(unsigned char *data, rg_page *pages, int npages,
+        unsigned char *joined, long joined_len,
+        const char *find, const char *value)
+{
+    long findlen = strlen(find), vlen = strlen(value);
+    long i, at, start;
+    int p;
+
+    for(i = 0; i + findlen <= joined_len; i++)
+        if(!memcmp(joined + i, find, findlen))
+            break;
+    if(i + findlen > joined_len)
+        return 0;
+
+    /* Only the value changes, and it's the same width */
+    at = i + findlen - vlen;
+    for(p = 0, start = 0; p < npages && vlen > 0; start += pages[p++].body_len)
+    {
+        long from, n;
+
+        if(at >= start + pages[p].body_len)
+            continue;
+
+        from = at - start;
+        n = pages[p].body_len - from;
+        if(n > vlen)
+            n = vlen;
+
+        memcpy(data + pages[p].body + from, value, n);
+        pages[p].dirty = 1;
+        at += n;
+        value += n;
+        vlen -= n;
+    }
+
+    return 1;
+}
+
+/* Patch the values into a copy of the comment header pages held in
+   memory. Returns 0 once both values have been found. */
+int rg_patch_pages(unsigned char *data, long len, const char *which,
+        double gain, double peak)
+{
+    rg_page *pages = NULL, *grown;
+    unsigned char *joined;
+    char find[64], value[16];
+    ogg_page og;
+    long pos = 0, joined_len = 0;
+    int npages = 0, p, gain_found, peak_found;
+
+    /* Cover art can spread the comments over any number of pages */
+    while(pos + 27 <= len)
+    {
+        rg_page *page;
+
+        if(memcmp(data + pos, "OggS", 4) || pos + 27 + data[pos + 26] > len)
+            break;
+        if((grown = realloc(pages, (npages + 1) * sizeof(*pages))) == NULL)
+            break;
+        pages = grown;
+        page = &pages[npages];
+        page->header = pos;
+        page->body_len = page_length(data + pos, &page->header_len);
+        page->body = pos + page->header_len;
+        page->dirty = 0;
+        if(page->body + page->body_len > len)
+            break;
+
+        joined_len += page->body_len;
+        pos = page->body + page->body_len;
+        npages++;
+    }
+
+    if((joined = malloc(joined_len > 0 ? joined_len : 1)) == NULL)
+    {
+        free(pages);
+        return 1;
+    }
+    for(p = 0, pos = 0; p < npages; pos += pages[p++].body_len)
+        memcpy(joined + pos, data + pages[p].body, pages[p].body_len);
+
+    if(gain > 99.99)
+        gain = 99.99;
+    else if(gain < -99.99)
+        gain = -99.99;
+    if(peak > 9.999999)
+        peak = 9.999999;
+
+    sprintf(find, "REPLAYGAIN_%s_GAIN=" RG_GAIN_PLACEHOLDER, which);
+    sprintf(value, "%+06.2f dB", gain);
+    gain_found = replace(data, pages, npages, joined, joined_len, find, value);
+    if(!gain_found)
+        fprintf(stderr, _("WARNING: No REPLAYGAIN_%s_GAIN placeholder to fill in\n"),
+                which);
+
+    sprintf(find, "REPLAYGAIN_%s_PEAK=" RG_PEAK_PLACEHOLDER, which);
+    sprintf(value, "%.6f", peak);
+    peak_found = replace(data, pages, npages, joined, joined_len, find, value);
+    if(!peak_found)
+        fprintf(stderr, _("WARNING: No REPLAYGAIN_%s_PEAK placeholder to fill in\n"),
+                which);
+
+    for(p = 0; p < npages; p++)
+    {
+        if(!pages[p].dirty)
+            continue;
+        og.header = data + pages[p].header;
+        og.header_len = pages[p].header_len;
+        og.body = data + pages[p].body;
+        og.body_len = pages[p].body_len;
+        ogg_page_checksum_set(&og);
+    }
+
+    free(joined);
+    free(pages);
+
+    return !(gain_found && peak_found);
+}
+
+/* The same, for an already written file. The header pages starting at
+   the comment header are read in, patched, and written back. They are
+   the pages of that stream up to the one the setup header, the second
+   packet from there, ends on. Pages that no packet ends on have a
+   granule position of -1, so only a positive one means audio. */
+int rg_patch_file(FILE *f, long offset, const char *which,
+        double gain, double peak)
+{
+    unsigned char header[27 + 255];
+    unsigned char *data = NULL, *grown;
+    ogg_page og;
+    long header_len, body_len, len = 0;
+    int page, i, serialno = 0, packets = 0, ret = 1;
+
+    if(fseek(f, offset, SEEK_SET))
+        return 1;
+
+    for(page = 0; packets < 2; page++)
+    {
+        if(fread(header, 1, 27, f) < 27 || memcmp(header, "OggS", 4))
+            break;
+        if(fread(header + 27, 1, header[26], f) < header[26])
+            break;
+        body_len = page_length(header, &header_len);
+
+        og.header = header;
+        og.header_len = header_len;
+        if(page == 0)
+            serialno = ogg_page_serialno(&og);
+        else if(ogg_page_serialno(&og) != serialno || ogg_page_granulepos(&og) > 0)
+            break;
+
+        /* A lacing value under 255 ends a packet */
+        for(i = 0; i < header[26]; i++)
+            if(header[27 + i] < 255)
+                packets++;
+
+        if((grown = realloc(data, len + header_len + body_len)) == NULL)
+            break;
+        data = grown;
+        memcpy(data + len, header, header_len);
+        if(fread(data + len + header_len, 1, body_len, f) < body_len)
+            break;
+        len += header_len + body_len;
+    }
+
+    if(len > 0 && !rg_patch_pages(data, len, which, gain, peak) &&
+            !fseek(f, offset, SEEK_SET) && fwrite(data, 1, len, f) == len)
+        ret = 0;
+
+    free(data);
+    fseek(f, 0, SEEK_END);
+
+    return ret;
+}
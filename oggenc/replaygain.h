@@ -0,0 +1,36 @@
+/* OggEnc
+ **
+ ** This program is distributed under the GNU General Public License, version 2.
+ ** A copy of this license is included with this source.
+ **/
+
+#ifndef __REPLAYGAIN_H
+#define __REPLAYGAIN_H
+
+#include <stdio.h>
+#include <vorbis/codec.h>
+
+/* Loudness analysis for ReplayGain tags, done on the PCM as it is fed to
+   the encoder. Loudness is measured as in ITU-R BS.1770 (K-weighted,
+   gated) and the gain is relative to the ReplayGain 2.0 reference of
+   -18 LUFS. */
+typedef struct rg_state rg_state;
+
+rg_state *rg_new(int channels, long rate);
+void rg_free(rg_state *rg);
+void rg_analyze(rg_state *rg, float **pcm, long samples);
+void rg_merge(rg_state *album, rg_state *track);
+double rg_gain(rg_state *rg);
+double rg_peak(rg_state *rg);
+
+/* The gain and peak don't exist until the audio has been through, but
+   the comment header has to be written first. So it gets fixed-width
+   placeholder values, which are overwritten in place once they're known.
+   which is "TRACK" or "ALBUM". */
+void rg_add_placeholders(vorbis_comment *vc, const char *which);
+int rg_patch_pages(unsigned char *data, long len, const char *which,
+        double gain, double peak);
+int rg_patch_file(FILE *f, long offset, const char *which,
+        double gain, double peak);
+
+#endif /* __REPLAYGAIN_H */
@@ -0,0 +1,81 @@
+/* OggEnc
+ **
+ ** This program is distributed under the GNU General Public License, version 2.
+ ** A copy of this license is included with this source.
+ **/
+
+/* Reusable working buffers - see scratch.h */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "scratch.h"
+#include "i18n.h"
+
+static struct {
+    void *data;
+    size_t size;
+} slots[SCRATCH_SLOTS];
+
+static long growths = 0;  /* times any slot had to grow */
+
+void *scratch_get(scratch_slot slot, size_t size)
+{
+    if(size > slots[slot].size)
+    {
+        void *data = realloc(slots[slot].data, size);
+
+        if(data == NULL)
+        {
+            fprintf(stderr, _("ERROR: Out of memory.\n"));
+            exit(1);
+        }
+        slots[slot].data = data;
+        slots[slot].size = size;
+        growths++;
+    }
+
+    return slots[slot].data;
+}
+
+/* A channels x samples array, laid out as the pointer table followed by
+   the sample data so that it takes a single slot */
+float **scratch_channels(scratch_slot slot, int channels, int samples)
+{
+    float **bufs = scratch_get(slot, channels * sizeof(float *) +
+            (size_t)channels * samples * sizeof(float));
+    float *data = (float *)(bufs + channels);
+    int i;
+
+    for(i = 0; i < channels; i++)
+        bufs[i] = data + (size_t)i * samples;
+
+    return bufs;
+}
+
+char *scratch_string(scratch_slot slot, const char *str)
+{
+    return strcpy(scratch_get(slot, strlen(str) + 1), str);
+}
+
+long scratch_growths(void)
+{
+    return growths;
+}
+
+void scratch_free_all(void)
+{
+    int i;
+
+    for(i = 0; i < SCRATCH_SLOTS; i++)
+    {
+        free(slots[i].data);
+        slots[i].data = NULL;
+        slots[i].size = 0;
+    }
+}
@@ -0,0 +1,43 @@
+/* OggEnc
+ **
+ ** This program is distributed under the GNU General Public License, version 2.
+ ** A copy of this license is included with this source.
+ **/
+
+#ifndef __SCRATCH_H
+#define __SCRATCH_H
+
+#include <stddef.h>
+
+/* Working buffers that live for the whole run. Each slot only ever grows,
+   so once the first block of the first file has been through, encoding
+   further blocks and files goes back to the allocator only if a later
+   file needs more room (more channels, say). */
+typedef enum {
+    SCRATCH_INPUT,          /* wav, aiff or raw reader state */
+    SCRATCH_PERMUTE,        /* reader's channel_permute table */
+    SCRATCH_READ,           /* interleaved input in wav_read() */
+    SCRATCH_RESAMPLER,      /* resampler wrapper state */
+    SCRATCH_RESAMPLE_BUFS,  /* resampler input */
+    SCRATCH_DOWNMIX,        /* downmix wrapper state */
+    SCRATCH_DOWNMIX_BUFS,   /* downmix input */
+    SCRATCH_SCALER,         /* scaler wrapper state */
+    SCRATCH_SPLITTER,       /* silence splitter state */
+    SCRATCH_SPLIT_BUFS,     /* splitter input */
+    SCRATCH_SPLIT_HELD,     /* silence held back by the splitter */
+    SCRATCH_OUTNAME,        /* output filename */
+    SCRATCH_SLOTS
+} scratch_slot;
+
+void *scratch_get(scratch_slot slot, size_t size);
+float **scratch_channels(scratch_slot slot, int channels, int samples);
+char *scratch_string(scratch_slot slot, const char *str);
+
+/* How many times a slot has had to grow.  This only covers the scratch
+   slots, not heap use in general: libvorbis and libogg, vorbis_comment,
+   the resampler tables and the FLAC reader still allocate once per
+   file, and none of that is counted. */
+long scratch_growths(void);
+void scratch_free_all(void);
+
+#endif /* __SCRATCH_H */